@@ -0,0 +1,213 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_EMULATOR_H
+#define CHIAKI_EMULATOR_H
+
+#include <chiaki/common.h>
+#include <chiaki/log.h>
+#include <chiaki/thread.h>
+#include <chiaki/stoppipe.h>
+#include <chiaki/rpcrypt.h>
+#include <chiaki/gkcrypt.h>
+#include <chiaki/takion.h>
+#include <chiaki/session.h>
+
+#include <takion.pb.h>
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include <netinet/in.h>
+
+/*
+ * chiaki-emulator stands in for a PS4/PS5 on the ports the client connects to:
+ *   9295 TCP: session request and ctrl
+ *   9296 UDP: stream connection (Takion v9 for PS4, v12 for PS5, encrypted)
+ *   9297 UDP: senkusha (Takion v7, unencrypted)
+ */
+
+#define EMULATOR_SESSION_PORT 9295
+#define EMULATOR_STREAM_PORT 9296
+#define EMULATOR_SENKUSHA_PORT 9297
+
+#define EMULATOR_SESSION_ID_SIZE 0x20 // must stay below CHIAKI_SESSION_ID_SIZE_MAX - 1
+
+typedef struct emulator_options_t
+{
+	const char *host; // address to listen on
+	uint8_t morning[0x10]; // must match ChiakiConnectInfo.morning of the client
+	bool check_regist_key;
+	char regist_key[CHIAKI_SESSION_AUTH_SIZE];
+	unsigned int bitrate_kbps; // 0 to use the one from the client's launch spec
+	unsigned int fps; // 0 to use the one from the client's launch spec
+	unsigned int fec_percent; // fec units per frame relative to its source units
+	double loss; // probability for each AV packet to be dropped instead of sent
+	double reorder; // probability for each AV packet to be held back and sent after the next one
+	const char *video_filename; // Annex B stream in the codec the client requests, synthetic video if NULL
+	bool audio;
+} EmulatorOptions;
+
+/**
+ * State of the last session request, shared between the session server and the stream server.
+ */
+typedef struct emulator_session_t
+{
+	ChiakiMutex mutex;
+	bool valid;
+	ChiakiTarget target;
+	ChiakiRPCrypt rpcrypt;
+	char id[EMULATOR_SESSION_ID_SIZE + 1];
+} EmulatorSession;
+
+/**
+ * Server side of a Takion connection on a single UDP socket.
+ * Handles the handshake and acks all data itself, everything else is reported as events.
+ * Not thread-safe, used only by the thread of its server.
+ */
+typedef struct emulator_takion_t
+{
+	ChiakiLog *log;
+	chiaki_socket_t sock;
+	uint8_t version;
+
+	struct sockaddr_storage addr; // of the client, valid if connected
+	socklen_t addr_len;
+	bool connected;
+	uint32_t tag_local;
+	uint32_t tag_remote;
+	ChiakiSeqNum32 seq_num_local;
+	uint64_t key_pos_local;
+	ChiakiGKCrypt *gkcrypt_local; // owned, set once the keys are known
+	uint64_t recv_time_last_us;
+
+	double loss;
+	double reorder;
+	uint32_t loss_rng;
+	uint16_t av_packet_index;
+	uint8_t av_held_buf[1500]; // packet held back for reordering
+	size_t av_held_size; // 0 if none
+
+	uint8_t recv_buf[1500];
+
+	// statistics since connecting
+	uint64_t av_packets_sent;
+	uint64_t av_packets_dropped;
+	uint64_t av_packets_reordered;
+	uint64_t av_bytes_sent;
+} EmulatorTakion;
+
+typedef enum {
+	EMULATOR_TAKION_EVENT_NONE, // handled internally, e.g. handshake or data ack
+	EMULATOR_TAKION_EVENT_CONNECTED,
+	EMULATOR_TAKION_EVENT_DATA,
+	EMULATOR_TAKION_EVENT_AV
+} EmulatorTakionEventType;
+
+typedef struct emulator_takion_event_t
+{
+	EmulatorTakionEventType type;
+	uint8_t data_type; // for DATA
+	uint8_t *buf; // data for DATA, whole datagram for AV, points into recv_buf
+	size_t buf_size;
+} EmulatorTakionEvent;
+
+ChiakiErrorCode emulator_takion_init(EmulatorTakion *takion, ChiakiLog *log, const char *host, uint16_t port, uint8_t version);
+void emulator_takion_fini(EmulatorTakion *takion);
+void emulator_takion_set_crypt(EmulatorTakion *takion, ChiakiGKCrypt *gkcrypt_local);
+
+/**
+ * Receive and handle a single datagram.
+ * @return CHIAKI_ERR_TIMEOUT if nothing was received in time, CHIAKI_ERR_CANCELED if stop_pipe was stopped
+ */
+ChiakiErrorCode emulator_takion_recv(EmulatorTakion *takion, ChiakiStopPipe *stop_pipe, uint64_t timeout_ms, EmulatorTakionEvent *event);
+
+ChiakiErrorCode emulator_takion_send_data(EmulatorTakion *takion, uint16_t channel, const uint8_t *buf, size_t buf_size);
+ChiakiErrorCode emulator_takion_send_message(EmulatorTakion *takion, uint16_t channel, const tkproto_TakionMessage *msg);
+
+/**
+ * Send an AV packet, formatting its header for the protocol version, encrypting it and
+ * dropping or reordering it with the configured probabilities.
+ * packet->packet_index and packet->key_pos are assigned by this function.
+ */
+ChiakiErrorCode emulator_takion_send_av(EmulatorTakion *takion, ChiakiTakionAVPacket *packet, const uint8_t *data, size_t data_size);
+
+ChiakiErrorCode emulator_takion_send_raw(EmulatorTakion *takion, const uint8_t *buf, size_t buf_size);
+
+
+typedef struct emulator_video_source_t
+{
+	bool h265;
+	uint8_t *header;
+	size_t header_size;
+
+	// Annex B file split into access units
+	uint8_t *file_buf;
+	size_t *aus; // offsets into file_buf, aus_count + 1 entries
+	size_t aus_count;
+	size_t au_cur;
+
+	// synthetic
+	uint8_t *synth_buf;
+	size_t synth_buf_size;
+} EmulatorVideoSource;
+
+/**
+ * @param filename Annex B file to loop over, or NULL for synthetic access units of filler data.
+ * Synthetic video can't be decoded, but exercises the whole receive path at an exact bitrate.
+ */
+ChiakiErrorCode emulator_video_source_init(EmulatorVideoSource *source, ChiakiLog *log, const char *filename, bool h265);
+void emulator_video_source_fini(EmulatorVideoSource *source);
+
+/**
+ * @param size_hint size of synthetic access units
+ */
+ChiakiErrorCode emulator_video_source_next(EmulatorVideoSource *source, size_t size_hint, const uint8_t **au, size_t *au_size);
+
+
+typedef struct emulator_stream_stats_t
+{
+	uint64_t video_frames;
+	uint64_t video_frames_skipped;
+	uint64_t audio_frames;
+	uint64_t av_packets_sent;
+	uint64_t av_packets_dropped;
+	uint64_t av_packets_reordered;
+	uint64_t av_bytes_sent;
+	uint64_t duration_us;
+} EmulatorStreamStats;
+
+typedef struct emulator_t
+{
+	EmulatorOptions options;
+	ChiakiLog *log;
+	EmulatorSession session;
+
+	chiaki_socket_t session_sock;
+	chiaki_socket_t ctrl_sock; // kept open until the next ctrl connection, only used by session_thread
+	ChiakiStopPipe session_stop_pipe;
+	ChiakiThread session_thread;
+
+	EmulatorTakion senkusha_takion;
+	ChiakiStopPipe senkusha_stop_pipe;
+	ChiakiThread senkusha_thread;
+
+	EmulatorTakion stream_takion;
+	ChiakiStopPipe stream_stop_pipe;
+	ChiakiThread stream_thread;
+
+	ChiakiMutex stats_mutex;
+	EmulatorStreamStats stats_last; // of the last finished stream
+	uint64_t streams_finished;
+} Emulator;
+
+ChiakiErrorCode emulator_session_server_start(Emulator *emulator);
+void emulator_session_server_stop(Emulator *emulator);
+
+ChiakiErrorCode emulator_senkusha_server_start(Emulator *emulator);
+void emulator_senkusha_server_stop(Emulator *emulator);
+
+ChiakiErrorCode emulator_stream_server_start(Emulator *emulator);
+void emulator_stream_server_stop(Emulator *emulator);
+
+#endif // CHIAKI_EMULATOR_H
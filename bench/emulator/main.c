@@ -0,0 +1,389 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+/*
+ * Emulates the console side of Remote Play (session request, ctrl, senkusha and an encrypted
+ * Takion stream with FEC-protected video and audio) for end-to-end load testing without a console.
+ *
+ * Usage: chiaki-emulator [options]
+ *   -H <host>     address to listen on, default 127.0.0.1
+ *   -m <hex>      morning the client uses, 32 hex digits, default all zero
+ *   -k <key>      only accept clients with this regist key
+ *   -b <kbps>     video bitrate, default from the client's launch spec
+ *   -f <fps>      video frame rate, default from the client's launch spec
+ *   -e <percent>  fec units per frame relative to source units, default 10
+ *   -l <loss>     probability for each AV packet to be dropped, default 0
+ *   -r <reorder>  probability for each AV packet to be sent after the next one, default 0
+ *   -i <file>     Annex B H.264/H.265 file to loop instead of synthetic video
+ *   -n            no audio
+ *   -c <seconds>  connect a client session to the emulator, stream for the given time and report
+ *   -5            emulate a PS5 when the client is run with -c
+ *   -s            client receives video as slices before frames are complete
+ *   -d <engine>   fec decode engine of the client, matrix (default) or bitmatrix
+ *   -v            verbose log
+ *
+ * Without -c, the emulator runs until interrupted and any client can connect to it.
+ */
+
+#include "emulator.h"
+
+#include <chiaki/fec.h>
+#include <chiaki/time.h>
+
+#include "utils.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FEC_PERCENT_DEFAULT 10
+#define STREAM_FINISH_TIMEOUT_MS 2000
+
+static ChiakiStopPipe stop_pipe;
+
+static void signal_handler(int signum)
+{
+	(void)signum;
+	chiaki_stop_pipe_stop(&stop_pipe);
+}
+
+typedef struct client_stats_t
+{
+	uint64_t connected_us;
+	uint64_t video_frames;
+	uint64_t video_bytes;
+	uint64_t video_slices; // passed on before the end of their frame
+	uint64_t audio_frames;
+	ChiakiQuitReason quit_reason;
+	bool quit;
+} ClientStats;
+
+static void client_event_cb(ChiakiEvent *event, void *user)
+{
+	ClientStats *stats = user;
+	switch(event->type)
+	{
+		case CHIAKI_EVENT_CONNECTED:
+			stats->connected_us = chiaki_time_now_monotonic_us();
+			break;
+		case CHIAKI_EVENT_QUIT:
+			stats->quit = true;
+			stats->quit_reason = event->quit.reason;
+			break;
+		default:
+			break;
+	}
+}
+
+static bool client_video_sample_cb(uint8_t *buf, size_t buf_size, void *user)
+{
+	ClientStats *stats = user;
+	(void)buf;
+	stats->video_frames++;
+	stats->video_bytes += buf_size;
+	return true;
+}
+
+static bool client_video_slice_cb(ChiakiVideoSampleSegment *segments, size_t segments_count, size_t size, bool frame_end, void *user)
+{
+	ClientStats *stats = user;
+	(void)segments;
+	(void)segments_count;
+	if(frame_end)
+		stats->video_frames++;
+	else
+		stats->video_slices++;
+	stats->video_bytes += size;
+	return true;
+}
+
+static void client_audio_frame_cb(uint8_t *buf, size_t buf_size, void *user)
+{
+	ClientStats *stats = user;
+	(void)buf;
+	(void)buf_size;
+	stats->audio_frames++;
+}
+
+static int run_client(Emulator *emulator, bool ps5, bool slices, unsigned int duration_s)
+{
+	ChiakiConnectInfo connect_info = { 0 };
+	connect_info.ps5 = ps5;
+	connect_info.host = emulator->options.host;
+	memcpy(connect_info.regist_key, emulator->options.regist_key, sizeof(connect_info.regist_key));
+	memcpy(connect_info.morning, emulator->options.morning, sizeof(connect_info.morning));
+	chiaki_connect_video_profile_preset(&connect_info.video_profile, CHIAKI_VIDEO_RESOLUTION_PRESET_720p, CHIAKI_VIDEO_FPS_PRESET_60);
+
+	ChiakiSession session;
+	ChiakiErrorCode err = chiaki_session_init(&session, &connect_info, emulator->log);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		fprintf(stderr, "Failed to init client session: %s\n", chiaki_error_string(err));
+		return 1;
+	}
+
+	ClientStats stats = { 0 };
+	chiaki_session_set_event_cb(&session, client_event_cb, &stats);
+	if(slices)
+		chiaki_session_set_video_slice_cb(&session, client_video_slice_cb, &stats);
+	else
+		chiaki_session_set_video_sample_cb(&session, client_video_sample_cb, &stats);
+	ChiakiAudioSink audio_sink = { 0 };
+	audio_sink.user = &stats;
+	audio_sink.frame_cb = client_audio_frame_cb;
+	chiaki_session_set_audio_sink(&session, &audio_sink);
+
+	uint64_t start_us = chiaki_time_now_monotonic_us();
+	err = chiaki_session_start(&session);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		fprintf(stderr, "Failed to start client session: %s\n", chiaki_error_string(err));
+		chiaki_session_fini(&session);
+		return 1;
+	}
+
+	chiaki_stop_pipe_sleep(&stop_pipe, (uint64_t)duration_s * 1000);
+	ChiakiBandwidthEstimate estimate;
+	bool estimate_valid = chiaki_session_get_bandwidth_estimate(&session, &estimate) == CHIAKI_ERR_SUCCESS;
+	ChiakiStreamStatsSnapshot stream_stats;
+	chiaki_session_get_stream_stats(&session, &stream_stats);
+	chiaki_session_stop(&session);
+	chiaki_session_join(&session);
+	chiaki_session_fini(&session);
+
+	// the stream server finishes its stream once it received the client's disconnect
+	for(unsigned int i=0; i<STREAM_FINISH_TIMEOUT_MS / 10; i++)
+	{
+		chiaki_mutex_lock(&emulator->stats_mutex);
+		uint64_t finished = emulator->streams_finished;
+		chiaki_mutex_unlock(&emulator->stats_mutex);
+		if(finished)
+			break;
+		chiaki_stop_pipe_sleep(&stop_pipe, 10);
+	}
+
+	chiaki_mutex_lock(&emulator->stats_mutex);
+	EmulatorStreamStats server = emulator->stats_last;
+	uint64_t streams_finished = emulator->streams_finished;
+	chiaki_mutex_unlock(&emulator->stats_mutex);
+
+	if(!stats.connected_us)
+	{
+		fprintf(stderr, "Client did not connect: %s\n", chiaki_quit_reason_string(stats.quit_reason));
+		return 1;
+	}
+
+	printf("%-28s %llu us\n", "time to stream connected", (unsigned long long)(stats.connected_us - start_us));
+	if(streams_finished)
+	{
+		double duration = (double)server.duration_us / 1000000.0;
+		printf("%-28s %llu frames, %llu skipped, %llu audio frames in %.3f s\n", "server sent",
+				(unsigned long long)server.video_frames, (unsigned long long)server.video_frames_skipped,
+				(unsigned long long)server.audio_frames, duration);
+		printf("%-28s %llu packets, %llu dropped, %llu reordered, %.1f Mbit/s\n", "server av",
+				(unsigned long long)server.av_packets_sent, (unsigned long long)server.av_packets_dropped,
+				(unsigned long long)server.av_packets_reordered,
+				duration > 0.0 ? server.av_bytes_sent * 8.0 / 1000000.0 / duration : 0.0);
+	}
+	else
+		printf("%-28s stream did not finish\n", "server sent");
+	printf("%-28s %llu frames, %llu bytes, %llu early slices\n", "client video",
+			(unsigned long long)stats.video_frames, (unsigned long long)stats.video_bytes,
+			(unsigned long long)stats.video_slices);
+	printf("%-28s %llu frames\n", "client audio", (unsigned long long)stats.audio_frames);
+	ChiakiStreamStatsWindow *window = &stream_stats.window_short;
+	printf("%-28s %.1f fps, %.1f Mbit/s, loss %.3f, fec recovered %.3f, jitter %llu us\n", "client last second",
+			window->fps, window->bitrate / 1000000.0, window->loss_ratio, window->fec_recovery_ratio,
+			(unsigned long long)stream_stats.jitter_us);
+	if(estimate_valid)
+		printf("%-28s %llu kbps of %llu kbps received, %s, loss %.3f\n", "client bandwidth estimate",
+				(unsigned long long)estimate.bitrate_kbps, (unsigned long long)estimate.received_kbps,
+				chiaki_bandwidth_usage_string(estimate.usage), estimate.loss_ratio);
+	ChiakiFecCacheStats fec_cache;
+	chiaki_fec_cache_stats(&fec_cache);
+	printf("%-28s coding %llu hits, %llu misses, decoding %llu hits, %llu misses, schedule %llu hits, %llu misses\n",
+			"fec matrix cache",
+			(unsigned long long)fec_cache.coding_hits, (unsigned long long)fec_cache.coding_misses,
+			(unsigned long long)fec_cache.decoding_hits, (unsigned long long)fec_cache.decoding_misses,
+			(unsigned long long)fec_cache.schedule_hits, (unsigned long long)fec_cache.schedule_misses);
+
+	if(stats.quit && stats.quit_reason != CHIAKI_QUIT_REASON_STOPPED)
+	{
+		fprintf(stderr, "Client quit: %s\n", chiaki_quit_reason_string(stats.quit_reason));
+		return 1;
+	}
+	return stats.video_frames ? 0 : 1;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-H host] [-m morning] [-k regist key] [-b kbps] [-f fps] [-e fec percent] [-l loss] [-r reorder]"
+			" [-i video file] [-n] [-c seconds] [-5] [-s] [-d fec engine] [-v]\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	Emulator emulator;
+	memset(&emulator, 0, sizeof(emulator));
+	EmulatorOptions *options = &emulator.options;
+	options->host = "127.0.0.1";
+	options->fec_percent = FEC_PERCENT_DEFAULT;
+	options->audio = true;
+
+	bool verbose = false;
+	bool ps5 = false;
+	bool slices = false;
+	unsigned int client_duration_s = 0;
+	for(int i=1; i<argc; i++)
+	{
+		const char *arg = argv[i];
+		if(!strcmp(arg, "-v"))
+		{
+			verbose = true;
+			continue;
+		}
+		if(!strcmp(arg, "-n"))
+		{
+			options->audio = false;
+			continue;
+		}
+		if(!strcmp(arg, "-5"))
+		{
+			ps5 = true;
+			continue;
+		}
+		if(!strcmp(arg, "-s"))
+		{
+			slices = true;
+			continue;
+		}
+		if(i + 1 >= argc)
+		{
+			usage(argv[0]);
+			return 1;
+		}
+		const char *value = argv[++i];
+		if(!strcmp(arg, "-H"))
+			options->host = value;
+		else if(!strcmp(arg, "-m"))
+		{
+			size_t morning_size = sizeof(options->morning);
+			if(parse_hex(options->morning, &morning_size, value, strlen(value)) != CHIAKI_ERR_SUCCESS
+					|| morning_size != sizeof(options->morning))
+			{
+				fprintf(stderr, "Morning must be %d hex digits\n", (int)sizeof(options->morning) * 2);
+				return 1;
+			}
+		}
+		else if(!strcmp(arg, "-k"))
+		{
+			if(strlen(value) > sizeof(options->regist_key))
+			{
+				fprintf(stderr, "Regist key is too long\n");
+				return 1;
+			}
+			strncpy(options->regist_key, value, sizeof(options->regist_key));
+			options->check_regist_key = true;
+		}
+		else if(!strcmp(arg, "-b"))
+			options->bitrate_kbps = (unsigned int)strtoul(value, NULL, 0);
+		else if(!strcmp(arg, "-f"))
+			options->fps = (unsigned int)strtoul(value, NULL, 0);
+		else if(!strcmp(arg, "-e"))
+			options->fec_percent = (unsigned int)strtoul(value, NULL, 0);
+		else if(!strcmp(arg, "-l"))
+			options->loss = strtod(value, NULL);
+		else if(!strcmp(arg, "-r"))
+			options->reorder = strtod(value, NULL);
+		else if(!strcmp(arg, "-i"))
+			options->video_filename = value;
+		else if(!strcmp(arg, "-c"))
+			client_duration_s = (unsigned int)strtoul(value, NULL, 0);
+		else if(!strcmp(arg, "-d"))
+		{
+			if(!strcmp(value, chiaki_fec_engine_name(CHIAKI_FEC_ENGINE_MATRIX)))
+				chiaki_fec_set_engine(CHIAKI_FEC_ENGINE_MATRIX);
+			else if(!strcmp(value, chiaki_fec_engine_name(CHIAKI_FEC_ENGINE_BITMATRIX)))
+				chiaki_fec_set_engine(CHIAKI_FEC_ENGINE_BITMATRIX);
+			else
+			{
+				fprintf(stderr, "Unknown fec engine %s\n", value);
+				return 1;
+			}
+		}
+		else
+		{
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if(options->loss < 0.0 || options->loss > 1.0)
+	{
+		fprintf(stderr, "Loss must be between 0 and 1\n");
+		return 1;
+	}
+	if(options->reorder < 0.0 || options->reorder > 1.0)
+	{
+		fprintf(stderr, "Reorder must be between 0 and 1\n");
+		return 1;
+	}
+
+	ChiakiLog log;
+	chiaki_log_init(&log, verbose ? CHIAKI_LOG_ALL : CHIAKI_LOG_ALL & ~CHIAKI_LOG_VERBOSE, chiaki_log_cb_print, NULL);
+	emulator.log = &log;
+
+	ChiakiErrorCode err = chiaki_lib_init();
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		fprintf(stderr, "Failed to init lib: %s\n", chiaki_error_string(err));
+		return 1;
+	}
+
+	err = chiaki_stop_pipe_init(&stop_pipe);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		fprintf(stderr, "Failed to init stop pipe: %s\n", chiaki_error_string(err));
+		return 1;
+	}
+	signal(SIGINT, signal_handler);
+	signal(SIGTERM, signal_handler);
+
+	int ret = 1;
+	err = emulator_session_server_start(&emulator);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		fprintf(stderr, "Failed to start session server: %s\n", chiaki_error_string(err));
+		goto error_stop_pipe;
+	}
+	err = emulator_senkusha_server_start(&emulator);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		fprintf(stderr, "Failed to start senkusha server: %s\n", chiaki_error_string(err));
+		goto error_session;
+	}
+	err = emulator_stream_server_start(&emulator);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		fprintf(stderr, "Failed to start stream server: %s\n", chiaki_error_string(err));
+		goto error_senkusha;
+	}
+
+	if(client_duration_s)
+		ret = run_client(&emulator, ps5, slices, client_duration_s);
+	else
+	{
+		chiaki_stop_pipe_sleep(&stop_pipe, UINT64_MAX);
+		ret = 0;
+	}
+
+	emulator_stream_server_stop(&emulator);
+error_senkusha:
+	emulator_senkusha_server_stop(&emulator);
+error_session:
+	emulator_session_server_stop(&emulator);
+error_stop_pipe:
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	chiaki_stop_pipe_fini(&stop_pipe);
+	return ret;
+}
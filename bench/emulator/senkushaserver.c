@@ -0,0 +1,164 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include "emulator.h"
+
+#include "pb_utils.h"
+
+#include <pb_decode.h>
+
+#include <string.h>
+
+#define SENKUSHA_RECV_TIMEOUT_MS 1000
+#define SENKUSHA_VERSION 7
+
+// IP + UDP header, see MTU_UDP_PACKET_ADD in senkusha.c
+#define MTU_UDP_PACKET_ADD 0x1c
+
+static void *senkusha_thread_func(void *user);
+
+ChiakiErrorCode emulator_senkusha_server_start(Emulator *emulator)
+{
+	ChiakiErrorCode err = emulator_takion_init(&emulator->senkusha_takion, emulator->log,
+			emulator->options.host, EMULATOR_SENKUSHA_PORT, SENKUSHA_VERSION);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+
+	err = chiaki_stop_pipe_init(&emulator->senkusha_stop_pipe);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_takion;
+
+	err = chiaki_thread_create(&emulator->senkusha_thread, senkusha_thread_func, emulator);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_stop_pipe;
+	chiaki_thread_set_name(&emulator->senkusha_thread, "Chiaki Emu Senkusha");
+
+	return CHIAKI_ERR_SUCCESS;
+
+error_stop_pipe:
+	chiaki_stop_pipe_fini(&emulator->senkusha_stop_pipe);
+error_takion:
+	emulator_takion_fini(&emulator->senkusha_takion);
+	return err;
+}
+
+void emulator_senkusha_server_stop(Emulator *emulator)
+{
+	chiaki_stop_pipe_stop(&emulator->senkusha_stop_pipe);
+	chiaki_thread_join(&emulator->senkusha_thread, NULL);
+	chiaki_stop_pipe_fini(&emulator->senkusha_stop_pipe);
+	emulator_takion_fini(&emulator->senkusha_takion);
+}
+
+static ChiakiErrorCode senkusha_send_bang(EmulatorTakion *takion)
+{
+	tkproto_TakionMessage msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.type = tkproto_TakionMessage_PayloadType_BANG;
+	msg.has_bang_payload = true;
+	msg.bang_payload.server_version = SENKUSHA_VERSION;
+	msg.bang_payload.encrypted_key_accepted = true;
+	msg.bang_payload.version_accepted = true;
+	msg.bang_payload.session_key.arg = "";
+	msg.bang_payload.session_key.funcs.encode = chiaki_pb_encode_string;
+	return emulator_takion_send_message(takion, 1, &msg);
+}
+
+static void senkusha_handle_mtu_command(EmulatorTakion *takion, tkproto_SenkushaMtuCommand *command)
+{
+	// answered with a video packet that fills the requested mtu exactly
+	ChiakiTakionAVPacket packet = { 0 };
+	packet.is_video = true;
+	packet.frame_index = (ChiakiSeqNum16)command->id;
+	packet.units_in_frame_total = 1;
+	size_t header_size = CHIAKI_TAKION_V7_AV_HEADER_SIZE_BASE + CHIAKI_TAKION_V7_AV_HEADER_SIZE_VIDEO_ADD;
+	if(command->mtu_req < MTU_UDP_PACKET_ADD + header_size || command->mtu_req > 1500)
+	{
+		CHIAKI_LOGW(takion->log, "Senkusha server received MTU command with invalid mtu %u", (unsigned int)command->mtu_req);
+		return;
+	}
+
+	uint8_t data[1500] = { 0 };
+	size_t data_size = command->mtu_req - MTU_UDP_PACKET_ADD - header_size;
+	uint32_t num = command->has_num && command->num ? command->num : 1;
+	for(uint32_t i=0; i<num; i++)
+		emulator_takion_send_av(takion, &packet, data, data_size);
+}
+
+static void senkusha_handle_data(EmulatorTakion *takion, EmulatorTakionEvent *event)
+{
+	if(event->data_type != CHIAKI_TAKION_MESSAGE_DATA_TYPE_PROTOBUF)
+		return;
+
+	tkproto_TakionMessage msg;
+	memset(&msg, 0, sizeof(msg));
+	pb_istream_t stream = pb_istream_from_buffer(event->buf, event->buf_size);
+	if(!pb_decode(&stream, tkproto_TakionMessage_fields, &msg))
+	{
+		CHIAKI_LOGW(takion->log, "Senkusha server failed to decode data protobuf");
+		return;
+	}
+
+	switch(msg.type)
+	{
+		case tkproto_TakionMessage_PayloadType_BIG:
+			CHIAKI_LOGI(takion->log, "Senkusha server received big, sending bang");
+			senkusha_send_bang(takion);
+			break;
+		case tkproto_TakionMessage_PayloadType_SENKUSHA:
+			if(!msg.has_senkusha_payload)
+				break;
+			if(msg.senkusha_payload.command == tkproto_SenkushaPayload_Command_MTU_COMMAND
+					&& msg.senkusha_payload.has_mtu_command)
+			{
+				senkusha_handle_mtu_command(takion, &msg.senkusha_payload.mtu_command);
+			}
+			else if(msg.senkusha_payload.command == tkproto_SenkushaPayload_Command_CLIENT_MTU_COMMAND
+					&& msg.senkusha_payload.has_client_mtu_command)
+			{
+				// confirm by sending the same command back
+				emulator_takion_send_message(takion, 8, &msg);
+			}
+			break;
+		case tkproto_TakionMessage_PayloadType_DISCONNECT:
+			CHIAKI_LOGI(takion->log, "Senkusha server received disconnect");
+			takion->connected = false;
+			break;
+		default:
+			break;
+	}
+}
+
+static void *senkusha_thread_func(void *user)
+{
+	Emulator *emulator = user;
+	EmulatorTakion *takion = &emulator->senkusha_takion;
+	CHIAKI_LOGI(emulator->log, "Senkusha server listening on UDP port %d", EMULATOR_SENKUSHA_PORT);
+
+	while(true)
+	{
+		EmulatorTakionEvent event;
+		ChiakiErrorCode err = emulator_takion_recv(takion, &emulator->senkusha_stop_pipe, SENKUSHA_RECV_TIMEOUT_MS, &event);
+		if(err == CHIAKI_ERR_CANCELED)
+			break;
+		if(err != CHIAKI_ERR_SUCCESS)
+			continue;
+
+		switch(event.type)
+		{
+			case EMULATOR_TAKION_EVENT_CONNECTED:
+				CHIAKI_LOGI(emulator->log, "Senkusha server connected");
+				break;
+			case EMULATOR_TAKION_EVENT_DATA:
+				senkusha_handle_data(takion, &event);
+				break;
+			case EMULATOR_TAKION_EVENT_AV:
+				// pings for rtt and mtu out are echoed back unchanged
+				emulator_takion_send_raw(takion, event.buf, event.buf_size);
+				break;
+			default:
+				break;
+		}
+	}
+
+	return NULL;
+}
@@ -0,0 +1,359 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include "emulator.h"
+
+#include <chiaki/http.h>
+#include <chiaki/base64.h>
+#include <chiaki/random.h>
+
+#include "utils.h"
+
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <stdio.h>
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define SESSION_RECV_TIMEOUT_MS 5000
+#define SESSION_ACCEPT_POLL_MS 200
+
+#define CTRL_MESSAGE_TYPE_SESSION_ID 0x33
+
+static void *session_thread_func(void *user);
+
+ChiakiErrorCode emulator_session_server_start(Emulator *emulator)
+{
+	ChiakiLog *log = emulator->log;
+	emulator->ctrl_sock = CHIAKI_INVALID_SOCKET;
+
+	ChiakiErrorCode err = chiaki_mutex_init(&emulator->session.mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	emulator->session.valid = false;
+
+	char port_str[6];
+	snprintf(port_str, sizeof(port_str), "%d", EMULATOR_SESSION_PORT);
+	struct addrinfo hints = { 0 };
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	struct addrinfo *ai;
+	if(getaddrinfo(emulator->options.host, port_str, &hints, &ai) != 0)
+	{
+		CHIAKI_LOGE(log, "Failed to resolve %s", emulator->options.host);
+		err = CHIAKI_ERR_NETWORK;
+		goto error_mutex;
+	}
+
+	emulator->session_sock = socket(ai->ai_family, SOCK_STREAM, IPPROTO_TCP);
+	if(CHIAKI_SOCKET_IS_INVALID(emulator->session_sock))
+	{
+		CHIAKI_LOGE(log, "Failed to create session socket: " CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
+		freeaddrinfo(ai);
+		err = CHIAKI_ERR_NETWORK;
+		goto error_mutex;
+	}
+
+	const int reuse = 1;
+	setsockopt(emulator->session_sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+	if(bind(emulator->session_sock, ai->ai_addr, ai->ai_addrlen) < 0 || listen(emulator->session_sock, 4) < 0)
+	{
+		CHIAKI_LOGE(log, "Failed to listen on TCP port %d: " CHIAKI_SOCKET_ERROR_FMT, EMULATOR_SESSION_PORT, CHIAKI_SOCKET_ERROR_VALUE);
+		freeaddrinfo(ai);
+		err = CHIAKI_ERR_NETWORK;
+		goto error_sock;
+	}
+	freeaddrinfo(ai);
+
+	err = chiaki_stop_pipe_init(&emulator->session_stop_pipe);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_sock;
+
+	err = chiaki_thread_create(&emulator->session_thread, session_thread_func, emulator);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_stop_pipe;
+	chiaki_thread_set_name(&emulator->session_thread, "Chiaki Emu Session");
+
+	return CHIAKI_ERR_SUCCESS;
+
+error_stop_pipe:
+	chiaki_stop_pipe_fini(&emulator->session_stop_pipe);
+error_sock:
+	CHIAKI_SOCKET_CLOSE(emulator->session_sock);
+error_mutex:
+	chiaki_mutex_fini(&emulator->session.mutex);
+	return err;
+}
+
+void emulator_session_server_stop(Emulator *emulator)
+{
+	chiaki_stop_pipe_stop(&emulator->session_stop_pipe);
+	chiaki_thread_join(&emulator->session_thread, NULL);
+	chiaki_stop_pipe_fini(&emulator->session_stop_pipe);
+	if(!CHIAKI_SOCKET_IS_INVALID(emulator->ctrl_sock))
+		CHIAKI_SOCKET_CLOSE(emulator->ctrl_sock);
+	CHIAKI_SOCKET_CLOSE(emulator->session_sock);
+	chiaki_mutex_fini(&emulator->session.mutex);
+}
+
+static ChiakiErrorCode send_all(chiaki_socket_t sock, const void *buf, size_t buf_size)
+{
+	const uint8_t *cur = buf;
+	while(buf_size)
+	{
+		ssize_t sent = send(sock, cur, buf_size, 0);
+		if(sent <= 0)
+			return CHIAKI_ERR_NETWORK;
+		cur += sent;
+		buf_size -= (size_t)sent;
+	}
+	return CHIAKI_ERR_SUCCESS;
+}
+
+static ChiakiErrorCode send_response(chiaki_socket_t sock, const char *status, const char *headers)
+{
+	char buf[512];
+	int len = snprintf(buf, sizeof(buf), "HTTP/1.1 %s\r\nContent-Length: 0\r\n%s\r\n", status, headers ? headers : "");
+	if(len < 0 || (size_t)len >= sizeof(buf))
+		return CHIAKI_ERR_BUF_TOO_SMALL;
+	return send_all(sock, buf, (size_t)len);
+}
+
+static const char *header_get(ChiakiHttpHeader *headers, const char *key)
+{
+	for(ChiakiHttpHeader *header=headers; header; header=header->next)
+	{
+		if(strcasecmp(header->key, key) == 0)
+			return header->value;
+	}
+	return NULL;
+}
+
+static void session_id_generate(char *id, size_t size)
+{
+	static const char alphabet[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+	uint8_t rand[EMULATOR_SESSION_ID_SIZE];
+	chiaki_random_bytes_crypt(rand, sizeof(rand));
+	for(size_t i=0; i<size; i++)
+		id[i] = alphabet[rand[i % sizeof(rand)] % (sizeof(alphabet) - 1)];
+	id[size] = '\0';
+}
+
+static void handle_session_request(Emulator *emulator, chiaki_socket_t sock, const char *path, ChiakiHttpHeader *headers)
+{
+	ChiakiLog *log = emulator->log;
+	bool is_ps5 = strstr(path, "/ps5/") != NULL;
+
+	const char *rp_version = header_get(headers, "RP-Version");
+	ChiakiTarget target = rp_version ? chiaki_rp_version_parse(rp_version, is_ps5) : CHIAKI_TARGET_PS4_UNKNOWN;
+	if(chiaki_target_is_unknown(target))
+	{
+		CHIAKI_LOGW(log, "Session request with unknown RP-Version %s", rp_version ? rp_version : "(none)");
+		char reason[128];
+		snprintf(reason, sizeof(reason), "RP-Application-Reason: %x\r\nRP-Version: %s\r\n",
+				(unsigned int)CHIAKI_RP_APPLICATION_REASON_RP_VERSION,
+				chiaki_rp_version_string(is_ps5 ? CHIAKI_TARGET_PS5_1 : CHIAKI_TARGET_PS4_10));
+		send_response(sock, "403 Forbidden", reason);
+		return;
+	}
+
+	if(emulator->options.check_regist_key)
+	{
+		size_t regist_key_len = strnlen(emulator->options.regist_key, sizeof(emulator->options.regist_key));
+		char regist_key_hex[sizeof(emulator->options.regist_key) * 2 + 1];
+		format_hex(regist_key_hex, sizeof(regist_key_hex), (const uint8_t *)emulator->options.regist_key, regist_key_len);
+		const char *regist_key = header_get(headers, "RP-Registkey");
+		if(!regist_key || strcasecmp(regist_key, regist_key_hex) != 0)
+		{
+			CHIAKI_LOGW(log, "Session request with wrong RP-Registkey");
+			char reason[64];
+			snprintf(reason, sizeof(reason), "RP-Application-Reason: %x\r\n", (unsigned int)CHIAKI_RP_APPLICATION_REASON_REGIST_FAILED);
+			send_response(sock, "403 Forbidden", reason);
+			return;
+		}
+	}
+
+	uint8_t nonce[CHIAKI_RPCRYPT_KEY_SIZE];
+	chiaki_random_bytes_crypt(nonce, sizeof(nonce));
+	char nonce_b64[CHIAKI_RPCRYPT_KEY_SIZE * 2];
+	chiaki_base64_encode(nonce, sizeof(nonce), nonce_b64, sizeof(nonce_b64));
+
+	chiaki_mutex_lock(&emulator->session.mutex);
+	emulator->session.valid = true;
+	emulator->session.target = target;
+	chiaki_rpcrypt_init_auth(&emulator->session.rpcrypt, target, nonce, emulator->options.morning);
+	session_id_generate(emulator->session.id, EMULATOR_SESSION_ID_SIZE);
+	chiaki_mutex_unlock(&emulator->session.mutex);
+
+	CHIAKI_LOGI(log, "Session requested with RP-Version %s", chiaki_rp_version_string(target));
+
+	char nonce_header[64];
+	snprintf(nonce_header, sizeof(nonce_header), "RP-Nonce: %s\r\n", nonce_b64);
+	send_response(sock, "200 OK", nonce_header);
+}
+
+/**
+ * @return true if sock was kept as the ctrl connection
+ */
+static bool handle_ctrl_request(Emulator *emulator, chiaki_socket_t sock)
+{
+	ChiakiLog *log = emulator->log;
+
+	chiaki_mutex_lock(&emulator->session.mutex);
+	if(!emulator->session.valid)
+	{
+		chiaki_mutex_unlock(&emulator->session.mutex);
+		CHIAKI_LOGW(log, "Ctrl request without a session");
+		send_response(sock, "403 Forbidden", NULL);
+		return false;
+	}
+
+	// the client only accepts codecs other than h264 from a PS5
+	uint8_t server_type[CHIAKI_RPCRYPT_KEY_SIZE] = { 0 };
+	server_type[0] = chiaki_target_is_ps5(emulator->session.target) ? 2 : 1;
+	uint8_t server_type_enc[sizeof(server_type)];
+	chiaki_rpcrypt_encrypt(&emulator->session.rpcrypt, 0, server_type, server_type_enc, sizeof(server_type));
+
+	size_t id_size = strlen(emulator->session.id);
+	uint8_t msg[8 + 1 + EMULATOR_SESSION_ID_SIZE];
+	*((chiaki_unaligned_uint32_t *)msg) = htonl((uint32_t)(1 + id_size));
+	*((chiaki_unaligned_uint16_t *)(msg + 4)) = htons(CTRL_MESSAGE_TYPE_SESSION_ID);
+	*((chiaki_unaligned_uint16_t *)(msg + 6)) = 0;
+	uint8_t payload[1 + EMULATOR_SESSION_ID_SIZE];
+	payload[0] = 0x4a;
+	memcpy(payload + 1, emulator->session.id, id_size);
+	chiaki_rpcrypt_encrypt(&emulator->session.rpcrypt, 1, payload, msg + 8, 1 + id_size);
+	chiaki_mutex_unlock(&emulator->session.mutex);
+
+	char server_type_b64[CHIAKI_RPCRYPT_KEY_SIZE * 2];
+	chiaki_base64_encode(server_type_enc, sizeof(server_type_enc), server_type_b64, sizeof(server_type_b64));
+	char server_type_header[64];
+	snprintf(server_type_header, sizeof(server_type_header), "RP-Server-Type: %s\r\n", server_type_b64);
+	if(send_response(sock, "200 OK", server_type_header) != CHIAKI_ERR_SUCCESS
+			|| send_all(sock, msg, 8 + 1 + id_size) != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(log, "Failed to send ctrl response");
+		return false;
+	}
+
+	CHIAKI_LOGI(log, "Ctrl connected, sent session id");
+	if(!CHIAKI_SOCKET_IS_INVALID(emulator->ctrl_sock))
+		CHIAKI_SOCKET_CLOSE(emulator->ctrl_sock);
+	emulator->ctrl_sock = sock;
+	return true;
+}
+
+static void handle_connection(Emulator *emulator, chiaki_socket_t sock)
+{
+	ChiakiLog *log = emulator->log;
+
+	char buf[1024];
+	size_t header_size;
+	size_t received_size;
+	ChiakiErrorCode err = chiaki_recv_http_header(sock, buf, sizeof(buf) - 1, &header_size, &received_size, &emulator->session_stop_pipe, SESSION_RECV_TIMEOUT_MS);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		if(err != CHIAKI_ERR_CANCELED)
+			CHIAKI_LOGE(log, "Failed to receive request header: %s", chiaki_error_string(err));
+		goto close;
+	}
+	buf[header_size] = '\0';
+
+	char *line_end = strstr(buf, "\r\n");
+	if(!line_end || strncmp(buf, "GET ", 4) != 0)
+	{
+		CHIAKI_LOGE(log, "Received invalid request");
+		goto close;
+	}
+	*line_end = '\0';
+	char *path = buf + 4;
+	char *path_end = strchr(path, ' ');
+	if(path_end)
+		*path_end = '\0';
+
+	char *headers_buf = line_end + 2;
+	ChiakiHttpHeader *headers;
+	err = chiaki_http_header_parse(&headers, headers_buf, header_size - (headers_buf - buf));
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(log, "Failed to parse request headers");
+		goto close;
+	}
+
+	bool keep = false;
+	size_t path_len = strlen(path);
+	if(path_len >= 5 && strcmp(path + path_len - 5, "/ctrl") == 0)
+		keep = handle_ctrl_request(emulator, sock);
+	else if(strcmp(path, "/sie/ps4/rp/sess/init") == 0
+			|| strcmp(path, "/sie/ps5/rp/sess/init") == 0
+			|| strcmp(path, "/sce/rp/session") == 0)
+		handle_session_request(emulator, sock, path, headers);
+	else
+	{
+		CHIAKI_LOGW(log, "Request for unknown path %s", path);
+		send_response(sock, "404 Not Found", NULL);
+	}
+	chiaki_http_header_free(headers);
+	if(keep)
+		return;
+
+close:
+	CHIAKI_SOCKET_CLOSE(sock);
+}
+
+static void ctrl_drain(Emulator *emulator)
+{
+	// heartbeats and keyboard messages from the client are not answered, just don't let them pile up
+	if(CHIAKI_SOCKET_IS_INVALID(emulator->ctrl_sock))
+		return;
+	uint8_t buf[512];
+	while(true)
+	{
+		ssize_t received = recv(emulator->ctrl_sock, buf, sizeof(buf), MSG_DONTWAIT);
+		if(received > 0)
+			continue;
+		if(received == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+		{
+			CHIAKI_LOGI(emulator->log, "Ctrl disconnected");
+			CHIAKI_SOCKET_CLOSE(emulator->ctrl_sock);
+			emulator->ctrl_sock = CHIAKI_INVALID_SOCKET;
+		}
+		break;
+	}
+}
+
+static void *session_thread_func(void *user)
+{
+	Emulator *emulator = user;
+	CHIAKI_LOGI(emulator->log, "Session server listening on TCP port %d", EMULATOR_SESSION_PORT);
+
+	while(true)
+	{
+		ChiakiErrorCode err = chiaki_stop_pipe_select_single(&emulator->session_stop_pipe, emulator->session_sock, false, SESSION_ACCEPT_POLL_MS);
+		if(err == CHIAKI_ERR_CANCELED)
+			break;
+		ctrl_drain(emulator);
+		if(err == CHIAKI_ERR_TIMEOUT)
+			continue;
+		if(err != CHIAKI_ERR_SUCCESS)
+		{
+			CHIAKI_LOGE(emulator->log, "Session server select failed: %s", chiaki_error_string(err));
+			break;
+		}
+
+		chiaki_socket_t sock = accept(emulator->session_sock, NULL, NULL);
+		if(CHIAKI_SOCKET_IS_INVALID(sock))
+		{
+			CHIAKI_LOGE(emulator->log, "Session server failed to accept: " CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
+			continue;
+		}
+		handle_connection(emulator, sock);
+	}
+
+	return NULL;
+}
@@ -0,0 +1,703 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include "emulator.h"
+
+#include <chiaki/audio.h>
+#include <chiaki/base64.h>
+#include <chiaki/ecdh.h>
+#include <chiaki/fec.h>
+#include <chiaki/time.h>
+
+#include "pb_utils.h"
+
+#include <pb_decode.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#define STREAM_RECV_TIMEOUT_MS 1000
+#define STREAM_CLIENT_TIMEOUT_US (5 * 1000 * 1000)
+#define STREAMINFO_DELAY_US (50 * 1000)
+#define STREAMINFO_RESEND_US (200 * 1000)
+
+#define LAUNCH_SPEC_B64_SIZE_MAX 4096
+
+// IP + UDP header
+#define MTU_UDP_PACKET_ADD 0x1c
+// v9 and v12 video header without nalu info structs
+#define VIDEO_HEADER_SIZE 0x15
+#define VIDEO_CODEC 3
+#define VIDEO_FPS_DEFAULT 60
+#define VIDEO_BITRATE_KBPS_DEFAULT 10000
+#define VIDEO_MTU_DEFAULT 1454
+#define VIDEO_UNITS_MAX 256 // UNIT_SLOTS_MAX in frameprocessor.c
+
+#define AUDIO_CODEC 5
+#define AUDIO_FRAME_US (10 * 1000)
+#define AUDIO_FRAME_SIZE 480
+#define AUDIO_UNIT_SIZE 0x50
+#define AUDIO_FEC_UNITS 2
+#define AUDIO_OPUS_TOC 0xf4 // CELT fullband, 10 ms, stereo, single frame
+
+typedef enum {
+	STREAM_STATE_IDLE,
+	STREAM_STATE_EXPECT_BIG,
+	STREAM_STATE_EXPECT_STREAMINFO_ACK,
+	STREAM_STATE_STREAMING
+} StreamState;
+
+typedef struct stream_t
+{
+	Emulator *emulator;
+	ChiakiLog *log;
+	EmulatorTakion *takion;
+	StreamState state;
+
+	bool h265;
+	unsigned int width;
+	unsigned int height;
+	unsigned int fps;
+	unsigned int bitrate_kbps;
+	unsigned int mtu;
+
+	EmulatorVideoSource video_source;
+	bool video_source_valid;
+	uint64_t streaminfo_next_us;
+	uint64_t start_us;
+
+	// current video frame, sent progressively over the first half of its interval
+	uint64_t video_next_us;
+	uint64_t video_interval_us;
+	uint64_t frame_start_us;
+	ChiakiSeqNum16 frame_index;
+	uint8_t *frame_buf;
+	size_t frame_buf_size;
+	size_t unit_size;
+	size_t unit_stride;
+	unsigned int units_source;
+	unsigned int units_fec;
+	unsigned int units_sent;
+	size_t unit_last_size;
+
+	uint64_t audio_next_us;
+	ChiakiSeqNum16 audio_frame_index;
+
+	EmulatorStreamStats stats;
+} Stream;
+
+static void *stream_thread_func(void *user);
+
+ChiakiErrorCode emulator_stream_server_start(Emulator *emulator)
+{
+	ChiakiErrorCode err = chiaki_mutex_init(&emulator->stats_mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	memset(&emulator->stats_last, 0, sizeof(emulator->stats_last));
+	emulator->streams_finished = 0;
+
+	// the version is only known after the session request, set when the client connects
+	err = emulator_takion_init(&emulator->stream_takion, emulator->log,
+			emulator->options.host, EMULATOR_STREAM_PORT, 9);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_stats_mutex;
+	emulator->stream_takion.loss = emulator->options.loss;
+	emulator->stream_takion.reorder = emulator->options.reorder;
+
+	err = chiaki_stop_pipe_init(&emulator->stream_stop_pipe);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_takion;
+
+	err = chiaki_thread_create(&emulator->stream_thread, stream_thread_func, emulator);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_stop_pipe;
+	chiaki_thread_set_name(&emulator->stream_thread, "Chiaki Emu Stream");
+
+	return CHIAKI_ERR_SUCCESS;
+
+error_stop_pipe:
+	chiaki_stop_pipe_fini(&emulator->stream_stop_pipe);
+error_takion:
+	emulator_takion_fini(&emulator->stream_takion);
+error_stats_mutex:
+	chiaki_mutex_fini(&emulator->stats_mutex);
+	return err;
+}
+
+void emulator_stream_server_stop(Emulator *emulator)
+{
+	chiaki_stop_pipe_stop(&emulator->stream_stop_pipe);
+	chiaki_thread_join(&emulator->stream_thread, NULL);
+	chiaki_stop_pipe_fini(&emulator->stream_stop_pipe);
+	emulator_takion_fini(&emulator->stream_takion);
+	chiaki_mutex_fini(&emulator->stats_mutex);
+}
+
+static bool launch_spec_get_uint(const char *json, const char *key, unsigned int *value)
+{
+	char pattern[64];
+	snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+	const char *cur = strstr(json, pattern);
+	if(!cur)
+		return false;
+	*value = (unsigned int)strtoul(cur + strlen(pattern), NULL, 10);
+	return true;
+}
+
+static ChiakiErrorCode launch_spec_decode(Stream *stream, ChiakiRPCrypt *rpcrypt, const uint8_t *b64, size_t b64_size, uint8_t *handshake_key)
+{
+	char b64_str[LAUNCH_SPEC_B64_SIZE_MAX + 1];
+	memcpy(b64_str, b64, b64_size);
+	b64_str[b64_size] = '\0';
+
+	uint8_t json_enc[LAUNCH_SPEC_B64_SIZE_MAX];
+	size_t json_size = sizeof(json_enc) - 1;
+	ChiakiErrorCode err = chiaki_base64_decode(b64_str, b64_size, json_enc, &json_size);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+
+	// the client xors with the rpcrypt key stream for counter 0, see stream_connection_send_big()
+	char json[LAUNCH_SPEC_B64_SIZE_MAX];
+	memset(json, 0, json_size);
+	err = chiaki_rpcrypt_encrypt(rpcrypt, 0, (uint8_t *)json, (uint8_t *)json, json_size);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	for(size_t i=0; i<json_size; i++)
+		json[i] ^= json_enc[i];
+	json[json_size] = '\0';
+
+	CHIAKI_LOGV(stream->log, "Stream server received LaunchSpec: %s", json);
+
+	if(!launch_spec_get_uint(json, "width", &stream->width)
+			|| !launch_spec_get_uint(json, "height", &stream->height))
+	{
+		CHIAKI_LOGE(stream->log, "Stream server received LaunchSpec without resolution, probably wrong morning");
+		return CHIAKI_ERR_INVALID_DATA;
+	}
+	if(!launch_spec_get_uint(json, "maxFps", &stream->fps) || !stream->fps)
+		stream->fps = VIDEO_FPS_DEFAULT;
+	if(!launch_spec_get_uint(json, "bwKbpsSent", &stream->bitrate_kbps) || !stream->bitrate_kbps)
+		stream->bitrate_kbps = VIDEO_BITRATE_KBPS_DEFAULT;
+	if(!launch_spec_get_uint(json, "mtu", &stream->mtu) || !stream->mtu)
+		stream->mtu = VIDEO_MTU_DEFAULT;
+	stream->h265 = strstr(json, "\"videoCodec\":\"hevc\"") != NULL;
+
+	static const char handshake_key_pattern[] = "\"handshakeKey\":\"";
+	const char *handshake_key_b64 = strstr(json, handshake_key_pattern);
+	if(!handshake_key_b64)
+		return CHIAKI_ERR_INVALID_DATA;
+	handshake_key_b64 += strlen(handshake_key_pattern);
+	const char *handshake_key_b64_end = strchr(handshake_key_b64, '"');
+	if(!handshake_key_b64_end)
+		return CHIAKI_ERR_INVALID_DATA;
+	size_t handshake_key_size = CHIAKI_HANDSHAKE_KEY_SIZE;
+	err = chiaki_base64_decode(handshake_key_b64, handshake_key_b64_end - handshake_key_b64, handshake_key, &handshake_key_size);
+	if(err != CHIAKI_ERR_SUCCESS || handshake_key_size != CHIAKI_HANDSHAKE_KEY_SIZE)
+		return CHIAKI_ERR_INVALID_DATA;
+
+	return CHIAKI_ERR_SUCCESS;
+}
+
+static ChiakiErrorCode stream_send_bang(Stream *stream, ChiakiPBBuf *ecdh_pub_key, ChiakiPBBuf *ecdh_sig)
+{
+	tkproto_TakionMessage msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.type = tkproto_TakionMessage_PayloadType_BANG;
+	msg.has_bang_payload = true;
+	msg.bang_payload.server_version = stream->takion->version;
+	msg.bang_payload.token = 0;
+	msg.bang_payload.encrypted_key_accepted = true;
+	msg.bang_payload.version_accepted = true;
+	msg.bang_payload.session_key.arg = "";
+	msg.bang_payload.session_key.funcs.encode = chiaki_pb_encode_string;
+	msg.bang_payload.ecdh_pub_key.arg = ecdh_pub_key;
+	msg.bang_payload.ecdh_pub_key.funcs.encode = chiaki_pb_encode_buf;
+	msg.bang_payload.ecdh_sig.arg = ecdh_sig;
+	msg.bang_payload.ecdh_sig.funcs.encode = chiaki_pb_encode_buf;
+	return emulator_takion_send_message(stream->takion, 1, &msg);
+}
+
+static void stream_handle_big(Stream *stream, uint8_t *buf, size_t buf_size)
+{
+	Emulator *emulator = stream->emulator;
+
+	uint8_t launch_spec[LAUNCH_SPEC_B64_SIZE_MAX];
+	ChiakiPBDecodeBuf launch_spec_buf = { sizeof(launch_spec), 0, launch_spec };
+	uint8_t session_key[CHIAKI_SESSION_ID_SIZE_MAX];
+	ChiakiPBDecodeBuf session_key_buf = { sizeof(session_key) - 1, 0, session_key };
+	uint8_t ecdh_pub_key[128];
+	ChiakiPBDecodeBuf ecdh_pub_key_buf = { sizeof(ecdh_pub_key), 0, ecdh_pub_key };
+	uint8_t ecdh_sig[32];
+	ChiakiPBDecodeBuf ecdh_sig_buf = { sizeof(ecdh_sig), 0, ecdh_sig };
+
+	tkproto_TakionMessage msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.big_payload.launch_spec.arg = &launch_spec_buf;
+	msg.big_payload.launch_spec.funcs.decode = chiaki_pb_decode_buf;
+	msg.big_payload.session_key.arg = &session_key_buf;
+	msg.big_payload.session_key.funcs.decode = chiaki_pb_decode_buf;
+	msg.big_payload.ecdh_pub_key.arg = &ecdh_pub_key_buf;
+	msg.big_payload.ecdh_pub_key.funcs.decode = chiaki_pb_decode_buf;
+	msg.big_payload.ecdh_sig.arg = &ecdh_sig_buf;
+	msg.big_payload.ecdh_sig.funcs.decode = chiaki_pb_decode_buf;
+
+	pb_istream_t istream = pb_istream_from_buffer(buf, buf_size);
+	if(!pb_decode(&istream, tkproto_TakionMessage_fields, &msg) || !msg.has_big_payload)
+	{
+		CHIAKI_LOGE(stream->log, "Stream server failed to decode big");
+		return;
+	}
+	if(!launch_spec_buf.size || !ecdh_pub_key_buf.size || !ecdh_sig_buf.size)
+	{
+		CHIAKI_LOGE(stream->log, "Stream server received big without launch spec or ECDH key");
+		return;
+	}
+
+	chiaki_mutex_lock(&emulator->session.mutex);
+	bool session_valid = emulator->session.valid;
+	ChiakiRPCrypt rpcrypt = emulator->session.rpcrypt;
+	ChiakiTarget target = emulator->session.target;
+	bool session_key_match = session_key_buf.size == strlen(emulator->session.id)
+		&& memcmp(session_key, emulator->session.id, session_key_buf.size) == 0;
+	chiaki_mutex_unlock(&emulator->session.mutex);
+	if(!session_valid)
+	{
+		CHIAKI_LOGE(stream->log, "Stream server received big without a session");
+		return;
+	}
+	if(!session_key_match)
+		CHIAKI_LOGW(stream->log, "Stream server received big for a different session id");
+
+	uint8_t handshake_key[CHIAKI_HANDSHAKE_KEY_SIZE];
+	ChiakiErrorCode err = launch_spec_decode(stream, &rpcrypt, launch_spec, launch_spec_buf.size, handshake_key);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(stream->log, "Stream server failed to decode launch spec");
+		return;
+	}
+	if(!chiaki_target_is_ps5(target))
+		stream->h265 = false;
+	if(emulator->options.fps)
+		stream->fps = emulator->options.fps;
+	if(emulator->options.bitrate_kbps)
+		stream->bitrate_kbps = emulator->options.bitrate_kbps;
+
+	ChiakiECDH ecdh;
+	err = chiaki_ecdh_init(&ecdh);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(stream->log, "Stream server failed to init ECDH");
+		return;
+	}
+	uint8_t ecdh_secret[CHIAKI_ECDH_SECRET_SIZE];
+	err = chiaki_ecdh_derive_secret(&ecdh, ecdh_secret, ecdh_pub_key, ecdh_pub_key_buf.size,
+			handshake_key, ecdh_sig, ecdh_sig_buf.size);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(stream->log, "Stream server failed to derive ECDH secret");
+		chiaki_ecdh_fini(&ecdh);
+		return;
+	}
+	uint8_t local_pub_key[128];
+	ChiakiPBBuf local_pub_key_buf = { sizeof(local_pub_key), local_pub_key };
+	uint8_t local_sig[32];
+	ChiakiPBBuf local_sig_buf = { sizeof(local_sig), local_sig };
+	err = chiaki_ecdh_get_local_pub_key(&ecdh, local_pub_key, &local_pub_key_buf.size, handshake_key, local_sig, &local_sig_buf.size);
+	chiaki_ecdh_fini(&ecdh);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(stream->log, "Stream server failed to get local ECDH key");
+		return;
+	}
+
+	// the console encrypts with index 3, the client with index 2
+	ChiakiGKCrypt *gkcrypt = chiaki_gkcrypt_new(stream->log, 0, 3, handshake_key, ecdh_secret);
+	if(!gkcrypt)
+	{
+		CHIAKI_LOGE(stream->log, "Stream server failed to init GKCrypt");
+		return;
+	}
+
+	if(stream->video_source_valid)
+		emulator_video_source_fini(&stream->video_source);
+	err = emulator_video_source_init(&stream->video_source, stream->log, emulator->options.video_filename, stream->h265);
+	stream->video_source_valid = err == CHIAKI_ERR_SUCCESS;
+	if(!stream->video_source_valid)
+	{
+		chiaki_gkcrypt_free(gkcrypt);
+		return;
+	}
+
+	// bang itself is still sent without crypt
+	err = stream_send_bang(stream, &local_pub_key_buf, &local_sig_buf);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		chiaki_gkcrypt_free(gkcrypt);
+		return;
+	}
+	emulator_takion_set_crypt(stream->takion, gkcrypt);
+
+	CHIAKI_LOGI(stream->log, "Stream server sent bang, %ux%u@%u, %u kbps, mtu %u, %s",
+			stream->width, stream->height, stream->fps, stream->bitrate_kbps, stream->mtu,
+			stream->h265 ? "h265" : "h264");
+	stream->state = STREAM_STATE_EXPECT_STREAMINFO_ACK;
+	// the client switches to expecting streaminfo only after handling the bang
+	stream->streaminfo_next_us = chiaki_time_now_monotonic_us() + STREAMINFO_DELAY_US;
+}
+
+static bool stream_encode_resolution(pb_ostream_t *ostream, const pb_field_t *field, void *const *arg)
+{
+	Stream *stream = *arg;
+	ChiakiPBBuf header_buf = { stream->video_source.header_size, stream->video_source.header };
+	tkproto_ResolutionPayload resolution = { 0 };
+	resolution.width = stream->width;
+	resolution.height = stream->height;
+	resolution.video_header.arg = &header_buf;
+	resolution.video_header.funcs.encode = chiaki_pb_encode_buf;
+	if(!pb_encode_tag_for_field(ostream, field))
+		return false;
+	return pb_encode_submessage(ostream, tkproto_ResolutionPayload_fields, &resolution);
+}
+
+static ChiakiErrorCode stream_send_streaminfo(Stream *stream)
+{
+	// written by hand because chiaki_audio_header_save() swaps channels and bits compared to what the client loads
+	uint8_t audio_header_buf[CHIAKI_AUDIO_HEADER_SIZE] = { 0 };
+	audio_header_buf[0] = 2; // channels
+	audio_header_buf[1] = 16; // bits
+	*((chiaki_unaligned_uint32_t *)(audio_header_buf + 2)) = htonl(48000);
+	*((chiaki_unaligned_uint32_t *)(audio_header_buf + 6)) = htonl(AUDIO_FRAME_SIZE);
+	ChiakiPBBuf audio_header_pb_buf = { sizeof(audio_header_buf), audio_header_buf };
+
+	tkproto_TakionMessage msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.type = tkproto_TakionMessage_PayloadType_STREAMINFO;
+	msg.has_stream_info_payload = true;
+	msg.stream_info_payload.resolution.arg = stream;
+	msg.stream_info_payload.resolution.funcs.encode = stream_encode_resolution;
+	msg.stream_info_payload.audio_header.arg = &audio_header_pb_buf;
+	msg.stream_info_payload.audio_header.funcs.encode = chiaki_pb_encode_buf;
+	return emulator_takion_send_message(stream->takion, 9, &msg);
+}
+
+static void stream_start(Stream *stream)
+{
+	uint64_t now = chiaki_time_now_monotonic_us();
+	stream->state = STREAM_STATE_STREAMING;
+	stream->start_us = now;
+	stream->video_interval_us = 1000000 / stream->fps;
+	stream->video_next_us = now;
+	stream->frame_index = 0;
+	stream->units_source = 0;
+	stream->units_fec = 0;
+	stream->units_sent = 0;
+	stream->audio_next_us = now;
+	stream->audio_frame_index = 0;
+	CHIAKI_LOGI(stream->log, "Stream server received streaminfo ack, streaming");
+}
+
+static void stream_finish(Stream *stream)
+{
+	if(stream->state == STREAM_STATE_IDLE)
+		return;
+	if(stream->state == STREAM_STATE_STREAMING)
+	{
+		EmulatorTakion *takion = stream->takion;
+		stream->stats.av_packets_sent = takion->av_packets_sent;
+		stream->stats.av_packets_dropped = takion->av_packets_dropped;
+		stream->stats.av_packets_reordered = takion->av_packets_reordered;
+		stream->stats.av_bytes_sent = takion->av_bytes_sent;
+		stream->stats.duration_us = chiaki_time_now_monotonic_us() - stream->start_us;
+
+		Emulator *emulator = stream->emulator;
+		chiaki_mutex_lock(&emulator->stats_mutex);
+		emulator->stats_last = stream->stats;
+		emulator->streams_finished++;
+		chiaki_mutex_unlock(&emulator->stats_mutex);
+		CHIAKI_LOGI(stream->log, "Stream server finished stream after %llu video frames",
+				(unsigned long long)stream->stats.video_frames);
+	}
+	stream->state = STREAM_STATE_IDLE;
+	stream->takion->connected = false;
+}
+
+static void stream_handle_data(Stream *stream, EmulatorTakionEvent *event)
+{
+	if(event->data_type != CHIAKI_TAKION_MESSAGE_DATA_TYPE_PROTOBUF)
+		return;
+
+	if(stream->state == STREAM_STATE_EXPECT_BIG)
+	{
+		stream_handle_big(stream, event->buf, event->buf_size);
+		return;
+	}
+
+	// only the type is needed here, all string and bytes fields are skipped
+	tkproto_TakionMessage msg;
+	memset(&msg, 0, sizeof(msg));
+	pb_istream_t istream = pb_istream_from_buffer(event->buf, event->buf_size);
+	if(!pb_decode(&istream, tkproto_TakionMessage_fields, &msg))
+		return;
+
+	switch(msg.type)
+	{
+		case tkproto_TakionMessage_PayloadType_STREAMINFOACK:
+			if(stream->state == STREAM_STATE_EXPECT_STREAMINFO_ACK)
+				stream_start(stream);
+			break;
+		case tkproto_TakionMessage_PayloadType_DISCONNECT:
+			CHIAKI_LOGI(stream->log, "Stream server received disconnect");
+			stream_finish(stream);
+			break;
+		default:
+			// heartbeats, corrupt frame reports, ...
+			break;
+	}
+}
+
+static ChiakiErrorCode stream_video_frame_build(Stream *stream)
+{
+	// chunks of unit_size - 2 each, prefixed by the amount of padding to unit_size
+	size_t datagram_size = stream->mtu - MTU_UDP_PACKET_ADD;
+	if(datagram_size > sizeof(stream->takion->recv_buf))
+		datagram_size = sizeof(stream->takion->recv_buf);
+	stream->unit_size = datagram_size - VIDEO_HEADER_SIZE;
+	stream->unit_stride = ((stream->unit_size + 0xf) / 0x10) * 0x10;
+	size_t chunk_size = stream->unit_size - 2;
+
+	size_t au_size_hint = (size_t)stream->bitrate_kbps * 1000 / 8 / stream->fps;
+	const uint8_t *au;
+	size_t au_size;
+	ChiakiErrorCode err = emulator_video_source_next(&stream->video_source, au_size_hint, &au, &au_size);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+
+	unsigned int k = (unsigned int)((au_size + chunk_size - 1) / chunk_size);
+	unsigned int m = (k * stream->emulator->options.fec_percent + 99) / 100;
+	if(k + m > VIDEO_UNITS_MAX)
+	{
+		if(k >= VIDEO_UNITS_MAX)
+		{
+			CHIAKI_LOGW(stream->log, "Stream server skipping access unit of %llu bytes, too big for a single frame",
+					(unsigned long long)au_size);
+			return CHIAKI_ERR_BUF_TOO_SMALL;
+		}
+		m = VIDEO_UNITS_MAX - k;
+	}
+
+	size_t frame_buf_size = (k + m) * stream->unit_stride;
+	if(stream->frame_buf_size < frame_buf_size)
+	{
+		uint8_t *frame_buf = realloc(stream->frame_buf, frame_buf_size);
+		if(!frame_buf)
+			return CHIAKI_ERR_MEMORY;
+		stream->frame_buf = frame_buf;
+		stream->frame_buf_size = frame_buf_size;
+	}
+	memset(stream->frame_buf, 0, frame_buf_size);
+
+	for(unsigned int i=0; i<k; i++)
+	{
+		uint8_t *unit = stream->frame_buf + i * stream->unit_stride;
+		size_t part_size = au_size - i * chunk_size;
+		if(part_size > chunk_size)
+			part_size = chunk_size;
+		*((chiaki_unaligned_uint16_t *)unit) = htons((uint16_t)(chunk_size - part_size));
+		memcpy(unit + 2, au + i * chunk_size, part_size);
+		stream->unit_last_size = part_size + 2;
+	}
+
+	if(m)
+	{
+		err = chiaki_fec_encode(stream->frame_buf, stream->unit_size, stream->unit_stride, k, m);
+		if(err != CHIAKI_ERR_SUCCESS)
+			return err;
+	}
+
+	stream->units_source = k;
+	stream->units_fec = m;
+	stream->units_sent = 0;
+	stream->frame_index++;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+static void stream_video_send_units(Stream *stream, unsigned int units_target)
+{
+	unsigned int units_total = stream->units_source + stream->units_fec;
+	if(units_target > units_total)
+		units_target = units_total;
+	for(; stream->units_sent < units_target; stream->units_sent++)
+	{
+		unsigned int i = stream->units_sent;
+		ChiakiTakionAVPacket packet = { 0 };
+		packet.is_video = true;
+		packet.frame_index = stream->frame_index;
+		packet.unit_index = i;
+		packet.units_in_frame_total = units_total;
+		packet.units_in_frame_fec = stream->units_fec;
+		packet.codec = VIDEO_CODEC;
+		size_t data_size = i == stream->units_source - 1 ? stream->unit_last_size : stream->unit_size;
+		if(emulator_takion_send_av(stream->takion, &packet, stream->frame_buf + i * stream->unit_stride, data_size) != CHIAKI_ERR_SUCCESS)
+			return;
+	}
+}
+
+static void stream_video_run(Stream *stream, uint64_t now)
+{
+	if(now >= stream->video_next_us)
+	{
+		// whatever is left of the previous frame goes out before the next one
+		stream_video_send_units(stream, stream->units_source + stream->units_fec);
+
+		if(now >= stream->video_next_us + stream->video_interval_us)
+		{
+			// fell behind by more than a frame, e.g. because the thread was descheduled
+			uint64_t behind = (now - stream->video_next_us) / stream->video_interval_us;
+			stream->stats.video_frames_skipped += behind;
+			stream->video_next_us += behind * stream->video_interval_us;
+		}
+		stream->frame_start_us = now;
+		stream->video_next_us += stream->video_interval_us;
+
+		if(stream_video_frame_build(stream) == CHIAKI_ERR_SUCCESS)
+			stream->stats.video_frames++;
+		else
+		{
+			stream->units_source = stream->units_fec = stream->units_sent = 0;
+			stream->stats.video_frames_skipped++;
+		}
+	}
+
+	unsigned int units_total = stream->units_source + stream->units_fec;
+	if(stream->units_sent >= units_total)
+		return;
+	uint64_t spread_us = stream->video_interval_us / 2;
+	uint64_t elapsed_us = now - stream->frame_start_us;
+	unsigned int units_target = elapsed_us >= spread_us
+		? units_total
+		: (unsigned int)(((uint64_t)units_total * elapsed_us + spread_us - 1) / spread_us);
+	if(!units_target)
+		units_target = 1;
+	stream_video_send_units(stream, units_target);
+}
+
+static void stream_audio_run(Stream *stream, uint64_t now)
+{
+	if(now < stream->audio_next_us)
+		return;
+	stream->audio_next_us += AUDIO_FRAME_US;
+	if(now >= stream->audio_next_us)
+		stream->audio_next_us = now + AUDIO_FRAME_US;
+
+	// each packet carries its own frame and the two before as fec, all the same silence here
+	uint8_t data[AUDIO_UNIT_SIZE * (1 + AUDIO_FEC_UNITS)] = { 0 };
+	for(size_t i=0; i<1 + AUDIO_FEC_UNITS; i++)
+		data[i * AUDIO_UNIT_SIZE] = AUDIO_OPUS_TOC;
+
+	ChiakiTakionAVPacket packet = { 0 };
+	packet.is_video = false;
+	packet.frame_index = ++stream->audio_frame_index;
+	packet.units_in_frame_total = 1 + AUDIO_FEC_UNITS;
+	packet.units_in_frame_fec = (AUDIO_UNIT_SIZE << 8) | (AUDIO_FEC_UNITS << 4) | 1;
+	packet.codec = AUDIO_CODEC;
+	if(emulator_takion_send_av(stream->takion, &packet, data, sizeof(data)) == CHIAKI_ERR_SUCCESS)
+		stream->stats.audio_frames++;
+}
+
+/**
+ * @return how long to wait for client packets until something is due
+ */
+static uint64_t stream_run(Stream *stream)
+{
+	uint64_t now = chiaki_time_now_monotonic_us();
+	EmulatorTakion *takion = stream->takion;
+
+	if(stream->state != STREAM_STATE_IDLE && now - takion->recv_time_last_us > STREAM_CLIENT_TIMEOUT_US)
+	{
+		CHIAKI_LOGW(stream->log, "Stream server timed out waiting for the client");
+		stream_finish(stream);
+	}
+
+	uint64_t next_us = now + STREAM_RECV_TIMEOUT_MS * 1000;
+	switch(stream->state)
+	{
+		case STREAM_STATE_EXPECT_STREAMINFO_ACK:
+			if(now >= stream->streaminfo_next_us)
+			{
+				stream_send_streaminfo(stream);
+				stream->streaminfo_next_us = now + STREAMINFO_RESEND_US;
+			}
+			next_us = stream->streaminfo_next_us;
+			break;
+		case STREAM_STATE_STREAMING:
+			stream_video_run(stream, now);
+			next_us = stream->video_next_us;
+			if(stream->units_sent < stream->units_source + stream->units_fec)
+				next_us = now + 1000;
+			if(stream->emulator->options.audio)
+			{
+				stream_audio_run(stream, now);
+				if(stream->audio_next_us < next_us)
+					next_us = stream->audio_next_us;
+			}
+			break;
+		default:
+			break;
+	}
+
+	now = chiaki_time_now_monotonic_us();
+	return next_us > now ? (next_us - now + 999) / 1000 : 0;
+}
+
+static void *stream_thread_func(void *user)
+{
+	Emulator *emulator = user;
+	EmulatorTakion *takion = &emulator->stream_takion;
+	CHIAKI_LOGI(emulator->log, "Stream server listening on UDP port %d", EMULATOR_STREAM_PORT);
+
+	Stream stream;
+	memset(&stream, 0, sizeof(stream));
+	stream.emulator = emulator;
+	stream.log = emulator->log;
+	stream.takion = takion;
+	stream.state = STREAM_STATE_IDLE;
+
+	while(true)
+	{
+		uint64_t timeout_ms = stream_run(&stream);
+
+		EmulatorTakionEvent event;
+		ChiakiErrorCode err = emulator_takion_recv(takion, &emulator->stream_stop_pipe, timeout_ms, &event);
+		if(err == CHIAKI_ERR_CANCELED)
+			break;
+		if(err != CHIAKI_ERR_SUCCESS)
+			continue;
+
+		switch(event.type)
+		{
+			case EMULATOR_TAKION_EVENT_CONNECTED:
+			{
+				stream_finish(&stream);
+				takion->connected = true;
+				chiaki_mutex_lock(&emulator->session.mutex);
+				takion->version = chiaki_target_is_ps5(emulator->session.target) ? 12 : 9;
+				chiaki_mutex_unlock(&emulator->session.mutex);
+				memset(&stream.stats, 0, sizeof(stream.stats));
+				stream.state = STREAM_STATE_EXPECT_BIG;
+				CHIAKI_LOGI(emulator->log, "Stream server connected, Takion v%u", (unsigned int)takion->version);
+				break;
+			}
+			case EMULATOR_TAKION_EVENT_DATA:
+				stream_handle_data(&stream, &event);
+				break;
+			default:
+				// congestion and feedback packets are not used
+				break;
+		}
+	}
+
+	stream_finish(&stream);
+	if(stream.video_source_valid)
+		emulator_video_source_fini(&stream.video_source);
+	free(stream.frame_buf);
+	return NULL;
+}
@@ -0,0 +1,419 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include "emulator.h"
+
+#include <chiaki/random.h>
+#include <chiaki/time.h>
+
+#include <pb_encode.h>
+
+#include <string.h>
+#include <errno.h>
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// mirrors the definitions in lib/src/takion.c, seen from the other side
+#define TAKION_PACKET_TYPE_CONTROL 0
+#define TAKION_PACKET_TYPE_VIDEO 2
+#define TAKION_PACKET_TYPE_AUDIO 3
+#define TAKION_PACKET_BASE_TYPE_MASK 0xf
+
+#define TAKION_MESSAGE_HEADER_SIZE 0x10
+#define TAKION_COOKIE_SIZE 0x20
+#define TAKION_A_RWND 0x19000
+#define TAKION_STREAMS 0x64
+
+#define TAKION_CHUNK_TYPE_DATA 0
+#define TAKION_CHUNK_TYPE_INIT 1
+#define TAKION_CHUNK_TYPE_INIT_ACK 2
+#define TAKION_CHUNK_TYPE_DATA_ACK 3
+#define TAKION_CHUNK_TYPE_COOKIE 0xa
+#define TAKION_CHUNK_TYPE_COOKIE_ACK 0xb
+
+#define AV_PACKET_BUF_SIZE 1500
+
+ChiakiErrorCode emulator_takion_init(EmulatorTakion *takion, ChiakiLog *log, const char *host, uint16_t port, uint8_t version)
+{
+	memset(takion, 0, sizeof(*takion));
+	takion->log = log;
+	takion->version = version;
+	takion->loss_rng = chiaki_random_32() | 1;
+
+	char port_str[6];
+	snprintf(port_str, sizeof(port_str), "%u", (unsigned int)port);
+	struct addrinfo hints = { 0 };
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_PASSIVE;
+	struct addrinfo *ai;
+	if(getaddrinfo(host, port_str, &hints, &ai) != 0)
+	{
+		CHIAKI_LOGE(log, "Failed to resolve %s", host);
+		return CHIAKI_ERR_NETWORK;
+	}
+
+	takion->sock = socket(ai->ai_family, SOCK_DGRAM, IPPROTO_UDP);
+	if(CHIAKI_SOCKET_IS_INVALID(takion->sock))
+	{
+		CHIAKI_LOGE(log, "Failed to create UDP socket: " CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
+		freeaddrinfo(ai);
+		return CHIAKI_ERR_NETWORK;
+	}
+
+	const int reuse = 1;
+	setsockopt(takion->sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+	// frames are sent in bursts, give them some room
+	const int sndbuf = 4 * 1024 * 1024;
+	setsockopt(takion->sock, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+	if(bind(takion->sock, ai->ai_addr, ai->ai_addrlen) < 0)
+	{
+		CHIAKI_LOGE(log, "Failed to bind UDP port %u: " CHIAKI_SOCKET_ERROR_FMT, (unsigned int)port, CHIAKI_SOCKET_ERROR_VALUE);
+		CHIAKI_SOCKET_CLOSE(takion->sock);
+		freeaddrinfo(ai);
+		return CHIAKI_ERR_NETWORK;
+	}
+	freeaddrinfo(ai);
+
+	return CHIAKI_ERR_SUCCESS;
+}
+
+void emulator_takion_fini(EmulatorTakion *takion)
+{
+	chiaki_gkcrypt_free(takion->gkcrypt_local);
+	CHIAKI_SOCKET_CLOSE(takion->sock);
+}
+
+void emulator_takion_set_crypt(EmulatorTakion *takion, ChiakiGKCrypt *gkcrypt_local)
+{
+	chiaki_gkcrypt_free(takion->gkcrypt_local);
+	takion->gkcrypt_local = gkcrypt_local;
+	takion->key_pos_local = 0;
+}
+
+static void takion_reset(EmulatorTakion *takion)
+{
+	emulator_takion_set_crypt(takion, NULL);
+	takion->connected = false;
+	takion->tag_remote = 0;
+	takion->tag_local = chiaki_random_32();
+	takion->seq_num_local = takion->tag_local;
+	takion->av_packet_index = 0;
+	takion->av_packets_sent = 0;
+	takion->av_packets_dropped = 0;
+	takion->av_packets_reordered = 0;
+	takion->av_bytes_sent = 0;
+	takion->av_held_size = 0;
+}
+
+static uint64_t takion_advance_key_pos(EmulatorTakion *takion, size_t data_size)
+{
+	// same as chiaki_takion_crypt_advance_key_pos() on the client
+	if(!takion->gkcrypt_local)
+		return 0;
+	uint64_t key_pos = takion->key_pos_local;
+	takion->key_pos_local += data_size;
+	return key_pos;
+}
+
+ChiakiErrorCode emulator_takion_send_raw(EmulatorTakion *takion, const uint8_t *buf, size_t buf_size)
+{
+	ssize_t sent = sendto(takion->sock, buf, buf_size, 0, (struct sockaddr *)&takion->addr, takion->addr_len);
+	if(sent < 0)
+	{
+		CHIAKI_LOGE(takion->log, "Takion server failed to send: " CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
+		return CHIAKI_ERR_NETWORK;
+	}
+	return CHIAKI_ERR_SUCCESS;
+}
+
+static ChiakiErrorCode takion_send_message(EmulatorTakion *takion, uint8_t chunk_type, uint8_t chunk_flags,
+		const uint8_t *payload, size_t payload_size, uint64_t key_pos)
+{
+	uint8_t buf[1 + TAKION_MESSAGE_HEADER_SIZE + 9 + AV_PACKET_BUF_SIZE];
+	size_t buf_size = 1 + TAKION_MESSAGE_HEADER_SIZE + payload_size;
+	if(buf_size > sizeof(buf))
+		return CHIAKI_ERR_BUF_TOO_SMALL;
+
+	buf[0] = TAKION_PACKET_TYPE_CONTROL;
+	uint8_t *header = buf + 1;
+	*((chiaki_unaligned_uint32_t *)(header + 0)) = htonl(takion->tag_remote);
+	memset(header + 4, 0, CHIAKI_GKCRYPT_GMAC_SIZE);
+	*((chiaki_unaligned_uint32_t *)(header + 8)) = htonl((uint32_t)key_pos);
+	header[0xc] = chunk_type;
+	header[0xd] = chunk_flags;
+	*((chiaki_unaligned_uint16_t *)(header + 0xe)) = htons((uint16_t)(payload_size + 4));
+	if(payload_size)
+		memcpy(buf + 1 + TAKION_MESSAGE_HEADER_SIZE, payload, payload_size);
+
+	ChiakiErrorCode err = chiaki_takion_packet_mac(takion->gkcrypt_local, buf, buf_size, key_pos, NULL, NULL);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+
+	return emulator_takion_send_raw(takion, buf, buf_size);
+}
+
+ChiakiErrorCode emulator_takion_send_data(EmulatorTakion *takion, uint16_t channel, const uint8_t *buf, size_t buf_size)
+{
+	if(9 + buf_size > AV_PACKET_BUF_SIZE)
+		return CHIAKI_ERR_BUF_TOO_SMALL;
+
+	uint8_t payload[9 + AV_PACKET_BUF_SIZE];
+	*((chiaki_unaligned_uint32_t *)(payload + 0)) = htonl(takion->seq_num_local++);
+	*((chiaki_unaligned_uint16_t *)(payload + 4)) = htons(channel);
+	*((chiaki_unaligned_uint16_t *)(payload + 6)) = 0;
+	payload[8] = CHIAKI_TAKION_MESSAGE_DATA_TYPE_PROTOBUF;
+	memcpy(payload + 9, buf, buf_size);
+
+	uint64_t key_pos = takion_advance_key_pos(takion, buf_size);
+	return takion_send_message(takion, TAKION_CHUNK_TYPE_DATA, 1, payload, 9 + buf_size, key_pos);
+}
+
+ChiakiErrorCode emulator_takion_send_message(EmulatorTakion *takion, uint16_t channel, const tkproto_TakionMessage *msg)
+{
+	uint8_t buf[AV_PACKET_BUF_SIZE - 9];
+	pb_ostream_t stream = pb_ostream_from_buffer(buf, sizeof(buf));
+	if(!pb_encode(&stream, tkproto_TakionMessage_fields, msg))
+	{
+		CHIAKI_LOGE(takion->log, "Takion server failed to encode protobuf: %s", PB_GET_ERROR(&stream));
+		return CHIAKI_ERR_UNKNOWN;
+	}
+	return emulator_takion_send_data(takion, channel, buf, stream.bytes_written);
+}
+
+static ChiakiErrorCode takion_send_data_ack(EmulatorTakion *takion, uint32_t seq_num)
+{
+	uint8_t payload[0xc];
+	*((chiaki_unaligned_uint32_t *)(payload + 0)) = htonl(seq_num);
+	*((chiaki_unaligned_uint32_t *)(payload + 4)) = htonl(TAKION_A_RWND);
+	*((chiaki_unaligned_uint16_t *)(payload + 8)) = 0;
+	*((chiaki_unaligned_uint16_t *)(payload + 0xa)) = 0;
+
+	uint64_t key_pos = takion_advance_key_pos(takion, 1 + TAKION_MESSAGE_HEADER_SIZE + sizeof(payload));
+	return takion_send_message(takion, TAKION_CHUNK_TYPE_DATA_ACK, 0, payload, sizeof(payload), key_pos);
+}
+
+static bool takion_random_event(EmulatorTakion *takion, double probability)
+{
+	if(probability <= 0.0)
+		return false;
+	// xorshift32, rand() is too coarse and shared
+	uint32_t x = takion->loss_rng;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	takion->loss_rng = x;
+	return (double)x / (double)UINT32_MAX < probability;
+}
+
+ChiakiErrorCode emulator_takion_send_av(EmulatorTakion *takion, ChiakiTakionAVPacket *packet, const uint8_t *data, size_t data_size)
+{
+	uint8_t buf[AV_PACKET_BUF_SIZE];
+
+	packet->packet_index = takion->av_packet_index++;
+	packet->key_pos = takion->gkcrypt_local ? takion->key_pos_local : 0;
+
+	size_t header_size;
+	ChiakiErrorCode err;
+	switch(takion->version)
+	{
+		case 7:
+			err = chiaki_takion_v7_av_packet_format_header(buf, sizeof(buf), &header_size, packet);
+			break;
+		case 9:
+			err = chiaki_takion_v9_av_packet_format_header(buf, sizeof(buf), &header_size, packet);
+			break;
+		default:
+			err = chiaki_takion_v12_av_packet_format_header(buf, sizeof(buf), &header_size, packet);
+			break;
+	}
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	if(header_size + data_size > sizeof(buf))
+		return CHIAKI_ERR_BUF_TOO_SMALL;
+	memcpy(buf + header_size, data, data_size);
+
+	if(takion->gkcrypt_local)
+	{
+		// the client decrypts at key_pos + one block, see takion_handle_packet_mac()
+		err = chiaki_gkcrypt_decrypt(takion->gkcrypt_local, packet->key_pos + CHIAKI_GKCRYPT_BLOCK_SIZE, buf + header_size, data_size);
+		if(err != CHIAKI_ERR_SUCCESS)
+			return err;
+		err = chiaki_takion_packet_mac(takion->gkcrypt_local, buf, header_size + data_size, packet->key_pos, NULL, NULL);
+		if(err != CHIAKI_ERR_SUCCESS)
+			return err;
+		takion->key_pos_local += data_size;
+	}
+
+	// lost packets still use up their key_pos, just like on the network
+	if(takion_random_event(takion, takion->loss))
+	{
+		takion->av_packets_dropped++;
+		return CHIAKI_ERR_SUCCESS;
+	}
+
+	if(!takion->av_held_size && takion_random_event(takion, takion->reorder))
+	{
+		memcpy(takion->av_held_buf, buf, header_size + data_size);
+		takion->av_held_size = header_size + data_size;
+		takion->av_packets_reordered++;
+		return CHIAKI_ERR_SUCCESS;
+	}
+
+	err = emulator_takion_send_raw(takion, buf, header_size + data_size);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	takion->av_packets_sent++;
+	takion->av_bytes_sent += header_size + data_size;
+
+	if(takion->av_held_size)
+	{
+		size_t held_size = takion->av_held_size;
+		takion->av_held_size = 0;
+		err = emulator_takion_send_raw(takion, takion->av_held_buf, held_size);
+		if(err != CHIAKI_ERR_SUCCESS)
+			return err;
+		takion->av_packets_sent++;
+		takion->av_bytes_sent += held_size;
+	}
+	return CHIAKI_ERR_SUCCESS;
+}
+
+static bool takion_addr_equal(EmulatorTakion *takion, struct sockaddr_storage *addr, socklen_t addr_len)
+{
+	return takion->addr_len == addr_len && memcmp(&takion->addr, addr, addr_len) == 0;
+}
+
+static ChiakiErrorCode takion_handle_init(EmulatorTakion *takion, uint8_t *payload, size_t payload_size,
+		struct sockaddr_storage *addr, socklen_t addr_len)
+{
+	if(payload_size != 0x10)
+	{
+		CHIAKI_LOGW(takion->log, "Takion server received init with invalid size");
+		return CHIAKI_ERR_INVALID_DATA;
+	}
+
+	if(takion->connected)
+		CHIAKI_LOGI(takion->log, "Takion server received init, replacing the previous connection");
+	takion_reset(takion);
+	memcpy(&takion->addr, addr, addr_len);
+	takion->addr_len = addr_len;
+	takion->tag_remote = ntohl(*((chiaki_unaligned_uint32_t *)payload));
+
+	uint8_t init_ack[0x10 + TAKION_COOKIE_SIZE];
+	*((chiaki_unaligned_uint32_t *)(init_ack + 0)) = htonl(takion->tag_local);
+	*((chiaki_unaligned_uint32_t *)(init_ack + 4)) = htonl(TAKION_A_RWND);
+	*((chiaki_unaligned_uint16_t *)(init_ack + 8)) = htons(TAKION_STREAMS);
+	*((chiaki_unaligned_uint16_t *)(init_ack + 0xa)) = htons(TAKION_STREAMS);
+	*((chiaki_unaligned_uint32_t *)(init_ack + 0xc)) = htonl(takion->seq_num_local);
+	chiaki_random_bytes_crypt(init_ack + 0x10, TAKION_COOKIE_SIZE);
+
+	return takion_send_message(takion, TAKION_CHUNK_TYPE_INIT_ACK, 0, init_ack, sizeof(init_ack), 0);
+}
+
+static void takion_handle_control(EmulatorTakion *takion, uint8_t *buf, size_t buf_size,
+		struct sockaddr_storage *addr, socklen_t addr_len, EmulatorTakionEvent *event)
+{
+	if(buf_size < 1 + TAKION_MESSAGE_HEADER_SIZE)
+		return;
+	uint8_t *header = buf + 1;
+	uint32_t tag = ntohl(*((chiaki_unaligned_uint32_t *)header));
+	uint8_t chunk_type = header[0xc];
+	size_t payload_size = ntohs(*((chiaki_unaligned_uint16_t *)(header + 0xe)));
+	if(payload_size < 4 || buf_size - 1 != payload_size + 0xc)
+	{
+		CHIAKI_LOGW(takion->log, "Takion server received message with invalid size");
+		return;
+	}
+	payload_size -= 4;
+	uint8_t *payload = header + TAKION_MESSAGE_HEADER_SIZE;
+
+	if(chunk_type == TAKION_CHUNK_TYPE_INIT)
+	{
+		takion_handle_init(takion, payload, payload_size, addr, addr_len);
+		return;
+	}
+
+	if(!takion_addr_equal(takion, addr, addr_len) || tag != takion->tag_local)
+		return;
+
+	switch(chunk_type)
+	{
+		case TAKION_CHUNK_TYPE_COOKIE:
+			// resent cookies are acked again, but only the first one connects
+			takion_send_message(takion, TAKION_CHUNK_TYPE_COOKIE_ACK, 0, NULL, 0, 0);
+			if(!takion->connected)
+			{
+				takion->connected = true;
+				event->type = EMULATOR_TAKION_EVENT_CONNECTED;
+			}
+			break;
+		case TAKION_CHUNK_TYPE_DATA:
+		{
+			if(!takion->connected || payload_size < 9)
+				break;
+			uint32_t seq_num = ntohl(*((chiaki_unaligned_uint32_t *)payload));
+			takion_send_data_ack(takion, seq_num);
+			event->type = EMULATOR_TAKION_EVENT_DATA;
+			event->data_type = payload[8];
+			event->buf = payload + 9;
+			event->buf_size = payload_size - 9;
+			break;
+		}
+		default:
+			// data acks, nothing is ever resent here
+			break;
+	}
+}
+
+ChiakiErrorCode emulator_takion_recv(EmulatorTakion *takion, ChiakiStopPipe *stop_pipe, uint64_t timeout_ms, EmulatorTakionEvent *event)
+{
+	event->type = EMULATOR_TAKION_EVENT_NONE;
+
+	ChiakiErrorCode err = chiaki_stop_pipe_select_single(stop_pipe, takion->sock, false, timeout_ms);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+
+	struct sockaddr_storage addr;
+	socklen_t addr_len = sizeof(addr);
+	ssize_t received = recvfrom(takion->sock, takion->recv_buf, sizeof(takion->recv_buf), 0, (struct sockaddr *)&addr, &addr_len);
+	if(received < 0)
+	{
+		if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return CHIAKI_ERR_SUCCESS;
+		// e.g. ICMP port unreachable after the client has gone away
+		CHIAKI_LOGV(takion->log, "Takion server failed to receive: " CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
+		return CHIAKI_ERR_SUCCESS;
+	}
+	if(received == 0)
+		return CHIAKI_ERR_SUCCESS;
+
+	uint8_t *buf = takion->recv_buf;
+	size_t buf_size = (size_t)received;
+	switch(buf[0] & TAKION_PACKET_BASE_TYPE_MASK)
+	{
+		case TAKION_PACKET_TYPE_CONTROL:
+			takion_handle_control(takion, buf, buf_size, &addr, addr_len, event);
+			break;
+		case TAKION_PACKET_TYPE_VIDEO:
+		case TAKION_PACKET_TYPE_AUDIO:
+			if(takion->connected && takion_addr_equal(takion, &addr, addr_len))
+			{
+				event->type = EMULATOR_TAKION_EVENT_AV;
+				event->buf = buf;
+				event->buf_size = buf_size;
+			}
+			break;
+		default:
+			// congestion, feedback and client info are not used
+			break;
+	}
+
+	if(takion->connected && takion_addr_equal(takion, &addr, addr_len))
+		takion->recv_time_last_us = chiaki_time_now_monotonic_us();
+
+	return CHIAKI_ERR_SUCCESS;
+}
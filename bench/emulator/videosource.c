@@ -0,0 +1,256 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include "emulator.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// filler data NAL units, valid Annex B that any decoder will just skip
+static const uint8_t filler_h264[] = { 0, 0, 0, 1, 12 };
+static const uint8_t filler_h265[] = { 0, 0, 0, 1, 38 << 1, 1 };
+
+// synthetic access units are split into filler nal units of this size, like an encoder that uses multiple slices
+#define SYNTH_SLICE_SIZE 4096
+
+typedef enum {
+	NAL_CLASS_OTHER,
+	NAL_CLASS_PARAMETER_SET,
+	NAL_CLASS_AU_START, // AUD, SEI, ... that always precede the first slice of an access unit
+	NAL_CLASS_SLICE,
+	NAL_CLASS_SLICE_FIRST
+} NalClass;
+
+static NalClass nal_classify(bool h265, const uint8_t *nal, size_t nal_size)
+{
+	if(h265)
+	{
+		if(nal_size < 3)
+			return NAL_CLASS_OTHER;
+		uint8_t type = (nal[0] >> 1) & 0x3f;
+		if(type <= 31)
+			return (nal[2] & 0x80) ? NAL_CLASS_SLICE_FIRST : NAL_CLASS_SLICE; // first_slice_segment_in_pic_flag
+		if(type >= 32 && type <= 34)
+			return NAL_CLASS_PARAMETER_SET;
+		if(type == 35 || type == 39)
+			return NAL_CLASS_AU_START;
+		return NAL_CLASS_OTHER;
+	}
+
+	if(nal_size < 2)
+		return NAL_CLASS_OTHER;
+	uint8_t type = nal[0] & 0x1f;
+	if(type >= 1 && type <= 5)
+		return (nal[1] & 0x80) ? NAL_CLASS_SLICE_FIRST : NAL_CLASS_SLICE; // first_mb_in_slice == 0
+	if(type == 7 || type == 8)
+		return NAL_CLASS_PARAMETER_SET;
+	if(type == 6 || type == 9)
+		return NAL_CLASS_AU_START;
+	return NAL_CLASS_OTHER;
+}
+
+/**
+ * Find the next start code at or after pos.
+ * @return offset of the start code or buf_size, *sc_size is set to 3 or 4
+ */
+static size_t find_start_code(const uint8_t *buf, size_t buf_size, size_t pos, size_t *sc_size)
+{
+	for(size_t i=pos; i+3<=buf_size; i++)
+	{
+		if(buf[i] != 0 || buf[i+1] != 0)
+			continue;
+		if(buf[i+2] == 1)
+		{
+			if(i > pos && buf[i-1] == 0)
+			{
+				*sc_size = 4;
+				return i - 1;
+			}
+			*sc_size = 3;
+			return i;
+		}
+	}
+	*sc_size = 0;
+	return buf_size;
+}
+
+static ChiakiErrorCode video_source_split(EmulatorVideoSource *source, ChiakiLog *log, size_t buf_size)
+{
+	const uint8_t *buf = source->file_buf;
+
+	size_t aus_alloc = 64;
+	source->aus = malloc(aus_alloc * sizeof(size_t));
+	if(!source->aus)
+		return CHIAKI_ERR_MEMORY;
+	source->aus_count = 0;
+
+	uint8_t *header = malloc(buf_size);
+	if(!header)
+		return CHIAKI_ERR_MEMORY;
+	size_t header_size = 0;
+	bool header_done = false;
+
+	bool au_has_slice = false;
+	size_t sc_size;
+	size_t nal_start = find_start_code(buf, buf_size, 0, &sc_size);
+	while(nal_start < buf_size)
+	{
+		size_t next_sc_size;
+		size_t nal_end = find_start_code(buf, buf_size, nal_start + sc_size, &next_sc_size);
+		NalClass nal_class = nal_classify(source->h265, buf + nal_start + sc_size, nal_end - nal_start - sc_size);
+
+		bool au_start = source->aus_count == 0;
+		if(au_has_slice && nal_class != NAL_CLASS_OTHER && nal_class != NAL_CLASS_SLICE)
+			au_start = true;
+		if(au_start)
+		{
+			if(source->aus_count + 1 >= aus_alloc)
+			{
+				aus_alloc *= 2;
+				size_t *aus = realloc(source->aus, aus_alloc * sizeof(size_t));
+				if(!aus)
+				{
+					free(header);
+					return CHIAKI_ERR_MEMORY;
+				}
+				source->aus = aus;
+			}
+			source->aus[source->aus_count++] = nal_start;
+			au_has_slice = false;
+		}
+
+		if(nal_class == NAL_CLASS_SLICE || nal_class == NAL_CLASS_SLICE_FIRST)
+		{
+			au_has_slice = true;
+			header_done = true;
+		}
+		else if(nal_class == NAL_CLASS_PARAMETER_SET && !header_done)
+		{
+			memcpy(header + header_size, buf + nal_start, nal_end - nal_start);
+			header_size += nal_end - nal_start;
+		}
+
+		nal_start = nal_end;
+		sc_size = next_sc_size;
+	}
+
+	if(!source->aus_count || !header_size)
+	{
+		CHIAKI_LOGE(log, "Video file contains no Annex B access units with leading parameter sets");
+		free(header);
+		return CHIAKI_ERR_INVALID_DATA;
+	}
+
+	source->aus[source->aus_count] = buf_size;
+	source->header = header;
+	source->header_size = header_size;
+	CHIAKI_LOGI(log, "Video file split into %llu access units", (unsigned long long)source->aus_count);
+	return CHIAKI_ERR_SUCCESS;
+}
+
+ChiakiErrorCode emulator_video_source_init(EmulatorVideoSource *source, ChiakiLog *log, const char *filename, bool h265)
+{
+	memset(source, 0, sizeof(*source));
+	source->h265 = h265;
+
+	if(!filename)
+	{
+		const uint8_t *filler = h265 ? filler_h265 : filler_h264;
+		size_t filler_size = h265 ? sizeof(filler_h265) : sizeof(filler_h264);
+		source->header = malloc(filler_size + 1);
+		if(!source->header)
+			return CHIAKI_ERR_MEMORY;
+		memcpy(source->header, filler, filler_size);
+		source->header[filler_size] = 0x80; // rbsp trailing bits
+		source->header_size = filler_size + 1;
+		return CHIAKI_ERR_SUCCESS;
+	}
+
+	FILE *f = fopen(filename, "rb");
+	if(!f)
+	{
+		CHIAKI_LOGE(log, "Failed to open video file %s", filename);
+		return CHIAKI_ERR_UNKNOWN;
+	}
+	ChiakiErrorCode err = CHIAKI_ERR_SUCCESS;
+	if(fseek(f, 0, SEEK_END) < 0)
+	{
+		err = CHIAKI_ERR_UNKNOWN;
+		goto close;
+	}
+	long size = ftell(f);
+	if(size <= 0 || fseek(f, 0, SEEK_SET) < 0)
+	{
+		CHIAKI_LOGE(log, "Video file %s is empty", filename);
+		err = CHIAKI_ERR_INVALID_DATA;
+		goto close;
+	}
+	source->file_buf = malloc((size_t)size);
+	if(!source->file_buf)
+	{
+		err = CHIAKI_ERR_MEMORY;
+		goto close;
+	}
+	if(fread(source->file_buf, 1, (size_t)size, f) != (size_t)size)
+	{
+		CHIAKI_LOGE(log, "Failed to read video file %s", filename);
+		err = CHIAKI_ERR_UNKNOWN;
+		goto close;
+	}
+	err = video_source_split(source, log, (size_t)size);
+
+close:
+	fclose(f);
+	if(err != CHIAKI_ERR_SUCCESS)
+		emulator_video_source_fini(source);
+	return err;
+}
+
+void emulator_video_source_fini(EmulatorVideoSource *source)
+{
+	free(source->header);
+	free(source->file_buf);
+	free(source->aus);
+	free(source->synth_buf);
+	memset(source, 0, sizeof(*source));
+}
+
+ChiakiErrorCode emulator_video_source_next(EmulatorVideoSource *source, size_t size_hint, const uint8_t **au, size_t *au_size)
+{
+	if(source->file_buf)
+	{
+		size_t start = source->aus[source->au_cur];
+		*au = source->file_buf + start;
+		*au_size = source->aus[source->au_cur + 1] - start;
+		source->au_cur = (source->au_cur + 1) % source->aus_count;
+		return CHIAKI_ERR_SUCCESS;
+	}
+
+	const uint8_t *filler = source->h265 ? filler_h265 : filler_h264;
+	size_t filler_size = source->h265 ? sizeof(filler_h265) : sizeof(filler_h264);
+	if(size_hint < filler_size + 1)
+		size_hint = filler_size + 1;
+	if(source->synth_buf_size != size_hint)
+	{
+		uint8_t *buf = realloc(source->synth_buf, size_hint);
+		if(!buf)
+			return CHIAKI_ERR_MEMORY;
+		source->synth_buf = buf;
+		source->synth_buf_size = size_hint;
+		size_t pos = 0;
+		while(pos < size_hint)
+		{
+			// the last slice takes the rest, so none is too small for its header and trailing bits
+			size_t slice_size = size_hint - pos;
+			if(slice_size >= 2 * SYNTH_SLICE_SIZE)
+				slice_size = SYNTH_SLICE_SIZE;
+			memcpy(buf + pos, filler, filler_size);
+			memset(buf + pos + filler_size, 0xff, slice_size - filler_size - 1);
+			buf[pos + slice_size - 1] = 0x80;
+			pos += slice_size;
+		}
+	}
+	*au = source->synth_buf;
+	*au_size = size_hint;
+	return CHIAKI_ERR_SUCCESS;
+}
@@ -0,0 +1,177 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+/*
+ * Measures FEC recovery throughput of Jerasure's generic decoder against chiaki_fec_decode()
+ * with every engine and the GF(2^8) kernel of every implementation the cpu supports, checking
+ * that all of them restore exactly the same units.
+ *
+ * Usage: chiaki-bench-fec [iterations] [unit size]
+ */
+
+#include <chiaki/fec.h>
+#include <chiaki/gf256.h>
+
+#include <jerasure.h>
+#include <cauchy.h>
+#include <galois.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct bench_case_t
+{
+	unsigned int k;
+	unsigned int m;
+	unsigned int lost; // source units lost, first ones of the frame
+} BenchCase;
+
+// typical frames of a stream: small p-frames with few fec units up to big keyframes
+static const BenchCase cases[] = {
+	{ 6, 1, 1 },
+	{ 10, 2, 1 },
+	{ 20, 4, 2 },
+	{ 40, 4, 4 },
+	{ 80, 8, 3 },
+	{ 200, 20, 10 },
+};
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void print_result(const char *name, uint64_t duration, size_t iterations, size_t bytes)
+{
+	printf("  %-20s %10.0f ns/frame  %8.1f MB/s restored\n", name,
+			(double)duration / iterations,
+			duration ? (double)bytes * iterations * 1000.0 / duration : 0.0);
+}
+
+static bool bench_case(const BenchCase *c, size_t iterations, size_t unit_size)
+{
+	size_t stride = ((unit_size + 0xf) / 0x10) * 0x10;
+	unsigned int n = c->k + c->m;
+	uint8_t *ref = calloc(n, stride);
+	uint8_t *buf = calloc(n, stride);
+	uint8_t *expected = calloc(c->lost, stride);
+	if(!ref || !buf || !expected)
+		return false;
+	for(size_t i=0; i<c->k * stride; i++)
+		ref[i] = (uint8_t)rand();
+	if(chiaki_fec_encode(ref, unit_size, stride, c->k, c->m) != CHIAKI_ERR_SUCCESS)
+		return false;
+
+	unsigned int erasures[CHIAKI_FEC_UNITS_MAX];
+	int jerasures[CHIAKI_FEC_UNITS_MAX + 1];
+	for(unsigned int i=0; i<c->lost; i++)
+		erasures[i] = jerasures[i] = i;
+	jerasures[c->lost] = -1;
+
+	printf("k %u, m %u, %u lost\n", c->k, c->m, c->lost);
+	size_t restored = c->lost * unit_size;
+	bool ok = true;
+
+	// Jerasure as chiaki_fec_decode() used it before, with a new matrix every time
+	char *data_ptrs[CHIAKI_FEC_UNITS_MAX];
+	for(unsigned int i=0; i<n; i++)
+		data_ptrs[i] = (char *)buf + i * stride;
+	uint64_t start = now_ns();
+	for(size_t it=0; it<iterations; it++)
+	{
+		memcpy(buf, ref, n * stride);
+		int *matrix = cauchy_original_coding_matrix(c->k, c->m, CHIAKI_FEC_WORDSIZE);
+		int r = jerasure_matrix_decode(c->k, c->m, CHIAKI_FEC_WORDSIZE, matrix, 0, jerasures,
+				data_ptrs, data_ptrs + c->k, (int)unit_size);
+		free(matrix);
+		if(r < 0)
+			ok = false;
+	}
+	print_result("jerasure", now_ns() - start, iterations, restored);
+	memcpy(expected, buf, c->lost * stride);
+
+	for(int engine=CHIAKI_FEC_ENGINE_MATRIX; engine<=CHIAKI_FEC_ENGINE_BITMATRIX; engine++)
+	{
+		chiaki_fec_set_engine((ChiakiFecEngine)engine);
+		start = now_ns();
+		for(size_t it=0; it<iterations; it++)
+		{
+			memcpy(buf, ref, n * stride);
+			if(chiaki_fec_decode(buf, unit_size, stride, c->k, c->m, erasures, c->lost) != CHIAKI_ERR_SUCCESS)
+				ok = false;
+		}
+		char name[32];
+		snprintf(name, sizeof(name), "engine %s", chiaki_fec_engine_name((ChiakiFecEngine)engine));
+		print_result(name, now_ns() - start, iterations, restored);
+		for(unsigned int i=0; i<c->lost; i++)
+			ok = ok && !memcmp(buf + i * stride, expected + i * stride, unit_size);
+	}
+	chiaki_fec_set_engine(CHIAKI_FEC_ENGINE_MATRIX);
+
+	// one row of the decoding matrix applied to k units for every lost unit, like chiaki_fec_decode() does
+	const uint8_t *srcs[CHIAKI_FEC_UNITS_MAX];
+	uint8_t coefs[CHIAKI_FEC_UNITS_MAX];
+	for(unsigned int j=0; j<c->k; j++)
+	{
+		srcs[j] = ref + (c->lost + j) * stride;
+		coefs[j] = (uint8_t)(rand() | 1);
+	}
+	uint8_t *out = malloc(unit_size);
+	if(!out)
+		return false;
+	uint8_t *out_ref = malloc(unit_size);
+	if(!out_ref)
+		return false;
+	chiaki_gf256_dotprod(CHIAKI_GF256_IMPL_SCALAR, out_ref, srcs, coefs, c->k, unit_size);
+	for(int impl=0; impl<CHIAKI_GF256_IMPL_COUNT; impl++)
+	{
+		if(!chiaki_gf256_impl_supported((ChiakiGf256Impl)impl))
+			continue;
+		start = now_ns();
+		for(size_t it=0; it<iterations; it++)
+		{
+			for(unsigned int l=0; l<c->lost; l++)
+				chiaki_gf256_dotprod((ChiakiGf256Impl)impl, out, srcs, coefs, c->k, unit_size);
+		}
+		char name[32];
+		snprintf(name, sizeof(name), "kernel %s", chiaki_gf256_impl_name((ChiakiGf256Impl)impl));
+		print_result(name, now_ns() - start, iterations, restored);
+		ok = ok && !memcmp(out, out_ref, unit_size);
+	}
+
+	if(!ok)
+		fprintf(stderr, "Restored units differ\n");
+	free(out_ref);
+	free(out);
+	free(expected);
+	free(buf);
+	free(ref);
+	return ok;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t iterations = argc > 1 ? (size_t)strtoul(argv[1], NULL, 0) : 2000;
+	size_t unit_size = argc > 2 ? (size_t)strtoul(argv[2], NULL, 0) : 1400;
+	if(!iterations)
+		iterations = 1;
+	if(unit_size < 1)
+		unit_size = 1;
+
+	// like chiaki_lib_init() would
+	if(galois_init_default_field(CHIAKI_FEC_WORDSIZE) != 0 || chiaki_fec_cache_init() != CHIAKI_ERR_SUCCESS)
+		return 1;
+
+	srand(42);
+	printf("%zu iterations, %zu bytes per unit, best kernel %s\n", iterations, unit_size,
+			chiaki_gf256_impl_name(chiaki_gf256_impl_best()));
+	for(size_t i=0; i<sizeof(cases) / sizeof(cases[0]); i++)
+	{
+		if(!bench_case(&cases[i], iterations, unit_size))
+			return 1;
+	}
+	return 0;
+}
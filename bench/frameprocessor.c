@@ -0,0 +1,206 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+/*
+ * Measures how long ChiakiFrameProcessor takes to allocate, fill and flush video frames
+ * of varying size, like a stream of mostly small frames and a big keyframe every now and then.
+ *
+ * Usage: chiaki-bench-frameprocessor [frames] [unit size]
+ * Every mode is run with units that are copied into the frame processor, with units that are
+ * referenced in their receive buffers like Takion does, and with one source unit lost per frame,
+ * each flushed into one contiguous frame and into segments.
+ */
+
+#include <chiaki/frameprocessor.h>
+#include <chiaki/packetbuf.h>
+#include <chiaki/fec.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#define TEMPLATES_COUNT 60 // one keyframe per second at 60 fps
+#define KEYFRAME_UNITS 200
+#define FRAME_UNITS_MIN 8
+#define FRAME_UNITS_MAX 40
+#define FEC_PERCENT 10
+
+typedef enum {
+	BENCH_MODE_COPY,
+	BENCH_MODE_REF,
+	BENCH_MODE_FEC
+} BenchMode;
+
+typedef struct frame_template_t
+{
+	unsigned int k;
+	unsigned int m;
+	size_t unit_last_size;
+	ChiakiPacketBuf *bufs[CHIAKI_FRAME_PROCESSOR_UNITS_MAX]; // one per unit, data at the start
+} FrameTemplate;
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static bool template_init(FrameTemplate *tmpl, ChiakiPacketBufPool *pool, unsigned int k, size_t unit_size)
+{
+	size_t chunk_size = unit_size - 2;
+	size_t stride = ((unit_size + 0xf) / 0x10) * 0x10;
+	tmpl->k = k;
+	tmpl->m = (k * FEC_PERCENT + 99) / 100;
+	if(tmpl->k + tmpl->m > CHIAKI_FRAME_PROCESSOR_UNITS_MAX)
+		tmpl->m = CHIAKI_FRAME_PROCESSOR_UNITS_MAX - tmpl->k;
+
+	uint8_t *frame_buf = calloc(tmpl->k + tmpl->m, stride);
+	if(!frame_buf)
+		return false;
+	for(unsigned int i=0; i<tmpl->k; i++)
+	{
+		uint8_t *unit = frame_buf + i * stride;
+		// last unit only half full
+		size_t part_size = i == tmpl->k - 1 ? chunk_size / 2 : chunk_size;
+		*((chiaki_unaligned_uint16_t *)unit) = htons((uint16_t)(chunk_size - part_size));
+		for(size_t j=0; j<part_size; j++)
+			unit[2 + j] = (uint8_t)(rand() & 0xff);
+		tmpl->unit_last_size = part_size + 2;
+	}
+	if(chiaki_fec_encode(frame_buf, unit_size, stride, tmpl->k, tmpl->m) != CHIAKI_ERR_SUCCESS)
+	{
+		free(frame_buf);
+		return false;
+	}
+
+	for(unsigned int i=0; i<tmpl->k + tmpl->m; i++)
+	{
+		tmpl->bufs[i] = chiaki_packet_buf_pool_acquire(pool, NULL);
+		if(!tmpl->bufs[i])
+		{
+			free(frame_buf);
+			return false;
+		}
+		memcpy(tmpl->bufs[i]->data, frame_buf + i * stride, unit_size);
+	}
+	free(frame_buf);
+	return true;
+}
+
+static void template_fini(FrameTemplate *tmpl)
+{
+	for(unsigned int i=0; i<tmpl->k + tmpl->m; i++)
+		chiaki_packet_buf_unref(tmpl->bufs[i]);
+}
+
+static bool bench_run(const char *name, BenchMode mode, bool segments, ChiakiLog *log, FrameTemplate *templates,
+		size_t frames, size_t unit_size)
+{
+	ChiakiFrameProcessor frame_processor;
+	chiaki_frame_processor_init(&frame_processor, log);
+
+	uint64_t bytes = 0;
+	uint64_t start = now_ns();
+	for(size_t f=0; f<frames; f++)
+	{
+		FrameTemplate *tmpl = &templates[f % TEMPLATES_COUNT];
+		unsigned int lost = mode == BENCH_MODE_FEC ? (unsigned int)(f % tmpl->k) : UINT32_MAX;
+		bool allocated = false;
+		for(unsigned int i=0; i<tmpl->k + tmpl->m; i++)
+		{
+			if(i == lost)
+				continue;
+			ChiakiTakionAVPacket packet = { 0 };
+			packet.is_video = true;
+			packet.frame_index = (ChiakiSeqNum16)f;
+			packet.unit_index = i;
+			packet.units_in_frame_total = tmpl->k + tmpl->m;
+			packet.units_in_frame_fec = tmpl->m;
+			packet.data = tmpl->bufs[i]->data;
+			packet.data_size = i == tmpl->k - 1 ? tmpl->unit_last_size : unit_size;
+			packet.buf = mode == BENCH_MODE_COPY ? NULL : tmpl->bufs[i];
+			if(!allocated)
+			{
+				if(chiaki_frame_processor_alloc_frame(&frame_processor, &packet) != CHIAKI_ERR_SUCCESS)
+					return false;
+				allocated = true;
+			}
+			chiaki_frame_processor_put_unit(&frame_processor, &packet);
+		}
+
+		uint8_t *frame;
+		ChiakiVideoSampleSegment *frame_segments;
+		size_t frame_segments_count;
+		size_t frame_size;
+		ChiakiFrameProcessorFlushResult result = segments
+			? chiaki_frame_processor_flush_segments(&frame_processor, &frame_segments, &frame_segments_count, &frame_size)
+			: chiaki_frame_processor_flush(&frame_processor, &frame, &frame_size);
+		if(result == CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FAILED || result == CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_FAILED)
+		{
+			fprintf(stderr, "Failed to flush frame %zu\n", f);
+			return false;
+		}
+		bytes += frame_size;
+	}
+	uint64_t duration = now_ns() - start;
+	chiaki_frame_processor_fini(&frame_processor);
+
+	printf("%-28s %-10s %8.0f ns/frame  %8.1f MB/s\n", name, segments ? "segments" : "compacted",
+			(double)duration / frames,
+			duration ? (double)bytes * 1000.0 / duration : 0.0);
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t frames = argc > 1 ? (size_t)strtoul(argv[1], NULL, 0) : 20000;
+	size_t unit_size = argc > 2 ? (size_t)strtoul(argv[2], NULL, 0) : 1400;
+	if(!frames)
+		frames = 1;
+	if(unit_size < 4)
+		unit_size = 4;
+
+	ChiakiLog log;
+	// fec is logged for every single frame otherwise
+	chiaki_log_init(&log, CHIAKI_LOG_WARNING | CHIAKI_LOG_ERROR, chiaki_log_cb_print, NULL);
+
+	ChiakiPacketBufPool *pool = chiaki_packet_buf_pool_new(TEMPLATES_COUNT * CHIAKI_FRAME_PROCESSOR_UNITS_MAX, unit_size);
+	if(!pool)
+		return 1;
+
+	// like chiaki_lib_init() would
+	if(chiaki_fec_cache_init() != CHIAKI_ERR_SUCCESS)
+		return 1;
+
+	srand(42);
+	FrameTemplate *templates = calloc(TEMPLATES_COUNT, sizeof(FrameTemplate));
+	if(!templates)
+		return 1;
+	for(size_t i=0; i<TEMPLATES_COUNT; i++)
+	{
+		unsigned int k = i == 0 ? KEYFRAME_UNITS : FRAME_UNITS_MIN + (unsigned int)(rand() % (FRAME_UNITS_MAX - FRAME_UNITS_MIN + 1));
+		if(!template_init(&templates[i], pool, k, unit_size))
+		{
+			fprintf(stderr, "Failed to create frames\n");
+			return 1;
+		}
+	}
+
+	printf("%zu frames, %zu bytes per unit\n", frames, unit_size);
+	int ret = 0;
+	for(int segments=0; segments<2; segments++)
+	{
+		if(!bench_run("copied units", BENCH_MODE_COPY, segments, &log, templates, frames, unit_size)
+			|| !bench_run("referenced units", BENCH_MODE_REF, segments, &log, templates, frames, unit_size)
+			|| !bench_run("referenced units, 1 lost", BENCH_MODE_FEC, segments, &log, templates, frames, unit_size))
+			ret = 1;
+	}
+
+	for(size_t i=0; i<TEMPLATES_COUNT; i++)
+		template_fini(&templates[i]);
+	free(templates);
+	chiaki_packet_buf_pool_free(pool);
+	return ret;
+}
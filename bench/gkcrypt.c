@@ -0,0 +1,193 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+/*
+ * Measures the per-packet cost of ChiakiGKCrypt with every impl the cpu supports: the GMAC of every
+ * Takion packet, in order, with neighbouring packets swapped so older GMAC key indices show up around
+ * every key refresh, and a batch at a time, generating the ctr mode key stream without the key buffer thread,
+ * and receiving av packets: checking the gmac, then decrypting with the key buffer thread like Takion used to,
+ * against doing both in one pass. The key buffer counters are printed after the first.
+ *
+ * Usage: chiaki-bench-gkcrypt [packets]
+ */
+
+#include <chiaki/gkcrypt.h>
+#include <chiaki/ecdh.h>
+#include <chiaki/session.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BATCH_SIZE 16
+
+static const size_t packet_sizes[] = { 64, 500, 1400 };
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void print_result(const char *name, size_t packet_size, uint64_t duration, size_t packets)
+{
+	printf("  %-24s %5zu bytes %8.0f ns/packet  %8.1f MB/s\n", name, packet_size,
+			(double)duration / packets,
+			duration ? (double)packet_size * packets * 1000.0 / duration : 0.0);
+}
+
+static bool bench_gmac(ChiakiGKCrypt *gkcrypt, const char *name, bool swap, uint8_t *buf, size_t packet_size, size_t packets)
+{
+	uint8_t gmac[CHIAKI_GKCRYPT_GMAC_SIZE];
+	uint64_t start = now_ns();
+	for(size_t i=0; i<packets; i++)
+	{
+		// with swap, every odd packet goes out before the even one in front of it
+		size_t index = swap ? i ^ 1 : i;
+		if(chiaki_gkcrypt_gmac(gkcrypt, index * packet_size, buf, packet_size, gmac) != CHIAKI_ERR_SUCCESS)
+			return false;
+	}
+	print_result(name, packet_size, now_ns() - start, packets);
+	return true;
+}
+
+static bool bench_gmac_multi(ChiakiGKCrypt *gkcrypt, uint8_t *buf, size_t packet_size, size_t packets)
+{
+	uint64_t key_pos[BATCH_SIZE];
+	const uint8_t *bufs[BATCH_SIZE];
+	size_t buf_sizes[BATCH_SIZE];
+	uint8_t gmacs[BATCH_SIZE][CHIAKI_GKCRYPT_GMAC_SIZE];
+	uint8_t *gmacs_out[BATCH_SIZE];
+	for(size_t i=0; i<BATCH_SIZE; i++)
+	{
+		bufs[i] = buf;
+		buf_sizes[i] = packet_size;
+		gmacs_out[i] = gmacs[i];
+	}
+	uint64_t start = now_ns();
+	for(size_t i=0; i<packets; i+=BATCH_SIZE)
+	{
+		size_t count = packets - i < BATCH_SIZE ? packets - i : BATCH_SIZE;
+		for(size_t j=0; j<count; j++)
+			key_pos[j] = (i + j) * packet_size;
+		if(chiaki_gkcrypt_gmac_multi(gkcrypt, count, key_pos, bufs, buf_sizes, gmacs_out) != CHIAKI_ERR_SUCCESS)
+			return false;
+	}
+	print_result("gmac, batches", packet_size, now_ns() - start, packets);
+	return true;
+}
+
+static bool bench_key_stream(ChiakiGKCrypt *gkcrypt, uint8_t *buf, size_t packet_size, size_t packets)
+{
+	uint64_t start = now_ns();
+	for(size_t i=0; i<packets; i++)
+	{
+		if(chiaki_gkcrypt_decrypt(gkcrypt, i * packet_size, buf, packet_size) != CHIAKI_ERR_SUCCESS)
+			return false;
+	}
+	print_result("decrypt, no key buf", packet_size, now_ns() - start, packets);
+	return true;
+}
+
+static bool bench_receive(ChiakiGKCrypt *gkcrypt, bool fused, uint8_t *buf, size_t packet_size, size_t packets)
+{
+	// header as large as the one of v12 video packets
+	const size_t header_size = 0x19;
+	uint8_t gmac[CHIAKI_GKCRYPT_GMAC_SIZE];
+	const uint8_t gmac_expected[CHIAKI_GKCRYPT_GMAC_SIZE] = { 0 };
+	uint64_t start = now_ns();
+	for(size_t i=0; i<packets; i++)
+	{
+		uint64_t key_pos = i * packet_size;
+		ChiakiErrorCode err;
+		if(fused)
+			err = chiaki_gkcrypt_verify_decrypt(gkcrypt, key_pos, buf, packet_size, header_size, key_pos + CHIAKI_GKCRYPT_BLOCK_SIZE, gmac_expected, gmac);
+		else
+		{
+			err = chiaki_gkcrypt_gmac(gkcrypt, key_pos, buf, packet_size, gmac);
+			if(err == CHIAKI_ERR_SUCCESS)
+				err = chiaki_gkcrypt_decrypt(gkcrypt, key_pos + CHIAKI_GKCRYPT_BLOCK_SIZE, buf + header_size, packet_size - header_size);
+		}
+		// random data, so the gmac is not expected to match
+		if(err != CHIAKI_ERR_SUCCESS && err != CHIAKI_ERR_INVALID_MAC)
+			return false;
+	}
+	print_result(fused ? "receive, verify_decrypt" : "receive, gmac + decrypt", packet_size, now_ns() - start, packets);
+	if(!fused)
+	{
+		ChiakiGKCryptKeyBufStats stats;
+		chiaki_gkcrypt_key_buf_stats(gkcrypt, &stats);
+		printf("    key buf: %llu hits, %llu misses, %llu wakeups, %llu reader waits, %llu skips\n",
+				(unsigned long long)stats.hits, (unsigned long long)stats.misses, (unsigned long long)stats.wakeups,
+				(unsigned long long)stats.reader_waits, (unsigned long long)stats.skips);
+	}
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t packets = argc > 1 ? (size_t)strtoul(argv[1], NULL, 0) : 200000;
+	if(!packets)
+		packets = 1;
+
+	ChiakiLog log;
+	chiaki_log_init(&log, CHIAKI_LOG_WARNING | CHIAKI_LOG_ERROR, chiaki_log_cb_print, NULL);
+
+	srand(42);
+	uint8_t handshake_key[CHIAKI_HANDSHAKE_KEY_SIZE];
+	uint8_t ecdh_secret[CHIAKI_ECDH_SECRET_SIZE];
+	for(size_t i=0; i<sizeof(handshake_key); i++)
+		handshake_key[i] = (uint8_t)rand();
+	for(size_t i=0; i<sizeof(ecdh_secret); i++)
+		ecdh_secret[i] = (uint8_t)rand();
+
+	uint8_t buf[1400];
+	for(size_t i=0; i<sizeof(buf); i++)
+		buf[i] = (uint8_t)rand();
+
+	printf("%zu packets\n", packets);
+	int ret = 0;
+	for(int impl=0; impl<CHIAKI_GKCRYPT_IMPL_COUNT && !ret; impl++)
+	{
+		if(!chiaki_gkcrypt_impl_supported((ChiakiGKCryptImpl)impl))
+			continue;
+		chiaki_gkcrypt_set_impl((ChiakiGKCryptImpl)impl);
+		printf("impl %s\n", chiaki_gkcrypt_impl_name((ChiakiGKCryptImpl)impl));
+		for(size_t s=0; s<sizeof(packet_sizes) / sizeof(packet_sizes[0]) && !ret; s++)
+		{
+			// a new instance for every run, so all of them start at the first gmac key
+			for(int run=0; run<3 && !ret; run++)
+			{
+				ChiakiGKCrypt gkcrypt;
+				if(chiaki_gkcrypt_init(&gkcrypt, &log, 0, 2, handshake_key, ecdh_secret) != CHIAKI_ERR_SUCCESS)
+					return 1;
+				bool ok = run == 2
+					? bench_gmac_multi(&gkcrypt, buf, packet_sizes[s], packets)
+					: bench_gmac(&gkcrypt, run ? "gmac, reordered" : "gmac, in order", run == 1, buf, packet_sizes[s], packets);
+				if(!ok)
+					ret = 1;
+				chiaki_gkcrypt_fini(&gkcrypt);
+			}
+
+			ChiakiGKCrypt gkcrypt;
+			if(chiaki_gkcrypt_init(&gkcrypt, &log, 0, 3, handshake_key, ecdh_secret) != CHIAKI_ERR_SUCCESS)
+				return 1;
+			if(!ret && !bench_key_stream(&gkcrypt, buf, packet_sizes[s], packets))
+				ret = 1;
+			chiaki_gkcrypt_fini(&gkcrypt);
+
+			for(int fused=0; fused<2 && !ret; fused++)
+			{
+				if(chiaki_gkcrypt_init(&gkcrypt, &log, CHIAKI_GKCRYPT_KEY_BUF_BLOCKS_DEFAULT, 3, handshake_key, ecdh_secret) != CHIAKI_ERR_SUCCESS)
+					return 1;
+				if(!bench_receive(&gkcrypt, fused, buf, packet_sizes[s], packets))
+					ret = 1;
+				chiaki_gkcrypt_fini(&gkcrypt);
+			}
+		}
+	}
+	if(ret)
+		fprintf(stderr, "GKCrypt failed\n");
+	return ret;
+}
@@ -0,0 +1,211 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+/*
+ * Runs a capture written with ChiakiConnectInfo.capture_filename through the whole receive path
+ * (Takion, StreamConnection, Video and Audio Receiver) without a console and reports how it performed.
+ *
+ * Usage: chiaki-replay [-r] [-v] <capture file>
+ *   -r  replay with the timing of the capture instead of as fast as possible
+ *   -v  verbose log
+ */
+
+#include <chiaki/session.h>
+#include <chiaki/streamconnection.h>
+#include <chiaki/takioncapture.h>
+#include <chiaki/time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct replay_samples_t
+{
+	uint64_t *values;
+	size_t count;
+	size_t size;
+} ReplaySamples;
+
+typedef struct replay_stats_t
+{
+	uint64_t start_us;
+	uint64_t connected_us;
+	uint64_t video_frames;
+	uint64_t video_bytes;
+	uint64_t audio_frames;
+	uint64_t audio_bytes;
+	ReplaySamples processing_delay;
+	ReplaySamples arrival_spread;
+} ReplayStats;
+
+static void samples_add(ReplaySamples *samples, uint64_t value)
+{
+	if(samples->count == samples->size)
+	{
+		size_t size = samples->size ? samples->size * 2 : 1024;
+		uint64_t *values = realloc(samples->values, size * sizeof(uint64_t));
+		if(!values)
+			return;
+		samples->values = values;
+		samples->size = size;
+	}
+	samples->values[samples->count++] = value;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static void print_samples(const char *name, ReplaySamples *samples)
+{
+	if(!samples->count)
+	{
+		printf("%-28s no samples\n", name);
+		return;
+	}
+	qsort(samples->values, samples->count, sizeof(uint64_t), cmp_u64);
+	uint64_t sum = 0;
+	for(size_t i=0; i<samples->count; i++)
+		sum += samples->values[i];
+	printf("%-28s avg %6.1f us  p50 %5llu us  p99 %5llu us  max %6llu us\n", name,
+			(double)sum / samples->count,
+			(unsigned long long)samples->values[samples->count / 2],
+			(unsigned long long)samples->values[(samples->count * 99) / 100],
+			(unsigned long long)samples->values[samples->count - 1]);
+}
+
+static void event_cb(ChiakiEvent *event, void *user)
+{
+	ReplayStats *stats = user;
+	if(event->type == CHIAKI_EVENT_CONNECTED)
+		stats->connected_us = chiaki_time_now_monotonic_us();
+}
+
+static bool video_sample_cb(uint8_t *buf, size_t buf_size, void *user)
+{
+	ReplayStats *stats = user;
+	(void)buf;
+	stats->video_frames++;
+	stats->video_bytes += buf_size;
+	return true;
+}
+
+static void video_frame_timing_cb(ChiakiVideoFrameTiming *timing, void *user)
+{
+	ReplayStats *stats = user;
+	samples_add(&stats->processing_delay, timing->processing_delay_us);
+	samples_add(&stats->arrival_spread, timing->arrival_spread_us);
+}
+
+static void audio_frame_cb(uint8_t *buf, size_t buf_size, void *user)
+{
+	ReplayStats *stats = user;
+	(void)buf;
+	stats->audio_frames++;
+	stats->audio_bytes += buf_size;
+}
+
+int main(int argc, char *argv[])
+{
+	bool realtime = false;
+	bool verbose = false;
+	const char *filename = NULL;
+	for(int i=1; i<argc; i++)
+	{
+		if(!strcmp(argv[i], "-r"))
+			realtime = true;
+		else if(!strcmp(argv[i], "-v"))
+			verbose = true;
+		else
+			filename = argv[i];
+	}
+	if(!filename)
+	{
+		fprintf(stderr, "Usage: %s [-r] [-v] <capture file>\n", argv[0]);
+		return 1;
+	}
+
+	ChiakiLog log;
+	chiaki_log_init(&log, verbose ? CHIAKI_LOG_ALL : CHIAKI_LOG_ALL & ~CHIAKI_LOG_VERBOSE, chiaki_log_cb_print, NULL);
+
+	ChiakiTakionReplay replay;
+	ChiakiErrorCode err = chiaki_takion_replay_init(&replay, filename, realtime);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		fprintf(stderr, "Failed to open capture %s: %s\n", filename, chiaki_error_string(err));
+		return 1;
+	}
+
+	ChiakiConnectInfo connect_info = { 0 };
+	connect_info.ps5 = chiaki_target_is_ps5(replay.target);
+	connect_info.host = "127.0.0.1"; // never connected to
+	chiaki_connect_video_profile_preset(&connect_info.video_profile, CHIAKI_VIDEO_RESOLUTION_PRESET_720p, CHIAKI_VIDEO_FPS_PRESET_60);
+
+	ChiakiSession session;
+	err = chiaki_session_init(&session, &connect_info, &log);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		fprintf(stderr, "Failed to init session: %s\n", chiaki_error_string(err));
+		chiaki_takion_replay_fini(&replay);
+		return 1;
+	}
+
+	// the parts of the session thread the stream connection depends on
+	session.connect_info.host_addrinfo_selected = session.connect_info.host_addrinfos;
+	session.connect_info.replay = &replay;
+	chiaki_rpcrypt_init_auth(&session.rpcrypt, session.target, session.nonce, session.connect_info.morning);
+	err = chiaki_ecdh_init(&session.ecdh);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		fprintf(stderr, "Failed to init ECDH\n");
+		chiaki_session_fini(&session);
+		chiaki_takion_replay_fini(&replay);
+		return 1;
+	}
+
+	ReplayStats stats = { 0 };
+	chiaki_session_set_event_cb(&session, event_cb, &stats);
+	chiaki_session_set_video_sample_cb(&session, video_sample_cb, &stats);
+	chiaki_session_set_video_frame_timing_cb(&session, video_frame_timing_cb, &stats);
+	ChiakiAudioSink audio_sink = { 0 };
+	audio_sink.user = &stats;
+	audio_sink.frame_cb = audio_frame_cb;
+	chiaki_session_set_audio_sink(&session, &audio_sink);
+
+	stats.start_us = chiaki_time_now_monotonic_us();
+	err = chiaki_stream_connection_run(&session.stream_connection);
+	uint64_t end_us = chiaki_time_now_monotonic_us();
+
+	int ret = 0;
+	if(err != CHIAKI_ERR_DISCONNECTED)
+	{
+		fprintf(stderr, "Replay ended before the end of the capture: %s\n", chiaki_error_string(err));
+		ret = 1;
+	}
+
+	double duration_s = (double)(end_us - stats.start_us) / 1000000.0;
+	printf("%s replay of %llu datagrams, %llu bytes in %.3f s\n", realtime ? "Realtime" : "Fast",
+			(unsigned long long)replay.datagrams, (unsigned long long)replay.bytes, duration_s);
+	if(duration_s > 0.0)
+	{
+		printf("%-28s %.0f datagrams/s  %.1f Mbit/s\n", "throughput",
+				replay.datagrams / duration_s, replay.bytes * 8.0 / 1000000.0 / duration_s);
+	}
+	if(stats.connected_us)
+		printf("%-28s %llu us\n", "time to stream connected", (unsigned long long)(stats.connected_us - stats.start_us));
+	if(realtime)
+		printf("%-28s %llu us\n", "max behind schedule", (unsigned long long)replay.late_us_max);
+	printf("%-28s %llu frames, %llu bytes\n", "video", (unsigned long long)stats.video_frames, (unsigned long long)stats.video_bytes);
+	printf("%-28s %llu frames, %llu bytes\n", "audio", (unsigned long long)stats.audio_frames, (unsigned long long)stats.audio_bytes);
+	print_samples("frame arrival spread", &stats.arrival_spread);
+	print_samples("frame processing delay", &stats.processing_delay);
+
+	free(stats.processing_delay.values);
+	free(stats.arrival_spread.values);
+	chiaki_ecdh_fini(&session.ecdh);
+	chiaki_session_fini(&session);
+	chiaki_takion_replay_fini(&replay);
+	return ret;
+}
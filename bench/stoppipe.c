@@ -0,0 +1,282 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+/*
+ * Measures how fast a thread blocked in chiaki_stop_pipe_select_single() wakes up
+ * when a datagram arrives on its socket, compared to the plain pipe+select() approach
+ * the stop pipe used before, and how fast it wakes up on chiaki_stop_pipe_stop().
+ *
+ * Usage: chiaki-bench-stoppipe [iterations] [extra fds]
+ * With extra fds, that many descriptors are opened first, so with >= FD_SETSIZE
+ * the sockets end up beyond the limit of select() and only the stop pipe can be measured.
+ */
+
+#include <chiaki/stoppipe.h>
+#include <chiaki/thread.h>
+#include <chiaki/time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+typedef enum {
+	BENCH_MODE_STOP_PIPE,
+	BENCH_MODE_SELECT
+} BenchMode;
+
+typedef struct bench_t
+{
+	BenchMode mode;
+	size_t iterations;
+	int sock; // echo side
+	int peer; // measuring side
+	ChiakiStopPipe stop_pipe;
+	int select_pipe[2];
+	bool failed;
+} Bench;
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static void print_result(const char *name, uint64_t *samples, size_t count)
+{
+	qsort(samples, count, sizeof(uint64_t), cmp_u64);
+	uint64_t sum = 0;
+	for(size_t i=0; i<count; i++)
+		sum += samples[i];
+	printf("%-28s avg %6.1f us  p50 %4llu us  p99 %4llu us  max %5llu us\n", name,
+			(double)sum / count,
+			(unsigned long long)samples[count / 2],
+			(unsigned long long)samples[(count * 99) / 100],
+			(unsigned long long)samples[count - 1]);
+}
+
+static bool select_wait(Bench *bench)
+{
+	fd_set rfds;
+	FD_ZERO(&rfds);
+	FD_SET(bench->select_pipe[0], &rfds);
+	FD_SET(bench->sock, &rfds);
+	int nfds = (bench->sock > bench->select_pipe[0] ? bench->sock : bench->select_pipe[0]) + 1;
+	int r = select(nfds, &rfds, NULL, NULL, NULL);
+	if(r < 0 || FD_ISSET(bench->select_pipe[0], &rfds))
+		return false;
+	return FD_ISSET(bench->sock, &rfds);
+}
+
+static void *echo_thread_func(void *user)
+{
+	Bench *bench = user;
+	uint8_t buf[64];
+	for(size_t i=0; i<bench->iterations; i++)
+	{
+		bool ready;
+		if(bench->mode == BENCH_MODE_STOP_PIPE)
+			ready = chiaki_stop_pipe_select_single(&bench->stop_pipe, bench->sock, false, UINT64_MAX) == CHIAKI_ERR_SUCCESS;
+		else
+			ready = select_wait(bench);
+		if(!ready)
+		{
+			bench->failed = true;
+			break;
+		}
+		ssize_t r = recv(bench->sock, buf, sizeof(buf), 0);
+		if(r <= 0)
+			continue;
+		send(bench->sock, buf, (size_t)r, 0);
+	}
+	return NULL;
+}
+
+static bool socket_pair(int *a, int *b)
+{
+	struct sockaddr_in addr = { 0 };
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t addr_len = sizeof(addr);
+	struct sockaddr_in addr_a = addr, addr_b = addr;
+
+	*a = socket(AF_INET, SOCK_DGRAM, 0);
+	*b = socket(AF_INET, SOCK_DGRAM, 0);
+	if(*a < 0 || *b < 0)
+		return false;
+	if(bind(*a, (struct sockaddr *)&addr_a, addr_len) < 0 || bind(*b, (struct sockaddr *)&addr_b, addr_len) < 0)
+		return false;
+	getsockname(*a, (struct sockaddr *)&addr_a, &addr_len);
+	addr_len = sizeof(addr);
+	getsockname(*b, (struct sockaddr *)&addr_b, &addr_len);
+	if(connect(*a, (struct sockaddr *)&addr_b, sizeof(addr_b)) < 0 || connect(*b, (struct sockaddr *)&addr_a, sizeof(addr_a)) < 0)
+		return false;
+	return fcntl(*a, F_SETFL, O_NONBLOCK) >= 0;
+}
+
+static bool bench_socket_wakeup(BenchMode mode, size_t iterations)
+{
+	Bench bench = { 0 };
+	bench.mode = mode;
+	bench.iterations = iterations;
+	if(!socket_pair(&bench.sock, &bench.peer))
+	{
+		fprintf(stderr, "Failed to create sockets\n");
+		return false;
+	}
+	if(mode == BENCH_MODE_SELECT && bench.sock >= FD_SETSIZE)
+	{
+		printf("%-28s skipped, socket fd %d >= FD_SETSIZE\n", "pipe + select()", bench.sock);
+		close(bench.sock);
+		close(bench.peer);
+		return true;
+	}
+
+	if(mode == BENCH_MODE_STOP_PIPE)
+	{
+		if(chiaki_stop_pipe_init(&bench.stop_pipe) != CHIAKI_ERR_SUCCESS)
+			return false;
+	}
+	else if(pipe(bench.select_pipe) < 0)
+		return false;
+
+	uint64_t *samples = calloc(iterations, sizeof(uint64_t));
+	if(!samples)
+		return false;
+
+	ChiakiThread thread;
+	chiaki_thread_create(&thread, echo_thread_func, &bench);
+
+	uint8_t buf[64] = { 0 };
+	size_t count = 0;
+	for(; count<iterations; count++)
+	{
+		uint64_t start = chiaki_time_now_monotonic_us();
+		if(send(bench.peer, buf, sizeof(buf), 0) < 0 || recv(bench.peer, buf, sizeof(buf), 0) <= 0)
+			break;
+		samples[count] = chiaki_time_now_monotonic_us() - start;
+	}
+
+	chiaki_thread_join(&thread, NULL);
+	if(count && !bench.failed)
+		print_result(mode == BENCH_MODE_STOP_PIPE ? "chiaki_stop_pipe (round trip)" : "pipe + select() (round trip)", samples, count);
+	else
+		printf("socket wakeup benchmark failed\n");
+
+	free(samples);
+	if(mode == BENCH_MODE_STOP_PIPE)
+		chiaki_stop_pipe_fini(&bench.stop_pipe);
+	else
+	{
+		close(bench.select_pipe[0]);
+		close(bench.select_pipe[1]);
+	}
+	close(bench.sock);
+	close(bench.peer);
+	return true;
+}
+
+typedef struct stop_bench_t
+{
+	ChiakiStopPipe stop_pipe;
+	ChiakiMutex mutex;
+	ChiakiCond cond;
+	bool waiting;
+	uint64_t stopped_at;
+	uint64_t *samples;
+	size_t iterations;
+} StopBench;
+
+static bool stop_bench_waiting(void *user)
+{
+	StopBench *bench = user;
+	return bench->waiting;
+}
+
+static void *stop_thread_func(void *user)
+{
+	StopBench *bench = user;
+	for(size_t i=0; i<bench->iterations; i++)
+	{
+		chiaki_mutex_lock(&bench->mutex);
+		bench->waiting = true;
+		chiaki_cond_signal(&bench->cond);
+		chiaki_mutex_unlock(&bench->mutex);
+
+		chiaki_stop_pipe_sleep(&bench->stop_pipe, UINT64_MAX);
+		uint64_t now = chiaki_time_now_monotonic_us();
+		chiaki_stop_pipe_reset(&bench->stop_pipe);
+
+		chiaki_mutex_lock(&bench->mutex);
+		bench->samples[i] = now - bench->stopped_at;
+		chiaki_mutex_unlock(&bench->mutex);
+	}
+	return NULL;
+}
+
+static bool bench_stop_wakeup(size_t iterations)
+{
+	StopBench bench = { 0 };
+	bench.iterations = iterations;
+	bench.samples = calloc(iterations, sizeof(uint64_t));
+	if(!bench.samples)
+		return false;
+	chiaki_stop_pipe_init(&bench.stop_pipe);
+	chiaki_mutex_init(&bench.mutex, false);
+	chiaki_cond_init(&bench.cond);
+
+	ChiakiThread thread;
+	chiaki_thread_create(&thread, stop_thread_func, &bench);
+
+	for(size_t i=0; i<iterations; i++)
+	{
+		chiaki_mutex_lock(&bench.mutex);
+		chiaki_cond_wait_pred(&bench.cond, &bench.mutex, stop_bench_waiting, &bench);
+		bench.waiting = false;
+		chiaki_mutex_unlock(&bench.mutex);
+
+		// give the thread some time to actually block
+		usleep(20);
+		chiaki_mutex_lock(&bench.mutex);
+		bench.stopped_at = chiaki_time_now_monotonic_us();
+		chiaki_mutex_unlock(&bench.mutex);
+		chiaki_stop_pipe_stop(&bench.stop_pipe);
+	}
+
+	chiaki_thread_join(&thread, NULL);
+	print_result("chiaki_stop_pipe_stop()", bench.samples, iterations);
+
+	chiaki_cond_fini(&bench.cond);
+	chiaki_mutex_fini(&bench.mutex);
+	chiaki_stop_pipe_fini(&bench.stop_pipe);
+	free(bench.samples);
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t iterations = argc > 1 ? (size_t)strtoul(argv[1], NULL, 0) : 20000;
+	int extra_fds = argc > 2 ? atoi(argv[2]) : 0;
+	if(!iterations)
+		iterations = 1;
+
+	for(int i=0; i<extra_fds; i++)
+	{
+		if(open("/dev/null", O_RDONLY) < 0)
+		{
+			fprintf(stderr, "Failed to open %d extra fds, check ulimit -n\n", extra_fds);
+			return 1;
+		}
+	}
+
+	printf("%zu iterations\n", iterations);
+	if(!bench_socket_wakeup(BENCH_MODE_SELECT, iterations)
+		|| !bench_socket_wakeup(BENCH_MODE_STOP_PIPE, iterations)
+		|| !bench_stop_wakeup(iterations / 10 ? iterations / 10 : 1))
+		return 1;
+	return 0;
+}
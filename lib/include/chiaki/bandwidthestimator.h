@@ -0,0 +1,104 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_BANDWIDTHESTIMATOR_H
+#define CHIAKI_BANDWIDTHESTIMATOR_H
+
+#include "common.h"
+#include "seqnum.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum chiaki_bandwidth_usage_t
+{
+	CHIAKI_BANDWIDTH_USAGE_NORMAL,
+	CHIAKI_BANDWIDTH_USAGE_OVERUSE, // frames arrive increasingly late, a queue on the path is building up
+	CHIAKI_BANDWIDTH_USAGE_UNDERUSE // frames arrive increasingly early, a queue on the path is draining
+} ChiakiBandwidthUsage;
+
+CHIAKI_EXPORT const char *chiaki_bandwidth_usage_string(ChiakiBandwidthUsage usage);
+
+typedef struct chiaki_bandwidth_estimate_t
+{
+	ChiakiBandwidthUsage usage;
+	uint64_t bitrate_kbps; // estimated available bitrate, 0 until enough video has been received
+	uint64_t received_kbps; // video bitrate received recently, 0 if unknown
+	double delay_trend; // trend of the one-way delay variation, overuse is detected when it exceeds delay_threshold
+	double delay_threshold;
+	double loss_ratio; // of all av packets in the last loss report
+} ChiakiBandwidthEstimate;
+
+#define CHIAKI_BANDWIDTH_ESTIMATOR_TRENDLINE_SIZE 20
+
+/**
+ * Delay-based bandwidth estimation from the arrival times of video frames.
+ *
+ * The console sends frames at a constant rate, so the difference between the arrival interval of two frames
+ * and their send interval is the change in one-way delay. The slope of the smoothed accumulated delay
+ * over the last frames tells whether a queue on the path is growing, usually well before it overflows and loses packets.
+ * The estimate is then adjusted AIMD-style: decreased below the received bitrate on overuse,
+ * slowly increased otherwise and also decreased on high loss.
+ */
+typedef struct chiaki_bandwidth_estimator_t
+{
+	uint64_t frame_interval_us;
+	uint64_t bitrate_max_kbps;
+
+	bool frame_prev_valid;
+	ChiakiSeqNum16 frame_index_prev;
+	uint64_t arrival_prev_us;
+	uint64_t arrival_origin_us;
+
+	double delay_acc_ms;
+	double delay_smoothed_ms;
+	double trendline_time_ms[CHIAKI_BANDWIDTH_ESTIMATOR_TRENDLINE_SIZE];
+	double trendline_delay_ms[CHIAKI_BANDWIDTH_ESTIMATOR_TRENDLINE_SIZE];
+	size_t trendline_count;
+	size_t trendline_next;
+	uint64_t delays_count;
+
+	uint64_t threshold_update_prev_us;
+	double delay_trend_prev;
+	unsigned int overuse_count;
+
+	uint64_t rate_window_start_us;
+	uint64_t rate_window_bytes;
+
+	uint64_t rate_update_prev_us;
+	uint64_t decrease_prev_us;
+
+	ChiakiBandwidthEstimate estimate;
+} ChiakiBandwidthEstimator;
+
+/**
+ * @param fps frame rate the console is sending at
+ * @param bitrate_max_kbps upper limit for the estimate, e.g. the bitrate of the requested video profile, 0 for none
+ */
+CHIAKI_EXPORT void chiaki_bandwidth_estimator_init(ChiakiBandwidthEstimator *estimator, unsigned int fps, uint64_t bitrate_max_kbps);
+
+/**
+ * Feed a completely received (or given up) video frame.
+ * Frames must be pushed in order, out-of-order frames are ignored.
+ *
+ * @param arrival_first_us arrival of the first unit of the frame
+ * @param arrival_last_us arrival of the last unit of the frame
+ * @param size received payload size of the frame
+ */
+CHIAKI_EXPORT void chiaki_bandwidth_estimator_push_frame(ChiakiBandwidthEstimator *estimator, ChiakiSeqNum16 frame_index,
+		uint64_t arrival_first_us, uint64_t arrival_last_us, size_t size);
+
+/**
+ * Feed the packet counts of one loss report interval, see ChiakiPacketStats.
+ */
+CHIAKI_EXPORT void chiaki_bandwidth_estimator_push_loss(ChiakiBandwidthEstimator *estimator, uint64_t received, uint64_t lost, uint64_t now_us);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_BANDWIDTHESTIMATOR_H
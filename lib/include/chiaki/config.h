@@ -5,5 +5,6 @@
 
 #define CHIAKI_LIB_ENABLE_OPUS 1
 #define CHIAKI_LIB_ENABLE_PI_DECODER 0
+#define CHIAKI_LIB_ENABLE_IO_URING 0
 
 #endif // CHIAKI_CONFIG_H
@@ -6,6 +6,7 @@
 #include "takion.h"
 #include "thread.h"
 #include "packetstats.h"
+#include "bandwidthestimator.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -17,15 +18,41 @@ typedef struct chiaki_congestion_control_t
 	ChiakiPacketStats *stats;
 	ChiakiThread thread;
 	ChiakiBoolPredCond stop_cond;
+
+	/**
+	 * If true, the reported loss is raised while the estimated bitrate is below the received one,
+	 * so the console reduces its bitrate before the bottleneck starts dropping packets.
+	 */
+	bool report_overuse;
+
+	/**
+	 * protects estimator
+	 */
+	ChiakiMutex estimator_mutex;
+	ChiakiBandwidthEstimator estimator;
 } ChiakiCongestionControl;
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_start(ChiakiCongestionControl *control, ChiakiTakion *takion, ChiakiPacketStats *stats);
+/**
+ * @param fps frame rate of the stream, see chiaki_bandwidth_estimator_init()
+ * @param bitrate_max_kbps bitrate of the requested video profile, see chiaki_bandwidth_estimator_init()
+ * @param report_overuse see ChiakiCongestionControl.report_overuse
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_start(ChiakiCongestionControl *control, ChiakiTakion *takion, ChiakiPacketStats *stats,
+		unsigned int fps, uint64_t bitrate_max_kbps, bool report_overuse);
 
 /**
  * Stop control and join the thread
  */
 CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_stop(ChiakiCongestionControl *control);
 
+/**
+ * Feed a video frame into the bandwidth estimation, see chiaki_bandwidth_estimator_push_frame()
+ */
+CHIAKI_EXPORT void chiaki_congestion_control_push_frame(ChiakiCongestionControl *control, ChiakiSeqNum16 frame_index,
+		uint64_t arrival_first_us, uint64_t arrival_last_us, size_t size);
+
+CHIAKI_EXPORT void chiaki_congestion_control_get_estimate(ChiakiCongestionControl *control, ChiakiBandwidthEstimate *estimate);
+
 #ifdef __cplusplus
 }
 #endif
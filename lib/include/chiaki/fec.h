@@ -15,9 +15,65 @@ extern "C" {
 #endif
 
 #define CHIAKI_FEC_WORDSIZE 8
+#define CHIAKI_FEC_UNITS_MAX (1 << CHIAKI_FEC_WORDSIZE) // k + m
 
+#define CHIAKI_FEC_CACHE_CODING_ENTRIES 8
+#define CHIAKI_FEC_CACHE_DECODING_ENTRIES 16
+
+typedef struct chiaki_fec_cache_stats_t
+{
+	uint64_t coding_hits;
+	uint64_t coding_misses;
+	uint64_t decoding_hits;
+	uint64_t decoding_misses;
+	uint64_t schedule_hits;
+	uint64_t schedule_misses;
+} ChiakiFecCacheStats;
+
+typedef enum
+{
+	CHIAKI_FEC_ENGINE_MATRIX, // GF(2^8) multiplications with the decoding matrix, see gf256.h
+	CHIAKI_FEC_ENGINE_BITMATRIX // only XORs of packets of bit-sliced units, following a smart schedule of the Cauchy bitmatrix
+} ChiakiFecEngine;
+
+/**
+ * Set up the cache of coding matrices by (k, m) and inverted decoding matrices and schedules by (k, m, erasures)
+ * that chiaki_fec_decode() and chiaki_fec_encode() share between all sessions.
+ * Called by chiaki_lib_init(), before that every call creates its matrices from scratch.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_cache_init(void);
+
+/**
+ * Get the hit and miss counts of the matrix cache since chiaki_fec_cache_init(). May be called from any thread.
+ */
+CHIAKI_EXPORT void chiaki_fec_cache_stats(ChiakiFecCacheStats *stats);
+
+CHIAKI_EXPORT const char *chiaki_fec_engine_name(ChiakiFecEngine engine);
+
+/**
+ * Choose how chiaki_fec_decode() restores units from now on, in all sessions. Both give identical results.
+ * Default is CHIAKI_FEC_ENGINE_MATRIX.
+ */
+CHIAKI_EXPORT void chiaki_fec_set_engine(ChiakiFecEngine engine);
+
+CHIAKI_EXPORT ChiakiFecEngine chiaki_fec_get_engine(void);
+
+/**
+ * Restore the erased source units of a frame. Erased fec units are not restored.
+ *
+ * @param frame_buf k source units followed by m fec units, each stride bytes apart
+ * @param erasures indices of the units to restore, at most m
+ */
 CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_decode(uint8_t *frame_buf, size_t unit_size, size_t stride, unsigned int k, unsigned int m, const unsigned int *erasures, size_t erasures_count);
 
+/**
+ * Calculate the m fec units of a frame the way the console does, so chiaki_fec_decode() can restore it.
+ *
+ * @param frame_buf k source units followed by space for m fec units, each stride bytes apart.
+ * Source units shorter than unit_size must be zero-padded up to unit_size.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_encode(uint8_t *frame_buf, size_t unit_size, size_t stride, unsigned int k, unsigned int m);
+
 #ifdef __cplusplus
 }
 #endif
@@ -6,6 +6,8 @@
 #include "common.h"
 #include "takion.h"
 #include "packetstats.h"
+#include "streamstats.h"
+#include "video.h"
 
 #include <stdint.h>
 #include <stdbool.h>
@@ -14,15 +16,7 @@
 extern "C" {
 #endif
 
-typedef struct chiaki_stream_stats_t
-{
-	uint64_t frames;
-	uint64_t bytes;
-} ChiakiStreamStats;
-
-CHIAKI_EXPORT void chiaki_stream_stats_reset(ChiakiStreamStats *stats);
-CHIAKI_EXPORT void chiaki_stream_stats_frame(ChiakiStreamStats *stats, uint64_t size);
-CHIAKI_EXPORT uint64_t chiaki_stream_stats_bitrate(ChiakiStreamStats *stats, uint64_t framerate);
+#define CHIAKI_FRAME_PROCESSOR_UNITS_MAX 256
 
 struct chiaki_frame_unit_t;
 typedef struct chiaki_frame_unit_t ChiakiFrameUnit;
@@ -30,7 +24,7 @@ typedef struct chiaki_frame_unit_t ChiakiFrameUnit;
 typedef struct chiaki_frame_processor_t
 {
 	ChiakiLog *log;
-	uint8_t *frame_buf;
+	uint8_t *frame_buf; // never shrinks, only the parts that fec needs are zeroed and only right before it
 	size_t frame_buf_size;
 	size_t buf_size_per_unit;
 	size_t buf_stride_per_unit;
@@ -38,10 +32,18 @@ typedef struct chiaki_frame_processor_t
 	unsigned int units_fec_expected;
 	unsigned int units_source_received;
 	unsigned int units_fec_received;
-	ChiakiFrameUnit *unit_slots;
-	size_t unit_slots_size;
+	ChiakiFrameUnit *unit_slots; // only valid for units in units_received
+	size_t unit_slots_size; // units of the current frame
+	size_t unit_slots_capacity; // allocated unit_slots and segments, never shrinks
+	ChiakiVideoSampleSegment *segments;
+	uint64_t units_received[CHIAKI_FRAME_PROCESSOR_UNITS_MAX / 64]; // bitmap of units received for the current frame
 	bool flushed; // whether we have already flushed the current frame, i.e. are only interested in stats, not data.
-	ChiakiStreamStats stream_stats;
+	uint64_t recv_time_first_us; // earliest arrival of a unit of the current frame, 0 if unknown
+	uint64_t recv_time_last_us; // latest arrival of a unit of the current frame, 0 if unknown
+	unsigned int slices_scanned; // leading source units that chiaki_frame_processor_flush_slices() has searched for nal boundaries
+	unsigned int slices_unit; // source unit up to which the frame has been handed out as slices
+	size_t slices_offset; // bytes of the payload of slices_unit that have been handed out as slices
+	size_t slices_size; // total bytes handed out as slices
 } ChiakiFrameProcessor;
 
 typedef enum chiaki_frame_flush_result_t {
@@ -55,7 +57,17 @@ CHIAKI_EXPORT void chiaki_frame_processor_init(ChiakiFrameProcessor *frame_proce
 CHIAKI_EXPORT void chiaki_frame_processor_fini(ChiakiFrameProcessor *frame_processor);
 
 CHIAKI_EXPORT void chiaki_frame_processor_report_packet_stats(ChiakiFrameProcessor *frame_processor, ChiakiPacketStats *packet_stats);
+
+/**
+ * Report received and lost units and loss bursts of the current frame.
+ */
+CHIAKI_EXPORT void chiaki_frame_processor_report_stream_stats(ChiakiFrameProcessor *frame_processor, ChiakiStreamStats *stream_stats, uint64_t now_us);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_alloc_frame(ChiakiFrameProcessor *frame_processor, ChiakiTakionAVPacket *packet);
+
+/**
+ * If packet->buf is set, a reference to it is kept until the next frame is allocated
+ * instead of copying the unit's data.
+ */
 CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_put_unit(ChiakiFrameProcessor *frame_processor, ChiakiTakionAVPacket *packet);
 
 /**
@@ -64,6 +76,37 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_put_unit(ChiakiFrameProcess
  */
 CHIAKI_EXPORT ChiakiFrameProcessorFlushResult chiaki_frame_processor_flush(ChiakiFrameProcessor *frame_processor, uint8_t **frame, size_t *frame_size);
 
+/**
+ * Like chiaki_frame_processor_flush(), but the frame is returned as segments pointing directly at the units
+ * instead of being compacted, one per source unit. Units restored by FEC point into the internal buffer.
+ * Only the part of the frame that has not been handed out by chiaki_frame_processor_flush_slices() yet is returned.
+ *
+ * @param segments unless CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FAILED returned, will receive a pointer to an internal array of segments.
+ * Neither the array nor the data it points to may be used after the next call to this frame processor!
+ * @param frame_size total size of all segments
+ */
+CHIAKI_EXPORT ChiakiFrameProcessorFlushResult chiaki_frame_processor_flush_segments(ChiakiFrameProcessor *frame_processor,
+		ChiakiVideoSampleSegment **segments, size_t *segments_count, size_t *frame_size);
+
+/**
+ * Drop the references to the packet buffers of the flushed frame, so they go back to their pool
+ * instead of waiting for the next frame to be allocated. Segments pointing into them must not be used anymore.
+ */
+CHIAKI_EXPORT void chiaki_frame_processor_release_units(ChiakiFrameProcessor *frame_processor);
+
+/**
+ * Hand out the complete nal units at the start of the frame that have not been handed out before,
+ * as far as its source units have been received without gaps, so decoding can start before the frame is complete.
+ * Nal units are delimited by the Annex B start codes in front of them, so the last one is only handed out
+ * by chiaki_frame_processor_flush() or chiaki_frame_processor_flush_segments(), which also return only the rest of the frame.
+ *
+ * @param segments will receive a pointer to an internal array of segments, same rules as for chiaki_frame_processor_flush_segments()
+ * @param size total size of all segments
+ * @return whether there was anything to hand out
+ */
+CHIAKI_EXPORT bool chiaki_frame_processor_flush_slices(ChiakiFrameProcessor *frame_processor,
+		ChiakiVideoSampleSegment **segments, size_t *segments_count, size_t *size);
+
 static inline bool chiaki_frame_processor_flush_possible(ChiakiFrameProcessor *frame_processor)
 {
 	return frame_processor->units_source_received + frame_processor->units_fec_received
@@ -0,0 +1,59 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_GF256_H
+#define CHIAKI_GF256_H
+
+#include "common.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Arithmetic in GF(2^8) with the polynomial Jerasure uses for w = 8 (x^8 + x^4 + x^3 + x^2 + 1),
+ * so results are identical to its galois routines.
+ */
+#define CHIAKI_GF256_POLY 0x11d
+
+typedef enum
+{
+	CHIAKI_GF256_IMPL_SCALAR,
+	CHIAKI_GF256_IMPL_SSSE3,
+	CHIAKI_GF256_IMPL_AVX2,
+	CHIAKI_GF256_IMPL_AVX512,
+	CHIAKI_GF256_IMPL_NEON,
+	CHIAKI_GF256_IMPL_COUNT
+} ChiakiGf256Impl;
+
+CHIAKI_EXPORT const char *chiaki_gf256_impl_name(ChiakiGf256Impl impl);
+
+/**
+ * @return whether impl was compiled in and the cpu supports it
+ */
+CHIAKI_EXPORT bool chiaki_gf256_impl_supported(ChiakiGf256Impl impl);
+
+/**
+ * @return the fastest impl supported by the cpu, detected once
+ */
+CHIAKI_EXPORT ChiakiGf256Impl chiaki_gf256_impl_best(void);
+
+CHIAKI_EXPORT uint8_t chiaki_gf256_mul(uint8_t a, uint8_t b);
+
+/**
+ * dst = coefs[0] * srcs[0] + ... + coefs[count - 1] * srcs[count - 1] over size bytes.
+ * dst must not overlap any of srcs.
+ *
+ * @param impl must be supported, see chiaki_gf256_impl_supported()
+ */
+CHIAKI_EXPORT void chiaki_gf256_dotprod(ChiakiGf256Impl impl, uint8_t *dst, const uint8_t *const *srcs,
+		const uint8_t *coefs, size_t count, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_GF256_H
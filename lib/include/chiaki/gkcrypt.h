@@ -15,25 +15,70 @@ extern "C" {
 #endif
 
 #define CHIAKI_GKCRYPT_BLOCK_SIZE 0x10
-#define CHIAKI_GKCRYPT_KEY_BUF_BLOCKS_DEFAULT 0x20 // 2MB
+#define CHIAKI_GKCRYPT_KEY_BUF_BLOCKS_DEFAULT 0x80 // 512 KiB
 #define CHIAKI_GKCRYPT_GMAC_SIZE 4
 #define CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_KEY_POS 45000
 #define CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_IV_OFFSET 44910
+#define CHIAKI_GKCRYPT_GMAC_CTXS_COUNT 4
+
+/**
+ * Implementation of the ctr mode key stream and gmac. All of them give identical results.
+ */
+typedef enum
+{
+	CHIAKI_GKCRYPT_IMPL_BACKEND, // OpenSSL or mbedtls, always available
+	CHIAKI_GKCRYPT_IMPL_AESNI, // built-in AES-NI and PCLMULQDQ
+	CHIAKI_GKCRYPT_IMPL_ARMV8, // built-in ARMv8 Crypto Extensions
+	CHIAKI_GKCRYPT_IMPL_COUNT
+} ChiakiGKCryptImpl;
 
 typedef struct chiaki_key_state_t
 {
    uint64_t prev;
 } ChiakiKeyState;
 
+/**
+ * Cipher context that has been keyed once with the gmac key of index.
+ */
+typedef struct chiaki_gkcrypt_gmac_ctx_t
+{
+	uint64_t index;
+	void *ctx; // aes-128-gcm context of the crypto backend or key of a built-in impl, NULL if unused
+	uint64_t last_used;
+} ChiakiGKCryptGmacCtx;
+
+/**
+ * Counters of the key buffer, see chiaki_gkcrypt_key_buf_stats()
+ */
+typedef struct chiaki_gkcrypt_key_buf_stats_t
+{
+	uint64_t hits; // requests served from the key buffer
+	uint64_t misses; // requests that were not in the key buffer, so the key stream was generated on the spot
+	uint64_t wakeups; // times the key buffer thread was woken up to generate more
+	uint64_t reader_waits; // times the key buffer thread had to wait for a request reading the part it was about to overwrite
+	uint64_t skips; // times the key buffer thread skipped ahead because requests were beyond the whole buffer
+} ChiakiGKCryptKeyBufStats;
+
+/**
+ * Except for the key buffer thread, which has its own cipher context, a ChiakiGKCrypt
+ * must not be used from multiple threads at the same time.
+ */
 typedef struct chiaki_gkcrypt_t {
 	uint8_t index;
 
-	uint8_t *key_buf; // circular buffer of the ctr mode key stream
+	// The key buffer is a ring with the key thread as the single producer and the user of the ChiakiGKCrypt as the single consumer.
+	// The key pos fields are only accessed atomically, the mutex and cond are only used to put the thread to sleep and wake it up.
+	uint8_t *key_buf; // circular buffer of the ctr mode key stream, key pos p is at p % key_buf_size
 	size_t key_buf_size;
-	size_t key_buf_populated; // size of key_buf that is already populated (on startup)
-	uint64_t key_buf_key_pos_min; // minimal key pos currently in key_buf
-	size_t key_buf_start_offset; // offset in key_buf of the minimal key pos
-	uint64_t last_key_pos;        // last key pos that has been requested
+	uint64_t key_buf_key_pos_min; // minimal key pos currently in key_buf, raised by the thread before it overwrites anything below
+	uint64_t key_buf_key_pos_max; // end of the key stream that has been generated into key_buf
+	uint64_t key_buf_reader_key_pos; // start of the key stream currently being read from key_buf, UINT64_MAX if none
+	uint64_t key_buf_wake_key_pos; // last_key_pos at which the sleeping thread wants to be woken up, UINT64_MAX while it is awake
+	uint64_t last_key_pos; // end of the highest key stream that has been requested
+	uint64_t key_buf_rate; // estimated bytes of key stream requested per second, only used by the thread to size how far ahead it generates
+	uint64_t key_buf_rate_time_us; // when key_buf_rate_key_pos was sampled
+	uint64_t key_buf_rate_key_pos;
+	ChiakiGKCryptKeyBufStats key_buf_stats;
 	bool key_buf_thread_stop;
 	ChiakiMutex key_buf_mutex;
 	ChiakiCond key_buf_cond;
@@ -44,17 +89,50 @@ typedef struct chiaki_gkcrypt_t {
 	uint8_t key_gmac_base[CHIAKI_GKCRYPT_BLOCK_SIZE];
 	uint8_t key_gmac_current[CHIAKI_GKCRYPT_BLOCK_SIZE];
 	uint64_t key_gmac_index_current;
+
+	// cipher contexts are created on first use with the impl set at that time and kept until fini,
+	// so a zeroed ChiakiGKCrypt is valid for gmac
+	void *key_stream_ctx; // aes-128-ecb context of the crypto backend or key of a built-in impl for key_base, NULL if not created yet
+	ChiakiGKCryptGmacCtx gmac_ctxs[CHIAKI_GKCRYPT_GMAC_CTXS_COUNT]; // most recently used gmac key indices, around a key refresh the previous one is still needed
+	uint64_t gmac_ctxs_clock;
 	ChiakiLog *log;
 } ChiakiGKCrypt;
 
 struct chiaki_session_t;
 
+CHIAKI_EXPORT const char *chiaki_gkcrypt_impl_name(ChiakiGKCryptImpl impl);
+
+/**
+ * @return whether impl was compiled in and the cpu supports it
+ */
+CHIAKI_EXPORT bool chiaki_gkcrypt_impl_supported(ChiakiGKCryptImpl impl);
+
 /**
- * @param key_buf_chunks if > 0, use a thread to generate the ctr mode key stream
+ * @return the fastest impl supported by the cpu
+ */
+CHIAKI_EXPORT ChiakiGKCryptImpl chiaki_gkcrypt_impl_best(void);
+
+/**
+ * Select the impl for all cipher contexts created from now on, the default is chiaki_gkcrypt_impl_best().
+ * Unsupported impls fall back to CHIAKI_GKCRYPT_IMPL_BACKEND.
+ */
+CHIAKI_EXPORT void chiaki_gkcrypt_set_impl(ChiakiGKCryptImpl impl);
+
+CHIAKI_EXPORT ChiakiGKCryptImpl chiaki_gkcrypt_get_impl(void);
+
+/**
+ * @param key_buf_chunks if > 0, use a thread to generate the ctr mode key stream,
+ * the first part of it is generated right away so the first requests are already in the buffer
  */
 CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_init(ChiakiGKCrypt *gkcrypt, ChiakiLog *log, size_t key_buf_chunks, uint8_t index, const uint8_t *handshake_key, const uint8_t *ecdh_secret);
 
 CHIAKI_EXPORT void chiaki_gkcrypt_fini(ChiakiGKCrypt *gkcrypt);
+
+/**
+ * Get the counters of the key buffer since chiaki_gkcrypt_init(), all zero without a key buffer. May be called from any thread.
+ */
+CHIAKI_EXPORT void chiaki_gkcrypt_key_buf_stats(ChiakiGKCrypt *gkcrypt, ChiakiGKCryptKeyBufStats *stats);
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gen_key_stream(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_get_key_stream(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_decrypt(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size);
@@ -64,6 +142,27 @@ CHIAKI_EXPORT void chiaki_gkcrypt_gen_new_gmac_key(ChiakiGKCrypt *gkcrypt, uint6
 CHIAKI_EXPORT void chiaki_gkcrypt_gen_tmp_gmac_key(ChiakiGKCrypt *gkcrypt, uint64_t index, uint8_t *key_out);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gmac(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, const uint8_t *buf, size_t buf_size, uint8_t *gmac_out);
 
+/**
+ * Calculate the gmacs of count buffers, like calling chiaki_gkcrypt_gmac() for each of them in order.
+ * Built-in impls calculate several of them interleaved, which is faster than one after the other.
+ *
+ * @param gmacs_out CHIAKI_GKCRYPT_GMAC_SIZE bytes for each buffer
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gmac_multi(ChiakiGKCrypt *gkcrypt, size_t count, const uint64_t *key_pos,
+		const uint8_t *const *bufs, const size_t *buf_sizes, uint8_t *const *gmacs_out);
+
+/**
+ * Check the gmac of buf and decrypt buf from decrypt_offset to its end in place, like chiaki_gkcrypt_gmac()
+ * followed by chiaki_gkcrypt_decrypt(gkcrypt, decrypt_key_pos, buf + decrypt_offset, buf_size - decrypt_offset).
+ * Built-in impls do both in a single pass over buf, decrypting every piece right after it has been hashed.
+ *
+ * @param gmac expected gmac of buf before decryption
+ * @param gmac_out optional, receives the calculated gmac
+ * @return CHIAKI_ERR_INVALID_MAC if the gmacs differ, buf has been decrypted anyway and must be dropped then
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_verify_decrypt(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size,
+		size_t decrypt_offset, uint64_t decrypt_key_pos, const uint8_t *gmac, uint8_t *gmac_out);
+
 static inline ChiakiGKCrypt *chiaki_gkcrypt_new(ChiakiLog *log, size_t key_buf_chunks, uint8_t index, const uint8_t *handshake_key, const uint8_t *ecdh_secret)
 {
 	ChiakiGKCrypt *gkcrypt = CHIAKI_NEW(ChiakiGKCrypt);
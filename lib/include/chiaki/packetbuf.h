@@ -0,0 +1,85 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_PACKETBUF_H
+#define CHIAKI_PACKETBUF_H
+
+#include "common.h"
+#include "thread.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct chiaki_packet_buf_pool_t ChiakiPacketBufPool;
+
+/**
+ * Reference-counted buffer for a single received datagram.
+ *
+ * Buffers are handed out by a ChiakiPacketBufPool and go back to it once the last reference is dropped,
+ * so anything that wants to keep the data around without copying it can simply take a reference.
+ */
+typedef struct chiaki_packet_buf_t
+{
+	ChiakiPacketBufPool *pool;
+	struct chiaki_packet_buf_t *next_free; // internal
+	unsigned int refcount; // protected by the pool's mutex
+	bool pooled; // false if the buffer had to be allocated separately because the pool was exhausted
+	struct chiaki_packet_buf_t *parent; // for slices, the buffer data points into, a reference to it is held
+	uint8_t *data;
+	size_t size; // allocated size of data or size of the slice
+	uint64_t recv_time_us; // when the datagram arrived, in chiaki_time_now_monotonic_us() time, 0 if unknown
+} ChiakiPacketBuf;
+
+/**
+ * @param bufs_count number of buffers to preallocate
+ * @param buf_size size of every single buffer
+ */
+CHIAKI_EXPORT ChiakiPacketBufPool *chiaki_packet_buf_pool_new(size_t bufs_count, size_t buf_size);
+
+/**
+ * Release the pool. Memory of buffers that are still referenced stays valid
+ * and is freed together with the pool as soon as the last of them is unreferenced.
+ */
+CHIAKI_EXPORT void chiaki_packet_buf_pool_free(ChiakiPacketBufPool *pool);
+
+/**
+ * Get a buffer with a refcount of 1.
+ * If all preallocated buffers are in use, a new one is allocated and exhausted (if non-NULL) is set to true.
+ *
+ * Thread-safe.
+ *
+ * @return the buffer or NULL if allocation failed
+ */
+CHIAKI_EXPORT ChiakiPacketBuf *chiaki_packet_buf_pool_acquire(ChiakiPacketBufPool *pool, bool *exhausted);
+
+/**
+ * Get a buffer that refers to a part of parent without copying, e.g. a single datagram out of a coalesced receive.
+ * The slice has a refcount of 1 and keeps parent alive until it is released itself.
+ *
+ * Thread-safe.
+ *
+ * @return the slice or NULL if allocation failed
+ */
+CHIAKI_EXPORT ChiakiPacketBuf *chiaki_packet_buf_slice(ChiakiPacketBuf *parent, size_t offset, size_t size);
+
+/**
+ * Thread-safe.
+ */
+CHIAKI_EXPORT void chiaki_packet_buf_ref(ChiakiPacketBuf *buf);
+
+/**
+ * Drop a reference and give the buffer back to its pool if it was the last one.
+ *
+ * Thread-safe.
+ */
+CHIAKI_EXPORT void chiaki_packet_buf_unref(ChiakiPacketBuf *buf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_PACKETBUF_H
@@ -10,6 +10,12 @@
 extern "C" {
 #endif
 
+/**
+ * Packet counts of a stream, pushed by the thread receiving the stream and read by congestion control.
+ *
+ * Pushing is lock-free: the counters only ever grow and are accessed atomically,
+ * resetting just moves the reader's baseline, which is protected by mutex.
+ */
 typedef struct chiaki_packet_stats_t
 {
 	ChiakiMutex mutex;
@@ -19,14 +25,23 @@ typedef struct chiaki_packet_stats_t
 	uint64_t gen_lost;
 
 	// For sequential packets, i.e. where packets are identified by a sequence number
+	uint64_t seq_max; // currently maximal sequence number, a ChiakiSeqNum16
+	uint64_t seq_received; // total received packets
+
+	// values at the last reset, protected by mutex
+	uint64_t gen_received_reset;
+	uint64_t gen_lost_reset;
 	ChiakiSeqNum16 seq_min; // sequence number that was max at the last reset
-	ChiakiSeqNum16 seq_max; // currently maximal sequence number
-	uint64_t seq_received; // total received packets since the last reset
+	uint64_t seq_received_reset;
 } ChiakiPacketStats;
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_packet_stats_init(ChiakiPacketStats *stats);
 CHIAKI_EXPORT void chiaki_packet_stats_fini(ChiakiPacketStats *stats);
 CHIAKI_EXPORT void chiaki_packet_stats_reset(ChiakiPacketStats *stats);
+
+/**
+ * Push functions must only be called from a single thread, but never block.
+ */
 CHIAKI_EXPORT void chiaki_packet_stats_push_generation(ChiakiPacketStats *stats, uint64_t received, uint64_t lost);
 CHIAKI_EXPORT void chiaki_packet_stats_push_seq(ChiakiPacketStats *stats, ChiakiSeqNum16 seq_num);
 CHIAKI_EXPORT void chiaki_packet_stats_get(ChiakiPacketStats *stats, bool reset, uint64_t *received, uint64_t *lost);
@@ -22,6 +22,15 @@ typedef struct chiaki_reorder_queue_entry_t
 	bool set;
 } ChiakiReorderQueueEntry;
 
+/**
+ * Range of consecutive elements present in the queue, as indices relative to begin (inclusive).
+ */
+typedef struct chiaki_reorder_queue_range_t
+{
+	uint64_t start;
+	uint64_t end;
+} ChiakiReorderQueueRange;
+
 typedef void (*ChiakiReorderQueueDropCb)(uint64_t seq_num, void *elem_user, void *cb_user);
 typedef bool (*ChiakiReorderQueueSeqNumGt)(uint64_t a, uint64_t b);
 typedef bool (*ChiakiReorderQueueSeqNumLt)(uint64_t a, uint64_t b);
@@ -123,6 +132,15 @@ CHIAKI_EXPORT bool chiaki_reorder_queue_peek(ChiakiReorderQueue *queue, uint64_t
  */
 CHIAKI_EXPORT void chiaki_reorder_queue_drop(ChiakiReorderQueue *queue, uint64_t index);
 
+/**
+ * Get the ranges of elements that have been received after a missing one, e.g. for selective acknowledgement.
+ * The queue can never hold more than chiaki_reorder_queue_size(queue) / 2 of these.
+ *
+ * @param ranges array of at least ranges_max elements, filled in ascending order
+ * @return number of ranges written to ranges, at most ranges_max
+ */
+CHIAKI_EXPORT size_t chiaki_reorder_queue_received_ranges(ChiakiReorderQueue *queue, ChiakiReorderQueueRange *ranges, size_t ranges_max);
+
 #ifdef __cplusplus
 }
 #endif
@@ -78,6 +78,13 @@ typedef struct chiaki_connect_info_t
 	ChiakiConnectVideoProfile video_profile;
 	bool video_profile_auto_downgrade; // Downgrade video_profile if server does not seem to support it.
 	bool enable_keyboard;
+	size_t packet_ring_size; // if > 0, receive stream packets on a separate thread with a ring of this size, see ChiakiTakionConnectInfo.recv_ring_size
+	bool udp_gro; // see ChiakiTakionConnectInfo.enable_udp_gro
+	bool io_uring; // see ChiakiTakionConnectInfo.enable_io_uring
+	const char *capture_filename; // if non-null, everything received on the stream connection is captured to this file for chiaki-replay
+	bool congestion_control_report_overuse; // see ChiakiCongestionControl.report_overuse
+	unsigned int video_reorder_frames; // frames received at the same time to wait for reordered units, 0 for the default, 1 to disable, see ChiakiVideoReceiver
+	uint64_t video_reorder_window_us; // time to wait for reordered units of a frame, 0 for the default
 } ChiakiConnectInfo;
 
 
@@ -154,6 +161,33 @@ typedef void (*ChiakiEventCallback)(ChiakiEvent *event, void *user);
  */
 typedef bool (*ChiakiVideoSampleCallback)(uint8_t *buf, size_t buf_size, void *user);
 
+/**
+ * Variant of ChiakiVideoSampleCallback for decoders that can consume a sample in multiple parts,
+ * which saves compacting a frame that was received without losses into a single buffer.
+ * The segments have no padding and are only valid during the callback.
+ *
+ * @param frame_size total size of all segments
+ * @return same as for ChiakiVideoSampleCallback
+ */
+typedef bool (*ChiakiVideoSampleGatherCallback)(ChiakiVideoSampleSegment *segments, size_t segments_count, size_t frame_size, void *user);
+
+/**
+ * Variant of ChiakiVideoSampleGatherCallback for decoders that can start decoding a frame before all of it has been received,
+ * e.g. with slice threading. The complete nal units at the start of the next frame are passed on as soon as all of their
+ * units have arrived, the rest of the frame, restored with FEC if necessary, once the frame is flushed.
+ * All calls concatenated are exactly the samples the other callbacks would receive.
+ *
+ * @param size total size of all segments
+ * @param frame_end whether this is the last call for the frame, it may have no segments in that case
+ * @return same as for ChiakiVideoSampleCallback
+ */
+typedef bool (*ChiakiVideoSliceCallback)(ChiakiVideoSampleSegment *segments, size_t segments_count, size_t size, bool frame_end, void *user);
+
+/**
+ * Called for every video frame after it has been passed to the video sample callback.
+ * Runs on the same thread, so it should return quickly.
+ */
+typedef void (*ChiakiVideoFrameTimingCallback)(ChiakiVideoFrameTiming *timing, void *user);
 
 
 typedef struct chiaki_session_t
@@ -170,6 +204,14 @@ typedef struct chiaki_session_t
 		ChiakiConnectVideoProfile video_profile;
 		bool video_profile_auto_downgrade;
 		bool enable_keyboard;
+		size_t packet_ring_size;
+		bool udp_gro;
+		bool io_uring;
+		bool congestion_control_report_overuse;
+		unsigned int video_reorder_frames;
+		uint64_t video_reorder_window_us;
+		ChiakiTakionCapture *capture;
+		ChiakiTakionReplay *replay; // set directly to run the stream connection on a capture instead of a console
 	} connect_info;
 
 	ChiakiTarget target;
@@ -181,6 +223,7 @@ typedef struct chiaki_session_t
 	uint32_t mtu_in;
 	uint32_t mtu_out;
 	uint64_t rtt_us;
+	bool rtt_measured; // whether rtt_us comes from senkusha, otherwise it is only a fallback value
 	ChiakiECDH ecdh;
 
 	ChiakiQuitReason quit_reason;
@@ -190,6 +233,12 @@ typedef struct chiaki_session_t
 	void *event_cb_user;
 	ChiakiVideoSampleCallback video_sample_cb;
 	void *video_sample_cb_user;
+	ChiakiVideoSampleGatherCallback video_sample_gather_cb;
+	void *video_sample_gather_cb_user;
+	ChiakiVideoSliceCallback video_slice_cb;
+	void *video_slice_cb_user;
+	ChiakiVideoFrameTimingCallback video_frame_timing_cb;
+	void *video_frame_timing_cb_user;
 	ChiakiAudioSink audio_sink;
 
 	ChiakiThread session_thread;
@@ -226,6 +275,18 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_session_keyboard_set_text(ChiakiSession *se
 CHIAKI_EXPORT ChiakiErrorCode chiaki_session_keyboard_reject(ChiakiSession *session);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_session_keyboard_accept(ChiakiSession *session);
 
+/**
+ * Get the current bandwidth estimate of the stream, see ChiakiBandwidthEstimator.
+ * @return CHIAKI_ERR_UNINITIALIZED if the stream is not connected
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_session_get_bandwidth_estimate(ChiakiSession *session, ChiakiBandwidthEstimate *estimate);
+
+/**
+ * Get statistics about the received video, see ChiakiStreamStats.
+ * Never blocks the thread receiving the stream, so it is fine to call this often, e.g. for an overlay.
+ */
+CHIAKI_EXPORT void chiaki_session_get_stream_stats(ChiakiSession *session, ChiakiStreamStatsSnapshot *snapshot);
+
 static inline void chiaki_session_set_event_cb(ChiakiSession *session, ChiakiEventCallback cb, void *user)
 {
 	session->event_cb = cb;
@@ -238,6 +299,30 @@ static inline void chiaki_session_set_video_sample_cb(ChiakiSession *session, Ch
 	session->video_sample_cb_user = user;
 }
 
+/**
+ * If set, this is used instead of the video sample callback.
+ */
+static inline void chiaki_session_set_video_sample_gather_cb(ChiakiSession *session, ChiakiVideoSampleGatherCallback cb, void *user)
+{
+	session->video_sample_gather_cb = cb;
+	session->video_sample_gather_cb_user = user;
+}
+
+/**
+ * If set, this is used instead of the video sample callback and the video sample gather callback.
+ */
+static inline void chiaki_session_set_video_slice_cb(ChiakiSession *session, ChiakiVideoSliceCallback cb, void *user)
+{
+	session->video_slice_cb = cb;
+	session->video_slice_cb_user = user;
+}
+
+static inline void chiaki_session_set_video_frame_timing_cb(ChiakiSession *session, ChiakiVideoFrameTimingCallback cb, void *user)
+{
+	session->video_frame_timing_cb = cb;
+	session->video_frame_timing_cb_user = user;
+}
+
 /**
  * @param sink contents are copied
  */
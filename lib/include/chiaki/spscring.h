@@ -0,0 +1,96 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_SPSCRING_H
+#define CHIAKI_SPSCRING_H
+
+#include "common.h"
+#include "thread.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CHIAKI_SPSC_RING_CACHE_LINE_SIZE 64
+
+/**
+ * Bounded lock-free ring for exactly one producer and one consumer thread.
+ * Elements of a fixed size are copied in and out.
+ *
+ * The counters must only be accessed through the functions below.
+ */
+typedef struct chiaki_spsc_ring_t
+{
+	uint8_t *elems;
+	size_t elem_size;
+	uint64_t mask; // capacity - 1
+
+	uint64_t head; // next element to pop, written by the consumer
+	uint8_t head_pad[CHIAKI_SPSC_RING_CACHE_LINE_SIZE - sizeof(uint64_t)];
+	uint64_t tail; // next element to push, written by the producer
+	uint64_t high_water; // most elements that were in the ring at once, written by the producer
+	uint8_t tail_pad[CHIAKI_SPSC_RING_CACHE_LINE_SIZE - 2 * sizeof(uint64_t)];
+
+	uint64_t consumer_waiting;
+	uint64_t closed;
+	ChiakiMutex wait_mutex;
+	ChiakiCond wait_cond;
+} ChiakiSpscRing;
+
+/**
+ * @param capacity minimum number of elements, rounded up to the next power of 2
+ * @param elem_size size of a single element in bytes
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_spsc_ring_init(ChiakiSpscRing *ring, size_t capacity, size_t elem_size);
+CHIAKI_EXPORT void chiaki_spsc_ring_fini(ChiakiSpscRing *ring);
+
+static inline size_t chiaki_spsc_ring_capacity(ChiakiSpscRing *ring)
+{
+	return (size_t)ring->mask + 1;
+}
+
+/**
+ * Producer only.
+ *
+ * @return false if the ring is full
+ */
+CHIAKI_EXPORT bool chiaki_spsc_ring_push(ChiakiSpscRing *ring, const void *elem);
+
+/**
+ * Producer only. Wakes up the consumer and makes chiaki_spsc_ring_pop_wait() fail once the ring is empty.
+ */
+CHIAKI_EXPORT void chiaki_spsc_ring_close(ChiakiSpscRing *ring);
+
+/**
+ * Consumer only.
+ *
+ * @return false if the ring is empty
+ */
+CHIAKI_EXPORT bool chiaki_spsc_ring_pop(ChiakiSpscRing *ring, void *elem);
+
+/**
+ * Consumer only. Block until an element is available.
+ *
+ * @return CHIAKI_ERR_SUCCESS or CHIAKI_ERR_CANCELED if the ring has been closed and is empty
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_spsc_ring_pop_wait(ChiakiSpscRing *ring, void *elem);
+
+/**
+ * Number of elements currently in the ring.
+ * Exact when called from the producer or consumer, a snapshot otherwise.
+ */
+CHIAKI_EXPORT size_t chiaki_spsc_ring_count(ChiakiSpscRing *ring);
+
+/**
+ * Thread-safe.
+ */
+CHIAKI_EXPORT size_t chiaki_spsc_ring_high_water(ChiakiSpscRing *ring);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_SPSCRING_H
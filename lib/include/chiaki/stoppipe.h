@@ -32,6 +32,16 @@ typedef struct chiaki_stop_pipe_t
 	// this fd is audited by 'select' as
 	// fd_set *readfds
 	int fd;
+#elif defined(__linux__)
+	// signaled by chiaki_stop_pipe_stop()
+	int event_fd;
+	// persistent set containing event_fd and the socket of the last wait,
+	// so waiting on the same socket again does not have to rebuild anything
+	int epoll_fd;
+	int epoll_sock; // -1 if none is registered
+	uint32_t epoll_sock_events;
+	uint64_t epoll_sock_dev; // identity of epoll_sock to notice when its fd number was reused
+	uint64_t epoll_sock_ino;
 #else
 	int fds[2];
 #endif
@@ -42,6 +52,15 @@ struct sockaddr;
 CHIAKI_EXPORT ChiakiErrorCode chiaki_stop_pipe_init(ChiakiStopPipe *stop_pipe);
 CHIAKI_EXPORT void chiaki_stop_pipe_fini(ChiakiStopPipe *stop_pipe);
 CHIAKI_EXPORT void chiaki_stop_pipe_stop(ChiakiStopPipe *stop_pipe);
+
+/**
+ * Wait until fd is readable (or writable if write is set), the stop pipe is stopped or the timeout expires.
+ * On Linux, the last fd stays registered with the stop pipe, so waiting on the same fd repeatedly is cheap,
+ * but only one thread may wait on a stop pipe at a time.
+ *
+ * @param fd may be CHIAKI_INVALID_SOCKET to only wait for the stop pipe
+ * @return CHIAKI_ERR_SUCCESS if fd is ready, CHIAKI_ERR_CANCELED if stopped, CHIAKI_ERR_TIMEOUT
+ */
 CHIAKI_EXPORT ChiakiErrorCode chiaki_stop_pipe_select_single(ChiakiStopPipe *stop_pipe, chiaki_socket_t fd, bool write, uint64_t timeout_ms);
 /**
  * Like connect(), but can be canceled by the stop pipe. Only makes sense with a non-blocking socket.
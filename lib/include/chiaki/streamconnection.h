@@ -30,6 +30,7 @@ typedef struct chiaki_stream_connection_t
 	ChiakiGKCrypt *gkcrypt_remote;
 
 	ChiakiPacketStats packet_stats;
+	ChiakiStreamStats stream_stats;
 	ChiakiAudioReceiver *audio_receiver;
 	ChiakiVideoReceiver *video_receiver;
 
@@ -44,6 +45,17 @@ typedef struct chiaki_stream_connection_t
 	 */
 	ChiakiMutex feedback_sender_mutex;
 
+	ChiakiCongestionControl congestion_control;
+	/**
+	 * whether congestion_control is running
+	 * only if this is true, congestion_control may be accessed!
+	 */
+	bool congestion_control_active;
+	/**
+	 * protects congestion_control_active
+	 */
+	ChiakiMutex congestion_control_mutex;
+
 	/**
 	 * signaled on change of state_finished or should_stop
 	 */
@@ -75,6 +87,14 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnectio
  */
 CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_stop(ChiakiStreamConnection *stream_connection);
 
+/**
+ * @return CHIAKI_ERR_UNINITIALIZED if congestion control is not running
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_get_bandwidth_estimate(ChiakiStreamConnection *stream_connection, ChiakiBandwidthEstimate *estimate);
+
+CHIAKI_EXPORT void stream_connection_push_frame_arrival(ChiakiStreamConnection *stream_connection, ChiakiSeqNum16 frame_index,
+		uint64_t arrival_first_us, uint64_t arrival_last_us, size_t size);
+
 CHIAKI_EXPORT ChiakiErrorCode stream_connection_send_corrupt_frame(ChiakiStreamConnection *stream_connection, ChiakiSeqNum16 start, ChiakiSeqNum16 end);
 
 #ifdef __cplusplus
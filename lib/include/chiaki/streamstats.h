@@ -0,0 +1,128 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_STREAMSTATS_H
+#define CHIAKI_STREAMSTATS_H
+
+#include "common.h"
+#include "seqnum.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Loss bursts are counted in buckets of 1, 2, 3-4, 5-8, ..., 65+ consecutive lost units of a frame.
+ */
+#define CHIAKI_STREAM_STATS_BURST_BUCKETS 8
+
+#define CHIAKI_STREAM_STATS_SLOT_US 100000
+#define CHIAKI_STREAM_STATS_SLOTS 100 // 10 s
+
+#define CHIAKI_STREAM_STATS_WINDOW_SHORT_US 1000000
+#define CHIAKI_STREAM_STATS_WINDOW_LONG_US 10000000
+
+/**
+ * Everything that was recorded during CHIAKI_STREAM_STATS_SLOT_US.
+ */
+typedef struct chiaki_stream_stats_slot_t
+{
+	uint64_t index; // absolute time / CHIAKI_STREAM_STATS_SLOT_US this slot was recorded in
+	uint64_t frames;
+	uint64_t bytes;
+	uint64_t units_received;
+	uint64_t units_lost;
+	uint64_t frames_fec; // frames that needed fec
+	uint64_t frames_fec_failed; // frames that could not be completed, even with fec
+	uint64_t bursts[CHIAKI_STREAM_STATS_BURST_BUCKETS];
+} ChiakiStreamStatsSlot;
+
+/**
+ * Video statistics of a stream, written by a single thread (the one receiving the stream)
+ * without locking and read through chiaki_stream_stats_snapshot() from any thread.
+ *
+ * Readers never block the writer: all fields are only accessed atomically and snapshots
+ * are retried if the writer modified the stats while they were being copied (seqlock).
+ */
+typedef struct chiaki_stream_stats_t
+{
+	uint64_t seq; // odd while the writer is modifying the stats
+	uint64_t start_us; // time of the first recorded event, 0 if none
+	uint64_t frames_total;
+	uint64_t bytes_total;
+	uint64_t jitter_us; // interarrival jitter of frames, RFC 3550 style
+	ChiakiStreamStatsSlot slots[CHIAKI_STREAM_STATS_SLOTS];
+
+	// only accessed by the writer
+	uint64_t frame_interval_us;
+	bool frame_prev_valid;
+	ChiakiSeqNum16 frame_index_prev;
+	uint64_t arrival_prev_us;
+	uint64_t jitter_acc_us; // jitter_us * 16
+} ChiakiStreamStats;
+
+typedef struct chiaki_stream_stats_window_t
+{
+	uint64_t duration_us; // may be less than the window size at the beginning of a stream
+	double fps;
+	uint64_t bitrate; // bits per second of video frames passed on to the decoder
+	uint64_t units_received;
+	uint64_t units_lost;
+	double loss_ratio;
+	uint64_t frames_fec;
+	uint64_t frames_fec_failed;
+	double fec_recovery_ratio; // of frames that needed fec, 1 if none did
+	uint64_t bursts[CHIAKI_STREAM_STATS_BURST_BUCKETS];
+} ChiakiStreamStatsWindow;
+
+typedef struct chiaki_stream_stats_snapshot_t
+{
+	ChiakiStreamStatsWindow window_short; // last CHIAKI_STREAM_STATS_WINDOW_SHORT_US
+	ChiakiStreamStatsWindow window_long; // last CHIAKI_STREAM_STATS_WINDOW_LONG_US
+	uint64_t frames_total;
+	uint64_t bytes_total;
+	uint64_t jitter_us;
+} ChiakiStreamStatsSnapshot;
+
+CHIAKI_EXPORT void chiaki_stream_stats_init(ChiakiStreamStats *stats);
+
+/**
+ * Clear all stats for a new stream. Must only be called by the writer.
+ * @param fps frame rate the console is sending at, for jitter
+ */
+CHIAKI_EXPORT void chiaki_stream_stats_reset(ChiakiStreamStats *stats, unsigned int fps);
+
+/**
+ * @return index into ChiakiStreamStatsSlot.bursts for a burst of length consecutive lost units
+ */
+CHIAKI_EXPORT unsigned int chiaki_stream_stats_burst_bucket(unsigned int length);
+
+/**
+ * Record the units of a frame once no more of them are expected.
+ * @param bursts number of loss bursts per bucket, see chiaki_stream_stats_burst_bucket()
+ */
+CHIAKI_EXPORT void chiaki_stream_stats_push_units(ChiakiStreamStats *stats, uint64_t now_us,
+		uint64_t received, uint64_t lost, const uint64_t bursts[CHIAKI_STREAM_STATS_BURST_BUCKETS]);
+
+/**
+ * Record a flushed frame.
+ * @param arrival_us arrival of the first unit of the frame or 0 if unknown
+ * @param size size of the frame passed on to the decoder or 0 if none
+ * @param fec whether fec was necessary to complete the frame
+ * @param failed whether the frame could not be completed, implies fec
+ */
+CHIAKI_EXPORT void chiaki_stream_stats_push_frame(ChiakiStreamStats *stats, uint64_t now_us,
+		ChiakiSeqNum16 frame_index, uint64_t arrival_us, uint64_t size, bool fec, bool failed);
+
+/**
+ * Get the stats of the windows ending at now_us. May be called from any thread.
+ */
+CHIAKI_EXPORT void chiaki_stream_stats_snapshot(ChiakiStreamStats *stats, uint64_t now_us, ChiakiStreamStatsSnapshot *snapshot);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_STREAMSTATS_H
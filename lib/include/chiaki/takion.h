@@ -12,6 +12,9 @@
 #include "reorderqueue.h"
 #include "feedback.h"
 #include "takionsendbuffer.h"
+#include "packetbuf.h"
+#include "spscring.h"
+#include "takioncapture.h"
 
 #include <stdbool.h>
 
@@ -48,8 +51,23 @@ typedef struct chiaki_takion_av_packet_t
 
 	uint8_t byte_before_audio_data;
 
-	uint8_t *data; // not owned
+	uint8_t *data; // not owned, already decrypted if the Takion has a remote gkcrypt
 	size_t data_size;
+
+	/**
+	 * Datagram that data points into, only valid during the av callback.
+	 * Take a reference with chiaki_packet_buf_ref() to keep data around without copying it.
+	 * NULL if the packet did not come from a Takion receive buffer or shares it with other datagrams coalesced by UDP_GRO,
+	 * then data has to be copied to be kept.
+	 */
+	ChiakiPacketBuf *buf;
+
+	/**
+	 * Arrival time of the datagram in chiaki_time_now_monotonic_us() time.
+	 * Taken by the kernel where SO_TIMESTAMPNS is available, otherwise when it was received.
+	 * When replaying, the time it was captured at, see chiaki_takion_replay_next(). 0 if unknown.
+	 */
+	uint64_t recv_time_us;
 } ChiakiTakionAVPacket;
 
 static inline uint8_t chiaki_takion_av_packet_audio_unit_size(ChiakiTakionAVPacket *packet)				{ return packet->units_in_frame_fec >> 8; }
@@ -97,6 +115,28 @@ typedef struct chiaki_takion_event_t
 
 typedef void (*ChiakiTakionCallback)(ChiakiTakionEvent *event, void *user);
 
+/**
+ * Size of a single receive buffer, i.e. the maximum size of a received datagram.
+ */
+#define CHIAKI_TAKION_PACKET_BUF_SIZE 1500
+
+/**
+ * Default for ChiakiTakionConnectInfo.recv_batch_size
+ */
+#define CHIAKI_TAKION_RECV_BATCH_SIZE_DEFAULT 32
+
+typedef struct chiaki_takion_recv_stats_t
+{
+	uint64_t wakeups; // times the socket became readable and at least one datagram was received
+	uint64_t packets; // total datagrams received
+	uint64_t batch_size_max; // most datagrams received in a single wakeup
+	uint64_t batches_full; // wakeups that used all available batch slots, i.e. more datagrams may have been waiting
+	uint64_t pool_exhausted; // receive buffers that had to be allocated because all preallocated ones were in use
+	uint64_t ring_high_water; // most datagrams waiting for the processing thread at once, only with recv_ring_size > 0
+	uint64_t ring_dropped; // av datagrams dropped because the processing thread fell behind, only with recv_ring_size > 0
+	uint64_t gro_coalesced; // received buffers that contained more than one datagram, only with UDP_GRO
+} ChiakiTakionRecvStats;
+
 typedef struct chiaki_takion_connect_info_t
 {
 	ChiakiLog *log;
@@ -107,6 +147,52 @@ typedef struct chiaki_takion_connect_info_t
 	void *cb_user;
 	bool enable_crypt;
 	uint8_t protocol_version;
+
+	/**
+	 * Maximum number of datagrams to receive per wakeup of the Takion thread.
+	 * Batching is only available on platforms supporting recvmmsg(), on all others 1 is used.
+	 * 0 selects CHIAKI_TAKION_RECV_BATCH_SIZE_DEFAULT.
+	 */
+	size_t recv_batch_size;
+
+	/**
+	 * If > 0, the socket is read on a separate thread that hands datagrams to the Takion thread
+	 * through a ring of this many entries (rounded up to a power of 2), so slow processing, e.g. in the av callback,
+	 * does not stall receiving.
+	 * If the ring is almost full, av datagrams are dropped while some space is kept for all other packets.
+	 * If 0, the Takion thread receives and processes everything itself.
+	 */
+	size_t recv_ring_size;
+
+	/**
+	 * Let the kernel coalesce bursts of equally sized datagrams with UDP_GRO (Linux only).
+	 * They are split up again without copying, only datagrams that are held for longer are copied out.
+	 * Falls back to regular receiving if the kernel does not support it.
+	 */
+	bool enable_udp_gro;
+
+	/**
+	 * Receive through io_uring with a multishot recv on a provided buffer ring (Linux only, CHIAKI_LIB_ENABLE_IO_URING).
+	 * Falls back to regular receiving if the kernel does not support it. Excludes enable_udp_gro.
+	 */
+	bool enable_io_uring;
+
+	/**
+	 * If set, every received datagram is written to this capture, see chiaki/takioncapture.h
+	 */
+	ChiakiTakionCapture *capture;
+
+	/**
+	 * If set, no socket is used at all: datagrams are read from this replay and everything sent is discarded.
+	 * sa is ignored and protocol_version must match the capture.
+	 */
+	ChiakiTakionReplay *replay;
+
+	/**
+	 * Round trip time to start estimating the retransmission timeout of data packets with, e.g. from senkusha.
+	 * 0 if unknown, then a conservative timeout is used until the first data ack arrives.
+	 */
+	uint64_t rtt_us;
 } ChiakiTakionConnectInfo;
 
 
@@ -162,14 +248,56 @@ typedef struct chiaki_takion_t
 	ChiakiTakionAVPacketParse av_packet_parse;
 
 	ChiakiKeyState key_state;
+
+	size_t recv_batch_size;
+
+	/**
+	 * Preallocated receive buffers of CHIAKI_TAKION_PACKET_BUF_SIZE bytes each
+	 * or larger ones for coalesced datagrams if recv_gro is set.
+	 */
+	ChiakiPacketBufPool *recv_pool;
+
+	/**
+	 * Only if recv_gro is set: buffers of CHIAKI_TAKION_PACKET_BUF_SIZE bytes that datagrams are copied to
+	 * if they are held longer than it takes to handle them, so coalesced buffers are never pinned.
+	 */
+	ChiakiPacketBufPool *recv_copy_pool;
+
+	bool enable_udp_gro;
+	bool recv_gro; // whether UDP_GRO is actually enabled on sock
+
+	bool recv_timestamps; // whether SO_TIMESTAMPNS is enabled on sock
+
+	bool enable_io_uring;
+	struct chiaki_takion_uring_t *recv_uring; // owned by the receiving thread while it is running
+
+	ChiakiTakionCapture *capture;
+	ChiakiTakionReplay *replay; // if set, sock is invalid
+
+	uint64_t rtt_initial_us;
+
+	size_t recv_ring_size;
+	ChiakiSpscRing recv_ring; // only initialized if recv_ring_size > 0
+	ChiakiThread recv_thread;
+
+	ChiakiTakionRecvStats recv_stats;
+	ChiakiMutex recv_stats_mutex;
 } ChiakiTakion;
 
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_connect(ChiakiTakion *takion, ChiakiTakionConnectInfo *info);
 CHIAKI_EXPORT void chiaki_takion_close(ChiakiTakion *takion);
 
+/**
+ * Get a snapshot of the receive counters.
+ *
+ * Thread-safe while Takion is running.
+ */
+CHIAKI_EXPORT void chiaki_takion_get_recv_stats(ChiakiTakion *takion, ChiakiTakionRecvStats *stats);
+
 /**
  * Must be called from within the Takion thread, i.e. inside the callback!
+ * With recv_ring_size > 0, this is still the thread calling the callback, not the one reading the socket.
  */
 static inline void chiaki_takion_set_crypt(ChiakiTakion *takion, ChiakiGKCrypt *gkcrypt_local, ChiakiGKCrypt *gkcrypt_remote)
 {
@@ -189,6 +317,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_crypt_advance_key_pos(ChiakiTakion *
 
 /**
  * Send a datagram directly on the socket.
+ * When replaying, nothing is sent.
  *
  * Thread-safe while Takion is running.
  */
@@ -234,6 +363,15 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_v9_av_packet_parse(ChiakiTakionAVPac
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_v12_av_packet_parse(ChiakiTakionAVPacket *packet, ChiakiKeyState *key_state, uint8_t *buf, size_t buf_size);
 
+/**
+ * Write the header of a v9 or v12 AV packet the way the console sends it, e.g. for emulating one.
+ * The gmac is left zeroed for chiaki_takion_packet_mac() and only the lower 32 bits of key_pos are written.
+ *
+ * @param header_size_out the data of the packet is to be placed at buf + *header_size_out
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_v9_av_packet_format_header(uint8_t *buf, size_t buf_size, size_t *header_size_out, ChiakiTakionAVPacket *packet);
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_v12_av_packet_format_header(uint8_t *buf, size_t buf_size, size_t *header_size_out, ChiakiTakionAVPacket *packet);
+
 #define CHIAKI_TAKION_V7_AV_HEADER_SIZE_BASE					0x12
 #define CHIAKI_TAKION_V7_AV_HEADER_SIZE_VIDEO_ADD				0x3
 #define CHIAKI_TAKION_V7_AV_HEADER_SIZE_NALU_INFO_STRUCTS_ADD	0x3
@@ -0,0 +1,113 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_TAKIONCAPTURE_H
+#define CHIAKI_TAKIONCAPTURE_H
+
+#include "common.h"
+#include "thread.h"
+#include "stoppipe.h"
+#include "ecdh.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Capture files contain everything Takion received in a session, so the whole receive path
+ * can be run again offline without a console.
+ *
+ * Layout (all integers little endian):
+ *   header: "CHKTCAP" followed by a version byte
+ *   records: u8 type, u32 payload size, u64 time in chiaki_time_now_monotonic_us() of the capturing host, payload
+ *
+ * Record payloads:
+ *   TAKION: u8 protocol version, u32 local tag (written on connect, received messages are checked against it)
+ *   KEYS: u32 target, handshake key, ECDH secret (written once the secret has been derived)
+ *   DATAGRAM: a received datagram exactly as it came from the socket, handshake included
+ */
+
+#define CHIAKI_TAKION_CAPTURE_VERSION 1
+#define CHIAKI_TAKION_CAPTURE_HANDSHAKE_KEY_SIZE 0x10 // same as CHIAKI_HANDSHAKE_KEY_SIZE
+
+typedef enum {
+	CHIAKI_TAKION_CAPTURE_RECORD_TAKION = 1,
+	CHIAKI_TAKION_CAPTURE_RECORD_KEYS = 2,
+	CHIAKI_TAKION_CAPTURE_RECORD_DATAGRAM = 3
+} ChiakiTakionCaptureRecordType;
+
+typedef struct chiaki_takion_capture_t
+{
+	FILE *file;
+	ChiakiMutex mutex; // records may come from the receive thread and the Takion thread
+	bool failed; // a write failed, nothing is written anymore
+	uint64_t datagrams;
+	uint64_t bytes;
+} ChiakiTakionCapture;
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_capture_init(ChiakiTakionCapture *capture, const char *filename);
+CHIAKI_EXPORT void chiaki_takion_capture_fini(ChiakiTakionCapture *capture);
+CHIAKI_EXPORT void chiaki_takion_capture_write_takion(ChiakiTakionCapture *capture, uint8_t protocol_version, uint32_t tag_local);
+CHIAKI_EXPORT void chiaki_takion_capture_write_keys(ChiakiTakionCapture *capture, ChiakiTarget target,
+		const uint8_t *handshake_key, const uint8_t *ecdh_secret);
+CHIAKI_EXPORT void chiaki_takion_capture_write_datagram(ChiakiTakionCapture *capture, uint64_t time_us, const uint8_t *buf, size_t buf_size);
+
+/**
+ * Source of datagrams reading a capture file, used by Takion instead of a socket if set in ChiakiTakionConnectInfo.
+ */
+typedef struct chiaki_takion_replay_t
+{
+	FILE *file;
+	bool realtime; // if false, datagrams are handed out as fast as they are requested
+
+	// from the capture, available after chiaki_takion_replay_init()
+	uint8_t protocol_version;
+	uint32_t tag_local;
+	ChiakiTarget target;
+	uint8_t handshake_key[CHIAKI_TAKION_CAPTURE_HANDSHAKE_KEY_SIZE];
+	uint8_t ecdh_secret[CHIAKI_ECDH_SECRET_SIZE];
+
+	long data_offset; // position of the first record after the TAKION record
+	bool pending; // the header of the next datagram has been read already
+	uint32_t pending_size;
+	uint64_t pending_time_us;
+	bool eof;
+
+	uint64_t first_time_us; // capture time of the first datagram
+	uint64_t start_us; // when the first datagram was replayed
+
+	// statistics
+	uint64_t datagrams;
+	uint64_t bytes;
+	uint64_t late_us_max; // realtime only, how far behind schedule a datagram was handed out at most
+} ChiakiTakionReplay;
+
+/**
+ * Open a capture and read its TAKION and KEYS records.
+ * @return CHIAKI_ERR_INVALID_DATA if the file is not a capture or is missing one of these records
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_replay_init(ChiakiTakionReplay *replay, const char *filename, bool realtime);
+CHIAKI_EXPORT void chiaki_takion_replay_fini(ChiakiTakionReplay *replay);
+
+/**
+ * Get the next datagram.
+ *
+ * @param stop_pipe in realtime mode, waiting for the datagram to become due is canceled by this
+ * @param buf_size size of buf, replaced by the size of the datagram, which is truncated to buf's size
+ * @param time_us optional, receives the time the datagram was captured at, moved to chiaki_time_now_monotonic_us() time
+ * so that the first datagram is at start_us. In realtime mode, this is when it was due.
+ * @param wait if false and the datagram is not due yet in realtime mode, CHIAKI_ERR_TIMEOUT is returned
+ * @return CHIAKI_ERR_DISCONNECTED at the end of the capture
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_replay_next(ChiakiTakionReplay *replay, ChiakiStopPipe *stop_pipe,
+		uint8_t *buf, size_t *buf_size, uint64_t *time_us, bool wait);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_TAKIONCAPTURE_H
@@ -23,12 +23,20 @@ typedef struct chiaki_takion_send_buffer_t
 	ChiakiLog *log;
 	ChiakiTakion *takion;
 
-	ChiakiTakionSendBufferPacket *packets;
-	size_t packets_size; // allocated size
+	ChiakiTakionSendBufferPacket *packets; // ring indexed by seq_num & (packets_size - 1)
+	size_t packets_size; // allocated size, power of 2
 	size_t packets_count; // current count
+	ChiakiSeqNum32 begin; // lowest seq num that may still be in packets, valid if packets_count > 0
+	ChiakiSeqNum32 end; // one past the highest seq num pushed, valid if packets_count > 0
+
+	// retransmission timeout estimation as in RFC 6298, all in microseconds
+	uint64_t srtt_us; // 0 if there is no estimate yet
+	uint64_t rttvar_us;
+	uint64_t rto_us;
 
 	ChiakiMutex mutex;
 	ChiakiCond cond;
+	bool pushed;
 	bool should_stop;
 	ChiakiThread thread;
 } ChiakiTakionSendBuffer;
@@ -38,18 +46,25 @@ typedef struct chiaki_takion_send_buffer_t
  * Init a Send Buffer and start a thread that automatically re-sends packets on takion.
  *
  * @param takion if NULL, the Send Buffer thread will effectively do nothing (for unit testing)
- * @param size number of packet slots
+ * @param size number of packet slots, must be a power of 2.
+ * Only packets whose seq nums are less than size apart can be in the buffer at the same time.
+ * @param rtt_initial_us round trip time to start the retransmission timeout estimation with, e.g. from senkusha, or 0 if unknown
  */
-CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_init(ChiakiTakionSendBuffer *send_buffer, ChiakiTakion *takion, size_t size);
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_init(ChiakiTakionSendBuffer *send_buffer, ChiakiTakion *takion, size_t size, uint64_t rtt_initial_us);
 CHIAKI_EXPORT void chiaki_takion_send_buffer_fini(ChiakiTakionSendBuffer *send_buffer);
 
 /**
+ * Push a packet and send it on takion for the first time.
+ * Sending happens while the buffer is locked, so its ack can't be handled before the packet is in the buffer.
+ *
  * @param buf ownership of this is taken by the ChiakiTakionSendBuffer, which will free it automatically later!
- * On error, buf is freed immediately.
+ * On error, buf is freed immediately, unless only sending failed, then it stays in the buffer to be re-sent.
  */
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_push(ChiakiTakionSendBuffer *send_buffer, ChiakiSeqNum32 seq_num, uint8_t *buf, size_t buf_size);
 
 /**
+ * Remove all packets up to and including seq_num and update the retransmission timeout.
+ *
  * @param acked_seq_nums optional array of size of at least send_buffer->packets_size where acked seq nums will be stored
  */
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_ack(ChiakiTakionSendBuffer *send_buffer, ChiakiSeqNum32 seq_num, ChiakiSeqNum32 *acked_seq_nums, size_t *acked_seq_nums_count);
@@ -36,6 +36,11 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_thread_create(ChiakiThread *thread, ChiakiT
 CHIAKI_EXPORT ChiakiErrorCode chiaki_thread_join(ChiakiThread *thread, void **retval);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_thread_set_name(ChiakiThread *thread, const char *name);
 
+/**
+ * Give up the rest of the time slice of the calling thread, for waiting on another thread without a condition.
+ */
+CHIAKI_EXPORT void chiaki_thread_yield(void);
+
 
 typedef struct chiaki_mutex_t
 {
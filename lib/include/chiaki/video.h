@@ -3,6 +3,8 @@
 #ifndef CHIAKI_VIDEO_H
 #define CHIAKI_VIDEO_H
 
+#include "packetbuf.h"
+
 #include <stdint.h>
 #include <stddef.h>
 
@@ -18,6 +20,33 @@ typedef struct chiaki_video_profile_t
 	uint8_t *header;
 } ChiakiVideoProfile;
 
+/**
+ * Part of a video sample that is handed out without being copied into one contiguous buffer.
+ */
+typedef struct chiaki_video_sample_segment_t
+{
+	uint8_t *data;
+	size_t size;
+
+	/**
+	 * Packet buffer that data points into or NULL if data is owned by the frame processor.
+	 * Take a reference with chiaki_packet_buf_ref() to keep the segment around after the callback returned.
+	 */
+	ChiakiPacketBuf *buf;
+} ChiakiVideoSampleSegment;
+
+/**
+ * Arrival timing of a single video frame, to tell network jitter apart from our own processing delay.
+ * All times are based on the arrival times of the frame's units, see ChiakiTakionAVPacket.recv_time_us.
+ */
+typedef struct chiaki_video_frame_timing_t
+{
+	uint16_t frame_index;
+	unsigned int units_received; // source and fec units
+	uint64_t arrival_spread_us; // between the arrival of the first and the last unit
+	uint64_t processing_delay_us; // between the arrival of the last unit and passing the frame to the video sample callback
+} ChiakiVideoFrameTiming;
+
 /**
  * Padding for FFMPEG
  */
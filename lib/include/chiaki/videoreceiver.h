@@ -15,6 +15,36 @@ extern "C" {
 
 #define CHIAKI_VIDEO_PROFILES_MAX 8
 
+/**
+ * Maximum number of frames that can be received at the same time, see ChiakiVideoReceiver.reorder_frames.
+ */
+#define CHIAKI_VIDEO_RECEIVER_FRAME_SLOTS_MAX 8
+#define CHIAKI_VIDEO_RECEIVER_REORDER_FRAMES_DEFAULT 2
+#define CHIAKI_VIDEO_RECEIVER_REORDER_WINDOW_US_DEFAULT 3000
+
+typedef struct chiaki_video_frame_timing_stats_t
+{
+	uint64_t frames; // frames with known arrival times
+	uint64_t arrival_spread_sum_us;
+	uint64_t arrival_spread_max_us;
+	uint64_t processing_delay_sum_us;
+	uint64_t processing_delay_max_us;
+} ChiakiVideoFrameTimingStats;
+
+typedef struct chiaki_video_frame_slot_t
+{
+	int32_t frame_index; // frame held by frame_processor, -1 if none
+	ChiakiFrameProcessor frame_processor; // flushed once the frame has been passed on or given up
+	bool slices_failed; // whether the video slice callback failed for any slice of the frame
+} ChiakiVideoFrameSlot;
+
+/**
+ * Frames are received in up to reorder_frames slots at the same time, so units that arrive
+ * after the first units of the following frames can still complete their frame without fec.
+ * Frames are always flushed in order: a frame is given up on and flushed with whatever it has
+ * once a frame reorder_frames newer arrives, or once a newer frame has been waiting for reorder_window_us.
+ * With a video slice callback, the start of the next frame to be flushed is passed on while it is still being received.
+ */
 typedef struct chiaki_video_receiver_t
 {
 	struct chiaki_session_t *session;
@@ -23,14 +53,17 @@ typedef struct chiaki_video_receiver_t
 	size_t profiles_count;
 	int profile_cur; // < 1 if no profile selected yet, else index in profiles
 
-	int32_t frame_index_cur; // frame that is currently being filled
-	int32_t frame_index_prev; // last frame that has been at least partially decoded
+	ChiakiVideoFrameSlot frame_slots[CHIAKI_VIDEO_RECEIVER_FRAME_SLOTS_MAX]; // only the first reorder_frames are used
+	unsigned int reorder_frames; // 1 disables reordering
+	uint64_t reorder_window_us;
+	int32_t frame_index_next; // next frame to be flushed, -1 before the first packet
 	int32_t frame_index_prev_complete; // last frame that has been completely decoded
-	ChiakiFrameProcessor frame_processor;
 	ChiakiPacketStats *packet_stats;
+	ChiakiStreamStats *stream_stats;
+	ChiakiVideoFrameTimingStats frame_timing_stats;
 } ChiakiVideoReceiver;
 
-CHIAKI_EXPORT void chiaki_video_receiver_init(ChiakiVideoReceiver *video_receiver, struct chiaki_session_t *session, ChiakiPacketStats *packet_stats);
+CHIAKI_EXPORT void chiaki_video_receiver_init(ChiakiVideoReceiver *video_receiver, struct chiaki_session_t *session, ChiakiPacketStats *packet_stats, ChiakiStreamStats *stream_stats);
 CHIAKI_EXPORT void chiaki_video_receiver_fini(ChiakiVideoReceiver *video_receiver);
 
 /**
@@ -44,12 +77,12 @@ CHIAKI_EXPORT void chiaki_video_receiver_stream_info(ChiakiVideoReceiver *video_
 
 CHIAKI_EXPORT void chiaki_video_receiver_av_packet(ChiakiVideoReceiver *video_receiver, ChiakiTakionAVPacket *packet);
 
-static inline ChiakiVideoReceiver *chiaki_video_receiver_new(struct chiaki_session_t *session, ChiakiPacketStats *packet_stats)
+static inline ChiakiVideoReceiver *chiaki_video_receiver_new(struct chiaki_session_t *session, ChiakiPacketStats *packet_stats, ChiakiStreamStats *stream_stats)
 {
 	ChiakiVideoReceiver *video_receiver = CHIAKI_NEW(ChiakiVideoReceiver);
 	if(!video_receiver)
 		return NULL;
-	chiaki_video_receiver_init(video_receiver, session, packet_stats);
+	chiaki_video_receiver_init(video_receiver, session, packet_stats, stream_stats);
 	return video_receiver;
 }
 
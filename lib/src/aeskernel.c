@@ -0,0 +1,748 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include "aeskernel.h"
+
+#include <string.h>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define AES_KERNEL_X86
+#include <immintrin.h>
+#endif
+
+// only if the compiler already targets the crypto extensions, as arm_neon.h doesn't offer them otherwise everywhere
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__aarch64__) && !defined(__ARM_BIG_ENDIAN) \
+	&& (defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_AES))
+#define AES_KERNEL_ARMV8
+#include <arm_neon.h>
+#ifdef __linux__
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
+#define CTR_BLOCKS 8 // blocks encrypted interleaved in ctr mode
+
+static const uint8_t sbox[0x100] = {
+	0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+	0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+	0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+	0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+	0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+	0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+	0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+	0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+	0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+	0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+	0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+	0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+	0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+	0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+	0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+	0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16
+};
+
+/**
+ * AES-128 key expansion, the round keys are in the byte order both AES-NI and the ARMv8 instructions take.
+ */
+static void aes_expand_key(uint8_t (*round_keys)[CHIAKI_GKCRYPT_BLOCK_SIZE], const uint8_t *key)
+{
+	static const uint8_t rcon[CHIAKI_AES_KERNEL_ROUNDS] = { 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 0x36 };
+	uint8_t *w = round_keys[0];
+	memcpy(w, key, CHIAKI_GKCRYPT_BLOCK_SIZE);
+	for(size_t i=4; i<4 * (CHIAKI_AES_KERNEL_ROUNDS + 1); i++)
+	{
+		uint8_t t[4];
+		memcpy(t, w + 4 * (i - 1), sizeof(t));
+		if(i % 4 == 0)
+		{
+			uint8_t t0 = t[0];
+			t[0] = sbox[t[1]] ^ rcon[i / 4 - 1];
+			t[1] = sbox[t[2]];
+			t[2] = sbox[t[3]];
+			t[3] = sbox[t0];
+		}
+		for(size_t j=0; j<4; j++)
+			w[4 * i + j] = w[4 * (i - 4) + j] ^ t[j];
+	}
+}
+
+/**
+ * Last block of a GHASH with the sizes in bits of the additional data and the ciphertext, both big endian.
+ */
+static void ghash_len_block(uint8_t *block, uint64_t a_bits, uint64_t c_bits)
+{
+	for(size_t i=0; i<8; i++)
+	{
+		block[i] = (uint8_t)(a_bits >> (56 - 8 * i));
+		block[8 + i] = (uint8_t)(c_bits >> (56 - 8 * i));
+	}
+}
+
+#ifdef AES_KERNEL_X86
+
+#define X86_TARGET __attribute__((target("aes,pclmul,ssse3")))
+
+/*
+ * GHASH works on the byte reflected blocks, so the products can be reduced like in Intel's white paper
+ * on carry-less multiplication for gcm: shift left by one bit, then reduce modulo x^128 + x^7 + x^2 + x + 1.
+ */
+
+X86_TARGET static inline __m128i x86_bswap(__m128i b)
+{
+	return _mm_shuffle_epi8(b, _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+}
+
+X86_TARGET static inline void x86_load_round_keys(__m128i *rk, const ChiakiAesKernelKey *key)
+{
+	for(size_t r=0; r<=CHIAKI_AES_KERNEL_ROUNDS; r++)
+		rk[r] = _mm_loadu_si128((const __m128i *)key->round_keys[r]);
+}
+
+X86_TARGET static inline __m128i x86_aes_encrypt(const __m128i *rk, __m128i b)
+{
+	b = _mm_xor_si128(b, rk[0]);
+	for(size_t r=1; r<CHIAKI_AES_KERNEL_ROUNDS; r++)
+		b = _mm_aesenc_si128(b, rk[r]);
+	return _mm_aesenclast_si128(b, rk[CHIAKI_AES_KERNEL_ROUNDS]);
+}
+
+/**
+ * Accumulate the unreduced product of a and b, mid collects both middle products.
+ */
+X86_TARGET static inline void x86_ghash_mul(__m128i a, __m128i b, __m128i *lo, __m128i *mid, __m128i *hi)
+{
+	*lo = _mm_xor_si128(*lo, _mm_clmulepi64_si128(a, b, 0x00));
+	*hi = _mm_xor_si128(*hi, _mm_clmulepi64_si128(a, b, 0x11));
+	*mid = _mm_xor_si128(*mid, _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x10), _mm_clmulepi64_si128(a, b, 0x01)));
+}
+
+X86_TARGET static inline __m128i x86_ghash_reduce(__m128i lo, __m128i mid, __m128i hi)
+{
+	lo = _mm_xor_si128(lo, _mm_slli_si128(mid, 8));
+	hi = _mm_xor_si128(hi, _mm_srli_si128(mid, 8));
+
+	// shift the 256 bit product left by one
+	__m128i lo_carry = _mm_srli_epi32(lo, 31);
+	__m128i hi_carry = _mm_srli_epi32(hi, 31);
+	__m128i cross = _mm_srli_si128(lo_carry, 12);
+	lo = _mm_or_si128(_mm_slli_epi32(lo, 1), _mm_slli_si128(lo_carry, 4));
+	hi = _mm_or_si128(_mm_or_si128(_mm_slli_epi32(hi, 1), _mm_slli_si128(hi_carry, 4)), cross);
+
+	// first phase of the reduction
+	__m128i a = _mm_xor_si128(_mm_xor_si128(_mm_slli_epi32(lo, 31), _mm_slli_epi32(lo, 30)), _mm_slli_epi32(lo, 25));
+	__m128i a_hi = _mm_srli_si128(a, 4);
+	lo = _mm_xor_si128(lo, _mm_slli_si128(a, 12));
+
+	// second phase
+	__m128i b = _mm_xor_si128(_mm_xor_si128(_mm_srli_epi32(lo, 1), _mm_srli_epi32(lo, 2)), _mm_srli_epi32(lo, 7));
+	lo = _mm_xor_si128(lo, _mm_xor_si128(b, a_hi));
+	return _mm_xor_si128(hi, lo);
+}
+
+/**
+ * x = (x ^ blocks[0]) * H^count ^ blocks[1] * H^(count - 1) ^ ... ^ blocks[count - 1] * H, with a single reduction.
+ */
+X86_TARGET static inline __m128i x86_ghash_blocks(__m128i x, const __m128i *blocks, size_t count, const __m128i *h)
+{
+	__m128i lo = _mm_setzero_si128();
+	__m128i mid = lo;
+	__m128i hi = lo;
+	x86_ghash_mul(_mm_xor_si128(x, blocks[0]), h[count - 1], &lo, &mid, &hi);
+	for(size_t i=1; i<count; i++)
+		x86_ghash_mul(blocks[i], h[count - 1 - i], &lo, &mid, &hi);
+	return x86_ghash_reduce(lo, mid, hi);
+}
+
+/**
+ * Hash the last size < 4 blocks of data, zero padded, followed by len_block.
+ */
+X86_TARGET static __m128i x86_ghash_tail(__m128i x, const uint8_t *buf, size_t size, const uint8_t *len_block, const __m128i *h)
+{
+	__m128i blocks[CHIAKI_AES_KERNEL_GHASH_POWERS + 1];
+	size_t count = 0;
+	for(; size >= CHIAKI_GKCRYPT_BLOCK_SIZE && count < CHIAKI_AES_KERNEL_GHASH_POWERS - 1; size -= CHIAKI_GKCRYPT_BLOCK_SIZE, buf += CHIAKI_GKCRYPT_BLOCK_SIZE)
+		blocks[count++] = x86_bswap(_mm_loadu_si128((const __m128i *)buf));
+	if(size)
+	{
+		uint8_t pad[CHIAKI_GKCRYPT_BLOCK_SIZE] = { 0 };
+		memcpy(pad, buf, size);
+		blocks[count++] = x86_bswap(_mm_loadu_si128((const __m128i *)pad));
+	}
+	blocks[count++] = x86_bswap(_mm_loadu_si128((const __m128i *)len_block));
+	if(count > CHIAKI_AES_KERNEL_GHASH_POWERS)
+	{
+		x = x86_ghash_blocks(x, blocks, CHIAKI_AES_KERNEL_GHASH_POWERS, h);
+		return x86_ghash_blocks(x, blocks + CHIAKI_AES_KERNEL_GHASH_POWERS, count - CHIAKI_AES_KERNEL_GHASH_POWERS, h);
+	}
+	return x86_ghash_blocks(x, blocks, count, h);
+}
+
+X86_TARGET static void x86_key_init(ChiakiAesKernelKey *key)
+{
+	__m128i rk[CHIAKI_AES_KERNEL_ROUNDS + 1];
+	x86_load_round_keys(rk, key);
+	__m128i h = x86_bswap(x86_aes_encrypt(rk, _mm_setzero_si128()));
+	__m128i p = h;
+	_mm_storeu_si128((__m128i *)key->ghash_key[0], p);
+	for(size_t i=1; i<CHIAKI_AES_KERNEL_GHASH_POWERS; i++)
+	{
+		p = x86_ghash_blocks(_mm_setzero_si128(), &p, 1, &h);
+		_mm_storeu_si128((__m128i *)key->ghash_key[i], p);
+	}
+}
+
+/**
+ * One round for all CTR_BLOCKS blocks, written out so the blocks stay in registers.
+ */
+X86_TARGET static inline void x86_aesenc_ctr_blocks(__m128i *b, __m128i rk)
+{
+	b[0] = _mm_aesenc_si128(b[0], rk);
+	b[1] = _mm_aesenc_si128(b[1], rk);
+	b[2] = _mm_aesenc_si128(b[2], rk);
+	b[3] = _mm_aesenc_si128(b[3], rk);
+	b[4] = _mm_aesenc_si128(b[4], rk);
+	b[5] = _mm_aesenc_si128(b[5], rk);
+	b[6] = _mm_aesenc_si128(b[6], rk);
+	b[7] = _mm_aesenc_si128(b[7], rk);
+}
+
+X86_TARGET static inline __m128i x86_ctr_block(const __m128i *rk0, uint64_t iv_lo, uint64_t iv_hi, uint64_t n)
+{
+	uint64_t lo = iv_lo + n;
+	uint64_t hi = iv_hi + (lo < n ? 1 : 0);
+	return _mm_xor_si128(_mm_set_epi64x((long long)hi, (long long)lo), *rk0);
+}
+
+X86_TARGET static void x86_ctr(const ChiakiAesKernelKey *key, uint64_t iv_lo, uint64_t iv_hi, uint64_t block_index, uint8_t *out, const uint8_t *in, size_t blocks)
+{
+	__m128i rk[CHIAKI_AES_KERNEL_ROUNDS + 1];
+	x86_load_round_keys(rk, key);
+	size_t i = 0;
+	for(; i + CTR_BLOCKS <= blocks; i += CTR_BLOCKS)
+	{
+		__m128i b[CTR_BLOCKS];
+		for(size_t j=0; j<CTR_BLOCKS; j++)
+			b[j] = x86_ctr_block(&rk[0], iv_lo, iv_hi, block_index + i + j);
+		for(size_t r=1; r<CHIAKI_AES_KERNEL_ROUNDS; r++)
+			x86_aesenc_ctr_blocks(b, rk[r]);
+		for(size_t j=0; j<CTR_BLOCKS; j++)
+		{
+			b[j] = _mm_aesenclast_si128(b[j], rk[CHIAKI_AES_KERNEL_ROUNDS]);
+			if(in)
+				b[j] = _mm_xor_si128(b[j], _mm_loadu_si128((const __m128i *)(in + (i + j) * CHIAKI_GKCRYPT_BLOCK_SIZE)));
+			_mm_storeu_si128((__m128i *)(out + (i + j) * CHIAKI_GKCRYPT_BLOCK_SIZE), b[j]);
+		}
+	}
+	for(; i < blocks; i++)
+	{
+		__m128i b = x86_ctr_block(&rk[0], iv_lo, iv_hi, block_index + i);
+		for(size_t r=1; r<CHIAKI_AES_KERNEL_ROUNDS; r++)
+			b = _mm_aesenc_si128(b, rk[r]);
+		b = _mm_aesenclast_si128(b, rk[CHIAKI_AES_KERNEL_ROUNDS]);
+		if(in)
+			b = _mm_xor_si128(b, _mm_loadu_si128((const __m128i *)(in + i * CHIAKI_GKCRYPT_BLOCK_SIZE)));
+		_mm_storeu_si128((__m128i *)(out + i * CHIAKI_GKCRYPT_BLOCK_SIZE), b);
+	}
+}
+
+X86_TARGET static void x86_gmac(size_t count, const ChiakiAesKernelKey *const *keys, const uint8_t (*ivs)[CHIAKI_GKCRYPT_BLOCK_SIZE],
+		const uint8_t *const *bufs, const size_t *buf_sizes, uint8_t *const *gmacs_out)
+{
+	__m128i h[CHIAKI_AES_KERNEL_GMAC_LANES][CHIAKI_AES_KERNEL_GHASH_POWERS];
+	__m128i x[CHIAKI_AES_KERNEL_GMAC_LANES];
+	__m128i j0[CHIAKI_AES_KERNEL_GMAC_LANES];
+	const uint8_t *cur[CHIAKI_AES_KERNEL_GMAC_LANES];
+	size_t left[CHIAKI_AES_KERNEL_GMAC_LANES];
+
+	uint8_t len_block[CHIAKI_GKCRYPT_BLOCK_SIZE];
+	ghash_len_block(len_block, 0, CHIAKI_GKCRYPT_BLOCK_SIZE * 8);
+	__m128i iv_len = x86_bswap(_mm_loadu_si128((const __m128i *)len_block));
+
+	// J0 = GHASH(iv || length of the iv)
+	for(size_t l=0; l<count; l++)
+	{
+		for(size_t p=0; p<CHIAKI_AES_KERNEL_GHASH_POWERS; p++)
+			h[l][p] = _mm_loadu_si128((const __m128i *)keys[l]->ghash_key[p]);
+		__m128i blocks[2] = { x86_bswap(_mm_loadu_si128((const __m128i *)ivs[l])), iv_len };
+		j0[l] = x86_bswap(x86_ghash_blocks(_mm_setzero_si128(), blocks, 2, h[l]));
+		x[l] = _mm_setzero_si128();
+		cur[l] = bufs[l];
+		left[l] = buf_sizes[l];
+	}
+
+	// E(J0), which masks the tag
+	for(size_t l=0; l<count; l++)
+		j0[l] = _mm_xor_si128(j0[l], _mm_loadu_si128((const __m128i *)keys[l]->round_keys[0]));
+	for(size_t r=1; r<CHIAKI_AES_KERNEL_ROUNDS; r++)
+	{
+		for(size_t l=0; l<count; l++)
+			j0[l] = _mm_aesenc_si128(j0[l], _mm_loadu_si128((const __m128i *)keys[l]->round_keys[r]));
+	}
+	for(size_t l=0; l<count; l++)
+		j0[l] = _mm_aesenclast_si128(j0[l], _mm_loadu_si128((const __m128i *)keys[l]->round_keys[CHIAKI_AES_KERNEL_ROUNDS]));
+
+	// one step of every lane at a time, the lanes don't depend on each other
+	bool more = true;
+	while(more)
+	{
+		more = false;
+		for(size_t l=0; l<count; l++)
+		{
+			if(left[l] < CHIAKI_AES_KERNEL_GHASH_POWERS * CHIAKI_GKCRYPT_BLOCK_SIZE)
+				continue;
+			__m128i blocks[CHIAKI_AES_KERNEL_GHASH_POWERS];
+			for(size_t i=0; i<CHIAKI_AES_KERNEL_GHASH_POWERS; i++)
+				blocks[i] = x86_bswap(_mm_loadu_si128((const __m128i *)(cur[l] + i * CHIAKI_GKCRYPT_BLOCK_SIZE)));
+			x[l] = x86_ghash_blocks(x[l], blocks, CHIAKI_AES_KERNEL_GHASH_POWERS, h[l]);
+			cur[l] += CHIAKI_AES_KERNEL_GHASH_POWERS * CHIAKI_GKCRYPT_BLOCK_SIZE;
+			left[l] -= CHIAKI_AES_KERNEL_GHASH_POWERS * CHIAKI_GKCRYPT_BLOCK_SIZE;
+			more = true;
+		}
+	}
+
+	for(size_t l=0; l<count; l++)
+	{
+		ghash_len_block(len_block, (uint64_t)buf_sizes[l] * 8, 0);
+		x[l] = x86_ghash_tail(x[l], cur[l], left[l], len_block, h[l]);
+		uint8_t tag[CHIAKI_GKCRYPT_BLOCK_SIZE];
+		_mm_storeu_si128((__m128i *)tag, _mm_xor_si128(x86_bswap(x[l]), j0[l]));
+		memcpy(gmacs_out[l], tag, CHIAKI_GKCRYPT_GMAC_SIZE);
+	}
+}
+
+/**
+ * Continue the GHASH in x_bytes, a block as it is in memory, with the given whole blocks of buf.
+ */
+X86_TARGET static void x86_ghash(const ChiakiAesKernelKey *key, uint8_t *x_bytes, const uint8_t *buf, size_t blocks)
+{
+	__m128i h[CHIAKI_AES_KERNEL_GHASH_POWERS];
+	for(size_t p=0; p<CHIAKI_AES_KERNEL_GHASH_POWERS; p++)
+		h[p] = _mm_loadu_si128((const __m128i *)key->ghash_key[p]);
+	__m128i x = x86_bswap(_mm_loadu_si128((const __m128i *)x_bytes));
+	while(blocks)
+	{
+		size_t count = blocks < CHIAKI_AES_KERNEL_GHASH_POWERS ? blocks : CHIAKI_AES_KERNEL_GHASH_POWERS;
+		__m128i b[CHIAKI_AES_KERNEL_GHASH_POWERS];
+		for(size_t i=0; i<count; i++)
+			b[i] = x86_bswap(_mm_loadu_si128((const __m128i *)(buf + i * CHIAKI_GKCRYPT_BLOCK_SIZE)));
+		x = x86_ghash_blocks(x, b, count, h);
+		buf += count * CHIAKI_GKCRYPT_BLOCK_SIZE;
+		blocks -= count;
+	}
+	_mm_storeu_si128((__m128i *)x_bytes, x86_bswap(x));
+}
+
+#endif
+
+#ifdef AES_KERNEL_ARMV8
+
+/*
+ * GHASH works on blocks with the bits of every byte reversed, so bit i of the field element is bit i
+ * of the 128 bit integer and the products can be reduced modulo x^128 + x^7 + x^2 + x + 1 directly.
+ */
+
+static inline uint64x2_t armv8_ghash_load(const uint8_t *p)
+{
+	return vreinterpretq_u64_u8(vrbitq_u8(vld1q_u8(p)));
+}
+
+static inline uint8x16_t armv8_ghash_bytes(uint64x2_t x)
+{
+	return vrbitq_u8(vreinterpretq_u8_u64(x));
+}
+
+static inline void armv8_load_round_keys(uint8x16_t *rk, const ChiakiAesKernelKey *key)
+{
+	for(size_t r=0; r<=CHIAKI_AES_KERNEL_ROUNDS; r++)
+		rk[r] = vld1q_u8(key->round_keys[r]);
+}
+
+static inline uint8x16_t armv8_aes_encrypt(const uint8x16_t *rk, uint8x16_t b)
+{
+	for(size_t r=0; r<CHIAKI_AES_KERNEL_ROUNDS - 1; r++)
+		b = vaesmcq_u8(vaeseq_u8(b, rk[r]));
+	return veorq_u8(vaeseq_u8(b, rk[CHIAKI_AES_KERNEL_ROUNDS - 1]), rk[CHIAKI_AES_KERNEL_ROUNDS]);
+}
+
+static inline uint64x2_t armv8_pmull_lo(uint64x2_t a, uint64x2_t b)
+{
+	return vreinterpretq_u64_p128(vmull_p64(vgetq_lane_p64(vreinterpretq_p64_u64(a), 0), vgetq_lane_p64(vreinterpretq_p64_u64(b), 0)));
+}
+
+static inline uint64x2_t armv8_pmull_hi(uint64x2_t a, uint64x2_t b)
+{
+	return vreinterpretq_u64_p128(vmull_high_p64(vreinterpretq_p64_u64(a), vreinterpretq_p64_u64(b)));
+}
+
+/**
+ * Accumulate the unreduced product of a and b, mid collects both middle products.
+ */
+static inline void armv8_ghash_mul(uint64x2_t a, uint64x2_t b, uint64x2_t *lo, uint64x2_t *mid, uint64x2_t *hi)
+{
+	uint64x2_t b_swapped = vextq_u64(b, b, 1);
+	*lo = veorq_u64(*lo, armv8_pmull_lo(a, b));
+	*hi = veorq_u64(*hi, armv8_pmull_hi(a, b));
+	*mid = veorq_u64(*mid, veorq_u64(armv8_pmull_lo(a, b_swapped), armv8_pmull_hi(a, b_swapped)));
+}
+
+static inline uint64x2_t armv8_ghash_reduce(uint64x2_t lo, uint64x2_t mid, uint64x2_t hi)
+{
+	const uint64x2_t zero = vdupq_n_u64(0);
+	const uint64x2_t poly = vdupq_n_u64(0x87);
+	lo = veorq_u64(lo, vextq_u64(zero, mid, 1));
+	hi = veorq_u64(hi, vextq_u64(mid, zero, 1));
+	// x^128 = x^7 + x^2 + x + 1, fold the upper half of hi into the lower one first, then all of it into lo
+	uint64x2_t t = armv8_pmull_hi(hi, poly);
+	lo = veorq_u64(lo, vextq_u64(zero, t, 1));
+	hi = veorq_u64(hi, vextq_u64(t, zero, 1));
+	return veorq_u64(lo, armv8_pmull_lo(hi, poly));
+}
+
+/**
+ * x = (x ^ blocks[0]) * H^count ^ blocks[1] * H^(count - 1) ^ ... ^ blocks[count - 1] * H, with a single reduction.
+ */
+static inline uint64x2_t armv8_ghash_blocks(uint64x2_t x, const uint64x2_t *blocks, size_t count, const uint64x2_t *h)
+{
+	uint64x2_t lo = vdupq_n_u64(0);
+	uint64x2_t mid = lo;
+	uint64x2_t hi = lo;
+	armv8_ghash_mul(veorq_u64(x, blocks[0]), h[count - 1], &lo, &mid, &hi);
+	for(size_t i=1; i<count; i++)
+		armv8_ghash_mul(blocks[i], h[count - 1 - i], &lo, &mid, &hi);
+	return armv8_ghash_reduce(lo, mid, hi);
+}
+
+/**
+ * Hash the last size < 4 blocks of data, zero padded, followed by len_block.
+ */
+static uint64x2_t armv8_ghash_tail(uint64x2_t x, const uint8_t *buf, size_t size, const uint8_t *len_block, const uint64x2_t *h)
+{
+	uint64x2_t blocks[CHIAKI_AES_KERNEL_GHASH_POWERS + 1];
+	size_t count = 0;
+	for(; size >= CHIAKI_GKCRYPT_BLOCK_SIZE && count < CHIAKI_AES_KERNEL_GHASH_POWERS - 1; size -= CHIAKI_GKCRYPT_BLOCK_SIZE, buf += CHIAKI_GKCRYPT_BLOCK_SIZE)
+		blocks[count++] = armv8_ghash_load(buf);
+	if(size)
+	{
+		uint8_t pad[CHIAKI_GKCRYPT_BLOCK_SIZE] = { 0 };
+		memcpy(pad, buf, size);
+		blocks[count++] = armv8_ghash_load(pad);
+	}
+	blocks[count++] = armv8_ghash_load(len_block);
+	if(count > CHIAKI_AES_KERNEL_GHASH_POWERS)
+	{
+		x = armv8_ghash_blocks(x, blocks, CHIAKI_AES_KERNEL_GHASH_POWERS, h);
+		return armv8_ghash_blocks(x, blocks + CHIAKI_AES_KERNEL_GHASH_POWERS, count - CHIAKI_AES_KERNEL_GHASH_POWERS, h);
+	}
+	return armv8_ghash_blocks(x, blocks, count, h);
+}
+
+static void armv8_key_init(ChiakiAesKernelKey *key)
+{
+	uint8x16_t rk[CHIAKI_AES_KERNEL_ROUNDS + 1];
+	armv8_load_round_keys(rk, key);
+	uint8_t h_bytes[CHIAKI_GKCRYPT_BLOCK_SIZE];
+	vst1q_u8(h_bytes, armv8_aes_encrypt(rk, vdupq_n_u8(0)));
+	uint64x2_t h = armv8_ghash_load(h_bytes);
+	uint64x2_t p = h;
+	vst1q_u8(key->ghash_key[0], vreinterpretq_u8_u64(p));
+	for(size_t i=1; i<CHIAKI_AES_KERNEL_GHASH_POWERS; i++)
+	{
+		p = armv8_ghash_blocks(vdupq_n_u64(0), &p, 1, &h);
+		vst1q_u8(key->ghash_key[i], vreinterpretq_u8_u64(p));
+	}
+}
+
+/**
+ * One round without the last for all CTR_BLOCKS blocks, written out so the blocks stay in registers.
+ */
+static inline void armv8_aes_ctr_blocks(uint8x16_t *b, uint8x16_t rk)
+{
+	b[0] = vaesmcq_u8(vaeseq_u8(b[0], rk));
+	b[1] = vaesmcq_u8(vaeseq_u8(b[1], rk));
+	b[2] = vaesmcq_u8(vaeseq_u8(b[2], rk));
+	b[3] = vaesmcq_u8(vaeseq_u8(b[3], rk));
+	b[4] = vaesmcq_u8(vaeseq_u8(b[4], rk));
+	b[5] = vaesmcq_u8(vaeseq_u8(b[5], rk));
+	b[6] = vaesmcq_u8(vaeseq_u8(b[6], rk));
+	b[7] = vaesmcq_u8(vaeseq_u8(b[7], rk));
+}
+
+static inline uint8x16_t armv8_ctr_block(uint64_t iv_lo, uint64_t iv_hi, uint64_t n)
+{
+	uint64_t lo = iv_lo + n;
+	uint64_t hi = iv_hi + (lo < n ? 1 : 0);
+	return vreinterpretq_u8_u64(vcombine_u64(vcreate_u64(lo), vcreate_u64(hi)));
+}
+
+static void armv8_ctr(const ChiakiAesKernelKey *key, uint64_t iv_lo, uint64_t iv_hi, uint64_t block_index, uint8_t *out, const uint8_t *in, size_t blocks)
+{
+	uint8x16_t rk[CHIAKI_AES_KERNEL_ROUNDS + 1];
+	armv8_load_round_keys(rk, key);
+	size_t i = 0;
+	for(; i + CTR_BLOCKS <= blocks; i += CTR_BLOCKS)
+	{
+		uint8x16_t b[CTR_BLOCKS];
+		for(size_t j=0; j<CTR_BLOCKS; j++)
+			b[j] = armv8_ctr_block(iv_lo, iv_hi, block_index + i + j);
+		for(size_t r=0; r<CHIAKI_AES_KERNEL_ROUNDS - 1; r++)
+			armv8_aes_ctr_blocks(b, rk[r]);
+		for(size_t j=0; j<CTR_BLOCKS; j++)
+		{
+			b[j] = veorq_u8(vaeseq_u8(b[j], rk[CHIAKI_AES_KERNEL_ROUNDS - 1]), rk[CHIAKI_AES_KERNEL_ROUNDS]);
+			if(in)
+				b[j] = veorq_u8(b[j], vld1q_u8(in + (i + j) * CHIAKI_GKCRYPT_BLOCK_SIZE));
+			vst1q_u8(out + (i + j) * CHIAKI_GKCRYPT_BLOCK_SIZE, b[j]);
+		}
+	}
+	for(; i < blocks; i++)
+	{
+		uint8x16_t b = armv8_aes_encrypt(rk, armv8_ctr_block(iv_lo, iv_hi, block_index + i));
+		if(in)
+			b = veorq_u8(b, vld1q_u8(in + i * CHIAKI_GKCRYPT_BLOCK_SIZE));
+		vst1q_u8(out + i * CHIAKI_GKCRYPT_BLOCK_SIZE, b);
+	}
+}
+
+static void armv8_gmac(size_t count, const ChiakiAesKernelKey *const *keys, const uint8_t (*ivs)[CHIAKI_GKCRYPT_BLOCK_SIZE],
+		const uint8_t *const *bufs, const size_t *buf_sizes, uint8_t *const *gmacs_out)
+{
+	uint64x2_t h[CHIAKI_AES_KERNEL_GMAC_LANES][CHIAKI_AES_KERNEL_GHASH_POWERS];
+	uint64x2_t x[CHIAKI_AES_KERNEL_GMAC_LANES];
+	uint8x16_t j0[CHIAKI_AES_KERNEL_GMAC_LANES];
+	const uint8_t *cur[CHIAKI_AES_KERNEL_GMAC_LANES];
+	size_t left[CHIAKI_AES_KERNEL_GMAC_LANES];
+
+	uint8_t len_block[CHIAKI_GKCRYPT_BLOCK_SIZE];
+	ghash_len_block(len_block, 0, CHIAKI_GKCRYPT_BLOCK_SIZE * 8);
+	uint64x2_t iv_len = armv8_ghash_load(len_block);
+
+	// J0 = GHASH(iv || length of the iv)
+	for(size_t l=0; l<count; l++)
+	{
+		for(size_t p=0; p<CHIAKI_AES_KERNEL_GHASH_POWERS; p++)
+			h[l][p] = vreinterpretq_u64_u8(vld1q_u8(keys[l]->ghash_key[p]));
+		uint64x2_t blocks[2] = { armv8_ghash_load(ivs[l]), iv_len };
+		j0[l] = armv8_ghash_bytes(armv8_ghash_blocks(vdupq_n_u64(0), blocks, 2, h[l]));
+		x[l] = vdupq_n_u64(0);
+		cur[l] = bufs[l];
+		left[l] = buf_sizes[l];
+	}
+
+	// E(J0), which masks the tag
+	for(size_t r=0; r<CHIAKI_AES_KERNEL_ROUNDS - 1; r++)
+	{
+		for(size_t l=0; l<count; l++)
+			j0[l] = vaesmcq_u8(vaeseq_u8(j0[l], vld1q_u8(keys[l]->round_keys[r])));
+	}
+	for(size_t l=0; l<count; l++)
+	{
+		j0[l] = veorq_u8(vaeseq_u8(j0[l], vld1q_u8(keys[l]->round_keys[CHIAKI_AES_KERNEL_ROUNDS - 1])),
+				vld1q_u8(keys[l]->round_keys[CHIAKI_AES_KERNEL_ROUNDS]));
+	}
+
+	// one step of every lane at a time, the lanes don't depend on each other
+	bool more = true;
+	while(more)
+	{
+		more = false;
+		for(size_t l=0; l<count; l++)
+		{
+			if(left[l] < CHIAKI_AES_KERNEL_GHASH_POWERS * CHIAKI_GKCRYPT_BLOCK_SIZE)
+				continue;
+			uint64x2_t blocks[CHIAKI_AES_KERNEL_GHASH_POWERS];
+			for(size_t i=0; i<CHIAKI_AES_KERNEL_GHASH_POWERS; i++)
+				blocks[i] = armv8_ghash_load(cur[l] + i * CHIAKI_GKCRYPT_BLOCK_SIZE);
+			x[l] = armv8_ghash_blocks(x[l], blocks, CHIAKI_AES_KERNEL_GHASH_POWERS, h[l]);
+			cur[l] += CHIAKI_AES_KERNEL_GHASH_POWERS * CHIAKI_GKCRYPT_BLOCK_SIZE;
+			left[l] -= CHIAKI_AES_KERNEL_GHASH_POWERS * CHIAKI_GKCRYPT_BLOCK_SIZE;
+			more = true;
+		}
+	}
+
+	for(size_t l=0; l<count; l++)
+	{
+		ghash_len_block(len_block, (uint64_t)buf_sizes[l] * 8, 0);
+		x[l] = armv8_ghash_tail(x[l], cur[l], left[l], len_block, h[l]);
+		uint8_t tag[CHIAKI_GKCRYPT_BLOCK_SIZE];
+		vst1q_u8(tag, veorq_u8(armv8_ghash_bytes(x[l]), j0[l]));
+		memcpy(gmacs_out[l], tag, CHIAKI_GKCRYPT_GMAC_SIZE);
+	}
+}
+
+/**
+ * Continue the GHASH in x_bytes, a block as it is in memory, with the given whole blocks of buf.
+ */
+static void armv8_ghash(const ChiakiAesKernelKey *key, uint8_t *x_bytes, const uint8_t *buf, size_t blocks)
+{
+	uint64x2_t h[CHIAKI_AES_KERNEL_GHASH_POWERS];
+	for(size_t p=0; p<CHIAKI_AES_KERNEL_GHASH_POWERS; p++)
+		h[p] = vreinterpretq_u64_u8(vld1q_u8(key->ghash_key[p]));
+	uint64x2_t x = armv8_ghash_load(x_bytes);
+	while(blocks)
+	{
+		size_t count = blocks < CHIAKI_AES_KERNEL_GHASH_POWERS ? blocks : CHIAKI_AES_KERNEL_GHASH_POWERS;
+		uint64x2_t b[CHIAKI_AES_KERNEL_GHASH_POWERS];
+		for(size_t i=0; i<count; i++)
+			b[i] = armv8_ghash_load(buf + i * CHIAKI_GKCRYPT_BLOCK_SIZE);
+		x = armv8_ghash_blocks(x, b, count, h);
+		buf += count * CHIAKI_GKCRYPT_BLOCK_SIZE;
+		blocks -= count;
+	}
+	vst1q_u8(x_bytes, armv8_ghash_bytes(x));
+}
+
+#endif
+
+bool chiaki_aes_kernel_supported(ChiakiGKCryptImpl impl)
+{
+	switch(impl)
+	{
+#ifdef AES_KERNEL_X86
+		case CHIAKI_GKCRYPT_IMPL_AESNI:
+			return __builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3");
+#endif
+#ifdef AES_KERNEL_ARMV8
+		case CHIAKI_GKCRYPT_IMPL_ARMV8:
+#ifdef __linux__
+		{
+			unsigned long hwcap = getauxval(AT_HWCAP);
+			return (hwcap & HWCAP_AES) && (hwcap & HWCAP_PMULL);
+		}
+#else
+			return true;
+#endif
+#endif
+		default:
+			return false;
+	}
+}
+
+void chiaki_aes_kernel_key_init(ChiakiAesKernelKey *key, ChiakiGKCryptImpl impl, const uint8_t *aes_key)
+{
+	key->impl = impl;
+	aes_expand_key(key->round_keys, aes_key);
+	memset(key->ghash_key, 0, sizeof(key->ghash_key));
+	switch(impl)
+	{
+#ifdef AES_KERNEL_X86
+		case CHIAKI_GKCRYPT_IMPL_AESNI:
+			x86_key_init(key);
+			break;
+#endif
+#ifdef AES_KERNEL_ARMV8
+		case CHIAKI_GKCRYPT_IMPL_ARMV8:
+			armv8_key_init(key);
+			break;
+#endif
+		default:
+			break;
+	}
+}
+
+void chiaki_aes_kernel_ctr(const ChiakiAesKernelKey *key, const uint8_t *iv, uint64_t block_index, uint8_t *out, const uint8_t *in, size_t blocks)
+{
+	// the counter is a little endian 128 bit integer, both kernels only exist on little endian cpus
+	uint64_t iv_lo, iv_hi;
+	memcpy(&iv_lo, iv, sizeof(iv_lo));
+	memcpy(&iv_hi, iv + sizeof(iv_lo), sizeof(iv_hi));
+	switch(key->impl)
+	{
+#ifdef AES_KERNEL_X86
+		case CHIAKI_GKCRYPT_IMPL_AESNI:
+			x86_ctr(key, iv_lo, iv_hi, block_index, out, in, blocks);
+			break;
+#endif
+#ifdef AES_KERNEL_ARMV8
+		case CHIAKI_GKCRYPT_IMPL_ARMV8:
+			armv8_ctr(key, iv_lo, iv_hi, block_index, out, in, blocks);
+			break;
+#endif
+		default:
+			break;
+	}
+}
+
+void chiaki_aes_kernel_gmac(size_t count, const ChiakiAesKernelKey *const *keys, const uint8_t (*ivs)[CHIAKI_GKCRYPT_BLOCK_SIZE],
+		const uint8_t *const *bufs, const size_t *buf_sizes, uint8_t *const *gmacs_out)
+{
+	if(!count)
+		return;
+	switch(keys[0]->impl)
+	{
+#ifdef AES_KERNEL_X86
+		case CHIAKI_GKCRYPT_IMPL_AESNI:
+			x86_gmac(count, keys, ivs, bufs, buf_sizes, gmacs_out);
+			break;
+#endif
+#ifdef AES_KERNEL_ARMV8
+		case CHIAKI_GKCRYPT_IMPL_ARMV8:
+			armv8_gmac(count, keys, ivs, bufs, buf_sizes, gmacs_out);
+			break;
+#endif
+		default:
+			break;
+	}
+}
+
+static void aes_kernel_ghash(const ChiakiAesKernelKey *key, uint8_t *x, const uint8_t *buf, size_t blocks)
+{
+	switch(key->impl)
+	{
+#ifdef AES_KERNEL_X86
+		case CHIAKI_GKCRYPT_IMPL_AESNI:
+			x86_ghash(key, x, buf, blocks);
+			break;
+#endif
+#ifdef AES_KERNEL_ARMV8
+		case CHIAKI_GKCRYPT_IMPL_ARMV8:
+			armv8_ghash(key, x, buf, blocks);
+			break;
+#endif
+		default:
+			break;
+	}
+}
+
+void chiaki_aes_kernel_gmac_start(ChiakiAesKernelGmac *gmac, const ChiakiAesKernelKey *key, const uint8_t *iv)
+{
+	gmac->key = key;
+	gmac->size = 0;
+
+	// J0 = GHASH(iv || length of the iv), taken as the counter block 0 it is E(J0)
+	uint8_t blocks[2][CHIAKI_GKCRYPT_BLOCK_SIZE];
+	memcpy(blocks[0], iv, CHIAKI_GKCRYPT_BLOCK_SIZE);
+	ghash_len_block(blocks[1], 0, CHIAKI_GKCRYPT_BLOCK_SIZE * 8);
+	uint8_t j0[CHIAKI_GKCRYPT_BLOCK_SIZE] = { 0 };
+	aes_kernel_ghash(key, j0, blocks[0], 2);
+	chiaki_aes_kernel_ctr(key, j0, 0, gmac->tag_mask, NULL, 1);
+
+	memset(gmac->ghash, 0, sizeof(gmac->ghash));
+}
+
+void chiaki_aes_kernel_gmac_update(ChiakiAesKernelGmac *gmac, const uint8_t *buf, size_t blocks)
+{
+	aes_kernel_ghash(gmac->key, gmac->ghash, buf, blocks);
+	gmac->size += blocks * CHIAKI_GKCRYPT_BLOCK_SIZE;
+}
+
+void chiaki_aes_kernel_gmac_finish(ChiakiAesKernelGmac *gmac, const uint8_t *buf, size_t size, uint8_t *gmac_out)
+{
+	size_t blocks = size / CHIAKI_GKCRYPT_BLOCK_SIZE;
+	chiaki_aes_kernel_gmac_update(gmac, buf, blocks);
+	buf += blocks * CHIAKI_GKCRYPT_BLOCK_SIZE;
+	size -= blocks * CHIAKI_GKCRYPT_BLOCK_SIZE;
+
+	// zero padded rest and the length block
+	uint8_t last[2][CHIAKI_GKCRYPT_BLOCK_SIZE] = { 0 };
+	size_t count = 0;
+	if(size)
+	{
+		memcpy(last[count++], buf, size);
+		gmac->size += size;
+	}
+	ghash_len_block(last[count++], gmac->size * 8, 0);
+	aes_kernel_ghash(gmac->key, gmac->ghash, last[0], count);
+
+	for(size_t i=0; i<CHIAKI_GKCRYPT_GMAC_SIZE; i++)
+		gmac_out[i] = gmac->ghash[i] ^ gmac->tag_mask[i];
+}
@@ -0,0 +1,82 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_AESKERNEL_H
+#define CHIAKI_AESKERNEL_H
+
+#include <chiaki/gkcrypt.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Built-in AES-128 kernels for ChiakiGKCrypt, used by every CHIAKI_GKCRYPT_IMPL_* except CHIAKI_GKCRYPT_IMPL_BACKEND.
+ *
+ * The ctr mode key stream uses the little endian counter of GKCrypt, so it is not the one of AES-CTR.
+ * GMAC is AES-GCM with a 16 byte IV and everything as additional data, which needs one GHASH over the IV
+ * and one over the data for each packet. Blocks are hashed CHIAKI_AES_KERNEL_GHASH_POWERS at a time with a single
+ * reduction, and the gmacs of up to CHIAKI_AES_KERNEL_GMAC_LANES packets are calculated interleaved, so the latency
+ * of one chain of carry-less multiplications is hidden behind the others.
+ */
+
+#define CHIAKI_AES_KERNEL_ROUNDS 10
+#define CHIAKI_AES_KERNEL_GHASH_POWERS 4
+#define CHIAKI_AES_KERNEL_GMAC_LANES 4
+
+typedef struct chiaki_aes_kernel_key_t
+{
+	ChiakiGKCryptImpl impl;
+	uint8_t round_keys[CHIAKI_AES_KERNEL_ROUNDS + 1][CHIAKI_GKCRYPT_BLOCK_SIZE];
+	uint8_t ghash_key[CHIAKI_AES_KERNEL_GHASH_POWERS][CHIAKI_GKCRYPT_BLOCK_SIZE]; // H^1 to H^4 in the representation of impl
+} ChiakiAesKernelKey;
+
+/**
+ * @return whether impl was compiled in and the cpu supports it, always false for CHIAKI_GKCRYPT_IMPL_BACKEND
+ */
+bool chiaki_aes_kernel_supported(ChiakiGKCryptImpl impl);
+
+/**
+ * Expand aes_key and derive the GHASH key from it.
+ *
+ * @param impl must be supported, see chiaki_aes_kernel_supported()
+ */
+void chiaki_aes_kernel_key_init(ChiakiAesKernelKey *key, ChiakiGKCryptImpl impl, const uint8_t *aes_key);
+
+/**
+ * out = in ^ key stream for blocks starting at counter block iv + block_index.
+ *
+ * @param in NULL to only write the key stream, may be the same as out
+ */
+void chiaki_aes_kernel_ctr(const ChiakiAesKernelKey *key, const uint8_t *iv, uint64_t block_index, uint8_t *out, const uint8_t *in, size_t blocks);
+
+/**
+ * Calculate the gmacs of count <= CHIAKI_AES_KERNEL_GMAC_LANES buffers at once.
+ * All keys must have the same impl.
+ */
+void chiaki_aes_kernel_gmac(size_t count, const ChiakiAesKernelKey *const *keys, const uint8_t (*ivs)[CHIAKI_GKCRYPT_BLOCK_SIZE],
+		const uint8_t *const *bufs, const size_t *buf_sizes, uint8_t *const *gmacs_out);
+
+/**
+ * A gmac calculated piece by piece, so a buffer can be decrypted right after each piece was hashed.
+ */
+typedef struct chiaki_aes_kernel_gmac_t
+{
+	const ChiakiAesKernelKey *key;
+	uint8_t ghash[CHIAKI_GKCRYPT_BLOCK_SIZE];
+	uint8_t tag_mask[CHIAKI_GKCRYPT_BLOCK_SIZE]; // E(J0)
+	uint64_t size;
+} ChiakiAesKernelGmac;
+
+void chiaki_aes_kernel_gmac_start(ChiakiAesKernelGmac *gmac, const ChiakiAesKernelKey *key, const uint8_t *iv);
+
+/**
+ * Hash the next blocks whole blocks of the buffer.
+ */
+void chiaki_aes_kernel_gmac_update(ChiakiAesKernelGmac *gmac, const uint8_t *buf, size_t blocks);
+
+/**
+ * Hash the last size bytes of the buffer and write the gmac.
+ */
+void chiaki_aes_kernel_gmac_finish(ChiakiAesKernelGmac *gmac, const uint8_t *buf, size_t size, uint8_t *gmac_out);
+
+#endif // CHIAKI_AESKERNEL_H
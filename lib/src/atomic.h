@@ -0,0 +1,44 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_ATOMIC_H
+#define CHIAKI_ATOMIC_H
+
+#include <stdint.h>
+
+/*
+ * Minimal atomic operations on plain uint64_t values, so structs in public headers
+ * don't need _Atomic types, which are not available in C++ and older MSVC.
+ */
+
+#if defined(_MSC_VER) && !defined(__clang__)
+
+#include <windows.h>
+
+static inline uint64_t chiaki_atomic_load_relaxed(const uint64_t *p) { return (uint64_t)InterlockedOr64((volatile LONG64 *)p, 0); }
+static inline uint64_t chiaki_atomic_load_acquire(const uint64_t *p) { return (uint64_t)InterlockedOr64((volatile LONG64 *)p, 0); }
+static inline void chiaki_atomic_store_relaxed(uint64_t *p, uint64_t v) { InterlockedExchange64((volatile LONG64 *)p, (LONG64)v); }
+static inline void chiaki_atomic_store_release(uint64_t *p, uint64_t v) { InterlockedExchange64((volatile LONG64 *)p, (LONG64)v); }
+static inline uint64_t chiaki_atomic_fetch_add_relaxed(uint64_t *p, uint64_t v) { return (uint64_t)InterlockedExchangeAdd64((volatile LONG64 *)p, (LONG64)v); }
+static inline void chiaki_atomic_fence(void) { MemoryBarrier(); }
+
+#else
+
+static inline uint64_t chiaki_atomic_load_relaxed(const uint64_t *p) { return __atomic_load_n(p, __ATOMIC_RELAXED); }
+static inline uint64_t chiaki_atomic_load_acquire(const uint64_t *p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+static inline void chiaki_atomic_store_relaxed(uint64_t *p, uint64_t v) { __atomic_store_n(p, v, __ATOMIC_RELAXED); }
+static inline void chiaki_atomic_store_release(uint64_t *p, uint64_t v) { __atomic_store_n(p, v, __ATOMIC_RELEASE); }
+static inline uint64_t chiaki_atomic_fetch_add_relaxed(uint64_t *p, uint64_t v) { return __atomic_fetch_add(p, v, __ATOMIC_RELAXED); }
+static inline void chiaki_atomic_fence(void) { __atomic_thread_fence(__ATOMIC_SEQ_CST); }
+
+#endif
+
+/**
+ * Raise *p to v if it is lower. Only safe if there is a single writer.
+ */
+static inline void chiaki_atomic_store_max_relaxed(uint64_t *p, uint64_t v)
+{
+	if(v > chiaki_atomic_load_relaxed(p))
+		chiaki_atomic_store_relaxed(p, v);
+}
+
+#endif // CHIAKI_ATOMIC_H
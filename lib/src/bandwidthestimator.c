@@ -0,0 +1,257 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/bandwidthestimator.h>
+
+#include <string.h>
+
+// accumulated delay is smoothed exponentially before fitting the trendline
+#define DELAY_SMOOTHING 0.9
+// trendline slope is scaled by min(delays, TRENDLINE_DELAYS_MAX) * TRENDLINE_GAIN before comparing it to the threshold
+#define TRENDLINE_DELAYS_MAX 60
+#define TRENDLINE_GAIN 4.0
+
+// adaptive threshold, grows slowly towards the trend and shrinks quickly when the trend is below it
+#define THRESHOLD_INITIAL 12.5
+#define THRESHOLD_MIN 6.0
+#define THRESHOLD_MAX 600.0
+#define THRESHOLD_K_UP 0.0087
+#define THRESHOLD_K_DOWN 0.039
+// trends this far above the threshold are spikes that the threshold should not adapt to
+#define THRESHOLD_SPIKE_MAX 15.0
+#define THRESHOLD_UPDATE_INTERVAL_MAX_MS 100
+
+// frames further apart than this are not used for delay estimation, e.g. after a stall
+#define DELTA_FRAMES_MAX 30
+
+#define RATE_WINDOW_US 500000
+#define RATE_DECREASE_FACTOR 0.85
+#define RATE_DECREASE_INTERVAL_US 200000
+#define RATE_INCREASE_PER_S 0.08
+#define RATE_INCREASE_RECEIVED_FACTOR 1.5
+#define BITRATE_MIN_KBPS 500
+
+#define LOSS_RATIO_HIGH 0.1
+
+CHIAKI_EXPORT const char *chiaki_bandwidth_usage_string(ChiakiBandwidthUsage usage)
+{
+	switch(usage)
+	{
+		case CHIAKI_BANDWIDTH_USAGE_NORMAL:
+			return "normal";
+		case CHIAKI_BANDWIDTH_USAGE_OVERUSE:
+			return "overuse";
+		case CHIAKI_BANDWIDTH_USAGE_UNDERUSE:
+			return "underuse";
+		default:
+			return "unknown";
+	}
+}
+
+CHIAKI_EXPORT void chiaki_bandwidth_estimator_init(ChiakiBandwidthEstimator *estimator, unsigned int fps, uint64_t bitrate_max_kbps)
+{
+	memset(estimator, 0, sizeof(*estimator));
+	estimator->frame_interval_us = 1000000 / (fps ? fps : 60);
+	estimator->bitrate_max_kbps = bitrate_max_kbps;
+	estimator->estimate.usage = CHIAKI_BANDWIDTH_USAGE_NORMAL;
+	estimator->estimate.delay_threshold = THRESHOLD_INITIAL;
+}
+
+static void bandwidth_estimator_decrease(ChiakiBandwidthEstimator *estimator, uint64_t bitrate_kbps, uint64_t now_us)
+{
+	if(bitrate_kbps < BITRATE_MIN_KBPS)
+		bitrate_kbps = BITRATE_MIN_KBPS;
+	if(bitrate_kbps < estimator->estimate.bitrate_kbps)
+		estimator->estimate.bitrate_kbps = bitrate_kbps;
+	estimator->decrease_prev_us = now_us;
+}
+
+static double trendline_slope(ChiakiBandwidthEstimator *estimator)
+{
+	size_t count = estimator->trendline_count;
+	double time_mean = 0.0;
+	double delay_mean = 0.0;
+	for(size_t i=0; i<count; i++)
+	{
+		time_mean += estimator->trendline_time_ms[i];
+		delay_mean += estimator->trendline_delay_ms[i];
+	}
+	time_mean /= count;
+	delay_mean /= count;
+
+	double num = 0.0;
+	double den = 0.0;
+	for(size_t i=0; i<count; i++)
+	{
+		double t = estimator->trendline_time_ms[i] - time_mean;
+		num += t * (estimator->trendline_delay_ms[i] - delay_mean);
+		den += t * t;
+	}
+	return den > 0.0 ? num / den : 0.0;
+}
+
+static void bandwidth_estimator_update_threshold(ChiakiBandwidthEstimator *estimator, double trend_abs, uint64_t now_us)
+{
+	ChiakiBandwidthEstimate *estimate = &estimator->estimate;
+	if(!estimator->threshold_update_prev_us)
+		estimator->threshold_update_prev_us = now_us;
+
+	if(trend_abs > estimate->delay_threshold + THRESHOLD_SPIKE_MAX)
+	{
+		estimator->threshold_update_prev_us = now_us;
+		return;
+	}
+
+	double k = trend_abs < estimate->delay_threshold ? THRESHOLD_K_DOWN : THRESHOLD_K_UP;
+	double dt_ms = (double)(now_us - estimator->threshold_update_prev_us) / 1000.0;
+	if(dt_ms > THRESHOLD_UPDATE_INTERVAL_MAX_MS)
+		dt_ms = THRESHOLD_UPDATE_INTERVAL_MAX_MS;
+	estimate->delay_threshold += k * (trend_abs - estimate->delay_threshold) * dt_ms;
+	if(estimate->delay_threshold < THRESHOLD_MIN)
+		estimate->delay_threshold = THRESHOLD_MIN;
+	else if(estimate->delay_threshold > THRESHOLD_MAX)
+		estimate->delay_threshold = THRESHOLD_MAX;
+	estimator->threshold_update_prev_us = now_us;
+}
+
+static void bandwidth_estimator_detect(ChiakiBandwidthEstimator *estimator, double delay_ms, uint64_t arrival_us)
+{
+	ChiakiBandwidthEstimate *estimate = &estimator->estimate;
+
+	estimator->delays_count++;
+	estimator->delay_acc_ms += delay_ms;
+	estimator->delay_smoothed_ms = DELAY_SMOOTHING * estimator->delay_smoothed_ms + (1.0 - DELAY_SMOOTHING) * estimator->delay_acc_ms;
+
+	estimator->trendline_time_ms[estimator->trendline_next] = (double)(arrival_us - estimator->arrival_origin_us) / 1000.0;
+	estimator->trendline_delay_ms[estimator->trendline_next] = estimator->delay_smoothed_ms;
+	estimator->trendline_next = (estimator->trendline_next + 1) % CHIAKI_BANDWIDTH_ESTIMATOR_TRENDLINE_SIZE;
+	if(estimator->trendline_count < CHIAKI_BANDWIDTH_ESTIMATOR_TRENDLINE_SIZE)
+	{
+		estimator->trendline_count++;
+		if(estimator->trendline_count < CHIAKI_BANDWIDTH_ESTIMATOR_TRENDLINE_SIZE)
+			return;
+	}
+
+	uint64_t delays = estimator->delays_count < TRENDLINE_DELAYS_MAX ? estimator->delays_count : TRENDLINE_DELAYS_MAX;
+	double trend = trendline_slope(estimator) * (double)delays * TRENDLINE_GAIN;
+	estimate->delay_trend = trend;
+
+	if(trend > estimate->delay_threshold)
+	{
+		// require the trend to be over the threshold for more than one frame and not to be decreasing already
+		estimator->overuse_count++;
+		if(estimator->overuse_count > 1 && trend >= estimator->delay_trend_prev)
+		{
+			estimate->usage = CHIAKI_BANDWIDTH_USAGE_OVERUSE;
+			estimator->overuse_count = 0;
+		}
+	}
+	else if(trend < -estimate->delay_threshold)
+	{
+		estimate->usage = CHIAKI_BANDWIDTH_USAGE_UNDERUSE;
+		estimator->overuse_count = 0;
+	}
+	else
+	{
+		estimate->usage = CHIAKI_BANDWIDTH_USAGE_NORMAL;
+		estimator->overuse_count = 0;
+	}
+	estimator->delay_trend_prev = trend;
+
+	bandwidth_estimator_update_threshold(estimator, trend < 0.0 ? -trend : trend, arrival_us);
+}
+
+static void bandwidth_estimator_update_rate(ChiakiBandwidthEstimator *estimator, uint64_t now_us)
+{
+	ChiakiBandwidthEstimate *estimate = &estimator->estimate;
+	uint64_t update_prev_us = estimator->rate_update_prev_us;
+	estimator->rate_update_prev_us = now_us;
+	if(!estimate->received_kbps)
+		return;
+
+	// only go up as long as the console actually sends close to the estimate
+	// and not above the maximum, unless the console is sending even more than that already
+	uint64_t limit = (uint64_t)(estimate->received_kbps * RATE_INCREASE_RECEIVED_FACTOR);
+	if(estimator->bitrate_max_kbps && limit > estimator->bitrate_max_kbps)
+		limit = estimate->received_kbps > estimator->bitrate_max_kbps ? estimate->received_kbps : estimator->bitrate_max_kbps;
+
+	if(!estimate->bitrate_kbps)
+	{
+		estimate->bitrate_kbps = limit;
+		return;
+	}
+
+	switch(estimate->usage)
+	{
+		case CHIAKI_BANDWIDTH_USAGE_OVERUSE:
+			if(now_us - estimator->decrease_prev_us >= RATE_DECREASE_INTERVAL_US)
+				bandwidth_estimator_decrease(estimator, (uint64_t)(estimate->received_kbps * RATE_DECREASE_FACTOR), now_us);
+			break;
+		case CHIAKI_BANDWIDTH_USAGE_NORMAL:
+		{
+			if(estimate->bitrate_kbps >= limit || !update_prev_us || now_us <= update_prev_us)
+				break;
+			uint64_t dt_us = now_us - update_prev_us;
+			if(dt_us > 1000000)
+				dt_us = 1000000;
+			uint64_t increase = (uint64_t)(estimate->bitrate_kbps * RATE_INCREASE_PER_S * dt_us / 1000000.0);
+			if(!increase)
+				increase = 1;
+			estimate->bitrate_kbps += increase;
+			if(estimate->bitrate_kbps > limit)
+				estimate->bitrate_kbps = limit;
+			break;
+		}
+		case CHIAKI_BANDWIDTH_USAGE_UNDERUSE:
+			// queues are draining, hold the rate until they are empty
+			break;
+	}
+}
+
+CHIAKI_EXPORT void chiaki_bandwidth_estimator_push_frame(ChiakiBandwidthEstimator *estimator, ChiakiSeqNum16 frame_index,
+		uint64_t arrival_first_us, uint64_t arrival_last_us, size_t size)
+{
+	if(estimator->frame_prev_valid && !chiaki_seq_num_16_gt(frame_index, estimator->frame_index_prev))
+		return;
+
+	ChiakiBandwidthEstimate *estimate = &estimator->estimate;
+	if(!estimator->rate_window_start_us)
+		estimator->rate_window_start_us = arrival_first_us;
+	estimator->rate_window_bytes += size;
+	if(arrival_last_us >= estimator->rate_window_start_us + RATE_WINDOW_US)
+	{
+		uint64_t dt_us = arrival_last_us - estimator->rate_window_start_us;
+		estimate->received_kbps = estimator->rate_window_bytes * 8 * 1000 / dt_us;
+		estimator->rate_window_start_us = arrival_last_us;
+		estimator->rate_window_bytes = 0;
+	}
+
+	if(!estimator->frame_prev_valid)
+		estimator->arrival_origin_us = arrival_first_us;
+	else
+	{
+		ChiakiSeqNum16 frames = frame_index - estimator->frame_index_prev;
+		if(frames <= DELTA_FRAMES_MAX && arrival_first_us >= estimator->arrival_prev_us)
+		{
+			// arrival interval minus send interval is the change in one-way delay
+			double delay_ms = (double)(arrival_first_us - estimator->arrival_prev_us) / 1000.0
+				- (double)(frames * estimator->frame_interval_us) / 1000.0;
+			bandwidth_estimator_detect(estimator, delay_ms, arrival_first_us);
+		}
+	}
+	estimator->frame_prev_valid = true;
+	estimator->frame_index_prev = frame_index;
+	estimator->arrival_prev_us = arrival_first_us;
+
+	bandwidth_estimator_update_rate(estimator, arrival_first_us);
+}
+
+CHIAKI_EXPORT void chiaki_bandwidth_estimator_push_loss(ChiakiBandwidthEstimator *estimator, uint64_t received, uint64_t lost, uint64_t now_us)
+{
+	ChiakiBandwidthEstimate *estimate = &estimator->estimate;
+	uint64_t total = received + lost;
+	estimate->loss_ratio = total ? (double)lost / (double)total : 0.0;
+	if(estimate->loss_ratio <= LOSS_RATIO_HIGH || !estimate->bitrate_kbps
+			|| now_us - estimator->decrease_prev_us < RATE_DECREASE_INTERVAL_US)
+		return;
+	bandwidth_estimator_decrease(estimator, (uint64_t)(estimate->bitrate_kbps * (1.0 - 0.5 * estimate->loss_ratio)), now_us);
+}
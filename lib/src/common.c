@@ -93,6 +93,10 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_lib_init()
 	if(galois_r != 0)
 		return galois_r == ENOMEM ? CHIAKI_ERR_MEMORY : CHIAKI_ERR_UNKNOWN;
 
+	ChiakiErrorCode err = chiaki_fec_cache_init();
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+
 #if _WIN32
 	{
 		WORD wsa_version = MAKEWORD(2, 2);
@@ -1,6 +1,7 @@
 // SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
 
 #include <chiaki/congestioncontrol.h>
+#include <chiaki/time.h>
 
 #define CONGESTION_CONTROL_INTERVAL_MS 200
 
@@ -21,11 +22,30 @@ static void *congestion_control_thread_func(void *user)
 		uint64_t received;
 		uint64_t lost;
 		chiaki_packet_stats_get(control->stats, true, &received, &lost);
+
+		chiaki_mutex_lock(&control->estimator_mutex);
+		chiaki_bandwidth_estimator_push_loss(&control->estimator, received, lost, chiaki_time_now_monotonic_us());
+		ChiakiBandwidthEstimate estimate = control->estimator.estimate;
+		chiaki_mutex_unlock(&control->estimator_mutex);
+
+		if(control->report_overuse && estimate.bitrate_kbps && estimate.received_kbps > estimate.bitrate_kbps)
+		{
+			// report the share of the received bitrate above the estimate as lost
+			uint64_t total = received + lost;
+			uint64_t lost_overuse = total * (estimate.received_kbps - estimate.bitrate_kbps) / estimate.received_kbps;
+			if(lost_overuse > lost)
+			{
+				lost = lost_overuse;
+				received = total - lost;
+			}
+		}
+
 		ChiakiTakionCongestionPacket packet = { 0 };
 		packet.received = (uint16_t)received;
 		packet.lost = (uint16_t)lost;
-		CHIAKI_LOGV(control->takion->log, "Sending Congestion Control Packet, received: %u, lost: %u",
-			(unsigned int)packet.received, (unsigned int)packet.lost);
+		CHIAKI_LOGV(control->takion->log, "Sending Congestion Control Packet, received: %u, lost: %u, usage: %s, estimate: %llu kbps, received: %llu kbps",
+			(unsigned int)packet.received, (unsigned int)packet.lost, chiaki_bandwidth_usage_string(estimate.usage),
+			(unsigned long long)estimate.bitrate_kbps, (unsigned long long)estimate.received_kbps);
 		chiaki_takion_send_congestion(control->takion, &packet);
 	}
 
@@ -33,25 +53,35 @@ static void *congestion_control_thread_func(void *user)
 	return NULL;
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_start(ChiakiCongestionControl *control, ChiakiTakion *takion, ChiakiPacketStats *stats)
+CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_start(ChiakiCongestionControl *control, ChiakiTakion *takion, ChiakiPacketStats *stats,
+		unsigned int fps, uint64_t bitrate_max_kbps, bool report_overuse)
 {
 	control->takion = takion;
 	control->stats = stats;
+	control->report_overuse = report_overuse;
+	chiaki_bandwidth_estimator_init(&control->estimator, fps, bitrate_max_kbps);
 
-	ChiakiErrorCode err = chiaki_bool_pred_cond_init(&control->stop_cond);
+	ChiakiErrorCode err = chiaki_mutex_init(&control->estimator_mutex, false);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return err;
 
+	err = chiaki_bool_pred_cond_init(&control->stop_cond);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_estimator_mutex;
+
 	err = chiaki_thread_create(&control->thread, congestion_control_thread_func, control);
 	if(err != CHIAKI_ERR_SUCCESS)
-	{
-		chiaki_bool_pred_cond_fini(&control->stop_cond);
-		return err;
-	}
+		goto error_stop_cond;
 
 	chiaki_thread_set_name(&control->thread, "Chiaki Congestion Control");
 
 	return CHIAKI_ERR_SUCCESS;
+
+error_stop_cond:
+	chiaki_bool_pred_cond_fini(&control->stop_cond);
+error_estimator_mutex:
+	chiaki_mutex_fini(&control->estimator_mutex);
+	return err;
 }
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_stop(ChiakiCongestionControl *control)
@@ -64,5 +94,31 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_stop(ChiakiCongestionCon
 	if(err != CHIAKI_ERR_SUCCESS)
 		return err;
 
-	return chiaki_bool_pred_cond_fini(&control->stop_cond);
+	err = chiaki_bool_pred_cond_fini(&control->stop_cond);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+
+	return chiaki_mutex_fini(&control->estimator_mutex);
+}
+
+CHIAKI_EXPORT void chiaki_congestion_control_push_frame(ChiakiCongestionControl *control, ChiakiSeqNum16 frame_index,
+		uint64_t arrival_first_us, uint64_t arrival_last_us, size_t size)
+{
+	chiaki_mutex_lock(&control->estimator_mutex);
+	ChiakiBandwidthUsage usage_prev = control->estimator.estimate.usage;
+	chiaki_bandwidth_estimator_push_frame(&control->estimator, frame_index, arrival_first_us, arrival_last_us, size);
+	ChiakiBandwidthEstimate estimate = control->estimator.estimate;
+	chiaki_mutex_unlock(&control->estimator_mutex);
+
+	if(estimate.usage != usage_prev)
+		CHIAKI_LOGD(control->takion->log, "Congestion Control detected %s, delay trend %.2f, threshold %.2f, estimate: %llu kbps, received: %llu kbps",
+				chiaki_bandwidth_usage_string(estimate.usage), estimate.delay_trend, estimate.delay_threshold,
+				(unsigned long long)estimate.bitrate_kbps, (unsigned long long)estimate.received_kbps);
+}
+
+CHIAKI_EXPORT void chiaki_congestion_control_get_estimate(ChiakiCongestionControl *control, ChiakiBandwidthEstimate *estimate)
+{
+	chiaki_mutex_lock(&control->estimator_mutex);
+	*estimate = control->estimator.estimate;
+	chiaki_mutex_unlock(&control->estimator_mutex);
 }
@@ -1,74 +1,580 @@
 // SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
 
 #include <chiaki/fec.h>
+#include <chiaki/gf256.h>
+#include <chiaki/thread.h>
+
+#include "atomic.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define FEC_SSE2
+#include <emmintrin.h>
+#endif
 
 #include <jerasure.h>
 #include <cauchy.h>
 
+#include <stdbool.h>
 #include <string.h>
 #include <stdlib.h>
 
-int *create_matrix(unsigned int k, unsigned int m)
+#define ERASED_WORDS (CHIAKI_FEC_UNITS_MAX / 64)
+
+// bit-sliced units are padded to this, so packets are a multiple of 8 bytes
+#define SLICED_ALIGN (CHIAKI_FEC_WORDSIZE * 8)
+
+typedef enum
+{
+	FEC_MATRIX_CODING,
+	FEC_MATRIX_DECODING,
+	FEC_MATRIX_SCHEDULE
+} FecMatrixType;
+
+/**
+ * Coding matrix, decoding matrix or decoding schedule for one (k, m) and for the latter two one erasure pattern.
+ * Cached entries in use by a decode (refs > 0) are never evicted.
+ */
+typedef struct fec_matrix_t
+{
+	FecMatrixType type;
+	unsigned int k;
+	unsigned int m;
+	uint64_t erased[ERASED_WORDS];
+	int *matrix; // coding matrix, decoding matrix followed by its dm_ids, or only the dm_ids for schedules
+	int **schedule; // jerasure schedule computing the erased source units from the dm_ids units
+	unsigned int refs;
+	uint64_t last_used;
+	bool cached; // otherwise owned by the one who acquired it
+} FecMatrix;
+
+typedef struct fec_cache_t
 {
-	return cauchy_original_coding_matrix(k, m, CHIAKI_FEC_WORDSIZE);
+	bool initialized;
+	ChiakiMutex mutex;
+	uint64_t tick;
+	FecMatrix coding[CHIAKI_FEC_CACHE_CODING_ENTRIES];
+	FecMatrix decoding[CHIAKI_FEC_CACHE_DECODING_ENTRIES]; // decoding matrices and schedules
+	ChiakiFecCacheStats stats;
+} FecCache;
+
+static FecCache cache;
+static uint64_t engine = CHIAKI_FEC_ENGINE_MATRIX;
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_cache_init(void)
+{
+	if(cache.initialized)
+		return CHIAKI_ERR_SUCCESS;
+	ChiakiErrorCode err = chiaki_mutex_init(&cache.mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	cache.initialized = true;
+	return CHIAKI_ERR_SUCCESS;
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_decode(uint8_t *frame_buf, size_t unit_size, size_t stride, unsigned int k, unsigned int m, const unsigned int *erasures, size_t erasures_count)
+CHIAKI_EXPORT void chiaki_fec_cache_stats(ChiakiFecCacheStats *stats)
 {
-	if(stride < unit_size)
-		return CHIAKI_ERR_INVALID_DATA;
-	int *matrix = create_matrix(k, m);
-	if(!matrix)
-		return CHIAKI_ERR_MEMORY;
+	if(!cache.initialized)
+	{
+		memset(stats, 0, sizeof(*stats));
+		return;
+	}
+	chiaki_mutex_lock(&cache.mutex);
+	*stats = cache.stats;
+	chiaki_mutex_unlock(&cache.mutex);
+}
+
+CHIAKI_EXPORT const char *chiaki_fec_engine_name(ChiakiFecEngine engine)
+{
+	switch(engine)
+	{
+		case CHIAKI_FEC_ENGINE_MATRIX:
+			return "matrix";
+		case CHIAKI_FEC_ENGINE_BITMATRIX:
+			return "bitmatrix";
+		default:
+			return "unknown";
+	}
+}
+
+CHIAKI_EXPORT void chiaki_fec_set_engine(ChiakiFecEngine e)
+{
+	chiaki_atomic_store_relaxed(&engine, (uint64_t)e);
+}
+
+CHIAKI_EXPORT ChiakiFecEngine chiaki_fec_get_engine(void)
+{
+	return (ChiakiFecEngine)chiaki_atomic_load_relaxed(&engine);
+}
+
+static void matrix_free_contents(FecMatrix *matrix)
+{
+	free(matrix->matrix);
+	matrix->matrix = NULL;
+	if(matrix->schedule)
+		jerasure_free_schedule(matrix->schedule);
+	matrix->schedule = NULL;
+}
 
-	ChiakiErrorCode err = CHIAKI_ERR_SUCCESS;
+static bool matrix_key_match(FecMatrix *matrix, FecMatrixType type, unsigned int k, unsigned int m, const uint64_t *erased)
+{
+	return matrix->matrix && matrix->type == type && matrix->k == k && matrix->m == m
+		&& (type == FEC_MATRIX_CODING || !memcmp(matrix->erased, erased, sizeof(matrix->erased)));
+}
+
+static FecMatrix *cache_entries(FecMatrixType type, size_t *count)
+{
+	if(type == FEC_MATRIX_CODING)
+	{
+		*count = CHIAKI_FEC_CACHE_CODING_ENTRIES;
+		return cache.coding;
+	}
+	*count = CHIAKI_FEC_CACHE_DECODING_ENTRIES;
+	return cache.decoding;
+}
+
+/**
+ * Find a cached matrix and take a reference on it. Cache must be locked.
+ */
+static FecMatrix *cache_lookup(FecMatrixType type, unsigned int k, unsigned int m, const uint64_t *erased)
+{
+	size_t entries_count;
+	FecMatrix *entries = cache_entries(type, &entries_count);
+	for(size_t i=0; i<entries_count; i++)
+	{
+		FecMatrix *entry = &entries[i];
+		if(!matrix_key_match(entry, type, k, m, erased))
+			continue;
+		entry->refs++;
+		entry->last_used = ++cache.tick;
+		return entry;
+	}
+	return NULL;
+}
+
+/**
+ * Move a newly created matrix into the least recently used free entry and take a reference on it.
+ * If another thread inserted the same matrix in the meantime, created is freed and the existing entry returned.
+ * Cache must be locked.
+ *
+ * @return the cache entry or created itself if all entries are in use
+ */
+static FecMatrix *cache_insert(FecMatrix *created)
+{
+	FecMatrix *entry = cache_lookup(created->type, created->k, created->m, created->erased);
+	if(entry)
+	{
+		matrix_free_contents(created);
+		free(created);
+		return entry;
+	}
 
-	int *jerasures = calloc(erasures_count + 1, sizeof(int));
-	if(!jerasures)
+	size_t entries_count;
+	FecMatrix *entries = cache_entries(created->type, &entries_count);
+	for(size_t i=0; i<entries_count; i++)
 	{
-		err = CHIAKI_ERR_MEMORY;
-		goto error_matrix;
+		FecMatrix *candidate = &entries[i];
+		if(candidate->refs)
+			continue;
+		if(!entry || !candidate->matrix || (entry->matrix && candidate->last_used < entry->last_used))
+			entry = candidate;
 	}
-	memcpy(jerasures, erasures, erasures_count * sizeof(int));
-	jerasures[erasures_count] = -1;
+	if(!entry)
+		return created;
 
-	uint8_t **data_ptrs = calloc(k, sizeof(uint8_t *));
-	if(!data_ptrs)
+	matrix_free_contents(entry);
+	*entry = *created;
+	free(created);
+	entry->cached = true;
+	entry->refs = 1;
+	entry->last_used = ++cache.tick;
+	return entry;
+}
+
+static FecMatrix *matrix_acquire(FecMatrixType type, unsigned int k, unsigned int m, const uint64_t *erased);
+
+/**
+ * Drop a reference taken by matrix_acquire(), freeing the matrix if it was not cached.
+ */
+static void matrix_release(FecMatrix *matrix)
+{
+	if(!matrix->cached)
+	{
+		matrix_free_contents(matrix);
+		free(matrix);
+		return;
+	}
+	chiaki_mutex_lock(&cache.mutex);
+	matrix->refs--;
+	chiaki_mutex_unlock(&cache.mutex);
+}
+
+/**
+ * k*k decoding matrix followed by the k ids of the units it is applied to, fails if the erasures can't be restored
+ */
+static bool decoding_matrix_create(FecMatrix *matrix)
+{
+	unsigned int k = matrix->k;
+	unsigned int m = matrix->m;
+	FecMatrix *coding = matrix_acquire(FEC_MATRIX_CODING, k, m, NULL);
+	if(!coding)
+		return false;
+	int erased_ints[CHIAKI_FEC_UNITS_MAX];
+	for(unsigned int i=0; i<k+m; i++)
+		erased_ints[i] = (matrix->erased[i / 64] >> (i % 64)) & 1;
+	matrix->matrix = malloc((k * k + k) * sizeof(int));
+	if(matrix->matrix && jerasure_make_decoding_matrix(k, m, CHIAKI_FEC_WORDSIZE, coding->matrix, erased_ints,
+				matrix->matrix, matrix->matrix + k * k) < 0)
 	{
-		err = CHIAKI_ERR_MEMORY;
-		goto error_jerasures;
+		free(matrix->matrix);
+		matrix->matrix = NULL;
 	}
+	matrix_release(coding);
+	return matrix->matrix != NULL;
+}
+
+/**
+ * Smart schedule of the bitmatrix of the decoding matrix rows for the erased source units.
+ * Device i < k of the schedule is unit dm_ids[i], device k + j the j-th erased source unit.
+ */
+static bool decoding_schedule_create(FecMatrix *matrix)
+{
+	unsigned int k = matrix->k;
+	FecMatrix *decoding = matrix_acquire(FEC_MATRIX_DECODING, k, matrix->m, matrix->erased);
+	if(!decoding)
+		return false;
 
-	uint8_t **coding_ptrs = calloc(m, sizeof(uint8_t *));
-	if(!coding_ptrs)
+	bool success = false;
+	int *rows = malloc(k * k * sizeof(int));
+	matrix->matrix = malloc(k * sizeof(int));
+	if(!rows || !matrix->matrix)
+		goto cleanup;
+	unsigned int rows_count = 0;
+	for(unsigned int i=0; i<k; i++)
 	{
-		err = CHIAKI_ERR_MEMORY;
-		goto error_data_ptrs;
+		if(matrix->erased[i / 64] & (1ULL << (i % 64)))
+			memcpy(rows + k * rows_count++, decoding->matrix + k * i, k * sizeof(int));
 	}
+	memcpy(matrix->matrix, decoding->matrix + k * k, k * sizeof(int));
 
-	for(size_t i=0; i<k+m; i++)
+	int *bitmatrix = jerasure_matrix_to_bitmatrix(k, rows_count, CHIAKI_FEC_WORDSIZE, rows);
+	if(!bitmatrix)
+		goto cleanup;
+	matrix->schedule = jerasure_smart_bitmatrix_to_schedule(k, rows_count, CHIAKI_FEC_WORDSIZE, bitmatrix);
+	free(bitmatrix);
+	success = matrix->schedule != NULL;
+
+cleanup:
+	free(rows);
+	matrix_release(decoding);
+	if(!success)
 	{
-		uint8_t *buf_ptr = frame_buf + stride * i;
-		if(i < k)
-			data_ptrs[i] = buf_ptr;
+		free(matrix->matrix);
+		matrix->matrix = NULL;
+	}
+	return success;
+}
+
+/**
+ * Get a matrix from the cache or create it. Release it with matrix_release().
+ *
+ * @param erased erased units, ignored for FEC_MATRIX_CODING
+ * @return NULL if it can't be created
+ */
+static FecMatrix *matrix_acquire(FecMatrixType type, unsigned int k, unsigned int m, const uint64_t *erased)
+{
+	if(cache.initialized)
+	{
+		chiaki_mutex_lock(&cache.mutex);
+		FecMatrix *entry = cache_lookup(type, k, m, erased);
+		uint64_t *counter;
+		switch(type)
+		{
+			case FEC_MATRIX_CODING:
+				counter = entry ? &cache.stats.coding_hits : &cache.stats.coding_misses;
+				break;
+			case FEC_MATRIX_DECODING:
+				counter = entry ? &cache.stats.decoding_hits : &cache.stats.decoding_misses;
+				break;
+			default:
+				counter = entry ? &cache.stats.schedule_hits : &cache.stats.schedule_misses;
+				break;
+		}
+		(*counter)++;
+		chiaki_mutex_unlock(&cache.mutex);
+		if(entry)
+			return entry;
+	}
+
+	// create without holding the lock, inverting big matrices takes a while
+	FecMatrix *matrix = calloc(1, sizeof(FecMatrix));
+	if(!matrix)
+		return NULL;
+	matrix->type = type;
+	matrix->k = k;
+	matrix->m = m;
+	if(type != FEC_MATRIX_CODING)
+		memcpy(matrix->erased, erased, sizeof(matrix->erased));
+	bool created;
+	switch(type)
+	{
+		case FEC_MATRIX_CODING:
+			matrix->matrix = cauchy_original_coding_matrix(k, m, CHIAKI_FEC_WORDSIZE);
+			created = matrix->matrix != NULL;
+			break;
+		case FEC_MATRIX_DECODING:
+			created = decoding_matrix_create(matrix);
+			break;
+		default:
+			created = decoding_schedule_create(matrix);
+			break;
+	}
+	if(!created)
+	{
+		free(matrix);
+		return NULL;
+	}
+	if(!cache.initialized)
+		return matrix;
+
+	chiaki_mutex_lock(&cache.mutex);
+	matrix = cache_insert(matrix);
+	chiaki_mutex_unlock(&cache.mutex);
+	return matrix;
+}
+
+/**
+ * Transpose the 8x8 bit matrix with byte i as row i.
+ */
+static inline uint64_t transpose8(uint64_t x)
+{
+	uint64_t t;
+	t = (x ^ (x >> 7)) & 0x00aa00aa00aa00aaULL;
+	x = x ^ t ^ (t << 7);
+	t = (x ^ (x >> 14)) & 0x0000cccc0000ccccULL;
+	x = x ^ t ^ (t << 14);
+	t = (x ^ (x >> 28)) & 0x00000000f0f0f0f0ULL;
+	x = x ^ t ^ (t << 28);
+	return x;
+}
+
+/**
+ * Split unit into CHIAKI_FEC_WORDSIZE packets of sliced_size / CHIAKI_FEC_WORDSIZE bytes each, packet b holding bit b of every byte.
+ * Multiplying bytes with a constant in GF(2^8) then becomes XORing packets as given by the constant's bitmatrix.
+ *
+ * @param sliced 8 byte aligned
+ */
+static void unit_slice(uint8_t *sliced, size_t sliced_size, const uint8_t *unit, size_t unit_size)
+{
+	size_t packet_words = sliced_size / CHIAKI_FEC_WORDSIZE / sizeof(uint64_t);
+	uint64_t *packets = (uint64_t *)sliced;
+	for(size_t w=0; w<packet_words; w++)
+	{
+		// 64 bytes of the unit become one word in each packet
+		uint64_t t[8];
+		size_t offset = w * 64;
+		if(offset + 64 <= unit_size)
+			memcpy(t, unit + offset, 64);
 		else
-			coding_ptrs[i - k] = buf_ptr;
+		{
+			memset(t, 0, sizeof(t));
+			if(offset < unit_size)
+				memcpy(t, unit + offset, unit_size - offset);
+		}
+#ifdef FEC_SSE2
+		// the top bit of every byte, then shift the next one up
+		__m128i v[4];
+		for(size_t q=0; q<4; q++)
+			v[q] = _mm_loadu_si128((const __m128i *)t + q);
+		for(size_t b=CHIAKI_FEC_WORDSIZE; b-->0;)
+		{
+			uint64_t p = 0;
+			for(size_t q=0; q<4; q++)
+			{
+				p |= (uint64_t)(uint16_t)_mm_movemask_epi8(v[q]) << (q * 16);
+				v[q] = _mm_add_epi8(v[q], v[q]);
+			}
+			packets[b * packet_words + w] = p;
+		}
+#else
+		for(size_t i=0; i<8; i++)
+			t[i] = transpose8(t[i]);
+		for(size_t b=0; b<CHIAKI_FEC_WORDSIZE; b++)
+		{
+			uint64_t p = 0;
+			for(size_t i=0; i<8; i++)
+				p |= ((t[i] >> (b * 8)) & 0xff) << (i * 8);
+			packets[b * packet_words + w] = p;
+		}
+#endif
+	}
+}
+
+static void unit_unslice(uint8_t *unit, size_t unit_size, const uint8_t *sliced, size_t sliced_size)
+{
+	size_t packet_words = sliced_size / CHIAKI_FEC_WORDSIZE / sizeof(uint64_t);
+	const uint64_t *packets = (const uint64_t *)sliced;
+	for(size_t w=0; w<packet_words; w++)
+	{
+		size_t offset = w * 64;
+		if(offset >= unit_size)
+			break;
+		uint64_t t[8] = { 0 };
+		for(size_t b=0; b<CHIAKI_FEC_WORDSIZE; b++)
+		{
+			uint64_t p = packets[b * packet_words + w];
+			for(size_t i=0; i<8; i++)
+				t[i] |= ((p >> (i * 8)) & 0xff) << (b * 8);
+		}
+		for(size_t i=0; i<8; i++)
+			t[i] = transpose8(t[i]);
+		memcpy(unit + offset, t, offset + 64 <= unit_size ? 64 : unit_size - offset);
+	}
+}
+
+/**
+ * @param devs bit-sliced units, 8 byte aligned
+ */
+static void schedule_run(int **schedule, uint8_t **devs, size_t packet_size)
+{
+	size_t words = packet_size / sizeof(uint64_t);
+	for(int **op_ptr = schedule; (*op_ptr)[0] >= 0; op_ptr++)
+	{
+		int *op = *op_ptr;
+		const uint64_t *src = (const uint64_t *)(devs[op[0]] + op[1] * packet_size);
+		uint64_t *dst = (uint64_t *)(devs[op[2]] + op[3] * packet_size);
+		if(!op[4])
+		{
+			memcpy(dst, src, packet_size);
+			continue;
+		}
+		for(size_t i=0; i<words; i++)
+			dst[i] ^= src[i];
 	}
+}
 
-	int res = jerasure_matrix_decode(k, m, CHIAKI_FEC_WORDSIZE, matrix, 0, jerasures,
-									 (char **)data_ptrs, (char **)coding_ptrs, unit_size);
+static ChiakiErrorCode decode_bitmatrix(uint8_t *frame_buf, size_t unit_size, size_t stride, unsigned int k, unsigned int m,
+		const uint64_t *erased, size_t source_erased_count)
+{
+	FecMatrix *schedule = matrix_acquire(FEC_MATRIX_SCHEDULE, k, m, erased);
+	if(!schedule)
+		return CHIAKI_ERR_FEC_FAILED;
 
-	if(res < 0)
-		err = CHIAKI_ERR_FEC_FAILED;
-	else
-		err = CHIAKI_ERR_SUCCESS;
+	size_t sliced_size = ((unit_size + SLICED_ALIGN - 1) / SLICED_ALIGN) * SLICED_ALIGN;
+	uint8_t *sliced = malloc((k + source_erased_count) * sliced_size);
+	if(!sliced)
+	{
+		matrix_release(schedule);
+		return CHIAKI_ERR_MEMORY;
+	}
+
+	uint8_t *devs[CHIAKI_FEC_UNITS_MAX];
+	for(unsigned int j=0; j<k + source_erased_count; j++)
+		devs[j] = sliced + j * sliced_size;
+	int *dm_ids = schedule->matrix;
+	for(unsigned int j=0; j<k; j++)
+		unit_slice(devs[j], sliced_size, frame_buf + stride * dm_ids[j], unit_size);
+
+	schedule_run(schedule->schedule, devs, sliced_size / CHIAKI_FEC_WORDSIZE);
+
+	size_t out = k;
+	for(unsigned int i=0; i<k; i++)
+	{
+		if(erased[i / 64] & (1ULL << (i % 64)))
+			unit_unslice(frame_buf + stride * i, unit_size, devs[out++], sliced_size);
+	}
+
+	free(sliced);
+	matrix_release(schedule);
+	return CHIAKI_ERR_SUCCESS;
+}
+
+static ChiakiErrorCode decode_matrix(uint8_t *frame_buf, size_t unit_size, size_t stride, unsigned int k, unsigned int m,
+		const uint64_t *erased)
+{
+	FecMatrix *decoding = matrix_acquire(FEC_MATRIX_DECODING, k, m, erased);
+	if(!decoding)
+		return CHIAKI_ERR_FEC_FAILED;
+	int *matrix = decoding->matrix;
+	int *dm_ids = matrix + k * k;
+
+	ChiakiGf256Impl impl = chiaki_gf256_impl_best();
+	const uint8_t *srcs[CHIAKI_FEC_UNITS_MAX];
+	for(unsigned int j=0; j<k; j++)
+		srcs[j] = frame_buf + stride * dm_ids[j];
+	const uint8_t *row_srcs[CHIAKI_FEC_UNITS_MAX];
+	uint8_t coefs[CHIAKI_FEC_UNITS_MAX];
+	for(unsigned int i=0; i<k; i++)
+	{
+		if(!(erased[i / 64] & (1ULL << (i % 64))))
+			continue;
+		size_t count = 0;
+		for(unsigned int j=0; j<k; j++)
+		{
+			int coef = matrix[i * k + j];
+			if(!coef)
+				continue;
+			row_srcs[count] = srcs[j];
+			coefs[count++] = (uint8_t)coef;
+		}
+		chiaki_gf256_dotprod(impl, frame_buf + stride * i, row_srcs, coefs, count, unit_size);
+	}
+
+	matrix_release(decoding);
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_decode(uint8_t *frame_buf, size_t unit_size, size_t stride, unsigned int k, unsigned int m, const unsigned int *erasures, size_t erasures_count)
+{
+	if(stride < unit_size || !k || k + m > CHIAKI_FEC_UNITS_MAX)
+		return CHIAKI_ERR_INVALID_DATA;
+
+	uint64_t erased[ERASED_WORDS] = { 0 };
+	size_t erased_count = 0;
+	size_t source_erased_count = 0;
+	for(size_t i=0; i<erasures_count; i++)
+	{
+		unsigned int e = erasures[i];
+		if(e >= k + m)
+			return CHIAKI_ERR_INVALID_DATA;
+		if(erased[e / 64] & (1ULL << (e % 64)))
+			continue;
+		erased[e / 64] |= 1ULL << (e % 64);
+		erased_count++;
+		if(e < k)
+			source_erased_count++;
+	}
+	if(erased_count > m)
+		return CHIAKI_ERR_FEC_FAILED;
+	if(!source_erased_count)
+		return CHIAKI_ERR_SUCCESS;
+
+	if(chiaki_fec_get_engine() == CHIAKI_FEC_ENGINE_BITMATRIX)
+		return decode_bitmatrix(frame_buf, unit_size, stride, k, m, erased, source_erased_count);
+	return decode_matrix(frame_buf, unit_size, stride, k, m, erased);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_encode(uint8_t *frame_buf, size_t unit_size, size_t stride, unsigned int k, unsigned int m)
+{
+	if(stride < unit_size || !k || k + m > CHIAKI_FEC_UNITS_MAX)
+		return CHIAKI_ERR_INVALID_DATA;
+
+	FecMatrix *coding = matrix_acquire(FEC_MATRIX_CODING, k, m, NULL);
+	if(!coding)
+		return CHIAKI_ERR_MEMORY;
+	int *matrix = coding->matrix;
+
+	ChiakiGf256Impl impl = chiaki_gf256_impl_best();
+	const uint8_t *srcs[CHIAKI_FEC_UNITS_MAX];
+	for(unsigned int j=0; j<k; j++)
+		srcs[j] = frame_buf + stride * j;
+	uint8_t coefs[CHIAKI_FEC_UNITS_MAX];
+	for(unsigned int i=0; i<m; i++)
+	{
+		for(unsigned int j=0; j<k; j++)
+			coefs[j] = (uint8_t)matrix[i * k + j];
+		chiaki_gf256_dotprod(impl, frame_buf + stride * (k + i), srcs, coefs, k, unit_size);
+	}
 
-	free(coding_ptrs);
-error_data_ptrs:
-	free(data_ptrs);
-error_jerasures:
-	free(jerasures);
-error_matrix:
-	free(matrix);
-	return err;
+	matrix_release(coding);
+	return CHIAKI_ERR_SUCCESS;
 }
@@ -3,6 +3,8 @@
 
 #include <libavcodec/avcodec.h>
 
+#include <string.h>
+
 static enum AVCodecID chiaki_codec_av_codec_id(ChiakiCodec codec)
 {
 	switch(codec)
@@ -105,18 +107,12 @@ CHIAKI_EXPORT void chiaki_ffmpeg_decoder_fini(ChiakiFfmpegDecoder *decoder)
 		av_buffer_unref(&decoder->hw_device_ctx);
 }
 
-CHIAKI_EXPORT bool chiaki_ffmpeg_decoder_video_sample_cb(uint8_t *buf, size_t buf_size, void *user)
+static bool decoder_send_packet(ChiakiFfmpegDecoder *decoder, AVPacket *packet)
 {
-	ChiakiFfmpegDecoder *decoder = user;
-
 	chiaki_mutex_lock(&decoder->mutex);
-	AVPacket packet;
-	av_init_packet(&packet);
-	packet.data = buf;
-	packet.size = buf_size;
 	int r;
 send_packet:
-	r = avcodec_send_packet(decoder->codec_context, &packet);
+	r = avcodec_send_packet(decoder->codec_context, packet);
 	if(r != 0)
 	{
 		if(r == AVERROR(EAGAIN))
@@ -154,6 +150,39 @@ hell:
 	return false;
 }
 
+CHIAKI_EXPORT bool chiaki_ffmpeg_decoder_video_sample_cb(uint8_t *buf, size_t buf_size, void *user)
+{
+	ChiakiFfmpegDecoder *decoder = user;
+
+	AVPacket packet;
+	av_init_packet(&packet);
+	packet.data = buf;
+	packet.size = buf_size;
+	return decoder_send_packet(decoder, &packet);
+}
+
+CHIAKI_EXPORT bool chiaki_ffmpeg_decoder_video_sample_gather_cb(ChiakiVideoSampleSegment *segments, size_t segments_count, size_t frame_size, void *user)
+{
+	ChiakiFfmpegDecoder *decoder = user;
+
+	// gather directly into a refcounted packet, so avcodec does not have to copy it once more
+	AVPacket packet;
+	if(av_new_packet(&packet, (int)frame_size) < 0)
+	{
+		CHIAKI_LOGE(decoder->log, "Failed to alloc AVPacket");
+		return false;
+	}
+	size_t cur = 0;
+	for(size_t i=0; i<segments_count; i++)
+	{
+		memcpy(packet.data + cur, segments[i].data, segments[i].size);
+		cur += segments[i].size;
+	}
+	bool r = decoder_send_packet(decoder, &packet);
+	av_packet_unref(&packet);
+	return r;
+}
+
 static AVFrame *pull_from_hw(ChiakiFfmpegDecoder *decoder, AVFrame *hw_frame)
 {
 	AVFrame *sw_frame = av_frame_alloc();
@@ -13,32 +13,31 @@
 #include <arpa/inet.h>
 #endif
 
-CHIAKI_EXPORT void chiaki_stream_stats_reset(ChiakiStreamStats *stats)
+struct chiaki_frame_unit_t
 {
-	stats->frames = 0;
-	stats->bytes = 0;
-}
+	size_t data_size;
+	uint8_t *data; // either inside buf or the unit's slot in frame_buf, NULL if not available
+	ChiakiPacketBuf *buf; // referenced packet buffer or NULL, also for slots of units that have not been received
+};
 
-CHIAKI_EXPORT void chiaki_stream_stats_frame(ChiakiStreamStats *stats, uint64_t size)
+static inline bool frame_processor_unit_received(ChiakiFrameProcessor *frame_processor, size_t i)
 {
-	stats->frames++;
-	stats->bytes += size;
-	//float br = (float)chiaki_stream_stats_bitrate(stats, 60) / 1000000.0f;
-	//CHIAKI_LOGD(NULL, "bitrate: %f", br);
+	return (frame_processor->units_received[i / 64] >> (i % 64)) & 1;
 }
 
-CHIAKI_EXPORT uint64_t chiaki_stream_stats_bitrate(ChiakiStreamStats *stats, uint64_t framerate)
+static void frame_processor_release_units(ChiakiFrameProcessor *frame_processor)
 {
-	return (stats->bytes * 8 * framerate) / stats->frames;
+	for(size_t i=0; i<frame_processor->unit_slots_size; i++)
+	{
+		ChiakiFrameUnit *unit = frame_processor->unit_slots + i;
+		if(!unit->buf)
+			continue;
+		chiaki_packet_buf_unref(unit->buf);
+		unit->buf = NULL;
+		unit->data = NULL;
+	}
 }
 
-#define UNIT_SLOTS_MAX 256
-
-struct chiaki_frame_unit_t
-{
-	size_t data_size;
-};
-
 CHIAKI_EXPORT void chiaki_frame_processor_init(ChiakiFrameProcessor *frame_processor, ChiakiLog *log)
 {
 	frame_processor->log = log;
@@ -52,102 +51,135 @@ CHIAKI_EXPORT void chiaki_frame_processor_init(ChiakiFrameProcessor *frame_proce
 	frame_processor->units_fec_received = 0;
 	frame_processor->unit_slots = NULL;
 	frame_processor->unit_slots_size = 0;
+	frame_processor->unit_slots_capacity = 0;
+	frame_processor->segments = NULL;
+	memset(frame_processor->units_received, 0, sizeof(frame_processor->units_received));
 	frame_processor->flushed = true;
-	chiaki_stream_stats_reset(&frame_processor->stream_stats);
+	frame_processor->recv_time_first_us = 0;
+	frame_processor->recv_time_last_us = 0;
+	frame_processor->slices_scanned = 0;
+	frame_processor->slices_unit = 0;
+	frame_processor->slices_offset = 0;
+	frame_processor->slices_size = 0;
 }
 
 CHIAKI_EXPORT void chiaki_frame_processor_fini(ChiakiFrameProcessor *frame_processor)
 {
+	frame_processor_release_units(frame_processor);
 	free(frame_processor->frame_buf);
 	free(frame_processor->unit_slots);
+	free(frame_processor->segments);
+}
+
+static ChiakiErrorCode frame_processor_reserve(ChiakiFrameProcessor *frame_processor, size_t unit_slots_size, size_t stride)
+{
+	if(unit_slots_size > frame_processor->unit_slots_capacity)
+	{
+		ChiakiFrameUnit *unit_slots = realloc(frame_processor->unit_slots, unit_slots_size * sizeof(ChiakiFrameUnit));
+		if(!unit_slots)
+			return CHIAKI_ERR_MEMORY;
+		memset(unit_slots + frame_processor->unit_slots_capacity, 0,
+				(unit_slots_size - frame_processor->unit_slots_capacity) * sizeof(ChiakiFrameUnit));
+		frame_processor->unit_slots = unit_slots;
+
+		ChiakiVideoSampleSegment *segments = realloc(frame_processor->segments, unit_slots_size * sizeof(ChiakiVideoSampleSegment));
+		if(!segments)
+			return CHIAKI_ERR_MEMORY;
+		frame_processor->segments = segments;
+		frame_processor->unit_slots_capacity = unit_slots_size;
+	}
+
+	if(unit_slots_size > SIZE_MAX / stride)
+		return CHIAKI_ERR_OVERFLOW;
+	size_t frame_buf_size_required = unit_slots_size * stride;
+	if(frame_processor->frame_buf_size < frame_buf_size_required)
+	{
+		free(frame_processor->frame_buf);
+		frame_processor->frame_buf = malloc(frame_buf_size_required + CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
+		if(!frame_processor->frame_buf)
+		{
+			frame_processor->frame_buf_size = 0;
+			return CHIAKI_ERR_MEMORY;
+		}
+		frame_processor->frame_buf_size = frame_buf_size_required;
+	}
+
+	return CHIAKI_ERR_SUCCESS;
 }
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_alloc_frame(ChiakiFrameProcessor *frame_processor, ChiakiTakionAVPacket *packet)
 {
+	frame_processor_release_units(frame_processor);
+
+	// until the new frame is set up, it has no units and flushing it fails
+	frame_processor->flushed = false;
+	frame_processor->units_source_expected = 0;
+	frame_processor->units_fec_expected = 0;
+	frame_processor->units_source_received = 0;
+	frame_processor->units_fec_received = 0;
+	frame_processor->unit_slots_size = 0;
+	frame_processor->recv_time_first_us = 0;
+	frame_processor->recv_time_last_us = 0;
+	frame_processor->slices_scanned = 0;
+	frame_processor->slices_unit = 0;
+	frame_processor->slices_offset = 0;
+	frame_processor->slices_size = 0;
+	memset(frame_processor->units_received, 0, sizeof(frame_processor->units_received));
+
 	if(packet->units_in_frame_total < packet->units_in_frame_fec)
 	{
 		CHIAKI_LOGE(frame_processor->log, "Packet has units_in_frame_total < units_in_frame_fec");
 		return CHIAKI_ERR_INVALID_DATA;
 	}
 
-	frame_processor->flushed = false;
-	frame_processor->units_source_expected = packet->units_in_frame_total - packet->units_in_frame_fec;
-	frame_processor->units_fec_expected = packet->units_in_frame_fec;
-	if(frame_processor->units_fec_expected < 1)
-		frame_processor->units_fec_expected = 1;
+	unsigned int units_source_expected = packet->units_in_frame_total - packet->units_in_frame_fec;
+	unsigned int units_fec_expected = packet->units_in_frame_fec;
+	if(units_fec_expected < 1)
+		units_fec_expected = 1;
 
-	frame_processor->buf_size_per_unit = packet->data_size;
-	if(packet->is_video && packet->unit_index < frame_processor->units_source_expected)
+	size_t buf_size_per_unit = packet->data_size;
+	if(packet->is_video && packet->unit_index < units_source_expected)
 	{
 		if(packet->data_size < 2)
 		{
 			CHIAKI_LOGE(frame_processor->log, "Packet too small to read buf size extension");
 			return CHIAKI_ERR_BUF_TOO_SMALL;
 		}
-		frame_processor->buf_size_per_unit += ntohs(((chiaki_unaligned_uint16_t *)packet->data)[0]);
+		buf_size_per_unit += ntohs(((chiaki_unaligned_uint16_t *)packet->data)[0]);
 	}
-	frame_processor->buf_stride_per_unit = ((frame_processor->buf_size_per_unit + 0xf) / 0x10) * 0x10;
 
-	if(frame_processor->buf_size_per_unit == 0)
+	if(buf_size_per_unit == 0)
 	{
 		CHIAKI_LOGE(frame_processor->log, "Frame Processor doesn't handle empty units");
 		return CHIAKI_ERR_BUF_TOO_SMALL;
 	}
 
-	frame_processor->units_source_received = 0;
-	frame_processor->units_fec_received = 0;
-
-	size_t unit_slots_size_required = frame_processor->units_source_expected + frame_processor->units_fec_expected;
-	if(unit_slots_size_required > UNIT_SLOTS_MAX)
+	size_t unit_slots_size = units_source_expected + units_fec_expected;
+	if(unit_slots_size > CHIAKI_FRAME_PROCESSOR_UNITS_MAX)
 	{
-		CHIAKI_LOGE(frame_processor->log, "Packet suggests more than %u unit slots", UNIT_SLOTS_MAX);
+		CHIAKI_LOGE(frame_processor->log, "Packet suggests more than %u unit slots", CHIAKI_FRAME_PROCESSOR_UNITS_MAX);
 		return CHIAKI_ERR_INVALID_DATA;
 	}
-	if(unit_slots_size_required != frame_processor->unit_slots_size)
-	{
-		void *new_ptr = NULL;
-		if(frame_processor->unit_slots)
-		{
-			new_ptr = realloc(frame_processor->unit_slots, unit_slots_size_required * sizeof(ChiakiFrameUnit));
-			if(!new_ptr)
-				free(frame_processor->unit_slots);
-		}
-		else
-			new_ptr = malloc(unit_slots_size_required * sizeof(ChiakiFrameUnit));
 
-		frame_processor->unit_slots = new_ptr;
-		if(!new_ptr)
-		{
-			frame_processor->unit_slots_size = 0;
-			return CHIAKI_ERR_MEMORY;
-		}
-		else
-			frame_processor->unit_slots_size = unit_slots_size_required;
-	}
-	memset(frame_processor->unit_slots, 0, frame_processor->unit_slots_size * sizeof(ChiakiFrameUnit));
+	size_t buf_stride_per_unit = ((buf_size_per_unit + 0xf) / 0x10) * 0x10;
+	ChiakiErrorCode err = frame_processor_reserve(frame_processor, unit_slots_size, buf_stride_per_unit);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
 
-	if(frame_processor->unit_slots_size > SIZE_MAX / frame_processor->buf_stride_per_unit)
-		return CHIAKI_ERR_OVERFLOW;
-	size_t frame_buf_size_required = frame_processor->unit_slots_size * frame_processor->buf_stride_per_unit;
-	if(frame_processor->frame_buf_size < frame_buf_size_required)
-	{
-		free(frame_processor->frame_buf);
-		frame_processor->frame_buf = malloc(frame_buf_size_required + CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
-		if(!frame_processor->frame_buf)
-		{
-			frame_processor->frame_buf_size = 0;
-			return CHIAKI_ERR_MEMORY;
-		}
-		frame_processor->frame_buf_size = frame_buf_size_required;
-	}
-	memset(frame_processor->frame_buf, 0, frame_buf_size_required + CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
+	// neither unit_slots nor frame_buf are cleared here, units_received tells which slots are valid
+	// and chiaki_frame_processor_fec() zeroes what it needs.
+	frame_processor->units_source_expected = units_source_expected;
+	frame_processor->units_fec_expected = units_fec_expected;
+	frame_processor->buf_size_per_unit = buf_size_per_unit;
+	frame_processor->buf_stride_per_unit = buf_stride_per_unit;
+	frame_processor->unit_slots_size = unit_slots_size;
 
 	return CHIAKI_ERR_SUCCESS;
 }
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_put_unit(ChiakiFrameProcessor *frame_processor, ChiakiTakionAVPacket *packet)
 {
-	if(packet->unit_index > frame_processor->unit_slots_size)
+	if(packet->unit_index >= frame_processor->unit_slots_size)
 	{
 		CHIAKI_LOGE(frame_processor->log, "Packet's unit index is too high");
 		return CHIAKI_ERR_INVALID_DATA;
@@ -165,19 +197,29 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_put_unit(ChiakiFrameProcess
 		return CHIAKI_ERR_INVALID_DATA;
 	}
 
-	ChiakiFrameUnit *unit = frame_processor->unit_slots + packet->unit_index;
-	if(unit->data_size)
+	if(frame_processor_unit_received(frame_processor, packet->unit_index))
 	{
 		CHIAKI_LOGW(frame_processor->log, "Received duplicate unit");
 		return CHIAKI_ERR_INVALID_DATA;
 	}
+	frame_processor->units_received[packet->unit_index / 64] |= (uint64_t)1 << (packet->unit_index % 64);
 
+	ChiakiFrameUnit *unit = frame_processor->unit_slots + packet->unit_index;
 	unit->data_size = packet->data_size;
+	unit->data = NULL;
 	if(!frame_processor->flushed)
 	{
-		memcpy(frame_processor->frame_buf + packet->unit_index * frame_processor->buf_stride_per_unit,
-				packet->data,
-				packet->data_size);
+		if(packet->buf)
+		{
+			chiaki_packet_buf_ref(packet->buf);
+			unit->buf = packet->buf;
+			unit->data = packet->data;
+		}
+		else
+		{
+			unit->data = frame_processor->frame_buf + packet->unit_index * frame_processor->buf_stride_per_unit;
+			memcpy(unit->data, packet->data, packet->data_size);
+		}
 	}
 
 	if(packet->unit_index < frame_processor->units_source_expected)
@@ -185,6 +227,14 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_put_unit(ChiakiFrameProcess
 	else
 		frame_processor->units_fec_received++;
 
+	if(packet->recv_time_us)
+	{
+		if(!frame_processor->recv_time_first_us || packet->recv_time_us < frame_processor->recv_time_first_us)
+			frame_processor->recv_time_first_us = packet->recv_time_us;
+		if(packet->recv_time_us > frame_processor->recv_time_last_us)
+			frame_processor->recv_time_last_us = packet->recv_time_us;
+	}
+
 	return CHIAKI_ERR_SUCCESS;
 }
 
@@ -195,6 +245,33 @@ CHIAKI_EXPORT void chiaki_frame_processor_report_packet_stats(ChiakiFrameProcess
 	chiaki_packet_stats_push_generation(packet_stats, received, expected - received);
 }
 
+CHIAKI_EXPORT void chiaki_frame_processor_report_stream_stats(ChiakiFrameProcessor *frame_processor, ChiakiStreamStats *stream_stats, uint64_t now_us)
+{
+	uint64_t received = frame_processor->units_source_received + frame_processor->units_fec_received;
+	uint64_t expected = frame_processor->units_source_expected + frame_processor->units_fec_expected;
+	if(!expected)
+		return;
+
+	uint64_t bursts[CHIAKI_STREAM_STATS_BURST_BUCKETS] = { 0 };
+	size_t slots = expected < frame_processor->unit_slots_size ? expected : frame_processor->unit_slots_size;
+	unsigned int burst = 0;
+	for(size_t i=0; i<slots; i++)
+	{
+		if(!frame_processor_unit_received(frame_processor, i))
+		{
+			burst++;
+			continue;
+		}
+		if(burst)
+			bursts[chiaki_stream_stats_burst_bucket(burst)]++;
+		burst = 0;
+	}
+	if(burst)
+		bursts[chiaki_stream_stats_burst_bucket(burst)]++;
+
+	chiaki_stream_stats_push_units(stream_stats, now_us, received, expected - received, bursts);
+}
+
 static ChiakiErrorCode chiaki_frame_processor_fec(ChiakiFrameProcessor *frame_processor)
 {
 	CHIAKI_LOGI(frame_processor->log, "Frame Processor received %u+%u / %u+%u units, attempting FEC",
@@ -208,11 +285,15 @@ static ChiakiErrorCode chiaki_frame_processor_fec(ChiakiFrameProcessor *frame_pr
 	if(!erasures)
 		return CHIAKI_ERR_MEMORY;
 
+	// fec works in-place on frame_buf, so all referenced units have to be copied into their slots first.
+	// Units are zero-padded up to buf_size_per_unit for fec, which is only done here instead of clearing
+	// the whole frame_buf for every frame, and slots of missing units are zeroed for the decoder to fill.
 	size_t erasure_index = 0;
 	for(size_t i=0; i<frame_processor->units_source_expected + frame_processor->units_fec_expected; i++)
 	{
 		ChiakiFrameUnit *slot = frame_processor->unit_slots + i;
-		if(!slot->data_size)
+		uint8_t *buf_ptr = frame_processor->frame_buf + frame_processor->buf_stride_per_unit * i;
+		if(!frame_processor_unit_received(frame_processor, i))
 		{
 			if(erasure_index >= erasures_count)
 			{
@@ -222,7 +303,20 @@ static ChiakiErrorCode chiaki_frame_processor_fec(ChiakiFrameProcessor *frame_pr
 				return CHIAKI_ERR_UNKNOWN;
 			}
 			erasures[erasure_index++] = (unsigned int)i;
+			slot->data_size = 0;
+			slot->data = NULL;
+			memset(buf_ptr, 0, frame_processor->buf_size_per_unit);
+			continue;
 		}
+		if(slot->buf)
+		{
+			memcpy(buf_ptr, slot->data, slot->data_size);
+			chiaki_packet_buf_unref(slot->buf);
+			slot->buf = NULL;
+			slot->data = buf_ptr;
+		}
+		if(slot->data_size < frame_processor->buf_size_per_unit)
+			memset(buf_ptr + slot->data_size, 0, frame_processor->buf_size_per_unit - slot->data_size);
 	}
 	assert(erasure_index == erasures_count);
 
@@ -255,6 +349,7 @@ static ChiakiErrorCode chiaki_frame_processor_fec(ChiakiFrameProcessor *frame_pr
 				continue;
 			}
 			slot->data_size = frame_processor->buf_size_per_unit - padding;
+			slot->data = buf_ptr;
 		}
 	}
 
@@ -265,7 +360,10 @@ static ChiakiErrorCode chiaki_frame_processor_fec(ChiakiFrameProcessor *frame_pr
 CHIAKI_EXPORT ChiakiFrameProcessorFlushResult chiaki_frame_processor_flush(ChiakiFrameProcessor *frame_processor, uint8_t **frame, size_t *frame_size)
 {
 	if(frame_processor->units_source_expected == 0 || frame_processor->flushed)
+	{
+		frame_processor->flushed = true;
 		return CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FAILED;
+	}
 
 	//CHIAKI_LOGD(NULL, "source: %u, fec: %u",
 	//		frame_processor->units_source_expected,
@@ -282,10 +380,12 @@ CHIAKI_EXPORT ChiakiFrameProcessorFlushResult chiaki_frame_processor_flush(Chiak
 	}
 
 	size_t cur = 0;
-	for(size_t i=0; i<frame_processor->units_source_expected; i++)
+	for(size_t i=frame_processor->slices_unit; i<frame_processor->units_source_expected; i++)
 	{
 		ChiakiFrameUnit *unit = frame_processor->unit_slots + i;
-		if(!unit->data_size)
+		// slots of units that were not received are only valid if fec restored them
+		if((!frame_processor_unit_received(frame_processor, i) && result != CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_SUCCESS)
+			|| !unit->data_size || !unit->data)
 		{
 			CHIAKI_LOGW(frame_processor->log, "Missing unit %#llx", (unsigned long long)i);
 			continue;
@@ -293,18 +393,168 @@ CHIAKI_EXPORT ChiakiFrameProcessorFlushResult chiaki_frame_processor_flush(Chiak
 		if(unit->data_size < 2)
 		{
 			CHIAKI_LOGE(frame_processor->log, "Saved unit has size < 2");
-			chiaki_log_hexdump(frame_processor->log, CHIAKI_LOG_VERBOSE, frame_processor->frame_buf + i*frame_processor->buf_size_per_unit, 0x50);
+			chiaki_log_hexdump(frame_processor->log, CHIAKI_LOG_VERBOSE, unit->data, unit->data_size);
 			continue;
 		}
-		size_t part_size = unit->data_size - 2;
-		uint8_t *buf_ptr = frame_processor->frame_buf + i*frame_processor->buf_stride_per_unit;
-		memmove(frame_processor->frame_buf + cur, buf_ptr + 2, part_size);
+		// the start of the frame may already have been handed out as slices
+		size_t offset = i == frame_processor->slices_unit ? frame_processor->slices_offset : 0;
+		size_t part_size = unit->data_size - 2 - offset;
+		// units in frame_buf may overlap with the destination, referenced ones are only copied once here
+		memmove(frame_processor->frame_buf + cur, unit->data + 2 + offset, part_size);
 		cur += part_size;
 	}
 
-	chiaki_stream_stats_frame(&frame_processor->stream_stats, (uint64_t)cur);
+	frame_processor_release_units(frame_processor);
+	frame_processor->flushed = true;
+	memset(frame_processor->frame_buf + cur, 0, CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
 
 	*frame = frame_processor->frame_buf;
 	*frame_size = cur;
 	return result;
 }
+
+CHIAKI_EXPORT ChiakiFrameProcessorFlushResult chiaki_frame_processor_flush_segments(ChiakiFrameProcessor *frame_processor,
+		ChiakiVideoSampleSegment **segments, size_t *segments_count, size_t *frame_size)
+{
+	if(frame_processor->units_source_expected == 0 || frame_processor->flushed)
+	{
+		frame_processor->flushed = true;
+		return CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FAILED;
+	}
+
+	ChiakiFrameProcessorFlushResult result = CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_SUCCESS;
+	if(frame_processor->units_source_received < frame_processor->units_source_expected)
+	{
+		// fec leaves all units in their slots of frame_buf, which are handed out from there just like referenced ones
+		ChiakiErrorCode err = chiaki_frame_processor_fec(frame_processor);
+		if(err == CHIAKI_ERR_SUCCESS)
+			result = CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_SUCCESS;
+		else
+			result = CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_FAILED;
+	}
+
+	size_t count = 0;
+	size_t size = 0;
+	for(size_t i=frame_processor->slices_unit; i<frame_processor->units_source_expected; i++)
+	{
+		ChiakiFrameUnit *unit = frame_processor->unit_slots + i;
+		// slots of units that were not received are only valid if fec restored them
+		if((!frame_processor_unit_received(frame_processor, i) && result != CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_SUCCESS)
+			|| !unit->data_size || !unit->data)
+		{
+			CHIAKI_LOGW(frame_processor->log, "Missing unit %#llx", (unsigned long long)i);
+			continue;
+		}
+		if(unit->data_size < 2)
+		{
+			CHIAKI_LOGE(frame_processor->log, "Saved unit has size < 2");
+			chiaki_log_hexdump(frame_processor->log, CHIAKI_LOG_VERBOSE, unit->data, unit->data_size);
+			continue;
+		}
+		size_t offset = i == frame_processor->slices_unit ? frame_processor->slices_offset : 0;
+		if(unit->data_size - 2 == offset)
+			continue;
+		ChiakiVideoSampleSegment *segment = &frame_processor->segments[count++];
+		segment->data = unit->data + 2 + offset;
+		segment->size = unit->data_size - 2 - offset;
+		segment->buf = unit->buf;
+		size += segment->size;
+	}
+	frame_processor->flushed = true;
+
+	*segments = frame_processor->segments;
+	*segments_count = count;
+	*frame_size = size;
+	return result;
+}
+
+CHIAKI_EXPORT void chiaki_frame_processor_release_units(ChiakiFrameProcessor *frame_processor)
+{
+	frame_processor_release_units(frame_processor);
+}
+
+/**
+ * Find the last Annex B start code in the payload of unit.
+ *
+ * @param offset will receive its offset, including zeros in front of it
+ * @return whether there is any
+ */
+static bool frame_processor_unit_last_start_code(ChiakiFrameUnit *unit, size_t *offset)
+{
+	const uint8_t *payload = unit->data + 2;
+	size_t size = unit->data_size - 2;
+	bool found = false;
+	size_t r = 0;
+	// emulation prevention makes sure 00 00 01 can't appear anywhere else.
+	// Start codes spanning two units are not found, which only delays handing out their nal unit.
+	const uint8_t *p = payload + 2;
+	while(p < payload + size)
+	{
+		p = memchr(p, 1, size - (size_t)(p - payload));
+		if(!p)
+			break;
+		if(!p[-1] && !p[-2])
+		{
+			r = (size_t)(p - 2 - payload);
+			found = true;
+		}
+		p++;
+	}
+	// the zero_byte of 4 byte start codes belongs to the next nal unit
+	while(r > 0 && !payload[r - 1])
+		r--;
+	*offset = r;
+	return found;
+}
+
+CHIAKI_EXPORT bool chiaki_frame_processor_flush_slices(ChiakiFrameProcessor *frame_processor,
+		ChiakiVideoSampleSegment **segments, size_t *segments_count, size_t *size)
+{
+	if(frame_processor->flushed)
+		return false;
+
+	// find the last nal unit boundary in the source units that have newly been received without gaps
+	unsigned int end_unit = frame_processor->slices_unit;
+	size_t end_offset = frame_processor->slices_offset;
+	unsigned int i;
+	for(i=frame_processor->slices_scanned; i<frame_processor->units_source_expected; i++)
+	{
+		ChiakiFrameUnit *unit = frame_processor->unit_slots + i;
+		if(!frame_processor_unit_received(frame_processor, i) || !unit->data || unit->data_size < 2)
+			break;
+		size_t offset;
+		if(frame_processor_unit_last_start_code(unit, &offset))
+		{
+			end_unit = i;
+			end_offset = offset;
+		}
+	}
+	frame_processor->slices_scanned = i;
+
+	size_t count = 0;
+	size_t total = 0;
+	for(i=frame_processor->slices_unit; i<=end_unit && i<frame_processor->units_source_expected; i++)
+	{
+		ChiakiFrameUnit *unit = frame_processor->unit_slots + i;
+		size_t begin = i == frame_processor->slices_unit ? frame_processor->slices_offset : 0;
+		size_t end = i == end_unit ? end_offset : unit->data_size - 2;
+		if(end <= begin)
+			continue;
+		ChiakiVideoSampleSegment *segment = &frame_processor->segments[count++];
+		segment->data = unit->data + 2 + begin;
+		segment->size = end - begin;
+		segment->buf = unit->buf;
+		total += segment->size;
+	}
+	if(!count)
+		return false;
+
+	frame_processor->slices_unit = end_unit;
+	frame_processor->slices_offset = end_offset;
+	frame_processor->slices_size += total;
+
+	*segments = frame_processor->segments;
+	*segments_count = count;
+	*size = total;
+	return true;
+}
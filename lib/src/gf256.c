@@ -0,0 +1,352 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/gf256.h>
+
+#include "atomic.h"
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define GF256_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) || defined(_M_ARM64)
+#define GF256_NEON
+#include <arm_neon.h>
+#endif
+
+/*
+ * Every kernel multiplies with the split-nibble method: c * x = c * (x & 0xf) ^ c * (x & 0xf0),
+ * each half looked up in a 16 byte table per coefficient, which is exactly what a byte shuffle does.
+ */
+
+#define TABLE_SIZE 32 // low nibble products followed by high nibble products
+#define SRCS_PER_PASS 256 // sources whose tables fit on the stack at once
+
+static inline uint8_t gf256_xtime(uint8_t a)
+{
+	return (uint8_t)((a << 1) ^ (a & 0x80 ? CHIAKI_GF256_POLY & 0xff : 0));
+}
+
+CHIAKI_EXPORT uint8_t chiaki_gf256_mul(uint8_t a, uint8_t b)
+{
+	uint8_t r = 0;
+	while(b)
+	{
+		if(b & 1)
+			r ^= a;
+		a = gf256_xtime(a);
+		b >>= 1;
+	}
+	return r;
+}
+
+static void table_init(uint8_t *table, uint8_t c)
+{
+	uint8_t powers[8]; // c * 2^i
+	powers[0] = c;
+	for(size_t i=1; i<8; i++)
+		powers[i] = gf256_xtime(powers[i - 1]);
+	table[0] = 0;
+	table[16] = 0;
+	for(unsigned int bit=0; bit<4; bit++)
+	{
+		for(unsigned int x=1u<<bit; x<2u<<bit; x++)
+		{
+			table[x] = table[x - (1u << bit)] ^ powers[bit];
+			table[16 + x] = table[16 + x - (1u << bit)] ^ powers[bit + 4];
+		}
+	}
+}
+
+/**
+ * Handles bytes from start to size, used for everything the vector kernels leave over.
+ */
+static void dotprod_scalar(uint8_t *dst, const uint8_t *const *srcs, const uint8_t (*tables)[TABLE_SIZE],
+		size_t count, size_t start, size_t size, bool add)
+{
+	for(size_t j=0; j<count; j++)
+	{
+		const uint8_t *src = srcs[j];
+		const uint8_t *table = tables[j];
+		if(!add && j == 0)
+		{
+			for(size_t i=start; i<size; i++)
+				dst[i] = table[src[i] & 0xf] ^ table[16 + (src[i] >> 4)];
+		}
+		else
+		{
+			for(size_t i=start; i<size; i++)
+				dst[i] ^= table[src[i] & 0xf] ^ table[16 + (src[i] >> 4)];
+		}
+	}
+}
+
+#ifdef GF256_X86
+
+__attribute__((target("ssse3")))
+static size_t dotprod_ssse3(uint8_t *dst, const uint8_t *const *srcs, const uint8_t (*tables)[TABLE_SIZE],
+		size_t count, size_t start, size_t size, bool add)
+{
+	const __m128i mask = _mm_set1_epi8(0x0f);
+	size_t i = start;
+	for(; i + 16 <= size; i += 16)
+	{
+		__m128i acc = add ? _mm_loadu_si128((const __m128i *)(dst + i)) : _mm_setzero_si128();
+		for(size_t j=0; j<count; j++)
+		{
+			__m128i lo = _mm_loadu_si128((const __m128i *)tables[j]);
+			__m128i hi = _mm_loadu_si128((const __m128i *)(tables[j] + 16));
+			__m128i x = _mm_loadu_si128((const __m128i *)(srcs[j] + i));
+			acc = _mm_xor_si128(acc, _mm_shuffle_epi8(lo, _mm_and_si128(x, mask)));
+			acc = _mm_xor_si128(acc, _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(x, 4), mask)));
+		}
+		_mm_storeu_si128((__m128i *)(dst + i), acc);
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+static size_t dotprod_avx2(uint8_t *dst, const uint8_t *const *srcs, const uint8_t (*tables)[TABLE_SIZE],
+		size_t count, size_t start, size_t size, bool add)
+{
+	const __m256i mask = _mm256_set1_epi8(0x0f);
+	size_t i = start;
+	for(; i + 64 <= size; i += 64)
+	{
+		__m256i acc0 = add ? _mm256_loadu_si256((const __m256i *)(dst + i)) : _mm256_setzero_si256();
+		__m256i acc1 = add ? _mm256_loadu_si256((const __m256i *)(dst + i + 32)) : _mm256_setzero_si256();
+		for(size_t j=0; j<count; j++)
+		{
+			__m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)tables[j]));
+			__m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(tables[j] + 16)));
+			__m256i x0 = _mm256_loadu_si256((const __m256i *)(srcs[j] + i));
+			__m256i x1 = _mm256_loadu_si256((const __m256i *)(srcs[j] + i + 32));
+			acc0 = _mm256_xor_si256(acc0, _mm256_shuffle_epi8(lo, _mm256_and_si256(x0, mask)));
+			acc0 = _mm256_xor_si256(acc0, _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi64(x0, 4), mask)));
+			acc1 = _mm256_xor_si256(acc1, _mm256_shuffle_epi8(lo, _mm256_and_si256(x1, mask)));
+			acc1 = _mm256_xor_si256(acc1, _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi64(x1, 4), mask)));
+		}
+		_mm256_storeu_si256((__m256i *)(dst + i), acc0);
+		_mm256_storeu_si256((__m256i *)(dst + i + 32), acc1);
+	}
+	for(; i + 32 <= size; i += 32)
+	{
+		__m256i acc = add ? _mm256_loadu_si256((const __m256i *)(dst + i)) : _mm256_setzero_si256();
+		for(size_t j=0; j<count; j++)
+		{
+			__m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)tables[j]));
+			__m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(tables[j] + 16)));
+			__m256i x = _mm256_loadu_si256((const __m256i *)(srcs[j] + i));
+			acc = _mm256_xor_si256(acc, _mm256_shuffle_epi8(lo, _mm256_and_si256(x, mask)));
+			acc = _mm256_xor_si256(acc, _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi64(x, 4), mask)));
+		}
+		_mm256_storeu_si256((__m256i *)(dst + i), acc);
+	}
+	return i;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static size_t dotprod_avx512(uint8_t *dst, const uint8_t *const *srcs, const uint8_t (*tables)[TABLE_SIZE],
+		size_t count, size_t start, size_t size, bool add)
+{
+	const __m512i mask = _mm512_set1_epi8(0x0f);
+	size_t i = start;
+	for(; i + 128 <= size; i += 128)
+	{
+		__m512i acc0 = add ? _mm512_loadu_si512((const void *)(dst + i)) : _mm512_setzero_si512();
+		__m512i acc1 = add ? _mm512_loadu_si512((const void *)(dst + i + 64)) : _mm512_setzero_si512();
+		for(size_t j=0; j<count; j++)
+		{
+			__m512i lo = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)tables[j]));
+			__m512i hi = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)(tables[j] + 16)));
+			__m512i x0 = _mm512_loadu_si512((const void *)(srcs[j] + i));
+			__m512i x1 = _mm512_loadu_si512((const void *)(srcs[j] + i + 64));
+			acc0 = _mm512_xor_si512(acc0, _mm512_shuffle_epi8(lo, _mm512_and_si512(x0, mask)));
+			acc0 = _mm512_xor_si512(acc0, _mm512_shuffle_epi8(hi, _mm512_and_si512(_mm512_srli_epi64(x0, 4), mask)));
+			acc1 = _mm512_xor_si512(acc1, _mm512_shuffle_epi8(lo, _mm512_and_si512(x1, mask)));
+			acc1 = _mm512_xor_si512(acc1, _mm512_shuffle_epi8(hi, _mm512_and_si512(_mm512_srli_epi64(x1, 4), mask)));
+		}
+		_mm512_storeu_si512((void *)(dst + i), acc0);
+		_mm512_storeu_si512((void *)(dst + i + 64), acc1);
+	}
+	for(; i + 64 <= size; i += 64)
+	{
+		__m512i acc = add ? _mm512_loadu_si512((const void *)(dst + i)) : _mm512_setzero_si512();
+		for(size_t j=0; j<count; j++)
+		{
+			__m512i lo = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)tables[j]));
+			__m512i hi = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)(tables[j] + 16)));
+			__m512i x = _mm512_loadu_si512((const void *)(srcs[j] + i));
+			acc = _mm512_xor_si512(acc, _mm512_shuffle_epi8(lo, _mm512_and_si512(x, mask)));
+			acc = _mm512_xor_si512(acc, _mm512_shuffle_epi8(hi, _mm512_and_si512(_mm512_srli_epi64(x, 4), mask)));
+		}
+		_mm512_storeu_si512((void *)(dst + i), acc);
+	}
+	return i;
+}
+
+#endif
+
+#ifdef GF256_NEON
+
+static size_t dotprod_neon(uint8_t *dst, const uint8_t *const *srcs, const uint8_t (*tables)[TABLE_SIZE],
+		size_t count, size_t start, size_t size, bool add)
+{
+	const uint8x16_t mask = vdupq_n_u8(0x0f);
+	size_t i = start;
+	for(; i + 32 <= size; i += 32)
+	{
+		uint8x16_t acc0 = add ? vld1q_u8(dst + i) : vdupq_n_u8(0);
+		uint8x16_t acc1 = add ? vld1q_u8(dst + i + 16) : vdupq_n_u8(0);
+		for(size_t j=0; j<count; j++)
+		{
+			uint8x16_t lo = vld1q_u8(tables[j]);
+			uint8x16_t hi = vld1q_u8(tables[j] + 16);
+			uint8x16_t x0 = vld1q_u8(srcs[j] + i);
+			uint8x16_t x1 = vld1q_u8(srcs[j] + i + 16);
+			acc0 = veorq_u8(acc0, vqtbl1q_u8(lo, vandq_u8(x0, mask)));
+			acc0 = veorq_u8(acc0, vqtbl1q_u8(hi, vshrq_n_u8(x0, 4)));
+			acc1 = veorq_u8(acc1, vqtbl1q_u8(lo, vandq_u8(x1, mask)));
+			acc1 = veorq_u8(acc1, vqtbl1q_u8(hi, vshrq_n_u8(x1, 4)));
+		}
+		vst1q_u8(dst + i, acc0);
+		vst1q_u8(dst + i + 16, acc1);
+	}
+	for(; i + 16 <= size; i += 16)
+	{
+		uint8x16_t acc = add ? vld1q_u8(dst + i) : vdupq_n_u8(0);
+		for(size_t j=0; j<count; j++)
+		{
+			uint8x16_t x = vld1q_u8(srcs[j] + i);
+			acc = veorq_u8(acc, vqtbl1q_u8(vld1q_u8(tables[j]), vandq_u8(x, mask)));
+			acc = veorq_u8(acc, vqtbl1q_u8(vld1q_u8(tables[j] + 16), vshrq_n_u8(x, 4)));
+		}
+		vst1q_u8(dst + i, acc);
+	}
+	return i;
+}
+
+#endif
+
+/**
+ * Run the vector kernels of impl, wider ones first, each leaving what's too short for it to the next.
+ * @return end of the bytes processed, the rest is left for dotprod_scalar()
+ */
+static size_t dotprod_vector(ChiakiGf256Impl impl, uint8_t *dst, const uint8_t *const *srcs, const uint8_t (*tables)[TABLE_SIZE],
+		size_t count, size_t size, bool add)
+{
+	size_t done = 0;
+	switch(impl)
+	{
+#ifdef GF256_X86
+		case CHIAKI_GF256_IMPL_AVX512:
+			done = dotprod_avx512(dst, srcs, tables, count, done, size, add);
+			// fallthrough
+		case CHIAKI_GF256_IMPL_AVX2:
+			done = dotprod_avx2(dst, srcs, tables, count, done, size, add);
+			// fallthrough
+		case CHIAKI_GF256_IMPL_SSSE3:
+			done = dotprod_ssse3(dst, srcs, tables, count, done, size, add);
+			break;
+#endif
+#ifdef GF256_NEON
+		case CHIAKI_GF256_IMPL_NEON:
+			done = dotprod_neon(dst, srcs, tables, count, done, size, add);
+			break;
+#endif
+		default:
+			break;
+	}
+	return done;
+}
+
+CHIAKI_EXPORT const char *chiaki_gf256_impl_name(ChiakiGf256Impl impl)
+{
+	switch(impl)
+	{
+		case CHIAKI_GF256_IMPL_SCALAR:
+			return "scalar";
+		case CHIAKI_GF256_IMPL_SSSE3:
+			return "ssse3";
+		case CHIAKI_GF256_IMPL_AVX2:
+			return "avx2";
+		case CHIAKI_GF256_IMPL_AVX512:
+			return "avx512";
+		case CHIAKI_GF256_IMPL_NEON:
+			return "neon";
+		default:
+			return "unknown";
+	}
+}
+
+CHIAKI_EXPORT bool chiaki_gf256_impl_supported(ChiakiGf256Impl impl)
+{
+	switch(impl)
+	{
+		case CHIAKI_GF256_IMPL_SCALAR:
+			return true;
+#ifdef GF256_X86
+		case CHIAKI_GF256_IMPL_SSSE3:
+			return __builtin_cpu_supports("ssse3");
+		case CHIAKI_GF256_IMPL_AVX2:
+			return __builtin_cpu_supports("avx2");
+		case CHIAKI_GF256_IMPL_AVX512:
+			return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+#endif
+#ifdef GF256_NEON
+		case CHIAKI_GF256_IMPL_NEON:
+			return true;
+#endif
+		default:
+			return false;
+	}
+}
+
+static uint64_t impl_best = UINT64_MAX;
+
+CHIAKI_EXPORT ChiakiGf256Impl chiaki_gf256_impl_best(void)
+{
+	// racing threads all detect the same value
+	uint64_t best = chiaki_atomic_load_relaxed(&impl_best);
+	if(best != UINT64_MAX)
+		return (ChiakiGf256Impl)best;
+	best = CHIAKI_GF256_IMPL_SCALAR;
+	static const ChiakiGf256Impl preferred[] = {
+		CHIAKI_GF256_IMPL_AVX512,
+		CHIAKI_GF256_IMPL_AVX2,
+		CHIAKI_GF256_IMPL_SSSE3,
+		CHIAKI_GF256_IMPL_NEON
+	};
+	for(size_t i=0; i<sizeof(preferred) / sizeof(preferred[0]); i++)
+	{
+		if(chiaki_gf256_impl_supported(preferred[i]))
+		{
+			best = preferred[i];
+			break;
+		}
+	}
+	chiaki_atomic_store_relaxed(&impl_best, best);
+	return (ChiakiGf256Impl)best;
+}
+
+CHIAKI_EXPORT void chiaki_gf256_dotprod(ChiakiGf256Impl impl, uint8_t *dst, const uint8_t *const *srcs,
+		const uint8_t *coefs, size_t count, size_t size)
+{
+	if(!count)
+	{
+		for(size_t i=0; i<size; i++)
+			dst[i] = 0;
+		return;
+	}
+
+	uint8_t tables[SRCS_PER_PASS][TABLE_SIZE];
+	for(size_t pass=0; pass<count; pass+=SRCS_PER_PASS)
+	{
+		size_t pass_count = count - pass < SRCS_PER_PASS ? count - pass : SRCS_PER_PASS;
+		for(size_t j=0; j<pass_count; j++)
+			table_init(tables[j], coefs[pass + j]);
+		bool add = pass > 0;
+		size_t done = dotprod_vector(impl, dst, srcs + pass, (const uint8_t (*)[TABLE_SIZE])tables, pass_count, size, add);
+		dotprod_scalar(dst, srcs + pass, (const uint8_t (*)[TABLE_SIZE])tables, pass_count, done, size, add);
+	}
+}
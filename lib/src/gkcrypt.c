@@ -2,9 +2,11 @@
 
 #include <chiaki/gkcrypt.h>
 #include <chiaki/session.h>
+#include <chiaki/time.h>
 
 #include <string.h>
 #include <assert.h>
+#include <limits.h>
 
 #ifdef CHIAKI_LIB_ENABLE_MBEDTLS
 #include "mbedtls/aes.h"
@@ -17,13 +19,91 @@
 #include <openssl/sha.h>
 #endif
 
+#include "aeskernel.h"
+#include "atomic.h"
 #include "utils.h"
 
 #define KEY_BUF_CHUNK_SIZE 0x1000
+#define KEY_BUF_READER_NONE UINT64_MAX
+#define KEY_BUF_AWAKE UINT64_MAX
+#define KEY_BUF_LEAD_MS 50 // how much of the key stream to keep generated ahead of the requests at the estimated rate
+#define KEY_BUF_RATE_INTERVAL_US 10000 // minimal time between two samples of the request rate
+#define VERIFY_DECRYPT_CHUNK_SIZE 0x100 // hashed, then decrypted while it is still in the cache
+
+#if CHIAKI_AES_KERNEL_GMAC_LANES > CHIAKI_GKCRYPT_GMAC_CTXS_COUNT
+#error "The gmac contexts of packets calculated together must not evict each other"
+#endif
+
+/**
+ * What key_stream_ctx and the gmac contexts point to
+ */
+typedef struct gkcrypt_ctx_t
+{
+	ChiakiGKCryptImpl impl;
+	void *backend; // cipher context of the crypto backend if impl is CHIAKI_GKCRYPT_IMPL_BACKEND
+	ChiakiAesKernelKey kernel; // key of all other impls
+} GKCryptCtx;
 
 static ChiakiErrorCode gkcrypt_gen_key_iv(ChiakiGKCrypt *gkcrypt, uint8_t index, const uint8_t *handshake_key, const uint8_t *ecdh_secret);
 
 static void *gkcrypt_thread_func(void *user);
+static size_t gkcrypt_key_buf_lead_min(ChiakiGKCrypt *gkcrypt);
+
+static GKCryptCtx *gkcrypt_key_stream_ctx_new(const uint8_t *key);
+static GKCryptCtx *gkcrypt_key_stream_ctx(ChiakiGKCrypt *gkcrypt);
+static void gkcrypt_key_stream_ctx_free(GKCryptCtx *ctx);
+static void gkcrypt_gmac_ctx_free(GKCryptCtx *ctx);
+static ChiakiErrorCode gkcrypt_gen_key_stream(ChiakiGKCrypt *gkcrypt, GKCryptCtx *ctx, uint64_t key_pos, uint8_t *buf, size_t buf_size);
+
+static uint64_t impl_selected = UINT64_MAX; // UINT64_MAX for chiaki_gkcrypt_impl_best()
+
+CHIAKI_EXPORT const char *chiaki_gkcrypt_impl_name(ChiakiGKCryptImpl impl)
+{
+	switch(impl)
+	{
+		case CHIAKI_GKCRYPT_IMPL_BACKEND:
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+			return "mbedtls";
+#else
+			return "openssl";
+#endif
+		case CHIAKI_GKCRYPT_IMPL_AESNI:
+			return "aesni";
+		case CHIAKI_GKCRYPT_IMPL_ARMV8:
+			return "armv8";
+		default:
+			return "unknown";
+	}
+}
+
+CHIAKI_EXPORT bool chiaki_gkcrypt_impl_supported(ChiakiGKCryptImpl impl)
+{
+	if(impl == CHIAKI_GKCRYPT_IMPL_BACKEND)
+		return true;
+	return chiaki_aes_kernel_supported(impl);
+}
+
+CHIAKI_EXPORT ChiakiGKCryptImpl chiaki_gkcrypt_impl_best(void)
+{
+	if(chiaki_gkcrypt_impl_supported(CHIAKI_GKCRYPT_IMPL_AESNI))
+		return CHIAKI_GKCRYPT_IMPL_AESNI;
+	if(chiaki_gkcrypt_impl_supported(CHIAKI_GKCRYPT_IMPL_ARMV8))
+		return CHIAKI_GKCRYPT_IMPL_ARMV8;
+	return CHIAKI_GKCRYPT_IMPL_BACKEND;
+}
+
+CHIAKI_EXPORT void chiaki_gkcrypt_set_impl(ChiakiGKCryptImpl impl)
+{
+	chiaki_atomic_store_relaxed(&impl_selected, (uint64_t)impl);
+}
+
+CHIAKI_EXPORT ChiakiGKCryptImpl chiaki_gkcrypt_get_impl(void)
+{
+	uint64_t impl = chiaki_atomic_load_relaxed(&impl_selected);
+	if(impl == UINT64_MAX)
+		return chiaki_gkcrypt_impl_best();
+	return (ChiakiGKCryptImpl)impl;
+}
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_init(ChiakiGKCrypt *gkcrypt, ChiakiLog *log, size_t key_buf_chunks, uint8_t index, const uint8_t *handshake_key, const uint8_t *ecdh_secret)
 {
@@ -31,11 +111,19 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_init(ChiakiGKCrypt *gkcrypt, Chiaki
 	gkcrypt->index = index;
 
 	gkcrypt->key_buf_size = key_buf_chunks * KEY_BUF_CHUNK_SIZE;
-	gkcrypt->key_buf_populated = 0;
 	gkcrypt->key_buf_key_pos_min = 0;
-	gkcrypt->key_buf_start_offset = 0;
+	gkcrypt->key_buf_key_pos_max = 0;
+	gkcrypt->key_buf_reader_key_pos = KEY_BUF_READER_NONE;
+	gkcrypt->key_buf_wake_key_pos = KEY_BUF_AWAKE;
 	gkcrypt->last_key_pos = 0;
+	gkcrypt->key_buf_rate = 0;
+	gkcrypt->key_buf_rate_time_us = chiaki_time_now_monotonic_us();
+	gkcrypt->key_buf_rate_key_pos = 0;
+	memset(&gkcrypt->key_buf_stats, 0, sizeof(gkcrypt->key_buf_stats));
 	gkcrypt->key_buf_thread_stop = false;
+	gkcrypt->key_stream_ctx = NULL;
+	memset(gkcrypt->gmac_ctxs, 0, sizeof(gkcrypt->gmac_ctxs));
+	gkcrypt->gmac_ctxs_clock = 0;
 
 	ChiakiErrorCode err;
 	if(gkcrypt->key_buf_size)
@@ -72,6 +160,19 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_init(ChiakiGKCrypt *gkcrypt, Chiaki
 
 	if(gkcrypt->key_buf)
 	{
+		// the thread would only just be starting when the first packets arrive
+		GKCryptCtx *ctx = gkcrypt_key_stream_ctx(gkcrypt);
+		if(!ctx)
+		{
+			err = CHIAKI_ERR_UNKNOWN;
+			goto error_key_buf_cond;
+		}
+		size_t prefill_size = gkcrypt_key_buf_lead_min(gkcrypt);
+		err = gkcrypt_gen_key_stream(gkcrypt, ctx, 0, gkcrypt->key_buf, prefill_size);
+		if(err != CHIAKI_ERR_SUCCESS)
+			goto error_key_buf_cond;
+		gkcrypt->key_buf_key_pos_max = prefill_size;
+
 		err = chiaki_thread_create(&gkcrypt->key_buf_thread, gkcrypt_thread_func, gkcrypt);
 		if(err != CHIAKI_ERR_SUCCESS)
 			goto error_key_buf_cond;
@@ -82,6 +183,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_init(ChiakiGKCrypt *gkcrypt, Chiaki
 	return CHIAKI_ERR_SUCCESS;
 
 error_key_buf_cond:
+	gkcrypt_key_stream_ctx_free(gkcrypt->key_stream_ctx);
 	if(gkcrypt->key_buf)
 		chiaki_cond_fini(&gkcrypt->key_buf_cond);
 error_key_buf_mutex:
@@ -102,10 +204,33 @@ CHIAKI_EXPORT void chiaki_gkcrypt_fini(ChiakiGKCrypt *gkcrypt)
 		chiaki_mutex_unlock(&gkcrypt->key_buf_mutex);
 		chiaki_cond_signal(&gkcrypt->key_buf_cond);
 		chiaki_thread_join(&gkcrypt->key_buf_thread, NULL);
+		CHIAKI_LOGI(gkcrypt->log, "GKCrypt %d key buf: %llu hits, %llu misses, %llu skips, estimated rate at the end %llu bytes/s",
+				(int)gkcrypt->index,
+				(unsigned long long)gkcrypt->key_buf_stats.hits,
+				(unsigned long long)gkcrypt->key_buf_stats.misses,
+				(unsigned long long)gkcrypt->key_buf_stats.skips,
+				(unsigned long long)gkcrypt->key_buf_rate);
 		chiaki_cond_fini(&gkcrypt->key_buf_cond);
 		chiaki_mutex_fini(&gkcrypt->key_buf_mutex);
 		chiaki_aligned_free(gkcrypt->key_buf);
 	}
+
+	gkcrypt_key_stream_ctx_free(gkcrypt->key_stream_ctx);
+	gkcrypt->key_stream_ctx = NULL;
+	for(size_t i=0; i<CHIAKI_GKCRYPT_GMAC_CTXS_COUNT; i++)
+	{
+		gkcrypt_gmac_ctx_free(gkcrypt->gmac_ctxs[i].ctx);
+		gkcrypt->gmac_ctxs[i].ctx = NULL;
+	}
+}
+
+CHIAKI_EXPORT void chiaki_gkcrypt_key_buf_stats(ChiakiGKCrypt *gkcrypt, ChiakiGKCryptKeyBufStats *stats)
+{
+	stats->hits = chiaki_atomic_load_relaxed(&gkcrypt->key_buf_stats.hits);
+	stats->misses = chiaki_atomic_load_relaxed(&gkcrypt->key_buf_stats.misses);
+	stats->wakeups = chiaki_atomic_load_relaxed(&gkcrypt->key_buf_stats.wakeups);
+	stats->reader_waits = chiaki_atomic_load_relaxed(&gkcrypt->key_buf_stats.reader_waits);
+	stats->skips = chiaki_atomic_load_relaxed(&gkcrypt->key_buf_stats.skips);
 }
 
 static ChiakiErrorCode gkcrypt_gen_key_iv(ChiakiGKCrypt *gkcrypt, uint8_t index, const uint8_t *handshake_key, const uint8_t *ecdh_secret)
@@ -178,6 +303,15 @@ static inline void counter_add(uint8_t *out, const uint8_t *base, uint64_t v)
 		memcpy(out + i, base + i, CHIAKI_GKCRYPT_BLOCK_SIZE - i);
 }
 
+static inline void counter_inc(uint8_t *counter)
+{
+	for(size_t i=0; i<CHIAKI_GKCRYPT_BLOCK_SIZE; i++)
+	{
+		if(++counter[i])
+			break;
+	}
+}
+
 CHIAKI_EXPORT void chiaki_gkcrypt_gen_gmac_key(uint64_t index, const uint8_t *key_base, const uint8_t *iv, uint8_t *key_out)
 {
 	uint8_t data[0x20];
@@ -211,156 +345,379 @@ CHIAKI_EXPORT void chiaki_gkcrypt_gen_tmp_gmac_key(ChiakiGKCrypt *gkcrypt, uint6
 		memcpy(key_out, gkcrypt->key_gmac_base, sizeof(gkcrypt->key_gmac_base));
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gen_key_stream(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size)
+/**
+ * @return context of the impl currently set, with only the key of a built-in impl set up,
+ * a backend context still has to be created
+ */
+static GKCryptCtx *gkcrypt_ctx_new(const uint8_t *key)
 {
-	assert(key_pos % CHIAKI_GKCRYPT_BLOCK_SIZE == 0);
-	assert(buf_size % CHIAKI_GKCRYPT_BLOCK_SIZE == 0);
+	GKCryptCtx *ctx = CHIAKI_NEW(GKCryptCtx);
+	if(!ctx)
+		return NULL;
+	ctx->impl = chiaki_gkcrypt_get_impl();
+	if(!chiaki_gkcrypt_impl_supported(ctx->impl))
+		ctx->impl = CHIAKI_GKCRYPT_IMPL_BACKEND;
+	ctx->backend = NULL;
+	if(ctx->impl != CHIAKI_GKCRYPT_IMPL_BACKEND)
+		chiaki_aes_kernel_key_init(&ctx->kernel, ctx->impl, key);
+	return ctx;
+}
 
+/**
+ * @return context keyed with key for the ctr mode key stream, aes-128-ecb for the crypto backend
+ */
+static GKCryptCtx *gkcrypt_key_stream_ctx_new(const uint8_t *key)
+{
+	GKCryptCtx *ctx = gkcrypt_ctx_new(key);
+	if(!ctx || ctx->impl != CHIAKI_GKCRYPT_IMPL_BACKEND)
+		return ctx;
 #ifdef CHIAKI_LIB_ENABLE_MBEDTLS
-	// build mbedtls aes context
-	mbedtls_aes_context ctx;
-	mbedtls_aes_init(&ctx);
-
-	if(mbedtls_aes_setkey_enc(&ctx, gkcrypt->key_base, 128) != 0)
+	mbedtls_aes_context *aes = malloc(sizeof(mbedtls_aes_context));
+	if(!aes)
+		goto error;
+	mbedtls_aes_init(aes);
+	if(mbedtls_aes_setkey_enc(aes, key, 128) != 0)
 	{
-		mbedtls_aes_free(&ctx);
-		return CHIAKI_ERR_UNKNOWN;
+		mbedtls_aes_free(aes);
+		free(aes);
+		goto error;
 	}
-
+	ctx->backend = aes;
 #else
-	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
-	if(!ctx)
-		return CHIAKI_ERR_UNKNOWN;
-
-	if(!EVP_EncryptInit_ex(ctx, EVP_aes_128_ecb(), NULL, gkcrypt->key_base, NULL))
+	EVP_CIPHER_CTX *evp = EVP_CIPHER_CTX_new();
+	if(!evp)
+		goto error;
+	if(!EVP_EncryptInit_ex(evp, EVP_aes_128_ecb(), NULL, key, NULL)
+		|| !EVP_CIPHER_CTX_set_padding(evp, 0))
 	{
-		EVP_CIPHER_CTX_free(ctx);
-		return CHIAKI_ERR_UNKNOWN;
+		EVP_CIPHER_CTX_free(evp);
+		goto error;
 	}
+	ctx->backend = evp;
+#endif
+	return ctx;
+error:
+	free(ctx);
+	return NULL;
+}
 
-	if(!EVP_CIPHER_CTX_set_padding(ctx, 0))
+static void gkcrypt_key_stream_ctx_free(GKCryptCtx *ctx)
+{
+	if(!ctx)
+		return;
+	if(ctx->backend)
 	{
-		EVP_CIPHER_CTX_free(ctx);
-		return CHIAKI_ERR_UNKNOWN;
-	}
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+		mbedtls_aes_free(ctx->backend);
+		free(ctx->backend);
+#else
+		EVP_CIPHER_CTX_free(ctx->backend);
 #endif
+	}
+	free(ctx);
+}
+
+static GKCryptCtx *gkcrypt_key_stream_ctx(ChiakiGKCrypt *gkcrypt)
+{
+	if(!gkcrypt->key_stream_ctx)
+		gkcrypt->key_stream_ctx = gkcrypt_key_stream_ctx_new(gkcrypt->key_base);
+	return gkcrypt->key_stream_ctx;
+}
+
+static ChiakiErrorCode gkcrypt_gen_key_stream(ChiakiGKCrypt *gkcrypt, GKCryptCtx *ctx, uint64_t key_pos, uint8_t *buf, size_t buf_size)
+{
+	assert(key_pos % CHIAKI_GKCRYPT_BLOCK_SIZE == 0);
+	assert(buf_size % CHIAKI_GKCRYPT_BLOCK_SIZE == 0);
+
 	int counter_offset = (int)(key_pos / CHIAKI_GKCRYPT_BLOCK_SIZE);
 
-	for(uint8_t *cur = buf, *end = buf + buf_size; cur < end; cur += CHIAKI_GKCRYPT_BLOCK_SIZE)
-		counter_add(cur, gkcrypt->iv, counter_offset++);
+	if(ctx->impl != CHIAKI_GKCRYPT_IMPL_BACKEND)
+	{
+		chiaki_aes_kernel_ctr(&ctx->kernel, gkcrypt->iv, (uint64_t)counter_offset, buf, NULL, buf_size / CHIAKI_GKCRYPT_BLOCK_SIZE);
+		return CHIAKI_ERR_SUCCESS;
+	}
 
-#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
-	for(int i = 0; i < buf_size; i = i + 16)
+	// counter_add() is only a plain addition for positive counters, so only up to INT_MAX is the next block the previous one + 1
+	int64_t counter_last = (int64_t)counter_offset + (int64_t)(buf_size / CHIAKI_GKCRYPT_BLOCK_SIZE) - 1;
+	if(buf_size && counter_offset >= 0 && counter_last <= INT_MAX)
 	{
-		// loop over all blocks of 16 bytes (128 bits)
-		if(mbedtls_aes_crypt_ecb(&ctx, MBEDTLS_AES_ENCRYPT, buf + i, buf + i) != 0)
+		counter_add(buf, gkcrypt->iv, (uint64_t)counter_offset);
+		for(uint8_t *cur = buf + CHIAKI_GKCRYPT_BLOCK_SIZE, *end = buf + buf_size; cur < end; cur += CHIAKI_GKCRYPT_BLOCK_SIZE)
 		{
-			mbedtls_aes_free(&ctx);
-			return CHIAKI_ERR_UNKNOWN;
+			memcpy(cur, cur - CHIAKI_GKCRYPT_BLOCK_SIZE, CHIAKI_GKCRYPT_BLOCK_SIZE);
+			counter_inc(cur);
 		}
 	}
+	else
+	{
+		for(uint8_t *cur = buf, *end = buf + buf_size; cur < end; cur += CHIAKI_GKCRYPT_BLOCK_SIZE)
+			counter_add(cur, gkcrypt->iv, counter_offset++);
+	}
 
-	mbedtls_aes_free(&ctx);
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+	for(size_t i = 0; i < buf_size; i += CHIAKI_GKCRYPT_BLOCK_SIZE)
+	{
+		// loop over all blocks of 16 bytes (128 bits)
+		if(mbedtls_aes_crypt_ecb(ctx->backend, MBEDTLS_AES_ENCRYPT, buf + i, buf + i) != 0)
+			return CHIAKI_ERR_UNKNOWN;
+	}
 #else
+	// ecb without padding keeps no state between updates, so the context never has to be finalized
 	int outl;
-	EVP_EncryptUpdate(ctx, buf, &outl, buf, (int)buf_size);
-	if(outl != buf_size)
-	{
-		EVP_CIPHER_CTX_free(ctx);
+	if(!EVP_EncryptUpdate(ctx->backend, buf, &outl, buf, (int)buf_size) || outl != buf_size)
 		return CHIAKI_ERR_UNKNOWN;
-	}
-
-	EVP_CIPHER_CTX_free(ctx);
 #endif
 	return CHIAKI_ERR_SUCCESS;
 }
 
-static bool gkcrypt_key_buf_should_generate(ChiakiGKCrypt *gkcrypt)
+CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gen_key_stream(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size)
 {
-	return gkcrypt->last_key_pos > gkcrypt->key_buf_key_pos_min + gkcrypt->key_buf_populated / 2;
+	GKCryptCtx *ctx = gkcrypt_key_stream_ctx(gkcrypt);
+	if(!ctx)
+		return CHIAKI_ERR_UNKNOWN;
+	return gkcrypt_gen_key_stream(gkcrypt, ctx, key_pos, buf, buf_size);
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_get_key_stream(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size)
+/**
+ * Note that the key stream up to key_pos_end has been requested and wake up the key buffer thread if it has been waiting for that.
+ */
+static void gkcrypt_key_buf_request(ChiakiGKCrypt *gkcrypt, uint64_t key_pos_end)
 {
-	if(!gkcrypt->key_buf)
-		return chiaki_gkcrypt_gen_key_stream(gkcrypt, key_pos, buf, buf_size);
+	chiaki_atomic_store_max_relaxed(&gkcrypt->last_key_pos, key_pos_end);
+	// pairs with the fence in gkcrypt_thread_func() before it goes to sleep
+	chiaki_atomic_fence();
+	if(chiaki_atomic_load_relaxed(&gkcrypt->last_key_pos) < chiaki_atomic_load_relaxed(&gkcrypt->key_buf_wake_key_pos))
+		return;
 
 	chiaki_mutex_lock(&gkcrypt->key_buf_mutex);
+	bool wake = chiaki_atomic_load_relaxed(&gkcrypt->key_buf_wake_key_pos) != KEY_BUF_AWAKE;
+	if(wake)
+	{
+		chiaki_atomic_store_relaxed(&gkcrypt->key_buf_wake_key_pos, KEY_BUF_AWAKE);
+		chiaki_atomic_fetch_add_relaxed(&gkcrypt->key_buf_stats.wakeups, 1);
+	}
+	chiaki_mutex_unlock(&gkcrypt->key_buf_mutex);
+	if(wake)
+		chiaki_cond_signal(&gkcrypt->key_buf_cond);
+}
 
-	if(key_pos + buf_size > gkcrypt->last_key_pos)
-		gkcrypt->last_key_pos = key_pos + buf_size;
-	bool signal = gkcrypt_key_buf_should_generate(gkcrypt);
+/**
+ * Copy or xor the key stream for key_pos from the key buffer into buf.
+ *
+ * @return false if it is not in the key buffer
+ */
+static bool gkcrypt_key_buf_read(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size, bool xor)
+{
+	// announce the read before checking the range, the thread raises the minimum before checking for a read, see gkcrypt_key_buf_reclaim()
+	chiaki_atomic_store_relaxed(&gkcrypt->key_buf_reader_key_pos, key_pos);
+	chiaki_atomic_fence();
+	bool hit = key_pos >= chiaki_atomic_load_relaxed(&gkcrypt->key_buf_key_pos_min)
+		&& key_pos + buf_size <= chiaki_atomic_load_acquire(&gkcrypt->key_buf_key_pos_max);
+	if(hit)
+	{
+		size_t offset = key_pos % gkcrypt->key_buf_size;
+		size_t size = gkcrypt->key_buf_size - offset;
+		if(size > buf_size)
+			size = buf_size;
+		if(xor)
+		{
+			xor_bytes(buf, gkcrypt->key_buf + offset, size);
+			xor_bytes(buf + size, gkcrypt->key_buf, buf_size - size);
+		}
+		else
+		{
+			memcpy(buf, gkcrypt->key_buf + offset, size);
+			memcpy(buf + size, gkcrypt->key_buf, buf_size - size);
+		}
+	}
+	chiaki_atomic_store_release(&gkcrypt->key_buf_reader_key_pos, KEY_BUF_READER_NONE);
 
-	ChiakiErrorCode err;
-	if(key_pos < gkcrypt->key_buf_key_pos_min
-		|| key_pos + buf_size >= gkcrypt->key_buf_key_pos_min + gkcrypt->key_buf_populated)
+	if(hit)
+	{
+		chiaki_atomic_fetch_add_relaxed(&gkcrypt->key_buf_stats.hits, 1);
+		return true;
+	}
+	if(chiaki_atomic_fetch_add_relaxed(&gkcrypt->key_buf_stats.misses, 1) == 0)
 	{
 		CHIAKI_LOGW(gkcrypt->log, "Requested key stream for key pos %#llx on GKCrypt %d, but it's not in the buffer:"
-				" key buf size %#llx, start offset: %#llx, populated: %#llx, min key pos: %#llx, last key pos: %#llx",
+				" key buf size %#llx, min key pos: %#llx, max key pos: %#llx, last key pos: %#llx. Further misses are only counted.",
 				(unsigned long long)key_pos,
 				gkcrypt->index,
 				(unsigned long long)gkcrypt->key_buf_size,
-				(unsigned long long)gkcrypt->key_buf_start_offset,
-				(unsigned long long)gkcrypt->key_buf_populated,
-				(unsigned long long)gkcrypt->key_buf_key_pos_min,
-				(unsigned long long)gkcrypt->last_key_pos);
-		chiaki_mutex_unlock(&gkcrypt->key_buf_mutex);
-		err = chiaki_gkcrypt_gen_key_stream(gkcrypt, key_pos, buf, buf_size);
+				(unsigned long long)chiaki_atomic_load_relaxed(&gkcrypt->key_buf_key_pos_min),
+				(unsigned long long)chiaki_atomic_load_relaxed(&gkcrypt->key_buf_key_pos_max),
+				(unsigned long long)chiaki_atomic_load_relaxed(&gkcrypt->last_key_pos));
 	}
-	else
+	return false;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_get_key_stream(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size)
+{
+	if(gkcrypt->key_buf)
 	{
-		size_t offset_in_buf = key_pos - gkcrypt->key_buf_key_pos_min + gkcrypt->key_buf_start_offset;
-		offset_in_buf %= gkcrypt->key_buf_size;
-		size_t end = offset_in_buf + buf_size;
-		if(end > gkcrypt->key_buf_size)
-		{
-			size_t excess = end - gkcrypt->key_buf_size;
-			memcpy(buf, gkcrypt->key_buf + offset_in_buf, buf_size - excess);
-			memcpy(buf + (buf_size - excess), gkcrypt->key_buf, excess);
-		}
-		else
-			memcpy(buf, gkcrypt->key_buf + offset_in_buf, buf_size);
-		err = CHIAKI_ERR_SUCCESS;
-		chiaki_mutex_unlock(&gkcrypt->key_buf_mutex);
+		gkcrypt_key_buf_request(gkcrypt, key_pos + buf_size);
+		if(gkcrypt_key_buf_read(gkcrypt, key_pos, buf, buf_size, false))
+			return CHIAKI_ERR_SUCCESS;
 	}
+	return chiaki_gkcrypt_gen_key_stream(gkcrypt, key_pos, buf, buf_size);
+}
 
-	if(signal)
-		chiaki_cond_signal(&gkcrypt->key_buf_cond);
+/**
+ * Xor the key stream of a built-in impl into buf directly, without a buffer for the key stream.
+ *
+ * @param counter counter block of the first byte of buf
+ * @param padding_pre offset of the first byte of buf inside that block
+ */
+static void gkcrypt_kernel_xor(ChiakiGKCrypt *gkcrypt, GKCryptCtx *ctx, uint64_t counter, size_t padding_pre, uint8_t *buf, size_t buf_size)
+{
+	uint8_t block[CHIAKI_GKCRYPT_BLOCK_SIZE];
+	if(padding_pre)
+	{
+		size_t size = CHIAKI_GKCRYPT_BLOCK_SIZE - padding_pre;
+		if(size > buf_size)
+			size = buf_size;
+		chiaki_aes_kernel_ctr(&ctx->kernel, gkcrypt->iv, counter++, block, NULL, 1);
+		xor_bytes(buf, block + padding_pre, size);
+		buf += size;
+		buf_size -= size;
+	}
 
-	return err;
+	size_t blocks = buf_size / CHIAKI_GKCRYPT_BLOCK_SIZE;
+	chiaki_aes_kernel_ctr(&ctx->kernel, gkcrypt->iv, counter, buf, buf, blocks);
+	counter += blocks;
+	buf += blocks * CHIAKI_GKCRYPT_BLOCK_SIZE;
+	buf_size -= blocks * CHIAKI_GKCRYPT_BLOCK_SIZE;
+
+	if(buf_size)
+	{
+		chiaki_aes_kernel_ctr(&ctx->kernel, gkcrypt->iv, counter, block, NULL, 1);
+		xor_bytes(buf, block, buf_size);
+	}
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_decrypt(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size)
+static uint64_t gkcrypt_kernel_counter(uint64_t key_pos)
 {
-	uint64_t padding_pre = key_pos % CHIAKI_GKCRYPT_BLOCK_SIZE;
-	size_t full_size = ((padding_pre + buf_size + CHIAKI_GKCRYPT_BLOCK_SIZE - 1) / CHIAKI_GKCRYPT_BLOCK_SIZE) * CHIAKI_GKCRYPT_BLOCK_SIZE;
+	// same counter as gkcrypt_gen_key_stream()
+	return (uint64_t)(int)(key_pos / CHIAKI_GKCRYPT_BLOCK_SIZE);
+}
 
-	uint8_t *key_stream = malloc(full_size);
-	if(!key_stream)
-		return CHIAKI_ERR_MEMORY;
+CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_decrypt(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size)
+{
+	if(gkcrypt->key_buf)
+	{
+		gkcrypt_key_buf_request(gkcrypt, key_pos + buf_size);
+		if(gkcrypt_key_buf_read(gkcrypt, key_pos, buf, buf_size, true))
+			return CHIAKI_ERR_SUCCESS;
+	}
 
-	ChiakiErrorCode err = chiaki_gkcrypt_get_key_stream(gkcrypt, key_pos - padding_pre, key_stream, full_size);
-	if(err != CHIAKI_ERR_SUCCESS)
+	GKCryptCtx *ctx = gkcrypt_key_stream_ctx(gkcrypt);
+	if(!ctx)
+		return CHIAKI_ERR_UNKNOWN;
+	if(ctx->impl != CHIAKI_GKCRYPT_IMPL_BACKEND)
 	{
-		free(key_stream);
-		return err;
+		gkcrypt_kernel_xor(gkcrypt, ctx, gkcrypt_kernel_counter(key_pos), key_pos % CHIAKI_GKCRYPT_BLOCK_SIZE, buf, buf_size);
+		return CHIAKI_ERR_SUCCESS;
 	}
 
-	xor_bytes(buf, key_stream + padding_pre, buf_size);
-	free(key_stream);
+	// the backend generates a piece of the key stream at a time on the stack
+	uint8_t key_stream[0x100];
+	uint64_t padding_pre = key_pos % CHIAKI_GKCRYPT_BLOCK_SIZE;
+	uint64_t stream_pos = key_pos - padding_pre;
+	while(buf_size)
+	{
+		size_t size = sizeof(key_stream) - padding_pre;
+		if(size > buf_size)
+			size = buf_size;
+		size_t full_size = ((padding_pre + size + CHIAKI_GKCRYPT_BLOCK_SIZE - 1) / CHIAKI_GKCRYPT_BLOCK_SIZE) * CHIAKI_GKCRYPT_BLOCK_SIZE;
+		ChiakiErrorCode err = gkcrypt_gen_key_stream(gkcrypt, ctx, stream_pos, key_stream, full_size);
+		if(err != CHIAKI_ERR_SUCCESS)
+			return err;
+		xor_bytes(buf, key_stream + padding_pre, size);
+		buf += size;
+		buf_size -= size;
+		stream_pos += sizeof(key_stream);
+		padding_pre = 0;
+	}
 
 	return CHIAKI_ERR_SUCCESS;
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gmac(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, const uint8_t *buf, size_t buf_size, uint8_t *gmac_out)
+/**
+ * @return context keyed with key for gmacs, aes-128-gcm for the crypto backend, only the iv has to be set for each gmac
+ */
+static GKCryptCtx *gkcrypt_gmac_ctx_new(const uint8_t *key)
 {
-	uint8_t iv[CHIAKI_GKCRYPT_BLOCK_SIZE];
-	counter_add(iv, gkcrypt->iv, key_pos / 0x10);
+	GKCryptCtx *ctx = gkcrypt_ctx_new(key);
+	if(!ctx || ctx->impl != CHIAKI_GKCRYPT_IMPL_BACKEND)
+		return ctx;
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+	mbedtls_gcm_context *gcm = malloc(sizeof(mbedtls_gcm_context));
+	if(!gcm)
+		goto error;
+	mbedtls_gcm_init(gcm);
+	if(mbedtls_gcm_setkey(gcm, MBEDTLS_CIPHER_ID_AES, key, CHIAKI_GKCRYPT_BLOCK_SIZE * 8) != 0)
+	{
+		mbedtls_gcm_free(gcm);
+		free(gcm);
+		goto error;
+	}
+	ctx->backend = gcm;
+#else
+	EVP_CIPHER_CTX *evp = EVP_CIPHER_CTX_new();
+	if(!evp)
+		goto error;
+	if(!EVP_CipherInit_ex(evp, EVP_aes_128_gcm(), NULL, NULL, NULL, 1)
+		|| !EVP_CIPHER_CTX_ctrl(evp, EVP_CTRL_GCM_SET_IVLEN, CHIAKI_GKCRYPT_BLOCK_SIZE, NULL)
+		|| !EVP_CipherInit_ex(evp, NULL, NULL, key, NULL, 1))
+	{
+		EVP_CIPHER_CTX_free(evp);
+		goto error;
+	}
+	ctx->backend = evp;
+#endif
+	return ctx;
+error:
+	free(ctx);
+	return NULL;
+}
 
-	uint8_t *gmac_key = gkcrypt->key_gmac_current;
-	uint8_t gmac_key_tmp[CHIAKI_GKCRYPT_BLOCK_SIZE];
-	uint64_t key_index = (key_pos > 0 ? key_pos - 1 : 0) / CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_KEY_POS;
+static void gkcrypt_gmac_ctx_free(GKCryptCtx *ctx)
+{
+	if(!ctx)
+		return;
+	if(ctx->backend)
+	{
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+		mbedtls_gcm_free(ctx->backend);
+		free(ctx->backend);
+#else
+		EVP_CIPHER_CTX_free(ctx->backend);
+#endif
+	}
+	free(ctx);
+}
+
+/**
+ * Get the context for the gmac key of key_index, keying a new one in place of the least recently used if necessary.
+ * Newer key indices replace the current gmac key, older ones only get a context.
+ */
+static GKCryptCtx *gkcrypt_gmac_ctx(ChiakiGKCrypt *gkcrypt, uint64_t key_index)
+{
+	ChiakiGKCryptGmacCtx *slot = NULL;
+	for(size_t i=0; i<CHIAKI_GKCRYPT_GMAC_CTXS_COUNT; i++)
+	{
+		ChiakiGKCryptGmacCtx *gmac_ctx = &gkcrypt->gmac_ctxs[i];
+		if(gmac_ctx->ctx && gmac_ctx->index == key_index)
+		{
+			gmac_ctx->last_used = ++gkcrypt->gmac_ctxs_clock;
+			return gmac_ctx->ctx;
+		}
+		if(!slot || (slot->ctx && (!gmac_ctx->ctx || gmac_ctx->last_used < slot->last_used)))
+			slot = gmac_ctx;
+	}
 
+	const uint8_t *gmac_key = gkcrypt->key_gmac_current;
+	uint8_t gmac_key_tmp[CHIAKI_GKCRYPT_BLOCK_SIZE];
 	if(key_index > gkcrypt->key_gmac_index_current)
 	{
 		chiaki_gkcrypt_gen_new_gmac_key(gkcrypt, key_index);
@@ -371,128 +728,279 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gmac(ChiakiGKCrypt *gkcrypt, uint64
 		gmac_key = gmac_key_tmp;
 	}
 
-#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
-	// build mbedtls gcm context AES_128_GCM
-	// Encryption
-	mbedtls_gcm_context actx;
-	mbedtls_gcm_init(&actx);
-	// set gmac_key 128 bits key
-	if(mbedtls_gcm_setkey(&actx, MBEDTLS_CIPHER_ID_AES, gmac_key, CHIAKI_GKCRYPT_BLOCK_SIZE * 8) != 0)
-	{
-		mbedtls_gcm_free(&actx);
-		return CHIAKI_ERR_UNKNOWN;
-	}
+	GKCryptCtx *ctx = gkcrypt_gmac_ctx_new(gmac_key);
+	if(!ctx)
+		return NULL;
+	gkcrypt_gmac_ctx_free(slot->ctx);
+	slot->ctx = ctx;
+	slot->index = key_index;
+	slot->last_used = ++gkcrypt->gmac_ctxs_clock;
+	return ctx;
+}
 
-	// encrypt without additional data
-	if(mbedtls_gcm_starts(&actx, MBEDTLS_GCM_ENCRYPT, iv, CHIAKI_GKCRYPT_BLOCK_SIZE, NULL, 0) != 0)
-	{
-		mbedtls_gcm_free(&actx);
-		return CHIAKI_ERR_UNKNOWN;
-	}
-	// set "additional data" only whitout input nor output
-	// to get the same result as:
-	// EVP_EncryptUpdate(ctx, NULL, &len, buf, (int)buf_size)
-	if(mbedtls_gcm_crypt_and_tag(&actx, MBEDTLS_GCM_ENCRYPT,
+static uint64_t gkcrypt_gmac_key_index(uint64_t key_pos)
+{
+	return (key_pos > 0 ? key_pos - 1 : 0) / CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_KEY_POS;
+}
+
+static ChiakiErrorCode gkcrypt_gmac_backend(void *ctx, const uint8_t *iv, const uint8_t *buf, size_t buf_size, uint8_t *gmac_out)
+{
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+	// the whole buffer is "additional data" without any input or output,
+	// to get the same result as EVP_EncryptUpdate(ctx, NULL, &len, buf, (int)buf_size)
+	if(mbedtls_gcm_crypt_and_tag(ctx, MBEDTLS_GCM_ENCRYPT,
 		   0, iv, CHIAKI_GKCRYPT_BLOCK_SIZE,
 		   buf, buf_size, NULL, NULL,
 		   CHIAKI_GKCRYPT_GMAC_SIZE, gmac_out) != 0)
-	{
+		return CHIAKI_ERR_UNKNOWN;
+
+	return CHIAKI_ERR_SUCCESS;
+#else
+	// setting only the iv keeps the key schedule and resets the rest of the gcm state
+	if(!EVP_CipherInit_ex(ctx, NULL, NULL, NULL, iv, 1))
+		return CHIAKI_ERR_UNKNOWN;
 
-		mbedtls_gcm_free(&actx);
+	int len;
+	if(!EVP_EncryptUpdate(ctx, NULL, &len, buf, (int)buf_size))
 		return CHIAKI_ERR_UNKNOWN;
-	}
 
-	mbedtls_gcm_free(&actx);
+	if(!EVP_EncryptFinal_ex(ctx, NULL, &len))
+		return CHIAKI_ERR_UNKNOWN;
+
+	if(!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, CHIAKI_GKCRYPT_GMAC_SIZE, gmac_out))
+		return CHIAKI_ERR_UNKNOWN;
 
 	return CHIAKI_ERR_SUCCESS;
-#else
-	ChiakiErrorCode ret = CHIAKI_ERR_SUCCESS;
+#endif
+}
 
-	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
-	if(!ctx)
-	{
-		ret = CHIAKI_ERR_MEMORY;
-		goto fail;
-	}
+CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gmac(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, const uint8_t *buf, size_t buf_size, uint8_t *gmac_out)
+{
+	return chiaki_gkcrypt_gmac_multi(gkcrypt, 1, &key_pos, &buf, &buf_size, &gmac_out);
+}
 
-	if(!EVP_CipherInit_ex(ctx, EVP_aes_128_gcm(), NULL, NULL, NULL, 1))
+CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gmac_multi(ChiakiGKCrypt *gkcrypt, size_t count, const uint64_t *key_pos,
+		const uint8_t *const *bufs, const size_t *buf_sizes, uint8_t *const *gmacs_out)
+{
+	size_t i = 0;
+	while(i < count)
 	{
-		ret = CHIAKI_ERR_UNKNOWN;
-		goto fail_cipher;
-	}
+		GKCryptCtx *ctx = gkcrypt_gmac_ctx(gkcrypt, gkcrypt_gmac_key_index(key_pos[i]));
+		if(!ctx)
+			return CHIAKI_ERR_UNKNOWN;
+		uint8_t ivs[CHIAKI_AES_KERNEL_GMAC_LANES][CHIAKI_GKCRYPT_BLOCK_SIZE];
+		counter_add(ivs[0], gkcrypt->iv, key_pos[i] / 0x10);
 
-	if(!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, CHIAKI_GKCRYPT_BLOCK_SIZE, NULL))
-	{
-		ret = CHIAKI_ERR_UNKNOWN;
-		goto fail_cipher;
+		if(ctx->impl == CHIAKI_GKCRYPT_IMPL_BACKEND)
+		{
+			ChiakiErrorCode err = gkcrypt_gmac_backend(ctx->backend, ivs[0], bufs[i], buf_sizes[i], gmacs_out[i]);
+			if(err != CHIAKI_ERR_SUCCESS)
+				return err;
+			i++;
+			continue;
+		}
+
+		// the following packets of the same impl go along, fewer than there are contexts, so none evicts another's
+		const ChiakiAesKernelKey *keys[CHIAKI_AES_KERNEL_GMAC_LANES];
+		keys[0] = &ctx->kernel;
+		size_t lanes = 1;
+		while(lanes < CHIAKI_AES_KERNEL_GMAC_LANES && i + lanes < count)
+		{
+			ctx = gkcrypt_gmac_ctx(gkcrypt, gkcrypt_gmac_key_index(key_pos[i + lanes]));
+			if(!ctx)
+				return CHIAKI_ERR_UNKNOWN;
+			if(ctx->impl != keys[0]->impl)
+				break;
+			keys[lanes] = &ctx->kernel;
+			counter_add(ivs[lanes], gkcrypt->iv, key_pos[i + lanes] / 0x10);
+			lanes++;
+		}
+		chiaki_aes_kernel_gmac(lanes, keys, (const uint8_t (*)[CHIAKI_GKCRYPT_BLOCK_SIZE])ivs, bufs + i, buf_sizes + i, gmacs_out + i);
+		i += lanes;
 	}
+	return CHIAKI_ERR_SUCCESS;
+}
 
-	if(!EVP_CipherInit_ex(ctx, NULL, NULL, gmac_key, iv, 1))
+static void gkcrypt_kernel_verify_decrypt(ChiakiGKCrypt *gkcrypt, GKCryptCtx *gmac_ctx, GKCryptCtx *ctx, uint64_t key_pos,
+		uint8_t *buf, size_t buf_size, size_t decrypt_offset, uint64_t decrypt_key_pos, uint8_t *gmac_out)
+{
+	uint8_t iv[CHIAKI_GKCRYPT_BLOCK_SIZE];
+	counter_add(iv, gkcrypt->iv, key_pos / 0x10);
+	ChiakiAesKernelGmac gmac;
+	chiaki_aes_kernel_gmac_start(&gmac, &gmac_ctx->kernel, iv);
+
+	// key stream position of buf[p] is padding_pre + p - decrypt_offset bytes after counter
+	uint64_t counter = gkcrypt_kernel_counter(decrypt_key_pos);
+	size_t padding_pre = decrypt_key_pos % CHIAKI_GKCRYPT_BLOCK_SIZE;
+	size_t hashed = 0;
+	size_t decrypted = decrypt_offset;
+	while(buf_size - hashed >= VERIFY_DECRYPT_CHUNK_SIZE)
 	{
-		ret = CHIAKI_ERR_UNKNOWN;
-		goto fail_cipher;
+		chiaki_aes_kernel_gmac_update(&gmac, buf + hashed, VERIFY_DECRYPT_CHUNK_SIZE / CHIAKI_GKCRYPT_BLOCK_SIZE);
+		hashed += VERIFY_DECRYPT_CHUNK_SIZE;
+		if(hashed <= decrypted)
+			continue;
+		// stop at the end of a key stream block, so no block has to be generated twice
+		size_t stream_pos = padding_pre + (decrypted - decrypt_offset);
+		size_t end = hashed - (padding_pre + (hashed - decrypt_offset)) % CHIAKI_GKCRYPT_BLOCK_SIZE;
+		if(end <= decrypted)
+			continue;
+		gkcrypt_kernel_xor(gkcrypt, ctx, counter + stream_pos / CHIAKI_GKCRYPT_BLOCK_SIZE, stream_pos % CHIAKI_GKCRYPT_BLOCK_SIZE,
+				buf + decrypted, end - decrypted);
+		decrypted = end;
 	}
+	chiaki_aes_kernel_gmac_finish(&gmac, buf + hashed, buf_size - hashed, gmac_out);
 
-	int len;
-	if(!EVP_EncryptUpdate(ctx, NULL, &len, buf, (int)buf_size))
+	if(decrypted < buf_size)
 	{
-		ret = CHIAKI_ERR_UNKNOWN;
-		goto fail_cipher;
+		size_t stream_pos = padding_pre + (decrypted - decrypt_offset);
+		gkcrypt_kernel_xor(gkcrypt, ctx, counter + stream_pos / CHIAKI_GKCRYPT_BLOCK_SIZE, stream_pos % CHIAKI_GKCRYPT_BLOCK_SIZE,
+				buf + decrypted, buf_size - decrypted);
 	}
+}
 
-	if(!EVP_EncryptFinal_ex(ctx, NULL, &len))
+CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_verify_decrypt(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size,
+		size_t decrypt_offset, uint64_t decrypt_key_pos, const uint8_t *gmac, uint8_t *gmac_out)
+{
+	if(decrypt_offset > buf_size)
+		return CHIAKI_ERR_INVALID_DATA;
+
+	uint8_t gmac_tmp[CHIAKI_GKCRYPT_GMAC_SIZE];
+	if(!gmac_out)
+		gmac_out = gmac_tmp;
+
+	GKCryptCtx *gmac_ctx = gkcrypt_gmac_ctx(gkcrypt, gkcrypt_gmac_key_index(key_pos));
+	if(!gmac_ctx)
+		return CHIAKI_ERR_UNKNOWN;
+	// the key stream of the built-in impls is generated right here, even if there is a key buffer
+	GKCryptCtx *ctx = gmac_ctx->impl != CHIAKI_GKCRYPT_IMPL_BACKEND ? gkcrypt_key_stream_ctx(gkcrypt) : NULL;
+	if(ctx && ctx->impl == gmac_ctx->impl)
 	{
-		ret = CHIAKI_ERR_UNKNOWN;
-		goto fail_cipher;
+		gkcrypt_kernel_verify_decrypt(gkcrypt, gmac_ctx, ctx, key_pos, buf, buf_size, decrypt_offset, decrypt_key_pos, gmac_out);
 	}
-
-	if(!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, CHIAKI_GKCRYPT_GMAC_SIZE, gmac_out))
+	else
 	{
-		ret = CHIAKI_ERR_UNKNOWN;
-		goto fail_cipher;
+		ChiakiErrorCode err = chiaki_gkcrypt_gmac(gkcrypt, key_pos, buf, buf_size, gmac_out);
+		if(err != CHIAKI_ERR_SUCCESS)
+			return err;
+		err = chiaki_gkcrypt_decrypt(gkcrypt, decrypt_key_pos, buf + decrypt_offset, buf_size - decrypt_offset);
+		if(err != CHIAKI_ERR_SUCCESS)
+			return err;
 	}
 
-fail_cipher:
-	EVP_CIPHER_CTX_free(ctx);
-fail:
-	return ret;
-#endif
+	return memcmp(gmac_out, gmac, CHIAKI_GKCRYPT_GMAC_SIZE) == 0 ? CHIAKI_ERR_SUCCESS : CHIAKI_ERR_INVALID_MAC;
 }
 
 static bool key_buf_mutex_pred(void *user)
 {
 	ChiakiGKCrypt *gkcrypt = user;
-	if(gkcrypt->key_buf_thread_stop)
-		return true;
+	return gkcrypt->key_buf_thread_stop || chiaki_atomic_load_relaxed(&gkcrypt->key_buf_wake_key_pos) == KEY_BUF_AWAKE;
+}
 
-	if(gkcrypt->key_buf_populated < gkcrypt->key_buf_size)
-		return true;
+/**
+ * Update the estimated request rate if the last sample is old enough. Only called by the key buffer thread.
+ */
+static void gkcrypt_key_buf_sample_rate(ChiakiGKCrypt *gkcrypt)
+{
+	uint64_t now = chiaki_time_now_monotonic_us();
+	uint64_t elapsed = now - gkcrypt->key_buf_rate_time_us;
+	if(elapsed < KEY_BUF_RATE_INTERVAL_US)
+		return;
+	uint64_t last_key_pos = chiaki_atomic_load_relaxed(&gkcrypt->last_key_pos);
+	uint64_t requested = last_key_pos - gkcrypt->key_buf_rate_key_pos;
+	// a jump far ahead only has to push the lead to its maximum, so keep the rate from overflowing
+	if(requested > (uint64_t)gkcrypt->key_buf_size * 1000)
+		requested = (uint64_t)gkcrypt->key_buf_size * 1000;
+	uint64_t rate = requested * 1000000 / elapsed;
+	// smooth out single frames, but follow a rising bitrate within a few samples
+	gkcrypt->key_buf_rate = rate > gkcrypt->key_buf_rate ? (gkcrypt->key_buf_rate + rate) / 2 : (gkcrypt->key_buf_rate * 3 + rate) / 4;
+	gkcrypt->key_buf_rate_time_us = now;
+	gkcrypt->key_buf_rate_key_pos = last_key_pos;
+}
 
-	if(gkcrypt_key_buf_should_generate(gkcrypt))
-		return true;
+/**
+ * Least part of the key buffer to keep ahead of the requests, the rest may hold older key stream for reordered packets.
+ */
+static size_t gkcrypt_key_buf_lead_min(ChiakiGKCrypt *gkcrypt)
+{
+	size_t lead = (gkcrypt->key_buf_size / 4 / KEY_BUF_CHUNK_SIZE) * KEY_BUF_CHUNK_SIZE;
+	return lead ? lead : KEY_BUF_CHUNK_SIZE;
+}
 
-	return false;
+/**
+ * @return how much of the key stream should be generated ahead of last_key_pos, enough for KEY_BUF_LEAD_MS at the estimated rate,
+ * but always leaving a quarter of the buffer for older key stream
+ */
+static uint64_t gkcrypt_key_buf_lead(ChiakiGKCrypt *gkcrypt)
+{
+	uint64_t lead = gkcrypt->key_buf_rate * KEY_BUF_LEAD_MS / 1000;
+	uint64_t lead_min = gkcrypt_key_buf_lead_min(gkcrypt);
+	uint64_t lead_max = gkcrypt->key_buf_size - lead_min;
+	if(lead < lead_min)
+		return lead_min;
+	if(lead > lead_max)
+		return lead_max;
+	return lead;
 }
 
-static ChiakiErrorCode gkcrypt_generate_next_chunk(ChiakiGKCrypt *gkcrypt)
+/**
+ * Only called by the key buffer thread, which is the only one writing the minimal and maximal key pos.
+ */
+static bool gkcrypt_key_buf_should_generate(ChiakiGKCrypt *gkcrypt)
 {
-	assert(gkcrypt->key_buf_populated + KEY_BUF_CHUNK_SIZE <= gkcrypt->key_buf_size);
-	size_t buf_offset = (gkcrypt->key_buf_start_offset + gkcrypt->key_buf_populated) % gkcrypt->key_buf_size;
-	uint64_t key_pos = gkcrypt->key_buf_key_pos_min + gkcrypt->key_buf_populated;
-	uint8_t *buf_start = gkcrypt->key_buf + buf_offset;
+	uint64_t min = chiaki_atomic_load_relaxed(&gkcrypt->key_buf_key_pos_min);
+	uint64_t max = chiaki_atomic_load_relaxed(&gkcrypt->key_buf_key_pos_max);
+	// fill the buffer, then keep the lead ahead of the requests
+	return max - min < gkcrypt->key_buf_size
+		|| chiaki_atomic_load_relaxed(&gkcrypt->last_key_pos) + gkcrypt_key_buf_lead(gkcrypt) > max;
+}
 
-	chiaki_mutex_unlock(&gkcrypt->key_buf_mutex);
+/**
+ * Raise the minimal key pos, after that everything below it may be overwritten.
+ */
+static void gkcrypt_key_buf_reclaim(ChiakiGKCrypt *gkcrypt, uint64_t key_pos)
+{
+	chiaki_atomic_store_relaxed(&gkcrypt->key_buf_key_pos_min, key_pos);
+	// either a read that is announced now sees the new minimum or it is seen here, see gkcrypt_key_buf_read()
+	chiaki_atomic_fence();
+	if(chiaki_atomic_load_relaxed(&gkcrypt->key_buf_reader_key_pos) >= key_pos)
+		return;
+	chiaki_atomic_fetch_add_relaxed(&gkcrypt->key_buf_stats.reader_waits, 1);
+	while(chiaki_atomic_load_acquire(&gkcrypt->key_buf_reader_key_pos) < key_pos)
+		chiaki_thread_yield();
+}
 
-	ChiakiErrorCode err = chiaki_gkcrypt_gen_key_stream(gkcrypt, key_pos, buf_start, KEY_BUF_CHUNK_SIZE);
-	if(err != CHIAKI_ERR_SUCCESS)
-		CHIAKI_LOGE(gkcrypt->log, "GKCrypt failed to generate key stream chunk");
+static ChiakiErrorCode gkcrypt_generate_next_chunk(ChiakiGKCrypt *gkcrypt, GKCryptCtx *ctx)
+{
+	uint64_t min = chiaki_atomic_load_relaxed(&gkcrypt->key_buf_key_pos_min);
+	uint64_t max = chiaki_atomic_load_relaxed(&gkcrypt->key_buf_key_pos_max);
+	uint64_t last_key_pos = chiaki_atomic_load_relaxed(&gkcrypt->last_key_pos);
 
-	chiaki_mutex_lock(&gkcrypt->key_buf_mutex);
+	if(last_key_pos > max)
+	{
+		// skip ahead if the last key pos is already beyond our buffer
+		uint64_t key_pos = (last_key_pos / KEY_BUF_CHUNK_SIZE) * KEY_BUF_CHUNK_SIZE;
+		CHIAKI_LOGW(gkcrypt->log, "Already requested a higher key pos than in the buffer, skipping ahead from min %#llx to %#llx",
+					(unsigned long long)min,
+					(unsigned long long)key_pos);
+		chiaki_atomic_fetch_add_relaxed(&gkcrypt->key_buf_stats.skips, 1);
+		gkcrypt_key_buf_reclaim(gkcrypt, key_pos);
+		chiaki_atomic_store_relaxed(&gkcrypt->key_buf_key_pos_max, key_pos);
+		max = key_pos;
+	}
+	else if(max - min >= gkcrypt->key_buf_size)
+		gkcrypt_key_buf_reclaim(gkcrypt, min + KEY_BUF_CHUNK_SIZE);
 
-	if(err == CHIAKI_ERR_SUCCESS)
-		gkcrypt->key_buf_populated += KEY_BUF_CHUNK_SIZE;
+	ChiakiErrorCode err = gkcrypt_gen_key_stream(gkcrypt, ctx, max, gkcrypt->key_buf + max % gkcrypt->key_buf_size, KEY_BUF_CHUNK_SIZE);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(gkcrypt->log, "GKCrypt failed to generate key stream chunk");
+		return err;
+	}
 
-	return err;
+	// publishes the chunk, see gkcrypt_key_buf_read()
+	chiaki_atomic_store_release(&gkcrypt->key_buf_key_pos_max, max + KEY_BUF_CHUNK_SIZE);
+	return CHIAKI_ERR_SUCCESS;
 }
 
 static void *gkcrypt_thread_func(void *user)
@@ -500,46 +1008,51 @@ static void *gkcrypt_thread_func(void *user)
 	ChiakiGKCrypt *gkcrypt = user;
 	CHIAKI_LOGV(gkcrypt->log, "GKCrypt %d thread starting", (int)gkcrypt->index);
 
+	// not shared with chiaki_gkcrypt_gen_key_stream(), which may run at the same time
+	GKCryptCtx *ctx = gkcrypt_key_stream_ctx_new(gkcrypt->key_base);
+	if(!ctx)
+	{
+		CHIAKI_LOGE(gkcrypt->log, "GKCrypt %d failed to create cipher context for key buf", (int)gkcrypt->index);
+		return NULL;
+	}
+
 	ChiakiErrorCode err = chiaki_mutex_lock(&gkcrypt->key_buf_mutex);
 	assert(err == CHIAKI_ERR_SUCCESS);
-	while(1)
+	while(!gkcrypt->key_buf_thread_stop)
 	{
-		err = chiaki_cond_wait_pred(&gkcrypt->key_buf_cond, &gkcrypt->key_buf_mutex, key_buf_mutex_pred, gkcrypt);
-
-		if(gkcrypt->key_buf_thread_stop || err != CHIAKI_ERR_SUCCESS)
-			break;
+		gkcrypt_key_buf_sample_rate(gkcrypt);
+		if(!gkcrypt_key_buf_should_generate(gkcrypt))
+		{
+			// sleep until half of the lead has been requested, so the chunks are generated in batches
+			uint64_t wake_key_pos = chiaki_atomic_load_relaxed(&gkcrypt->key_buf_key_pos_max) - gkcrypt_key_buf_lead(gkcrypt) / 2;
+			chiaki_atomic_store_relaxed(&gkcrypt->key_buf_wake_key_pos, wake_key_pos);
+			// pairs with the fence in gkcrypt_key_buf_request()
+			chiaki_atomic_fence();
+			if(chiaki_atomic_load_relaxed(&gkcrypt->last_key_pos) < wake_key_pos)
+				err = chiaki_cond_wait_pred(&gkcrypt->key_buf_cond, &gkcrypt->key_buf_mutex, key_buf_mutex_pred, gkcrypt);
+			chiaki_atomic_store_relaxed(&gkcrypt->key_buf_wake_key_pos, KEY_BUF_AWAKE);
+			if(err != CHIAKI_ERR_SUCCESS)
+				break;
+			continue;
+		}
 
-		CHIAKI_LOGV(gkcrypt->log, "GKCrypt %d key buf size %#llx, start offset: %#llx, populated: %#llx, min key pos: %#llx, last key pos: %#llx, generating next chunk",
+		CHIAKI_LOGV(gkcrypt->log, "GKCrypt %d key buf size %#llx, min key pos: %#llx, max key pos: %#llx, last key pos: %#llx, generating next chunk",
 					(int)gkcrypt->index,
 					(unsigned long long)gkcrypt->key_buf_size,
-					(unsigned long long)gkcrypt->key_buf_start_offset,
-					(unsigned long long)gkcrypt->key_buf_populated,
-					(unsigned long long)gkcrypt->key_buf_key_pos_min,
-					(unsigned long long)gkcrypt->last_key_pos);
+					(unsigned long long)chiaki_atomic_load_relaxed(&gkcrypt->key_buf_key_pos_min),
+					(unsigned long long)chiaki_atomic_load_relaxed(&gkcrypt->key_buf_key_pos_max),
+					(unsigned long long)chiaki_atomic_load_relaxed(&gkcrypt->last_key_pos));
 
-		if(gkcrypt->last_key_pos > gkcrypt->key_buf_key_pos_min + gkcrypt->key_buf_populated)
-		{
-			// skip ahead if the last key pos is already beyond our buffer
-			uint64_t key_pos = (gkcrypt->last_key_pos / KEY_BUF_CHUNK_SIZE) * KEY_BUF_CHUNK_SIZE;
-			CHIAKI_LOGW(gkcrypt->log, "Already requested a higher key pos than in the buffer, skipping ahead from min %#llx to %#llx",
-						(unsigned long long)gkcrypt->key_buf_key_pos_min,
-						(unsigned long long)key_pos);
-			gkcrypt->key_buf_key_pos_min = key_pos;
-			gkcrypt->key_buf_start_offset = 0;
-			gkcrypt->key_buf_populated = 0;
-		}
-		else if(gkcrypt->key_buf_populated == gkcrypt->key_buf_size)
-		{
-			gkcrypt->key_buf_start_offset = (gkcrypt->key_buf_start_offset + KEY_BUF_CHUNK_SIZE) % gkcrypt->key_buf_size;
-			gkcrypt->key_buf_key_pos_min += KEY_BUF_CHUNK_SIZE;
-			gkcrypt->key_buf_populated -= KEY_BUF_CHUNK_SIZE;
-		}
-		err = gkcrypt_generate_next_chunk(gkcrypt);
+		// requests never take the mutex unless they wake the thread
+		chiaki_mutex_unlock(&gkcrypt->key_buf_mutex);
+		err = gkcrypt_generate_next_chunk(gkcrypt, ctx);
+		chiaki_mutex_lock(&gkcrypt->key_buf_mutex);
 		if(err != CHIAKI_ERR_SUCCESS)
 			break;
 	}
 
 	chiaki_mutex_unlock(&gkcrypt->key_buf_mutex);
+	gkcrypt_key_stream_ctx_free(ctx);
 	return NULL;
 }
 
@@ -0,0 +1,208 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/packetbuf.h>
+
+#include <stdlib.h>
+#include <assert.h>
+
+struct chiaki_packet_buf_pool_t
+{
+	ChiakiMutex mutex;
+	size_t buf_size;
+	ChiakiPacketBuf *bufs;
+	size_t bufs_count;
+	uint8_t *mem;
+	ChiakiPacketBuf *free_bufs;
+	ChiakiPacketBuf *free_slices; // recycled headers for chiaki_packet_buf_slice()
+	size_t outstanding; // buffers handed out, including separately allocated ones
+	bool released; // chiaki_packet_buf_pool_free() was called, free everything once outstanding reaches 0
+};
+
+static void pool_destroy(ChiakiPacketBufPool *pool)
+{
+	while(pool->free_slices)
+	{
+		ChiakiPacketBuf *slice = pool->free_slices;
+		pool->free_slices = slice->next_free;
+		free(slice);
+	}
+	chiaki_mutex_fini(&pool->mutex);
+	free(pool->mem);
+	free(pool->bufs);
+	free(pool);
+}
+
+CHIAKI_EXPORT ChiakiPacketBufPool *chiaki_packet_buf_pool_new(size_t bufs_count, size_t buf_size)
+{
+	ChiakiPacketBufPool *pool = CHIAKI_NEW(ChiakiPacketBufPool);
+	if(!pool)
+		return NULL;
+	pool->buf_size = buf_size;
+	pool->bufs_count = bufs_count;
+	pool->outstanding = 0;
+	pool->released = false;
+	pool->free_bufs = NULL;
+	pool->free_slices = NULL;
+
+	if(chiaki_mutex_init(&pool->mutex, false) != CHIAKI_ERR_SUCCESS)
+		goto error_pool;
+
+	pool->bufs = calloc(bufs_count, sizeof(ChiakiPacketBuf));
+	if(!pool->bufs)
+		goto error_mutex;
+
+	pool->mem = malloc(bufs_count * buf_size);
+	if(!pool->mem)
+		goto error_bufs;
+
+	for(size_t i=bufs_count; i>0; i--)
+	{
+		ChiakiPacketBuf *buf = &pool->bufs[i - 1];
+		buf->pool = pool;
+		buf->refcount = 0;
+		buf->pooled = true;
+		buf->parent = NULL;
+		buf->data = pool->mem + (i - 1) * buf_size;
+		buf->size = buf_size;
+		buf->next_free = pool->free_bufs;
+		pool->free_bufs = buf;
+	}
+
+	return pool;
+error_bufs:
+	free(pool->bufs);
+error_mutex:
+	chiaki_mutex_fini(&pool->mutex);
+error_pool:
+	free(pool);
+	return NULL;
+}
+
+CHIAKI_EXPORT void chiaki_packet_buf_pool_free(ChiakiPacketBufPool *pool)
+{
+	if(!pool)
+		return;
+	chiaki_mutex_lock(&pool->mutex);
+	pool->released = true;
+	bool destroy = pool->outstanding == 0;
+	chiaki_mutex_unlock(&pool->mutex);
+	if(destroy)
+		pool_destroy(pool);
+}
+
+CHIAKI_EXPORT ChiakiPacketBuf *chiaki_packet_buf_pool_acquire(ChiakiPacketBufPool *pool, bool *exhausted)
+{
+	chiaki_mutex_lock(&pool->mutex);
+	ChiakiPacketBuf *buf = pool->free_bufs;
+	if(buf)
+	{
+		pool->free_bufs = buf->next_free;
+		buf->next_free = NULL;
+		buf->refcount = 1;
+		pool->outstanding++;
+		chiaki_mutex_unlock(&pool->mutex);
+		buf->recv_time_us = 0;
+		if(exhausted)
+			*exhausted = false;
+		return buf;
+	}
+	chiaki_mutex_unlock(&pool->mutex);
+
+	if(exhausted)
+		*exhausted = true;
+
+	// allocate header and data together
+	buf = malloc(sizeof(ChiakiPacketBuf) + pool->buf_size);
+	if(!buf)
+		return NULL;
+	buf->pool = pool;
+	buf->next_free = NULL;
+	buf->refcount = 1;
+	buf->pooled = false;
+	buf->parent = NULL;
+	buf->data = (uint8_t *)(buf + 1);
+	buf->size = pool->buf_size;
+	buf->recv_time_us = 0;
+
+	chiaki_mutex_lock(&pool->mutex);
+	pool->outstanding++;
+	chiaki_mutex_unlock(&pool->mutex);
+	return buf;
+}
+
+CHIAKI_EXPORT ChiakiPacketBuf *chiaki_packet_buf_slice(ChiakiPacketBuf *parent, size_t offset, size_t size)
+{
+	assert(offset + size <= parent->size);
+	ChiakiPacketBufPool *pool = parent->pool;
+
+	chiaki_mutex_lock(&pool->mutex);
+	ChiakiPacketBuf *slice = pool->free_slices;
+	if(slice)
+		pool->free_slices = slice->next_free;
+	else
+	{
+		slice = CHIAKI_NEW(ChiakiPacketBuf);
+		if(!slice)
+		{
+			chiaki_mutex_unlock(&pool->mutex);
+			return NULL;
+		}
+	}
+	assert(parent->refcount > 0);
+	parent->refcount++;
+	pool->outstanding++;
+	chiaki_mutex_unlock(&pool->mutex);
+
+	slice->pool = pool;
+	slice->next_free = NULL;
+	slice->refcount = 1;
+	slice->pooled = false;
+	slice->parent = parent;
+	slice->data = parent->data + offset;
+	slice->size = size;
+	slice->recv_time_us = parent->recv_time_us;
+	return slice;
+}
+
+CHIAKI_EXPORT void chiaki_packet_buf_ref(ChiakiPacketBuf *buf)
+{
+	ChiakiPacketBufPool *pool = buf->pool;
+	chiaki_mutex_lock(&pool->mutex);
+	assert(buf->refcount > 0);
+	buf->refcount++;
+	chiaki_mutex_unlock(&pool->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_packet_buf_unref(ChiakiPacketBuf *buf)
+{
+	ChiakiPacketBufPool *pool = buf->pool;
+	chiaki_mutex_lock(&pool->mutex);
+	// releasing a slice drops the reference to its parent
+	while(buf)
+	{
+		assert(buf->refcount > 0);
+		if(--buf->refcount > 0)
+			break;
+
+		ChiakiPacketBuf *parent = buf->parent;
+		if(buf->pooled)
+		{
+			buf->next_free = pool->free_bufs;
+			pool->free_bufs = buf;
+		}
+		else if(parent)
+		{
+			buf->next_free = pool->free_slices;
+			pool->free_slices = buf;
+		}
+		else
+			free(buf);
+		pool->outstanding--;
+		buf = parent;
+	}
+
+	bool destroy = pool->released && pool->outstanding == 0;
+	chiaki_mutex_unlock(&pool->mutex);
+	if(destroy)
+		pool_destroy(pool);
+}
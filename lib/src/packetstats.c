@@ -3,13 +3,18 @@
 #include <chiaki/packetstats.h>
 #include <chiaki/log.h>
 
+#include "atomic.h"
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_packet_stats_init(ChiakiPacketStats *stats)
 {
 	stats->gen_received = 0;
 	stats->gen_lost = 0;
-	stats->seq_min = 0;
 	stats->seq_max = 0;
 	stats->seq_received = 0;
+	stats->gen_received_reset = 0;
+	stats->gen_lost_reset = 0;
+	stats->seq_min = 0;
+	stats->seq_received_reset = 0;
 	return chiaki_mutex_init(&stats->mutex, false);
 }
 
@@ -18,59 +23,59 @@ CHIAKI_EXPORT void chiaki_packet_stats_fini(ChiakiPacketStats *stats)
 	chiaki_mutex_fini(&stats->mutex);
 }
 
-static void reset_stats(ChiakiPacketStats *stats)
+static void reset_stats(ChiakiPacketStats *stats, uint64_t gen_received, uint64_t gen_lost, ChiakiSeqNum16 seq_max, uint64_t seq_received)
 {
-	stats->gen_received = 0;
-	stats->gen_lost = 0;
-	stats->seq_min = stats->seq_max;
-	stats->seq_received = 0;
+	stats->gen_received_reset = gen_received;
+	stats->gen_lost_reset = gen_lost;
+	stats->seq_min = seq_max;
+	stats->seq_received_reset = seq_received;
 }
 
 CHIAKI_EXPORT void chiaki_packet_stats_reset(ChiakiPacketStats *stats)
 {
 	chiaki_mutex_lock(&stats->mutex);
-	reset_stats(stats);
+	reset_stats(stats,
+			chiaki_atomic_load_relaxed(&stats->gen_received),
+			chiaki_atomic_load_relaxed(&stats->gen_lost),
+			(ChiakiSeqNum16)chiaki_atomic_load_relaxed(&stats->seq_max),
+			chiaki_atomic_load_relaxed(&stats->seq_received));
 	chiaki_mutex_unlock(&stats->mutex);
 }
 
 CHIAKI_EXPORT void chiaki_packet_stats_push_generation(ChiakiPacketStats *stats, uint64_t received, uint64_t lost)
 {
-	chiaki_mutex_lock(&stats->mutex);
-	stats->gen_received += received;
-	stats->gen_lost += lost;
-	chiaki_mutex_unlock(&stats->mutex);
+	chiaki_atomic_fetch_add_relaxed(&stats->gen_received, received);
+	chiaki_atomic_fetch_add_relaxed(&stats->gen_lost, lost);
 }
 
 CHIAKI_EXPORT void chiaki_packet_stats_push_seq(ChiakiPacketStats *stats, ChiakiSeqNum16 seq_num)
 {
-	stats->seq_received++;
-	if(chiaki_seq_num_16_gt(seq_num, stats->seq_max))
-		stats->seq_max = seq_num;
+	chiaki_atomic_fetch_add_relaxed(&stats->seq_received, 1);
+	if(chiaki_seq_num_16_gt(seq_num, (ChiakiSeqNum16)chiaki_atomic_load_relaxed(&stats->seq_max)))
+		chiaki_atomic_store_relaxed(&stats->seq_max, seq_num);
 }
 
 CHIAKI_EXPORT void chiaki_packet_stats_get(ChiakiPacketStats *stats, bool reset, uint64_t *received, uint64_t *lost)
 {
+	uint64_t gen_received = chiaki_atomic_load_relaxed(&stats->gen_received);
+	uint64_t gen_lost = chiaki_atomic_load_relaxed(&stats->gen_lost);
+	ChiakiSeqNum16 seq_max = (ChiakiSeqNum16)chiaki_atomic_load_relaxed(&stats->seq_max);
+	uint64_t seq_received_total = chiaki_atomic_load_relaxed(&stats->seq_received);
+
 	chiaki_mutex_lock(&stats->mutex);
 
 	// gen
-	*received = stats->gen_received;
-	*lost = stats->gen_lost;
-
-	//CHIAKI_LOGD(NULL, "gen received: %llu, lost: %llu",
-	//		(unsigned long long)stats->gen_received,
-	//		(unsigned long long)stats->gen_lost);
+	*received = gen_received - stats->gen_received_reset;
+	*lost = gen_lost - stats->gen_lost_reset;
 
 	// seq
-	uint64_t seq_diff = stats->seq_max - stats->seq_min; // overflow on purpose if max < min
-	uint64_t seq_lost = stats->seq_received > seq_diff ? seq_diff : seq_diff - stats->seq_received;
-	*received += stats->seq_received;
+	uint64_t seq_received = seq_received_total - stats->seq_received_reset;
+	uint64_t seq_diff = seq_max - stats->seq_min; // overflow on purpose if max < min
+	uint64_t seq_lost = seq_received > seq_diff ? seq_diff : seq_diff - seq_received;
+	*received += seq_received;
 	*lost += seq_lost;
 
-	//CHIAKI_LOGD(NULL, "seq received: %llu, lost: %llu",
-	//		(unsigned long long)stats->seq_received,
-	//		(unsigned long long)seq_lost);
-
 	if(reset)
-		reset_stats(stats);
+		reset_stats(stats, gen_received, gen_lost, seq_max, seq_received_total);
 	chiaki_mutex_unlock(&stats->mutex);
 }
@@ -172,6 +172,7 @@ CHIAKI_EXPORT void chiaki_reorder_queue_drop(ChiakiReorderQueue *queue, uint64_t
 
 	if(queue->drop_cb)
 		queue->drop_cb(seq_num, entry->user, queue->drop_cb_user);
+	entry->set = false;
 
 	// reduce count if necessary
 	if(index == queue->count - 1)
@@ -185,4 +186,25 @@ CHIAKI_EXPORT void chiaki_reorder_queue_drop(ChiakiReorderQueue *queue, uint64_t
 			entry = &queue->queue[idx(seq_num)];
 		}
 	}
-}
\ No newline at end of file
+}
+
+CHIAKI_EXPORT size_t chiaki_reorder_queue_received_ranges(ChiakiReorderQueue *queue, ChiakiReorderQueueRange *ranges, size_t ranges_max)
+{
+	size_t ranges_count = 0;
+	bool in_range = false;
+	for(uint64_t i=0; i<queue->count; i++)
+	{
+		bool set = queue->queue[idx(add(queue->begin, i))].set;
+		if(set && !in_range)
+		{
+			if(ranges_count == ranges_max)
+				break;
+			ranges[ranges_count].start = i;
+			ranges_count++;
+		}
+		if(set)
+			ranges[ranges_count - 1].end = i;
+		in_range = set;
+	}
+	return ranges_count;
+}
@@ -144,6 +144,13 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_run(ChiakiSenkusha *senkusha, uint
 
 	takion_info.enable_crypt = false;
 	takion_info.protocol_version = 7;
+	takion_info.recv_batch_size = CHIAKI_TAKION_RECV_BATCH_SIZE_DEFAULT;
+	takion_info.recv_ring_size = 0;
+	takion_info.enable_udp_gro = false;
+	takion_info.enable_io_uring = false;
+	takion_info.capture = NULL;
+	takion_info.replay = NULL;
+	takion_info.rtt_us = 0;
 
 	takion_info.cb = senkusha_takion_cb;
 	takion_info.cb_user = senkusha;
@@ -6,6 +6,7 @@
 #include <chiaki/http.h>
 #include <chiaki/base64.h>
 #include <chiaki/random.h>
+#include <chiaki/time.h>
 
 #include <stdlib.h>
 #include <string.h>
@@ -227,6 +228,31 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_session_init(ChiakiSession *session, Chiaki
 	session->connect_info.video_profile = connect_info->video_profile;
 	session->connect_info.video_profile_auto_downgrade = connect_info->video_profile_auto_downgrade;
 	session->connect_info.enable_keyboard = connect_info->enable_keyboard;
+	session->connect_info.packet_ring_size = connect_info->packet_ring_size;
+	session->connect_info.udp_gro = connect_info->udp_gro;
+	session->connect_info.io_uring = connect_info->io_uring;
+	session->connect_info.congestion_control_report_overuse = connect_info->congestion_control_report_overuse;
+	session->connect_info.video_reorder_frames = connect_info->video_reorder_frames;
+	session->connect_info.video_reorder_window_us = connect_info->video_reorder_window_us;
+
+	if(connect_info->capture_filename)
+	{
+		session->connect_info.capture = CHIAKI_NEW(ChiakiTakionCapture);
+		if(!session->connect_info.capture)
+		{
+			chiaki_session_fini(session);
+			return CHIAKI_ERR_MEMORY;
+		}
+		err = chiaki_takion_capture_init(session->connect_info.capture, connect_info->capture_filename);
+		if(err != CHIAKI_ERR_SUCCESS)
+		{
+			CHIAKI_LOGE(session->log, "Failed to open capture file %s", connect_info->capture_filename);
+			free(session->connect_info.capture);
+			session->connect_info.capture = NULL;
+			chiaki_session_fini(session);
+			return err;
+		}
+	}
 
 	return CHIAKI_ERR_SUCCESS;
 error_stop_pipe:
@@ -253,6 +279,11 @@ CHIAKI_EXPORT void chiaki_session_fini(ChiakiSession *session)
 	chiaki_cond_fini(&session->state_cond);
 	chiaki_mutex_fini(&session->state_mutex);
 	freeaddrinfo(session->connect_info.host_addrinfos);
+	if(session->connect_info.capture)
+	{
+		chiaki_takion_capture_fini(session->connect_info.capture);
+		free(session->connect_info.capture);
+	}
 }
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_session_start(ChiakiSession *session)
@@ -472,7 +503,10 @@ ctrl_failed:
 	chiaki_senkusha_fini(&senkusha);
 
 	if(err == CHIAKI_ERR_SUCCESS)
+	{
 		CHIAKI_LOGI(session->log, "Senkusha completed successfully");
+		session->rtt_measured = true;
+	}
 	else if(err == CHIAKI_ERR_CANCELED)
 		QUIT(quit_ctrl);
 	else
@@ -841,3 +875,13 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_session_keyboard_accept(ChiakiSession *sess
 {
 	return chiaki_ctrl_keyboard_accept(&session->ctrl);
 }
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_session_get_bandwidth_estimate(ChiakiSession *session, ChiakiBandwidthEstimate *estimate)
+{
+	return chiaki_stream_connection_get_bandwidth_estimate(&session->stream_connection, estimate);
+}
+
+CHIAKI_EXPORT void chiaki_session_get_stream_stats(ChiakiSession *session, ChiakiStreamStatsSnapshot *snapshot)
+{
+	chiaki_stream_stats_snapshot(&session->stream_connection.stream_stats, chiaki_time_now_monotonic_us(), snapshot);
+}
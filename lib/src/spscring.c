@@ -0,0 +1,134 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/spscring.h>
+
+#include "atomic.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_spsc_ring_init(ChiakiSpscRing *ring, size_t capacity, size_t elem_size)
+{
+	if(!capacity || !elem_size)
+		return CHIAKI_ERR_INVALID_DATA;
+
+	size_t capacity_pow = 1;
+	while(capacity_pow < capacity)
+		capacity_pow <<= 1;
+
+	ring->elem_size = elem_size;
+	ring->mask = capacity_pow - 1;
+	ring->head = 0;
+	ring->tail = 0;
+	ring->high_water = 0;
+	ring->consumer_waiting = 0;
+	ring->closed = 0;
+
+	ring->elems = calloc(capacity_pow, elem_size);
+	if(!ring->elems)
+		return CHIAKI_ERR_MEMORY;
+
+	ChiakiErrorCode err = chiaki_mutex_init(&ring->wait_mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_elems;
+
+	err = chiaki_cond_init(&ring->wait_cond);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_mutex;
+
+	return CHIAKI_ERR_SUCCESS;
+error_mutex:
+	chiaki_mutex_fini(&ring->wait_mutex);
+error_elems:
+	free(ring->elems);
+	return err;
+}
+
+CHIAKI_EXPORT void chiaki_spsc_ring_fini(ChiakiSpscRing *ring)
+{
+	chiaki_cond_fini(&ring->wait_cond);
+	chiaki_mutex_fini(&ring->wait_mutex);
+	free(ring->elems);
+}
+
+static void ring_wake_consumer(ChiakiSpscRing *ring, bool always)
+{
+	// pairs with the fence in chiaki_spsc_ring_pop_wait(), so either we see the consumer waiting
+	// or the consumer sees what was just published
+	chiaki_atomic_fence();
+	if(!always && !chiaki_atomic_load_relaxed(&ring->consumer_waiting))
+		return;
+	chiaki_mutex_lock(&ring->wait_mutex);
+	chiaki_cond_signal(&ring->wait_cond);
+	chiaki_mutex_unlock(&ring->wait_mutex);
+}
+
+CHIAKI_EXPORT bool chiaki_spsc_ring_push(ChiakiSpscRing *ring, const void *elem)
+{
+	uint64_t tail = chiaki_atomic_load_relaxed(&ring->tail);
+	uint64_t head = chiaki_atomic_load_acquire(&ring->head);
+	if(tail - head > ring->mask)
+		return false;
+
+	memcpy(ring->elems + (tail & ring->mask) * ring->elem_size, elem, ring->elem_size);
+	chiaki_atomic_store_release(&ring->tail, tail + 1);
+	chiaki_atomic_store_max_relaxed(&ring->high_water, tail + 1 - head);
+
+	ring_wake_consumer(ring, false);
+	return true;
+}
+
+CHIAKI_EXPORT void chiaki_spsc_ring_close(ChiakiSpscRing *ring)
+{
+	chiaki_atomic_store_release(&ring->closed, 1);
+	ring_wake_consumer(ring, true);
+}
+
+CHIAKI_EXPORT bool chiaki_spsc_ring_pop(ChiakiSpscRing *ring, void *elem)
+{
+	uint64_t head = chiaki_atomic_load_relaxed(&ring->head);
+	uint64_t tail = chiaki_atomic_load_acquire(&ring->tail);
+	if(head == tail)
+		return false;
+
+	memcpy(elem, ring->elems + (head & ring->mask) * ring->elem_size, ring->elem_size);
+	chiaki_atomic_store_release(&ring->head, head + 1);
+	return true;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_spsc_ring_pop_wait(ChiakiSpscRing *ring, void *elem)
+{
+	if(chiaki_spsc_ring_pop(ring, elem))
+		return CHIAKI_ERR_SUCCESS;
+
+	ChiakiErrorCode err = CHIAKI_ERR_SUCCESS;
+	chiaki_mutex_lock(&ring->wait_mutex);
+	chiaki_atomic_store_relaxed(&ring->consumer_waiting, 1);
+	chiaki_atomic_fence();
+	while(!chiaki_spsc_ring_pop(ring, elem))
+	{
+		if(chiaki_atomic_load_acquire(&ring->closed))
+		{
+			// the producer may have pushed right before closing
+			if(!chiaki_spsc_ring_pop(ring, elem))
+				err = CHIAKI_ERR_CANCELED;
+			break;
+		}
+		chiaki_cond_wait(&ring->wait_cond, &ring->wait_mutex);
+	}
+	chiaki_atomic_store_relaxed(&ring->consumer_waiting, 0);
+	chiaki_mutex_unlock(&ring->wait_mutex);
+	return err;
+}
+
+CHIAKI_EXPORT size_t chiaki_spsc_ring_count(ChiakiSpscRing *ring)
+{
+	uint64_t head = chiaki_atomic_load_acquire(&ring->head);
+	uint64_t tail = chiaki_atomic_load_acquire(&ring->tail);
+	return (size_t)(tail - head);
+}
+
+CHIAKI_EXPORT size_t chiaki_spsc_ring_high_water(ChiakiSpscRing *ring)
+{
+	return (size_t)chiaki_atomic_load_relaxed(&ring->high_water);
+}
@@ -13,6 +13,14 @@
 #include <sys/select.h>
 #endif
 
+#if defined(__linux__) && !defined(__SWITCH__)
+#define STOP_PIPE_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <limits.h>
+#endif
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_stop_pipe_init(ChiakiStopPipe *stop_pipe)
 {
 #ifdef _WIN32
@@ -44,6 +52,29 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stop_pipe_init(ChiakiStopPipe *stop_pipe)
 		close(stop_pipe->fd);
 		return CHIAKI_ERR_UNKNOWN;
 	}
+#elif defined(STOP_PIPE_EPOLL)
+	stop_pipe->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(stop_pipe->event_fd < 0)
+		return CHIAKI_ERR_UNKNOWN;
+	stop_pipe->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if(stop_pipe->epoll_fd < 0)
+	{
+		close(stop_pipe->event_fd);
+		return CHIAKI_ERR_UNKNOWN;
+	}
+	struct epoll_event ev = { 0 };
+	ev.events = EPOLLIN;
+	ev.data.fd = stop_pipe->event_fd;
+	if(epoll_ctl(stop_pipe->epoll_fd, EPOLL_CTL_ADD, stop_pipe->event_fd, &ev) < 0)
+	{
+		close(stop_pipe->epoll_fd);
+		close(stop_pipe->event_fd);
+		return CHIAKI_ERR_UNKNOWN;
+	}
+	stop_pipe->epoll_sock = -1;
+	stop_pipe->epoll_sock_events = 0;
+	stop_pipe->epoll_sock_dev = 0;
+	stop_pipe->epoll_sock_ino = 0;
 #else
 	int r = pipe(stop_pipe->fds);
 	if(r < 0)
@@ -65,6 +96,9 @@ CHIAKI_EXPORT void chiaki_stop_pipe_fini(ChiakiStopPipe *stop_pipe)
 	WSACloseEvent(stop_pipe->event);
 #elif defined(__SWITCH__)
 	close(stop_pipe->fd);
+#elif defined(STOP_PIPE_EPOLL)
+	close(stop_pipe->epoll_fd);
+	close(stop_pipe->event_fd);
 #else
 	close(stop_pipe->fds[0]);
 	close(stop_pipe->fds[1]);
@@ -79,11 +113,67 @@ CHIAKI_EXPORT void chiaki_stop_pipe_stop(ChiakiStopPipe *stop_pipe)
 	// send to local socket (FIXME MSG_CONFIRM)
 	sendto(stop_pipe->fd, "\x00", 1, 0,
 		(struct sockaddr*)&stop_pipe->addr, sizeof(struct sockaddr_in));
+#elif defined(STOP_PIPE_EPOLL)
+	uint64_t v = 1;
+	write(stop_pipe->event_fd, &v, sizeof(v));
 #else
 	write(stop_pipe->fds[1], "\x00", 1);
 #endif
 }
 
+#ifdef STOP_PIPE_EPOLL
+/**
+ * Make sure exactly fd is registered in the epoll set besides the event_fd.
+ */
+static ChiakiErrorCode stop_pipe_epoll_set_sock(ChiakiStopPipe *stop_pipe, chiaki_socket_t fd, uint32_t events)
+{
+	if(CHIAKI_SOCKET_IS_INVALID(fd))
+	{
+		if(stop_pipe->epoll_sock >= 0)
+		{
+			// fails if the socket has been closed in the meantime, which already removed it from the set
+			epoll_ctl(stop_pipe->epoll_fd, EPOLL_CTL_DEL, stop_pipe->epoll_sock, NULL);
+			stop_pipe->epoll_sock = -1;
+		}
+		return CHIAKI_ERR_SUCCESS;
+	}
+
+	struct stat st;
+	if(fstat(fd, &st) < 0)
+		return CHIAKI_ERR_UNKNOWN;
+
+	struct epoll_event ev = { 0 };
+	ev.events = events;
+	ev.data.fd = fd;
+
+	if(fd == stop_pipe->epoll_sock
+		&& (uint64_t)st.st_dev == stop_pipe->epoll_sock_dev
+		&& (uint64_t)st.st_ino == stop_pipe->epoll_sock_ino)
+	{
+		if(events == stop_pipe->epoll_sock_events)
+			return CHIAKI_ERR_SUCCESS;
+		if(epoll_ctl(stop_pipe->epoll_fd, EPOLL_CTL_MOD, fd, &ev) < 0)
+			return CHIAKI_ERR_UNKNOWN;
+		stop_pipe->epoll_sock_events = events;
+		return CHIAKI_ERR_SUCCESS;
+	}
+
+	// different socket or the same fd number reused for a new one
+	if(stop_pipe->epoll_sock >= 0)
+	{
+		epoll_ctl(stop_pipe->epoll_fd, EPOLL_CTL_DEL, stop_pipe->epoll_sock, NULL);
+		stop_pipe->epoll_sock = -1;
+	}
+	if(epoll_ctl(stop_pipe->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		return CHIAKI_ERR_UNKNOWN;
+	stop_pipe->epoll_sock = fd;
+	stop_pipe->epoll_sock_events = events;
+	stop_pipe->epoll_sock_dev = (uint64_t)st.st_dev;
+	stop_pipe->epoll_sock_ino = (uint64_t)st.st_ino;
+	return CHIAKI_ERR_SUCCESS;
+}
+#endif
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_stop_pipe_select_single(ChiakiStopPipe *stop_pipe, chiaki_socket_t fd, bool write, uint64_t timeout_ms)
 {
 #ifdef _WIN32
@@ -116,6 +206,30 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stop_pipe_select_single(ChiakiStopPipe *sto
 		default:
 			return CHIAKI_ERR_UNKNOWN;
 	}
+#elif defined(STOP_PIPE_EPOLL)
+	ChiakiErrorCode err = stop_pipe_epoll_set_sock(stop_pipe, fd, write ? EPOLLOUT : EPOLLIN);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+
+	int timeout = -1;
+	if(timeout_ms != UINT64_MAX)
+		timeout = timeout_ms > INT_MAX ? INT_MAX : (int)timeout_ms;
+
+	struct epoll_event events[2];
+	int r = epoll_wait(stop_pipe->epoll_fd, events, 2, timeout);
+	if(r < 0)
+		return CHIAKI_ERR_UNKNOWN;
+
+	bool ready = false;
+	for(int i=0; i<r; i++)
+	{
+		if(events[i].data.fd == stop_pipe->event_fd)
+			return CHIAKI_ERR_CANCELED;
+		if(events[i].data.fd == fd)
+			ready = true;
+	}
+
+	return ready ? CHIAKI_ERR_SUCCESS : CHIAKI_ERR_TIMEOUT;
 #else
 	fd_set rfds;
 	FD_ZERO(&rfds);
@@ -249,6 +363,11 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stop_pipe_reset(ChiakiStopPipe *stop_pipe)
 	int r;
 	while((r = read(stop_pipe->fd, &v, sizeof(v))) > 0);
 	return r < 0 ? CHIAKI_ERR_UNKNOWN : CHIAKI_ERR_SUCCESS;
+#elif defined(STOP_PIPE_EPOLL)
+	// reading an eventfd resets its counter at once
+	uint64_t v;
+	ssize_t r = read(stop_pipe->event_fd, &v, sizeof(v));
+	return r < 0 && errno != EAGAIN ? CHIAKI_ERR_UNKNOWN : CHIAKI_ERR_SUCCESS;
 #else
 	uint8_t v;
 	int r;
@@ -77,6 +77,8 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_init(ChiakiStreamConnecti
 	if(err != CHIAKI_ERR_SUCCESS)
 		goto error_state_cond;
 
+	chiaki_stream_stats_init(&stream_connection->stream_stats);
+
 	stream_connection->video_receiver = NULL;
 	stream_connection->audio_receiver = NULL;
 
@@ -84,6 +86,11 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_init(ChiakiStreamConnecti
 	if(err != CHIAKI_ERR_SUCCESS)
 		goto error_packet_stats;
 
+	err = chiaki_mutex_init(&stream_connection->congestion_control_mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_feedback_sender_mutex;
+	stream_connection->congestion_control_active = false;
+
 	stream_connection->state = STATE_IDLE;
 	stream_connection->state_finished = false;
 	stream_connection->state_failed = false;
@@ -93,6 +100,8 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_init(ChiakiStreamConnecti
 
 	return CHIAKI_ERR_SUCCESS;
 
+error_feedback_sender_mutex:
+	chiaki_mutex_fini(&stream_connection->feedback_sender_mutex);
 error_packet_stats:
 	chiaki_packet_stats_fini(&stream_connection->packet_stats);
 error_state_cond:
@@ -115,6 +124,7 @@ CHIAKI_EXPORT void chiaki_stream_connection_fini(ChiakiStreamConnection *stream_
 	chiaki_packet_stats_fini(&stream_connection->packet_stats);
 
 	chiaki_mutex_fini(&stream_connection->feedback_sender_mutex);
+	chiaki_mutex_fini(&stream_connection->congestion_control_mutex);
 
 	chiaki_cond_fini(&stream_connection->state_cond);
 	chiaki_mutex_fini(&stream_connection->state_mutex);
@@ -126,6 +136,39 @@ static bool state_finished_cond_check(void *user)
 	return stream_connection->state_finished || stream_connection->should_stop || stream_connection->remote_disconnected;
 }
 
+/**
+ * Must be called with state_mutex locked.
+ */
+static void stream_connection_set_state(ChiakiStreamConnection *stream_connection, StreamConnectionState state)
+{
+	stream_connection->state = state;
+	stream_connection->state_finished = false;
+	stream_connection->state_failed = false;
+	// a replaying Takion thread may be waiting in stream_connection_replay_wait()
+	chiaki_cond_broadcast(&stream_connection->state_cond);
+}
+
+static bool replay_ready_cond_check(void *user)
+{
+	ChiakiStreamConnection *stream_connection = user;
+	return !stream_connection->state_finished || stream_connection->state == STATE_IDLE
+		|| stream_connection->should_stop || stream_connection->remote_disconnected;
+}
+
+/**
+ * Called on the Takion thread after each event when replaying a capture.
+ *
+ * With a console, the next packet can not arrive before this side reacted to the last one.
+ * A replay however would hand out e.g. the bang before the big has been sent and the state has moved on,
+ * so wait until a state that has finished has been left.
+ */
+static void stream_connection_replay_wait(ChiakiStreamConnection *stream_connection)
+{
+	chiaki_mutex_lock(&stream_connection->state_mutex);
+	chiaki_cond_wait_pred(&stream_connection->state_cond, &stream_connection->state_mutex, replay_ready_cond_check, stream_connection);
+	chiaki_mutex_unlock(&stream_connection->state_mutex);
+}
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnection *stream_connection)
 {
 	ChiakiSession *session = stream_connection->session;
@@ -144,6 +187,21 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnectio
 
 	takion_info.enable_crypt = true;
 	takion_info.protocol_version = chiaki_target_is_ps5(session->target) ? 12 : 9;
+	takion_info.recv_batch_size = CHIAKI_TAKION_RECV_BATCH_SIZE_DEFAULT;
+	takion_info.recv_ring_size = session->connect_info.packet_ring_size;
+	takion_info.enable_udp_gro = session->connect_info.udp_gro;
+	takion_info.enable_io_uring = session->connect_info.io_uring;
+	takion_info.capture = session->connect_info.capture;
+	takion_info.replay = session->connect_info.replay;
+	// the fallback rtt would let the retransmission timeout start out far too short
+	takion_info.rtt_us = session->rtt_measured ? session->rtt_us : 0;
+	if(takion_info.replay)
+	{
+		// the captured stream was encrypted with these, nothing is actually negotiated
+		session->target = takion_info.replay->target;
+		takion_info.protocol_version = chiaki_target_is_ps5(session->target) ? 12 : 9;
+		memcpy(session->handshake_key, takion_info.replay->handshake_key, sizeof(session->handshake_key));
+	}
 
 	takion_info.cb = stream_connection_takion_cb;
 	takion_info.cb_user = stream_connection;
@@ -164,7 +222,9 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnectio
 		return CHIAKI_ERR_UNKNOWN;
 	}
 
-	stream_connection->video_receiver = chiaki_video_receiver_new(session, &stream_connection->packet_stats);
+	// nothing is writing the stream stats before the video receiver is created
+	chiaki_stream_stats_reset(&stream_connection->stream_stats, session->connect_info.video_profile.max_fps);
+	stream_connection->video_receiver = chiaki_video_receiver_new(session, &stream_connection->packet_stats, &stream_connection->stream_stats);
 	if(!stream_connection->video_receiver)
 	{
 		CHIAKI_LOGE(session->log, "StreamConnection failed to initialize Video Receiver");
@@ -172,9 +232,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnectio
 		goto err_audio_receiver;
 	}
 
-	stream_connection->state = STATE_TAKION_CONNECT;
-	stream_connection->state_finished = false;
-	stream_connection->state_failed = false;
+	stream_connection_set_state(stream_connection, STATE_TAKION_CONNECT);
 	err = chiaki_takion_connect(&stream_connection->takion, &takion_info);
 	free(takion_info.sa);
 	if(err != CHIAKI_ERR_SUCCESS)
@@ -184,13 +242,19 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnectio
 		goto err_video_receiver;
 	}
 
-	ChiakiCongestionControl congestion_control;
-	err = chiaki_congestion_control_start(&congestion_control, &stream_connection->takion, &stream_connection->packet_stats);
+	err = chiaki_mutex_lock(&stream_connection->congestion_control_mutex);
+	assert(err == CHIAKI_ERR_SUCCESS);
+	err = chiaki_congestion_control_start(&stream_connection->congestion_control, &stream_connection->takion, &stream_connection->packet_stats,
+			session->connect_info.video_profile.max_fps, session->connect_info.video_profile.bitrate,
+			session->connect_info.congestion_control_report_overuse);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
+		chiaki_mutex_unlock(&stream_connection->congestion_control_mutex);
 		CHIAKI_LOGE(session->log, "StreamConnection failed to start Congestion Control");
 		goto close_takion;
 	}
+	stream_connection->congestion_control_active = true;
+	chiaki_mutex_unlock(&stream_connection->congestion_control_mutex);
 
 	err = chiaki_cond_timedwait_pred(&stream_connection->state_cond, &stream_connection->state_mutex, EXPECT_TIMEOUT_MS, state_finished_cond_check, stream_connection);
 	assert(err == CHIAKI_ERR_SUCCESS || err == CHIAKI_ERR_TIMEOUT);
@@ -203,9 +267,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnectio
 
 	CHIAKI_LOGI(session->log, "StreamConnection sending big");
 
-	stream_connection->state = STATE_EXPECT_BANG;
-	stream_connection->state_finished = false;
-	stream_connection->state_failed = false;
+	stream_connection_set_state(stream_connection, STATE_EXPECT_BANG);
 	err = stream_connection_send_big(stream_connection);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
@@ -229,9 +291,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnectio
 
 	CHIAKI_LOGI(session->log, "StreamConnection successfully received bang");
 
-	stream_connection->state = STATE_EXPECT_STREAMINFO;
-	stream_connection->state_finished = false;
-	stream_connection->state_failed = false;
+	stream_connection_set_state(stream_connection, STATE_EXPECT_STREAMINFO);
 	err = chiaki_cond_timedwait_pred(&stream_connection->state_cond, &stream_connection->state_mutex, EXPECT_TIMEOUT_MS, state_finished_cond_check, stream_connection);
 	assert(err == CHIAKI_ERR_SUCCESS || err == CHIAKI_ERR_TIMEOUT);
 	CHECK_STOP(disconnect);
@@ -261,9 +321,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnectio
 	chiaki_feedback_sender_set_controller_state(&stream_connection->feedback_sender, &session->controller_state);
 	chiaki_mutex_unlock(&stream_connection->feedback_sender_mutex);
 
-	stream_connection->state = STATE_IDLE;
-	stream_connection->state_finished = false;
-	stream_connection->state_failed = false;
+	stream_connection_set_state(stream_connection, STATE_IDLE);
 
 	ChiakiEvent event = { 0 };
 	event.type = CHIAKI_EVENT_CONNECTED;
@@ -309,9 +367,14 @@ disconnect:
 	}
 
 err_congestion_control:
-	chiaki_congestion_control_stop(&congestion_control);
+	chiaki_mutex_lock(&stream_connection->congestion_control_mutex);
+	stream_connection->congestion_control_active = false;
+	chiaki_congestion_control_stop(&stream_connection->congestion_control);
+	chiaki_mutex_unlock(&stream_connection->congestion_control_mutex);
 
 close_takion:
+	// don't leave a replaying Takion thread waiting for a state change that is not going to come anymore
+	stream_connection_set_state(stream_connection, STATE_IDLE);
 	chiaki_mutex_unlock(&stream_connection->state_mutex);
 
 	chiaki_takion_close(&stream_connection->takion);
@@ -335,7 +398,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_stop(ChiakiStreamConnecti
 		return err;
 	stream_connection->should_stop = true;
 	ChiakiErrorCode unlock_err = chiaki_mutex_unlock(&stream_connection->state_mutex);
-	err = chiaki_cond_signal(&stream_connection->state_cond);
+	err = chiaki_cond_broadcast(&stream_connection->state_cond);
 	return err == CHIAKI_ERR_SUCCESS ? unlock_err : err;
 }
 
@@ -353,6 +416,14 @@ static void stream_connection_takion_cb(ChiakiTakionEvent *event, void *user)
 				stream_connection->state_failed = event->type == CHIAKI_TAKION_EVENT_TYPE_DISCONNECT;
 				chiaki_cond_signal(&stream_connection->state_cond);
 			}
+			else if(event->type == CHIAKI_TAKION_EVENT_TYPE_DISCONNECT && stream_connection->session->connect_info.replay)
+			{
+				CHIAKI_LOGI(stream_connection->log, "StreamConnection reached the end of the replayed capture");
+				stream_connection->remote_disconnected = true;
+				free(stream_connection->remote_disconnect_reason);
+				stream_connection->remote_disconnect_reason = strdup("End of capture");
+				chiaki_cond_signal(&stream_connection->state_cond);
+			}
 			chiaki_mutex_unlock(&stream_connection->state_mutex);
 			break;
 		case CHIAKI_TAKION_EVENT_TYPE_DATA:
@@ -364,6 +435,9 @@ static void stream_connection_takion_cb(ChiakiTakionEvent *event, void *user)
 		default:
 			break;
 	}
+
+	if(stream_connection->session->connect_info.replay)
+		stream_connection_replay_wait(stream_connection);
 }
 
 static void stream_connection_takion_data(ChiakiStreamConnection *stream_connection, ChiakiTakionMessageDataType data_type, uint8_t *buf, size_t buf_size)
@@ -560,11 +634,22 @@ static void stream_connection_takion_data_expect_bang(ChiakiStreamConnection *st
 		goto error;
 	}
 
-	ChiakiErrorCode err = chiaki_ecdh_derive_secret(&stream_connection->session->ecdh,
-			stream_connection->ecdh_secret,
-			ecdh_pub_key_buf.buf, ecdh_pub_key_buf.size,
-			stream_connection->session->handshake_key,
-			ecdh_sig_buf.buf, ecdh_sig_buf.size);
+	ChiakiSession *session = stream_connection->session;
+	ChiakiErrorCode err;
+	if(session->connect_info.replay)
+	{
+		// our ECDH key is not the one the console derived the secret with back then
+		memcpy(stream_connection->ecdh_secret, session->connect_info.replay->ecdh_secret, CHIAKI_ECDH_SECRET_SIZE);
+		err = CHIAKI_ERR_SUCCESS;
+	}
+	else
+	{
+		err = chiaki_ecdh_derive_secret(&session->ecdh,
+				stream_connection->ecdh_secret,
+				ecdh_pub_key_buf.buf, ecdh_pub_key_buf.size,
+				session->handshake_key,
+				ecdh_sig_buf.buf, ecdh_sig_buf.size);
+	}
 
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
@@ -574,6 +659,9 @@ static void stream_connection_takion_data_expect_bang(ChiakiStreamConnection *st
 		goto error;
 	}
 
+	if(session->connect_info.capture)
+		chiaki_takion_capture_write_keys(session->connect_info.capture, session->target, session->handshake_key, stream_connection->ecdh_secret);
+
 	err = stream_connection_init_crypt(stream_connection);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
@@ -863,8 +951,7 @@ static ChiakiErrorCode stream_connection_send_disconnect(ChiakiStreamConnection
 
 static void stream_connection_takion_av(ChiakiStreamConnection *stream_connection, ChiakiTakionAVPacket *packet)
 {
-	chiaki_gkcrypt_decrypt(stream_connection->gkcrypt_remote, packet->key_pos + CHIAKI_GKCRYPT_BLOCK_SIZE, packet->data, packet->data_size);
-
+	// Takion has decrypted the data while checking the mac
 	if(packet->is_video)
 		chiaki_video_receiver_av_packet(stream_connection->video_receiver, packet);
 	else
@@ -889,6 +976,29 @@ static ChiakiErrorCode stream_connection_send_heartbeat(ChiakiStreamConnection *
 	return chiaki_takion_send_message_data(&stream_connection->takion, 1, 1, buf, stream.bytes_written, NULL);
 }
 
+CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_get_bandwidth_estimate(ChiakiStreamConnection *stream_connection, ChiakiBandwidthEstimate *estimate)
+{
+	ChiakiErrorCode err = chiaki_mutex_lock(&stream_connection->congestion_control_mutex);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	if(stream_connection->congestion_control_active)
+		chiaki_congestion_control_get_estimate(&stream_connection->congestion_control, estimate);
+	else
+		err = CHIAKI_ERR_UNINITIALIZED;
+	chiaki_mutex_unlock(&stream_connection->congestion_control_mutex);
+	return err;
+}
+
+CHIAKI_EXPORT void stream_connection_push_frame_arrival(ChiakiStreamConnection *stream_connection, ChiakiSeqNum16 frame_index,
+		uint64_t arrival_first_us, uint64_t arrival_last_us, size_t size)
+{
+	ChiakiErrorCode err = chiaki_mutex_lock(&stream_connection->congestion_control_mutex);
+	assert(err == CHIAKI_ERR_SUCCESS);
+	if(stream_connection->congestion_control_active)
+		chiaki_congestion_control_push_frame(&stream_connection->congestion_control, frame_index, arrival_first_us, arrival_last_us, size);
+	chiaki_mutex_unlock(&stream_connection->congestion_control_mutex);
+}
+
 CHIAKI_EXPORT ChiakiErrorCode stream_connection_send_corrupt_frame(ChiakiStreamConnection *stream_connection, ChiakiSeqNum16 start, ChiakiSeqNum16 end)
 {
 	tkproto_TakionMessage msg = { 0 };
@@ -0,0 +1,218 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/streamstats.h>
+
+#include "atomic.h"
+
+#include <string.h>
+
+// frames further apart than this are not used for jitter, e.g. after a stall
+#define JITTER_FRAMES_MAX 30
+
+#define SLOT_WORDS (sizeof(ChiakiStreamStatsSlot) / sizeof(uint64_t))
+
+static void stats_write_begin(ChiakiStreamStats *stats)
+{
+	chiaki_atomic_store_relaxed(&stats->seq, stats->seq + 1);
+	// readers that see any of the following stores must also see the odd seq
+	chiaki_atomic_fence();
+}
+
+static void stats_write_end(ChiakiStreamStats *stats)
+{
+	chiaki_atomic_store_release(&stats->seq, stats->seq + 1);
+}
+
+/**
+ * Only the writer may call this, so the plain read of the old value does not race.
+ */
+static inline void stats_add(uint64_t *p, uint64_t v)
+{
+	chiaki_atomic_store_relaxed(p, *p + v);
+}
+
+static void stats_clear_slot(ChiakiStreamStatsSlot *slot, uint64_t index)
+{
+	uint64_t *words = (uint64_t *)slot;
+	for(size_t i=0; i<SLOT_WORDS; i++)
+		chiaki_atomic_store_relaxed(&words[i], 0);
+	chiaki_atomic_store_relaxed(&slot->index, index);
+}
+
+/**
+ * Get the slot for now_us, clearing it if it still holds an older time.
+ * Also records the start of the stats if necessary.
+ */
+static ChiakiStreamStatsSlot *stats_slot(ChiakiStreamStats *stats, uint64_t now_us)
+{
+	if(!stats->start_us)
+		chiaki_atomic_store_relaxed(&stats->start_us, now_us);
+	uint64_t index = now_us / CHIAKI_STREAM_STATS_SLOT_US;
+	ChiakiStreamStatsSlot *slot = &stats->slots[index % CHIAKI_STREAM_STATS_SLOTS];
+	if(slot->index != index)
+		stats_clear_slot(slot, index);
+	return slot;
+}
+
+CHIAKI_EXPORT void chiaki_stream_stats_init(ChiakiStreamStats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	stats->frame_interval_us = 1000000 / 60;
+}
+
+CHIAKI_EXPORT void chiaki_stream_stats_reset(ChiakiStreamStats *stats, unsigned int fps)
+{
+	stats_write_begin(stats);
+	chiaki_atomic_store_relaxed(&stats->start_us, 0);
+	chiaki_atomic_store_relaxed(&stats->frames_total, 0);
+	chiaki_atomic_store_relaxed(&stats->bytes_total, 0);
+	chiaki_atomic_store_relaxed(&stats->jitter_us, 0);
+	for(size_t i=0; i<CHIAKI_STREAM_STATS_SLOTS; i++)
+		stats_clear_slot(&stats->slots[i], 0);
+	stats_write_end(stats);
+
+	stats->frame_interval_us = 1000000 / (fps ? fps : 60);
+	stats->frame_prev_valid = false;
+	stats->frame_index_prev = 0;
+	stats->arrival_prev_us = 0;
+	stats->jitter_acc_us = 0;
+}
+
+CHIAKI_EXPORT unsigned int chiaki_stream_stats_burst_bucket(unsigned int length)
+{
+	unsigned int bucket = 0;
+	for(unsigned int l = length > 0 ? length - 1 : 0; l; l >>= 1)
+		bucket++;
+	return bucket < CHIAKI_STREAM_STATS_BURST_BUCKETS ? bucket : CHIAKI_STREAM_STATS_BURST_BUCKETS - 1;
+}
+
+CHIAKI_EXPORT void chiaki_stream_stats_push_units(ChiakiStreamStats *stats, uint64_t now_us,
+		uint64_t received, uint64_t lost, const uint64_t bursts[CHIAKI_STREAM_STATS_BURST_BUCKETS])
+{
+	stats_write_begin(stats);
+	ChiakiStreamStatsSlot *slot = stats_slot(stats, now_us);
+	stats_add(&slot->units_received, received);
+	stats_add(&slot->units_lost, lost);
+	for(size_t i=0; i<CHIAKI_STREAM_STATS_BURST_BUCKETS; i++)
+	{
+		if(bursts[i])
+			stats_add(&slot->bursts[i], bursts[i]);
+	}
+	stats_write_end(stats);
+}
+
+static void stats_update_jitter(ChiakiStreamStats *stats, ChiakiSeqNum16 frame_index, uint64_t arrival_us)
+{
+	if(stats->frame_prev_valid)
+	{
+		if(!chiaki_seq_num_16_gt(frame_index, stats->frame_index_prev))
+			return;
+		ChiakiSeqNum16 frames = frame_index - stats->frame_index_prev;
+		if(frames <= JITTER_FRAMES_MAX)
+		{
+			// difference between arrival and send interval, see RFC 3550, 6.4.1
+			int64_t d = (int64_t)(arrival_us - stats->arrival_prev_us) - (int64_t)(frames * stats->frame_interval_us);
+			uint64_t d_abs = d < 0 ? (uint64_t)-d : (uint64_t)d;
+			stats->jitter_acc_us = stats->jitter_acc_us + d_abs - stats->jitter_acc_us / 16;
+			chiaki_atomic_store_relaxed(&stats->jitter_us, stats->jitter_acc_us / 16);
+		}
+	}
+	stats->frame_prev_valid = true;
+	stats->frame_index_prev = frame_index;
+	stats->arrival_prev_us = arrival_us;
+}
+
+CHIAKI_EXPORT void chiaki_stream_stats_push_frame(ChiakiStreamStats *stats, uint64_t now_us,
+		ChiakiSeqNum16 frame_index, uint64_t arrival_us, uint64_t size, bool fec, bool failed)
+{
+	stats_write_begin(stats);
+	ChiakiStreamStatsSlot *slot = stats_slot(stats, now_us);
+	if(size)
+	{
+		stats_add(&slot->frames, 1);
+		stats_add(&slot->bytes, size);
+		stats_add(&stats->frames_total, 1);
+		stats_add(&stats->bytes_total, size);
+	}
+	if(fec)
+		stats_add(&slot->frames_fec, 1);
+	if(failed)
+		stats_add(&slot->frames_fec_failed, 1);
+	if(arrival_us)
+		stats_update_jitter(stats, frame_index, arrival_us);
+	stats_write_end(stats);
+}
+
+static void stats_window(ChiakiStreamStatsWindow *window, const ChiakiStreamStatsSlot *slots, uint64_t start_us,
+		uint64_t now_us, uint64_t window_us)
+{
+	memset(window, 0, sizeof(*window));
+
+	// the current slot is only partially over
+	uint64_t now_index = now_us / CHIAKI_STREAM_STATS_SLOT_US;
+	uint64_t slots_count = window_us / CHIAKI_STREAM_STATS_SLOT_US;
+	uint64_t first_index = now_index >= slots_count - 1 ? now_index - (slots_count - 1) : 0;
+	uint64_t window_start_us = first_index * CHIAKI_STREAM_STATS_SLOT_US;
+	if(!start_us || start_us > now_us)
+		return;
+	if(start_us > window_start_us)
+		window_start_us = start_us;
+	window->duration_us = now_us - window_start_us;
+
+	uint64_t frames = 0;
+	uint64_t bytes = 0;
+	for(size_t i=0; i<CHIAKI_STREAM_STATS_SLOTS; i++)
+	{
+		const ChiakiStreamStatsSlot *slot = &slots[i];
+		if(slot->index < first_index || slot->index > now_index)
+			continue;
+		frames += slot->frames;
+		bytes += slot->bytes;
+		window->units_received += slot->units_received;
+		window->units_lost += slot->units_lost;
+		window->frames_fec += slot->frames_fec;
+		window->frames_fec_failed += slot->frames_fec_failed;
+		for(size_t b=0; b<CHIAKI_STREAM_STATS_BURST_BUCKETS; b++)
+			window->bursts[b] += slot->bursts[b];
+	}
+
+	if(window->duration_us)
+	{
+		window->fps = (double)frames * 1000000.0 / (double)window->duration_us;
+		window->bitrate = bytes * 8 * 1000000 / window->duration_us;
+	}
+	uint64_t units = window->units_received + window->units_lost;
+	window->loss_ratio = units ? (double)window->units_lost / (double)units : 0.0;
+	window->fec_recovery_ratio = window->frames_fec
+		? 1.0 - (double)window->frames_fec_failed / (double)window->frames_fec
+		: 1.0;
+}
+
+CHIAKI_EXPORT void chiaki_stream_stats_snapshot(ChiakiStreamStats *stats, uint64_t now_us, ChiakiStreamStatsSnapshot *snapshot)
+{
+	ChiakiStreamStatsSlot slots[CHIAKI_STREAM_STATS_SLOTS];
+	uint64_t start_us;
+	while(true)
+	{
+		uint64_t seq = chiaki_atomic_load_acquire(&stats->seq);
+		if(seq & 1)
+			continue;
+
+		start_us = chiaki_atomic_load_relaxed(&stats->start_us);
+		snapshot->frames_total = chiaki_atomic_load_relaxed(&stats->frames_total);
+		snapshot->bytes_total = chiaki_atomic_load_relaxed(&stats->bytes_total);
+		snapshot->jitter_us = chiaki_atomic_load_relaxed(&stats->jitter_us);
+		const uint64_t *src = (const uint64_t *)stats->slots;
+		uint64_t *dst = (uint64_t *)slots;
+		for(size_t i=0; i<CHIAKI_STREAM_STATS_SLOTS * SLOT_WORDS; i++)
+			dst[i] = chiaki_atomic_load_relaxed(&src[i]);
+
+		// all loads above must happen before checking seq again
+		chiaki_atomic_fence();
+		if(chiaki_atomic_load_relaxed(&stats->seq) == seq)
+			break;
+	}
+
+	stats_window(&snapshot->window_short, slots, start_us, now_us, CHIAKI_STREAM_STATS_WINDOW_SHORT_US);
+	stats_window(&snapshot->window_long, slots, start_us, now_us, CHIAKI_STREAM_STATS_WINDOW_LONG_US);
+}
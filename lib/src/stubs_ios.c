@@ -1028,6 +1028,16 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gmac(ChiakiGKCrypt *gkcrypt, uint64
     return CHIAKI_ERR_SUCCESS;
 }
 
+CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_verify_decrypt(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size,
+        size_t decrypt_offset, uint64_t decrypt_key_pos, const uint8_t *gmac, uint8_t *gmac_out) {
+    (void)decrypt_offset; (void)decrypt_key_pos;
+    // Stub: same as chiaki_gkcrypt_gmac() above, data already "decrypted"
+    uint8_t gmac_tmp[CHIAKI_GKCRYPT_GMAC_SIZE];
+    if(!gmac_out) gmac_out = gmac_tmp;
+    chiaki_gkcrypt_gmac(gkcrypt, key_pos, buf, buf_size, gmac_out);
+    return memcmp(gmac_out, gmac, CHIAKI_GKCRYPT_GMAC_SIZE) == 0 ? CHIAKI_ERR_SUCCESS : CHIAKI_ERR_INVALID_MAC;
+}
+
 // ========== FEC (Jerasure) ==========
 CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_decode(uint8_t *frame_buf, size_t unit_size, size_t stride, unsigned int k, unsigned int m, const unsigned int *erasures, size_t erasures_count) {
     (void)frame_buf; (void)unit_size; (void)stride; (void)k; (void)m; (void)erasures; (void)erasures_count;
@@ -1035,6 +1045,31 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_decode(uint8_t *frame_buf, size_t unit_
     return CHIAKI_ERR_FEC_FAILED;
 }
 
+CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_encode(uint8_t *frame_buf, size_t unit_size, size_t stride, unsigned int k, unsigned int m) {
+    (void)frame_buf; (void)unit_size; (void)stride; (void)k; (void)m;
+    return CHIAKI_ERR_FEC_FAILED;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_cache_init(void) {
+    return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT void chiaki_fec_cache_stats(ChiakiFecCacheStats *stats) {
+    memset(stats, 0, sizeof(ChiakiFecCacheStats));
+}
+
+CHIAKI_EXPORT const char *chiaki_fec_engine_name(ChiakiFecEngine engine) {
+    return engine == CHIAKI_FEC_ENGINE_BITMATRIX ? "bitmatrix" : "matrix";
+}
+
+CHIAKI_EXPORT void chiaki_fec_set_engine(ChiakiFecEngine engine) {
+    (void)engine;
+}
+
+CHIAKI_EXPORT ChiakiFecEngine chiaki_fec_get_engine(void) {
+    return CHIAKI_FEC_ENGINE_MATRIX;
+}
+
 // ========== GKCrypt Key State ==========
 CHIAKI_EXPORT void chiaki_key_state_init(ChiakiKeyState *state) {
     memset(state, 0, sizeof(ChiakiKeyState));
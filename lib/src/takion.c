@@ -1,10 +1,14 @@
 // SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
 
+#define _GNU_SOURCE // recvmmsg()
+
 #include "chiaki/feedback.h"
 #include <chiaki/takion.h>
 #include <chiaki/congestioncontrol.h>
 #include <chiaki/random.h>
 #include <chiaki/gkcrypt.h>
+#include <chiaki/config.h>
+#include <chiaki/time.h>
 
 #include <fcntl.h>
 #include <stdbool.h>
@@ -27,6 +31,25 @@
 #include <sys/socket.h>
 #endif
 
+#if defined(__linux__)
+#define TAKION_RECVMMSG
+#include <sys/uio.h>
+#include <netinet/udp.h>
+#define TAKION_UDP_GRO
+#define TAKION_RECV_TIMESTAMPS
+#include <time.h>
+#ifndef UDP_GRO
+#define UDP_GRO 104 // older libc headers
+#endif
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#if CHIAKI_LIB_ENABLE_IO_URING
+#define TAKION_IO_URING
+#include "takionuring.h"
+#endif
+#endif
+
 
 // VERY similar to SCTP, see RFC 4960
 
@@ -35,10 +58,30 @@
 #define TAKION_INBOUND_STREAMS 0x64
 
 #define TAKION_REORDER_QUEUE_SIZE_EXP 4 // => 16 entries
-#define TAKION_SEND_BUFFER_SIZE 16
+#define TAKION_SEND_BUFFER_SIZE 16 // must be a power of 2
+
+// maximum number of gap ack blocks that can be described by data_queue
+#define TAKION_DATA_ACK_GAP_ACK_BLOCKS_MAX ((1 << TAKION_REORDER_QUEUE_SIZE_EXP) / 2)
 
 #define TAKION_POSTPONE_PACKETS_SIZE 32
 
+// av units referenced by the frame processors instead of being copied, about two frames of the maximum size.
+// Frames release their units as soon as they have been handed out, so only frames still being received hold any.
+#define TAKION_RECV_POOL_AV_UNITS 512
+
+// receive buffers that may be held outside of the current batch, i.e. in the data queue, postponed or referenced by av consumers
+#define TAKION_RECV_POOL_RESERVE ((1 << TAKION_REORDER_QUEUE_SIZE_EXP) + TAKION_POSTPONE_PACKETS_SIZE + TAKION_RECV_POOL_AV_UNITS)
+
+// receive buffer size with UDP_GRO, large enough for the biggest coalesced datagram the kernel hands out.
+// These are never held beyond handling the batch they were received in, see takion_recv_buf_detach().
+#define TAKION_GRO_BUF_SIZE 0x10000
+
+// receive buffers that are kept provided to io_uring, must be a power of 2
+#define TAKION_IO_URING_BUFS 256
+
+// with a receive ring, av packets are dropped once less than 1/x of the ring is free, so there is always space for control packets
+#define TAKION_RECV_RING_CONTROL_RESERVE_DIV 8
+
 #define TAKION_MESSAGE_HEADER_SIZE 0x10
 
 #define TAKION_PACKET_BASE_TYPE_MASK 0xf
@@ -142,7 +185,8 @@ typedef struct takion_message_payload_init_ack_t
 
 typedef struct
 {
-	uint8_t *packet_buf;
+	ChiakiPacketBuf *buf;
+	uint8_t *packet_buf; // data of buf
 	size_t packet_size;
 	uint8_t type_b;
 	uint8_t *payload; // inside packet_buf
@@ -152,24 +196,58 @@ typedef struct
 
 typedef struct chiaki_takion_postponed_packet_t
 {
-	uint8_t *buf;
+	ChiakiPacketBuf *buf;
 	size_t buf_size;
 } ChiakiTakionPostponedPacket;
 
+/**
+ * Receive slots for a single wakeup of the Takion thread.
+ * Slots whose buffer has been passed on are NULL and refilled from the pool before the next receive.
+ */
+typedef struct takion_recv_batch_t
+{
+	size_t size;
+	size_t buf_size;
+	ChiakiPacketBuf **bufs;
+	size_t *buf_sizes;
+	size_t *segment_sizes; // UDP_GRO segment size of each received buffer or 0 if it holds a single datagram
+	uint64_t *recv_times; // kernel receive timestamp of each buffer as chiaki_time_now_monotonic_us() or 0 if there is none
+#ifdef TAKION_RECVMMSG
+	struct mmsghdr *msgs;
+	struct iovec *iovs;
+	uint8_t *controls; // TAKION_RECV_CONTROL_SIZE bytes per message, only if ancillary data is requested
+#endif
+} TakionRecvBatch;
+
+#ifdef TAKION_RECVMMSG
+// room for a UDP_GRO segment size and an SO_TIMESTAMPNS timestamp
+#define TAKION_RECV_CONTROL_SIZE (CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(struct timespec)))
+#endif
+
+typedef struct takion_recv_ring_entry_t
+{
+	ChiakiPacketBuf *buf;
+	size_t buf_size;
+} TakionRecvRingEntry;
+
 static void *takion_thread_func(void *user);
-static void takion_handle_packet(ChiakiTakion *takion, uint8_t *buf, size_t buf_size);
-static ChiakiErrorCode takion_handle_packet_mac(ChiakiTakion *takion, uint8_t base_type, uint8_t *buf, size_t buf_size);
-static void takion_handle_packet_message(ChiakiTakion *takion, uint8_t *buf, size_t buf_size);
-static void takion_handle_packet_message_data(ChiakiTakion *takion, uint8_t *packet_buf, size_t packet_buf_size, uint8_t type_b, uint8_t *payload, size_t payload_size);
+static void *takion_recv_thread_func(void *user);
+static void takion_handle_packet(ChiakiTakion *takion, ChiakiPacketBuf *packet_buf, size_t buf_size);
+static ChiakiErrorCode takion_handle_packet_mac(ChiakiTakion *takion, uint8_t base_type, uint8_t *buf, size_t buf_size, ChiakiTakionAVPacket *av);
+static void takion_handle_packet_message(ChiakiTakion *takion, ChiakiPacketBuf *packet_buf, size_t buf_size);
+static void takion_handle_packet_message_data(ChiakiTakion *takion, ChiakiPacketBuf *packet_buf, size_t packet_buf_size, uint8_t type_b, uint8_t *payload, size_t payload_size);
 static void takion_handle_packet_message_data_ack(ChiakiTakion *takion, uint8_t flags, uint8_t *buf, size_t buf_size);
 static ChiakiErrorCode takion_parse_message(ChiakiTakion *takion, uint8_t *buf, size_t buf_size, TakionMessage *msg);
 static void takion_write_message_header(uint8_t *buf, uint32_t tag, uint64_t key_pos, uint8_t chunk_type, uint8_t chunk_flags, size_t payload_data_size);
 static ChiakiErrorCode takion_send_message_init(ChiakiTakion *takion, TakionMessagePayloadInit *payload);
 static ChiakiErrorCode takion_send_message_cookie(ChiakiTakion *takion, uint8_t *cookie);
 static ChiakiErrorCode takion_recv(ChiakiTakion *takion, uint8_t *buf, size_t *buf_size, uint64_t timeout_ms);
+static ChiakiErrorCode takion_recv_handshake(ChiakiTakion *takion, uint8_t *buf, size_t *buf_size);
+static ChiakiErrorCode takion_recv_batch(ChiakiTakion *takion, TakionRecvBatch *batch, size_t *count);
+static ChiakiErrorCode takion_replay_batch(ChiakiTakion *takion, TakionRecvBatch *batch, size_t *count);
 static ChiakiErrorCode takion_recv_message_init_ack(ChiakiTakion *takion, TakionMessagePayloadInitAck *payload);
 static ChiakiErrorCode takion_recv_message_cookie_ack(ChiakiTakion *takion);
-static void takion_handle_packet_av(ChiakiTakion *takion, uint8_t base_type, uint8_t *buf, size_t buf_size);
+static void takion_handle_packet_av(ChiakiTakion *takion, uint8_t base_type, ChiakiPacketBuf *packet_buf, size_t buf_size);
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_connect(ChiakiTakion *takion, ChiakiTakionConnectInfo *info)
 {
@@ -194,6 +272,12 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_connect(ChiakiTakion *takion, Chiaki
 			return CHIAKI_ERR_INVALID_DATA;
 	}
 
+	if(info->replay && info->replay->protocol_version != takion->version)
+	{
+		CHIAKI_LOGE(takion->log, "Takion replay was captured with protocol version %u", (unsigned int)info->replay->protocol_version);
+		return CHIAKI_ERR_INVALID_DATA;
+	}
+
 	takion->gkcrypt_local = NULL;
 	ret = chiaki_mutex_init(&takion->gkcrypt_local_mutex, true);
 	if(ret != CHIAKI_ERR_SUCCESS)
@@ -204,7 +288,11 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_connect(ChiakiTakion *takion, Chiaki
 	takion->cb_user = info->cb_user;
 	takion->a_rwnd = TAKION_A_RWND;
 
-	takion->tag_local = chiaki_random_32(); // 0x4823
+	takion->capture = info->capture;
+	takion->replay = info->replay;
+
+	// received messages are checked against the tag, so a replay has to use the captured one
+	takion->tag_local = takion->replay ? takion->replay->tag_local : chiaki_random_32(); // 0x4823
 	takion->seq_num_local = takion->tag_local;
 	ret = chiaki_mutex_init(&takion->seq_num_local_mutex, false);
 	if(ret != CHIAKI_ERR_SUCCESS)
@@ -216,13 +304,43 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_connect(ChiakiTakion *takion, Chiaki
 	takion->postponed_packets_size = 0;
 	takion->postponed_packets_count = 0;
 
+#ifdef TAKION_RECVMMSG
+	takion->recv_batch_size = info->recv_batch_size ? info->recv_batch_size : CHIAKI_TAKION_RECV_BATCH_SIZE_DEFAULT;
+#else
+	takion->recv_batch_size = 1;
+#endif
+	takion->recv_pool = NULL;
+	takion->recv_copy_pool = NULL;
+	takion->rtt_initial_us = info->rtt_us;
+	takion->recv_ring_size = info->recv_ring_size;
+	// both only concern the socket
+	takion->enable_udp_gro = info->enable_udp_gro && !info->replay;
+	takion->recv_gro = false;
+	takion->enable_io_uring = info->enable_io_uring && !info->replay;
+	takion->recv_uring = NULL;
+	takion->recv_timestamps = false;
+	memset(&takion->recv_stats, 0, sizeof(takion->recv_stats));
+	ret = chiaki_mutex_init(&takion->recv_stats_mutex, false);
+	if(ret != CHIAKI_ERR_SUCCESS)
+		goto error_seq_num_local_mutex;
+
 	CHIAKI_LOGI(takion->log, "Takion connecting (version %u)", (unsigned int)info->protocol_version);
 
 	ChiakiErrorCode err = chiaki_stop_pipe_init(&takion->stop_pipe);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		CHIAKI_LOGE(takion->log, "Takion failed to create stop pipe");
-		goto error_seq_num_local_mutex;
+		goto error_recv_stats_mutex;
+	}
+
+	if(takion->capture)
+		chiaki_takion_capture_write_takion(takion->capture, takion->version, takion->tag_local);
+
+	if(takion->replay)
+	{
+		takion->sock = CHIAKI_INVALID_SOCKET;
+		CHIAKI_LOGI(takion->log, "Takion replaying a capture instead of connecting");
+		goto start_thread;
 	}
 
 	takion->sock = socket(info->sa->sa_family, SOCK_DGRAM, IPPROTO_UDP);
@@ -278,8 +396,9 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_connect(ChiakiTakion *takion, Chiaki
 		goto error_sock;
 	}
 
+start_thread:
 	err = chiaki_thread_create(&takion->thread, takion_thread_func, takion);
-	if(r != CHIAKI_ERR_SUCCESS)
+	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		ret = err;
 		goto error_sock;
@@ -290,9 +409,12 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_connect(ChiakiTakion *takion, Chiaki
 	return CHIAKI_ERR_SUCCESS;
 
 error_sock:
-	CHIAKI_SOCKET_CLOSE(takion->sock);
+	if(!takion->replay)
+		CHIAKI_SOCKET_CLOSE(takion->sock);
 error_pipe:
 	chiaki_stop_pipe_fini(&takion->stop_pipe);
+error_recv_stats_mutex:
+	chiaki_mutex_fini(&takion->recv_stats_mutex);
 error_seq_num_local_mutex:
 	chiaki_mutex_fini(&takion->seq_num_local_mutex);
 error_gkcrypt_local_mutex:
@@ -305,10 +427,18 @@ CHIAKI_EXPORT void chiaki_takion_close(ChiakiTakion *takion)
 	chiaki_stop_pipe_stop(&takion->stop_pipe);
 	chiaki_thread_join(&takion->thread, NULL);
 	chiaki_stop_pipe_fini(&takion->stop_pipe);
+	chiaki_mutex_fini(&takion->recv_stats_mutex);
 	chiaki_mutex_fini(&takion->seq_num_local_mutex);
 	chiaki_mutex_fini(&takion->gkcrypt_local_mutex);
 }
 
+CHIAKI_EXPORT void chiaki_takion_get_recv_stats(ChiakiTakion *takion, ChiakiTakionRecvStats *stats)
+{
+	chiaki_mutex_lock(&takion->recv_stats_mutex);
+	*stats = takion->recv_stats;
+	chiaki_mutex_unlock(&takion->recv_stats_mutex);
+}
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_crypt_advance_key_pos(ChiakiTakion *takion, size_t data_size, uint64_t *key_pos)
 {
 	ChiakiErrorCode err = chiaki_mutex_lock(&takion->gkcrypt_local_mutex);
@@ -336,6 +466,8 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_crypt_advance_key_pos(ChiakiTakion *
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_raw(ChiakiTakion *takion, const uint8_t *buf, size_t buf_size)
 {
+	if(takion->replay)
+		return CHIAKI_ERR_SUCCESS;
 	int r = send(takion->sock, buf, buf_size, 0);
 	if(r < 0)
 		return CHIAKI_ERR_NETWORK;
@@ -399,7 +531,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_packet_mac(ChiakiGKCrypt *crypt, uin
 	return CHIAKI_ERR_SUCCESS;
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send(ChiakiTakion *takion, uint8_t *buf, size_t buf_size, uint64_t key_pos)
+static ChiakiErrorCode takion_packet_mac_local(ChiakiTakion *takion, uint8_t *buf, size_t buf_size, uint64_t key_pos)
 {
 	ChiakiErrorCode err = chiaki_mutex_lock(&takion->gkcrypt_local_mutex);
 	if(err != CHIAKI_ERR_SUCCESS)
@@ -407,6 +539,12 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send(ChiakiTakion *takion, uint8_t *
 	uint8_t mac[CHIAKI_GKCRYPT_GMAC_SIZE];
 	err = chiaki_takion_packet_mac(takion->gkcrypt_local, buf, buf_size, key_pos, mac, NULL);
 	chiaki_mutex_unlock(&takion->gkcrypt_local_mutex);
+	return err;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send(ChiakiTakion *takion, uint8_t *buf, size_t buf_size, uint64_t key_pos)
+{
+	ChiakiErrorCode err = takion_packet_mac_local(takion, buf, buf_size, key_pos);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return err;
 
@@ -448,41 +586,62 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_message_data(ChiakiTakion *taki
 	*(msg_payload + 8) = 0;
 	memcpy(msg_payload + 9, buf, buf_size);
 
-	err = chiaki_takion_send(takion, packet_buf, packet_size, key_pos); // will alter packet_buf with gmac
+	err = takion_packet_mac_local(takion, packet_buf, packet_size, key_pos); // will alter packet_buf with gmac
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
-		CHIAKI_LOGE(takion->log, "Takion failed to send data packet: %s", chiaki_error_string(err));
+		CHIAKI_LOGE(takion->log, "Takion failed to calculate MAC of data packet: %s", chiaki_error_string(err));
 		free(packet_buf);
 		return err;
 	}
 
-	chiaki_takion_send_buffer_push(&takion->send_buffer, seq_num_val, packet_buf, packet_size);
-
 	if(seq_num)
 		*seq_num = seq_num_val;
 
+	// sent by the send buffer, so the ack can never be handled before the packet is in it
+	err = chiaki_takion_send_buffer_push(&takion->send_buffer, seq_num_val, packet_buf, packet_size);
+	if(err != CHIAKI_ERR_SUCCESS)
+		CHIAKI_LOGE(takion->log, "Takion failed to send data packet: %s", chiaki_error_string(err));
+
 	return err;
 }
 
-static ChiakiErrorCode chiaki_takion_send_message_data_ack(ChiakiTakion *takion, uint32_t seq_num)
+/**
+ * Acknowledge everything pulled from data_queue cumulatively and everything
+ * still waiting behind a missing packet in gap ack blocks.
+ */
+static ChiakiErrorCode chiaki_takion_send_message_data_ack(ChiakiTakion *takion)
 {
-	uint8_t buf[1 + TAKION_MESSAGE_HEADER_SIZE + 0xc];
+	ChiakiReorderQueueRange ranges[TAKION_DATA_ACK_GAP_ACK_BLOCKS_MAX];
+	size_t ranges_count = chiaki_reorder_queue_received_ranges(&takion->data_queue, ranges, TAKION_DATA_ACK_GAP_ACK_BLOCKS_MAX);
+	size_t payload_size = 0xc + ranges_count * 4;
+
+	uint8_t buf[1 + TAKION_MESSAGE_HEADER_SIZE + 0xc + TAKION_DATA_ACK_GAP_ACK_BLOCKS_MAX * 4];
+	size_t buf_size = 1 + TAKION_MESSAGE_HEADER_SIZE + payload_size;
 	buf[0] = TAKION_PACKET_TYPE_CONTROL;
 
 	uint64_t key_pos;
-	ChiakiErrorCode err = chiaki_takion_crypt_advance_key_pos(takion, sizeof(buf), &key_pos);
+	ChiakiErrorCode err = chiaki_takion_crypt_advance_key_pos(takion, buf_size, &key_pos);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return err;
 
-	takion_write_message_header(buf + 1, takion->tag_remote, key_pos, TAKION_CHUNK_TYPE_DATA_ACK, 0, 0xc);
+	takion_write_message_header(buf + 1, takion->tag_remote, key_pos, TAKION_CHUNK_TYPE_DATA_ACK, 0, payload_size);
+
+	// the last seq num pulled in order, gap ack block offsets are relative to it
+	ChiakiSeqNum32 cumulative_seq_num = (ChiakiSeqNum32)takion->data_queue.begin - 1;
 
 	uint8_t *data_ack = buf + 1 + TAKION_MESSAGE_HEADER_SIZE;
-	*((chiaki_unaligned_uint32_t *)(data_ack + 0)) = htonl(seq_num);
+	*((chiaki_unaligned_uint32_t *)(data_ack + 0)) = htonl(cumulative_seq_num);
 	*((chiaki_unaligned_uint32_t *)(data_ack + 4)) = htonl(takion->a_rwnd);
-	*((chiaki_unaligned_uint16_t *)(data_ack + 8)) = 0;
+	*((chiaki_unaligned_uint16_t *)(data_ack + 8)) = htons((uint16_t)ranges_count);
 	*((chiaki_unaligned_uint16_t *)(data_ack + 0xa)) = 0;
+	for(size_t i=0; i<ranges_count; i++)
+	{
+		uint8_t *block = data_ack + 0xc + i * 4;
+		*((chiaki_unaligned_uint16_t *)(block + 0)) = htons((uint16_t)(ranges[i].start + 1));
+		*((chiaki_unaligned_uint16_t *)(block + 2)) = htons((uint16_t)(ranges[i].end + 1));
+	}
 
-	return chiaki_takion_send(takion, buf, sizeof(buf), key_pos);
+	return chiaki_takion_send(takion, buf, buf_size, key_pos);
 }
 
 CHIAKI_EXPORT void chiaki_takion_format_congestion(uint8_t *buf, ChiakiTakionCongestionPacket *packet, uint64_t key_pos)
@@ -663,10 +822,420 @@ static void takion_data_drop(uint64_t seq_num, void *elem_user, void *cb_user)
 	ChiakiTakion *takion = cb_user;
 	CHIAKI_LOGE(takion->log, "Takion dropping data with seq num %#llx", (unsigned long long)seq_num);
 	TakionDataPacketEntry *entry = elem_user;
-	free(entry->packet_buf);
+	chiaki_packet_buf_unref(entry->buf);
 	free(entry);
 }
 
+/**
+ * @param controls whether to receive ancillary data, i.e. UDP_GRO segment sizes or timestamps
+ */
+static ChiakiErrorCode takion_recv_batch_init(TakionRecvBatch *batch, size_t size, size_t buf_size, bool controls)
+{
+	batch->size = size;
+	batch->buf_size = buf_size;
+	batch->bufs = calloc(size, sizeof(ChiakiPacketBuf *));
+	if(!batch->bufs)
+		return CHIAKI_ERR_MEMORY;
+	batch->buf_sizes = calloc(size, sizeof(size_t));
+	if(!batch->buf_sizes)
+		goto error_bufs;
+	batch->segment_sizes = calloc(size, sizeof(size_t));
+	if(!batch->segment_sizes)
+		goto error_buf_sizes;
+	batch->recv_times = calloc(size, sizeof(uint64_t));
+	if(!batch->recv_times)
+		goto error_segment_sizes;
+#ifdef TAKION_RECVMMSG
+	batch->msgs = calloc(size, sizeof(struct mmsghdr));
+	if(!batch->msgs)
+		goto error_recv_times;
+	batch->iovs = calloc(size, sizeof(struct iovec));
+	if(!batch->iovs)
+		goto error_msgs;
+	batch->controls = NULL;
+	if(controls)
+	{
+		batch->controls = calloc(size, TAKION_RECV_CONTROL_SIZE);
+		if(!batch->controls)
+		{
+			free(batch->iovs);
+			goto error_msgs;
+		}
+	}
+	for(size_t i=0; i<size; i++)
+	{
+		batch->iovs[i].iov_len = buf_size;
+		batch->msgs[i].msg_hdr.msg_iov = &batch->iovs[i];
+		batch->msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+#else
+	(void)controls;
+#endif
+	return CHIAKI_ERR_SUCCESS;
+#ifdef TAKION_RECVMMSG
+error_msgs:
+	free(batch->msgs);
+error_recv_times:
+	free(batch->recv_times);
+#endif
+error_segment_sizes:
+	free(batch->segment_sizes);
+error_buf_sizes:
+	free(batch->buf_sizes);
+error_bufs:
+	free(batch->bufs);
+	return CHIAKI_ERR_MEMORY;
+}
+
+static void takion_recv_batch_fini(TakionRecvBatch *batch)
+{
+	for(size_t i=0; i<batch->size; i++)
+	{
+		if(batch->bufs[i])
+			chiaki_packet_buf_unref(batch->bufs[i]);
+	}
+#ifdef TAKION_RECVMMSG
+	free(batch->controls);
+	free(batch->iovs);
+	free(batch->msgs);
+#endif
+	free(batch->recv_times);
+	free(batch->segment_sizes);
+	free(batch->buf_sizes);
+	free(batch->bufs);
+}
+
+/**
+ * Handle everything that has to happen once gkcrypt_remote has been set from inside the callback.
+ * Cheap enough to be called before every received packet.
+ */
+static void takion_check_crypt_available(ChiakiTakion *takion, bool *crypt_available)
+{
+	if(takion->enable_crypt && !*crypt_available && takion->gkcrypt_remote)
+	{
+		*crypt_available = true;
+		CHIAKI_LOGI(takion->log, "Crypt has become available. Re-checking MACs of %llu packets", (unsigned long long)chiaki_reorder_queue_count(&takion->data_queue));
+		for(uint64_t i=0; i<chiaki_reorder_queue_count(&takion->data_queue); i++)
+		{
+			TakionDataPacketEntry *packet;
+			bool peeked = chiaki_reorder_queue_peek(&takion->data_queue, i, NULL, (void **)&packet);
+			if(!peeked)
+				continue;
+			if(packet->packet_size == 0)
+				continue;
+			uint8_t base_type = (uint8_t)(packet->packet_buf[0] & TAKION_PACKET_BASE_TYPE_MASK);
+			if(takion_handle_packet_mac(takion, base_type, packet->packet_buf, packet->packet_size, NULL) != CHIAKI_ERR_SUCCESS)
+			{
+				CHIAKI_LOGW(takion->log, "Found an invalid MAC");
+				chiaki_reorder_queue_drop(&takion->data_queue, i);
+			}
+		}
+	}
+
+	if(takion->postponed_packets && takion->gkcrypt_remote)
+	{
+		// there are some postponed packets that were waiting until crypt is initialized and it is now :-)
+
+		CHIAKI_LOGI(takion->log, "Takion flushing %llu postpone packet(s)", (unsigned long long)takion->postponed_packets_count);
+
+		ChiakiTakionPostponedPacket *packets = takion->postponed_packets;
+		size_t packets_count = takion->postponed_packets_count;
+		takion->postponed_packets = NULL;
+		takion->postponed_packets_size = 0;
+		takion->postponed_packets_count = 0;
+		for(size_t i=0; i<packets_count; i++)
+			takion_handle_packet(takion, packets[i].buf, packets[i].buf_size);
+		free(packets);
+	}
+}
+
+/**
+ * Refill the batch with buffers and receive into it.
+ *
+ * @param count number of received datagrams, the first count buffers in batch->bufs have to be taken out by the caller.
+ */
+static ChiakiErrorCode takion_recv_batch_fill(ChiakiTakion *takion, TakionRecvBatch *batch, size_t *count)
+{
+	uint64_t pool_exhausted = 0;
+	ChiakiErrorCode err;
+#ifdef TAKION_IO_URING
+	if(takion->recv_uring)
+	{
+		// buffers come out of the ring already filled, nothing is left in the batch between calls
+		err = chiaki_takion_uring_recv(takion->recv_uring, batch->bufs, batch->buf_sizes, batch->size, count, &pool_exhausted);
+		if(err != CHIAKI_ERR_SUCCESS)
+			return err;
+		memset(batch->segment_sizes, 0, *count * sizeof(size_t));
+		memset(batch->recv_times, 0, *count * sizeof(uint64_t));
+	}
+	else
+#endif
+	{
+		for(size_t i=0; i<batch->size; i++)
+		{
+			if(batch->bufs[i])
+				continue;
+			bool exhausted;
+			batch->bufs[i] = chiaki_packet_buf_pool_acquire(takion->recv_pool, &exhausted);
+			if(!batch->bufs[i])
+				return CHIAKI_ERR_MEMORY;
+			if(exhausted)
+				pool_exhausted++;
+		}
+
+		err = takion->replay ? takion_replay_batch(takion, batch, count) : takion_recv_batch(takion, batch, count);
+		if(err != CHIAKI_ERR_SUCCESS)
+			return err;
+	}
+
+	size_t received_count = *count;
+	uint64_t now = chiaki_time_now_monotonic_us();
+	for(size_t i=0; i<received_count; i++)
+	{
+		// without a kernel timestamp, the time we got it is the best we know
+		batch->bufs[i]->recv_time_us = batch->recv_times[i] ? batch->recv_times[i] : now;
+	}
+
+	chiaki_mutex_lock(&takion->recv_stats_mutex);
+	if(received_count)
+		takion->recv_stats.wakeups++;
+	if(received_count > takion->recv_stats.batch_size_max)
+		takion->recv_stats.batch_size_max = received_count;
+	if(received_count == batch->size)
+		takion->recv_stats.batches_full++;
+	takion->recv_stats.pool_exhausted += pool_exhausted;
+	chiaki_mutex_unlock(&takion->recv_stats_mutex);
+
+	return CHIAKI_ERR_SUCCESS;
+}
+
+/**
+ * @return whether buf is or points into a coalesced receive buffer
+ */
+static bool takion_recv_buf_is_gro(ChiakiTakion *takion, ChiakiPacketBuf *buf)
+{
+	return takion->recv_gro && buf->pool == takion->recv_pool;
+}
+
+/**
+ * Move a datagram that is going to be held for longer out of a coalesced receive buffer,
+ * which would otherwise stay pinned with all its TAKION_GRO_BUF_SIZE bytes.
+ *
+ * @param buf ownership of this reference is taken.
+ * @param buf_size truncated to CHIAKI_TAKION_PACKET_BUF_SIZE like any other received datagram
+ * @return buf itself if it is not a coalesced buffer, otherwise a copy of it or NULL if allocation failed
+ */
+static ChiakiPacketBuf *takion_recv_buf_detach(ChiakiTakion *takion, ChiakiPacketBuf *buf, size_t *buf_size)
+{
+	if(!takion_recv_buf_is_gro(takion, buf))
+		return buf;
+
+	bool exhausted;
+	ChiakiPacketBuf *copy = chiaki_packet_buf_pool_acquire(takion->recv_copy_pool, &exhausted);
+	if(!copy)
+	{
+		chiaki_packet_buf_unref(buf);
+		return NULL;
+	}
+	if(exhausted)
+	{
+		chiaki_mutex_lock(&takion->recv_stats_mutex);
+		takion->recv_stats.pool_exhausted++;
+		chiaki_mutex_unlock(&takion->recv_stats_mutex);
+	}
+
+	if(*buf_size > copy->size)
+		*buf_size = copy->size;
+	memcpy(copy->data, buf->data, *buf_size);
+	copy->recv_time_us = buf->recv_time_us;
+	chiaki_packet_buf_unref(buf);
+	return copy;
+}
+
+/**
+ * @param buf ownership of this reference is taken.
+ * @return false to drop all further datagrams of the batch
+ */
+typedef bool (*TakionRecvPacketCb)(ChiakiTakion *takion, ChiakiPacketBuf *buf, size_t buf_size, void *user);
+
+/**
+ * Take the first count received buffers out of the batch and pass every single datagram to cb.
+ * Buffers coalesced by UDP_GRO are split into slices without copying.
+ */
+static void takion_recv_batch_dispatch(ChiakiTakion *takion, TakionRecvBatch *batch, size_t count, TakionRecvPacketCb cb, void *cb_user)
+{
+	uint64_t packets = 0;
+	uint64_t coalesced = 0;
+	bool stopped = false;
+	for(size_t i=0; i<count; i++)
+	{
+		ChiakiPacketBuf *buf = batch->bufs[i];
+		batch->bufs[i] = NULL;
+		size_t buf_size = batch->buf_sizes[i];
+		size_t segment_size = batch->segment_sizes[i];
+		if(!buf_size || stopped)
+		{
+			chiaki_packet_buf_unref(buf);
+			continue;
+		}
+
+		if(!segment_size || buf_size <= segment_size)
+		{
+			if(takion->capture)
+				chiaki_takion_capture_write_datagram(takion->capture, buf->recv_time_us, buf->data, buf_size);
+			packets++;
+			// nothing to split, so there is no reason to keep the whole coalesced buffer around
+			buf = takion_recv_buf_detach(takion, buf, &buf_size);
+			if(!buf)
+				continue;
+			if(!cb(takion, buf, buf_size, cb_user))
+				stopped = true;
+			continue;
+		}
+
+		coalesced++;
+		for(size_t offset=0; offset<buf_size && !stopped; offset+=segment_size)
+		{
+			size_t packet_size = buf_size - offset;
+			if(packet_size > segment_size)
+				packet_size = segment_size;
+			ChiakiPacketBuf *slice = chiaki_packet_buf_slice(buf, offset, packet_size);
+			if(!slice)
+			{
+				CHIAKI_LOGE(takion->log, "Takion failed to split coalesced datagrams");
+				break;
+			}
+			if(takion->capture)
+				chiaki_takion_capture_write_datagram(takion->capture, slice->recv_time_us, slice->data, packet_size);
+			packets++;
+			if(!cb(takion, slice, packet_size, cb_user))
+				stopped = true;
+		}
+		chiaki_packet_buf_unref(buf);
+	}
+
+	chiaki_mutex_lock(&takion->recv_stats_mutex);
+	takion->recv_stats.packets += packets;
+	takion->recv_stats.gro_coalesced += coalesced;
+	chiaki_mutex_unlock(&takion->recv_stats_mutex);
+}
+
+static size_t takion_recv_buf_size(ChiakiTakion *takion)
+{
+	return takion->recv_gro ? TAKION_GRO_BUF_SIZE : CHIAKI_TAKION_PACKET_BUF_SIZE;
+}
+
+static bool takion_run_handle_packet(ChiakiTakion *takion, ChiakiPacketBuf *buf, size_t buf_size, void *user)
+{
+	bool *crypt_available = user;
+	takion_check_crypt_available(takion, crypt_available);
+	takion_handle_packet(takion, buf, buf_size);
+	return true;
+}
+
+/**
+ * Set up io_uring receiving if requested, must be called from the thread that receives.
+ */
+static void takion_recv_uring_start(ChiakiTakion *takion)
+{
+	if(!takion->enable_io_uring)
+		return;
+#ifdef TAKION_IO_URING
+	takion->recv_uring = chiaki_takion_uring_new(takion->log, takion->sock, takion->stop_pipe.event_fd, takion->recv_pool, TAKION_IO_URING_BUFS);
+	if(takion->recv_uring)
+		CHIAKI_LOGI(takion->log, "Takion receiving with io_uring");
+	else
+		CHIAKI_LOGW(takion->log, "Takion failed to set up io_uring, receiving without it");
+#else
+	CHIAKI_LOGW(takion->log, "Takion was built without io_uring support, receiving without it");
+#endif
+}
+
+static void takion_recv_uring_stop(ChiakiTakion *takion)
+{
+#ifdef TAKION_IO_URING
+	chiaki_takion_uring_free(takion->recv_uring);
+	takion->recv_uring = NULL;
+#else
+	(void)takion;
+#endif
+}
+
+/**
+ * Receive and process everything on the Takion thread.
+ */
+static void takion_run(ChiakiTakion *takion)
+{
+	TakionRecvBatch batch;
+	if(takion_recv_batch_init(&batch, takion->recv_batch_size, takion_recv_buf_size(takion), takion->recv_gro || takion->recv_timestamps) != CHIAKI_ERR_SUCCESS)
+		return;
+	takion_recv_uring_start(takion);
+
+	bool crypt_available = takion->gkcrypt_remote ? true : false;
+
+	while(true)
+	{
+		takion_check_crypt_available(takion, &crypt_available);
+
+		size_t received_count;
+		if(takion_recv_batch_fill(takion, &batch, &received_count) != CHIAKI_ERR_SUCCESS)
+			break;
+
+		takion_recv_batch_dispatch(takion, &batch, received_count, takion_run_handle_packet, &crypt_available);
+	}
+
+	takion_recv_uring_stop(takion);
+	takion_recv_batch_fini(&batch);
+}
+
+/**
+ * Process everything that the receive thread pushes into recv_ring until it is closed.
+ */
+static void takion_run_pipelined(ChiakiTakion *takion)
+{
+	bool crypt_available = takion->gkcrypt_remote ? true : false;
+
+	TakionRecvRingEntry entry;
+	while(chiaki_spsc_ring_pop_wait(&takion->recv_ring, &entry) == CHIAKI_ERR_SUCCESS)
+	{
+		takion_check_crypt_available(takion, &crypt_available);
+		takion_handle_packet(takion, entry.buf, entry.buf_size);
+	}
+}
+
+static void takion_enable_recv_timestamps(ChiakiTakion *takion)
+{
+#ifdef TAKION_RECV_TIMESTAMPS
+	const int timestamp_val = 1;
+	int r = setsockopt(takion->sock, SOL_SOCKET, SO_TIMESTAMPNS, (const void *)&timestamp_val, sizeof(timestamp_val));
+	if(r < 0)
+	{
+		CHIAKI_LOGW(takion->log, "Takion failed to enable SO_TIMESTAMPNS, using receive times instead: %s", strerror(errno));
+		return;
+	}
+	takion->recv_timestamps = true;
+#else
+	(void)takion;
+#endif
+}
+
+static void takion_enable_udp_gro(ChiakiTakion *takion)
+{
+#ifdef TAKION_UDP_GRO
+	const int gro_val = 1;
+	int r = setsockopt(takion->sock, SOL_UDP, UDP_GRO, (const void *)&gro_val, sizeof(gro_val));
+	if(r < 0)
+	{
+		CHIAKI_LOGW(takion->log, "Takion failed to enable UDP_GRO, receiving without it: %s", strerror(errno));
+		return;
+	}
+	takion->recv_gro = true;
+	CHIAKI_LOGI(takion->log, "Takion enabled UDP_GRO");
+#else
+	CHIAKI_LOGW(takion->log, "UDP_GRO is not supported on this platform, receiving without it");
+#endif
+}
+
 static void *takion_thread_func(void *user)
 {
 	ChiakiTakion *takion = user;
@@ -675,16 +1244,48 @@ static void *takion_thread_func(void *user)
 	if(takion_handshake(takion, &seq_num_remote_initial) != CHIAKI_ERR_SUCCESS)
 		goto beach;
 
+	if(takion->recv_ring_size)
+	{
+		if(chiaki_spsc_ring_init(&takion->recv_ring, takion->recv_ring_size, sizeof(TakionRecvRingEntry)) != CHIAKI_ERR_SUCCESS)
+			goto beach;
+	}
+
+	// only after the handshake, which is received without looking at cmsgs
+	if(takion->enable_udp_gro && takion->enable_io_uring)
+		CHIAKI_LOGW(takion->log, "Takion can not use UDP_GRO together with io_uring, not enabling it");
+	else if(takion->enable_udp_gro)
+		takion_enable_udp_gro(takion);
+	if(!takion->enable_io_uring && !takion->replay)
+		takion_enable_recv_timestamps(takion);
+
+	size_t recv_pool_size = takion->recv_batch_size;
+	size_t recv_held_size = TAKION_RECV_POOL_RESERVE;
+	if(takion->recv_ring_size)
+		recv_held_size += chiaki_spsc_ring_capacity(&takion->recv_ring);
+	if(takion->recv_gro)
+	{
+		// datagrams that are held are copied out of the coalesced buffers, so only the batch itself needs those
+		takion->recv_copy_pool = chiaki_packet_buf_pool_new(recv_held_size, CHIAKI_TAKION_PACKET_BUF_SIZE);
+		if(!takion->recv_copy_pool)
+			goto error_recv_ring;
+	}
+	else
+		recv_pool_size += recv_held_size;
+	if(takion->enable_io_uring)
+		recv_pool_size += TAKION_IO_URING_BUFS;
+	takion->recv_pool = chiaki_packet_buf_pool_new(recv_pool_size, takion_recv_buf_size(takion));
+	if(!takion->recv_pool)
+		goto error_recv_copy_pool;
+
 	if(chiaki_reorder_queue_init_32(&takion->data_queue, TAKION_REORDER_QUEUE_SIZE_EXP, seq_num_remote_initial) != CHIAKI_ERR_SUCCESS)
-		goto beach;
+		goto error_recv_pool;
 
 	chiaki_reorder_queue_set_drop_cb(&takion->data_queue, takion_data_drop, takion);
 
 	// The send buffer size MUST be consistent with the acked seqnums array size in takion_handle_packet_message_data_ack()
-	if(chiaki_takion_send_buffer_init(&takion->send_buffer, takion, TAKION_SEND_BUFFER_SIZE) != CHIAKI_ERR_SUCCESS)
+	if(chiaki_takion_send_buffer_init(&takion->send_buffer, takion, TAKION_SEND_BUFFER_SIZE, takion->rtt_initial_us) != CHIAKI_ERR_SUCCESS)
 		goto error_reoder_queue;
 
-
 	if(takion->cb)
 	{
 		ChiakiTakionEvent event = { 0 };
@@ -692,75 +1293,61 @@ static void *takion_thread_func(void *user)
 		takion->cb(&event, takion->cb_user);
 	}
 
-	bool crypt_available = takion->gkcrypt_remote ? true : false;
-
-	while(true)
+	if(takion->recv_ring_size)
 	{
-		if(takion->enable_crypt && !crypt_available && takion->gkcrypt_remote)
+		if(chiaki_thread_create(&takion->recv_thread, takion_recv_thread_func, takion) == CHIAKI_ERR_SUCCESS)
 		{
-			crypt_available = true;
-			CHIAKI_LOGI(takion->log, "Crypt has become available. Re-checking MACs of %llu packets", (unsigned long long)chiaki_reorder_queue_count(&takion->data_queue));
-			for(uint64_t i=0; i<chiaki_reorder_queue_count(&takion->data_queue); i++)
-			{
-				TakionDataPacketEntry *packet;
-				bool peeked = chiaki_reorder_queue_peek(&takion->data_queue, i, NULL, (void **)&packet);
-				if(!peeked)
-					continue;
-				if(packet->packet_size == 0)
-					continue;
-				uint8_t base_type = (uint8_t)(packet->packet_buf[0] & TAKION_PACKET_BASE_TYPE_MASK);
-				if(takion_handle_packet_mac(takion, base_type, packet->packet_buf, packet->packet_size) != CHIAKI_ERR_SUCCESS)
-				{
-					CHIAKI_LOGW(takion->log, "Found an invalid MAC");
-					chiaki_reorder_queue_drop(&takion->data_queue, i);
-				}
-			}
-
+			chiaki_thread_set_name(&takion->recv_thread, "Chiaki Takion Recv");
+			CHIAKI_LOGI(takion->log, "Takion receiving on a separate thread with a ring of %llu entries",
+					(unsigned long long)chiaki_spsc_ring_capacity(&takion->recv_ring));
+			takion_run_pipelined(takion);
+			chiaki_thread_join(&takion->recv_thread, NULL);
 		}
-
-		if(takion->postponed_packets && takion->gkcrypt_remote)
-		{
-			// there are some postponed packets that were waiting until crypt is initialized and it is now :-)
-
-			CHIAKI_LOGI(takion->log, "Takion flushing %llu postpone packet(s)", (unsigned long long)takion->postponed_packets_count);
-
-			for(size_t i=0; i<takion->postponed_packets_count; i++)
-			{
-				ChiakiTakionPostponedPacket *packet = &takion->postponed_packets[i];
-				takion_handle_packet(takion, packet->buf, packet->buf_size);
-			}
-			free(takion->postponed_packets);
-			takion->postponed_packets = NULL;
-			takion->postponed_packets_size = 0;
-			takion->postponed_packets_count = 0;
-		}
-
-		size_t received_size = 1500;
-		uint8_t *buf = malloc(received_size); // TODO: no malloc?
-		if(!buf)
-			break;
-		ChiakiErrorCode err = takion_recv(takion, buf, &received_size, UINT64_MAX);
-		if(err != CHIAKI_ERR_SUCCESS)
-		{
-			free(buf);
-			break;
-		}
-		uint8_t *resized_buf = realloc(buf, received_size);
-		if(!resized_buf)
-		{
-			free(buf);
-			continue;
-		}
-		takion_handle_packet(takion, resized_buf, received_size);
+		else
+			CHIAKI_LOGE(takion->log, "Takion failed to create receive thread");
+	}
+	else
+		takion_run(takion);
+
+	CHIAKI_LOGI(takion->log, "Takion received %llu packets in %llu batches (max %llu), receive pool exhausted %llu times",
+			(unsigned long long)takion->recv_stats.packets,
+			(unsigned long long)takion->recv_stats.wakeups,
+			(unsigned long long)takion->recv_stats.batch_size_max,
+			(unsigned long long)takion->recv_stats.pool_exhausted);
+	if(takion->recv_gro)
+		CHIAKI_LOGI(takion->log, "Takion received %llu coalesced buffers with UDP_GRO", (unsigned long long)takion->recv_stats.gro_coalesced);
+	if(takion->recv_ring_size)
+	{
+		CHIAKI_LOGI(takion->log, "Takion receive ring was filled up to %llu entries, %llu av packets dropped",
+				(unsigned long long)takion->recv_stats.ring_high_water,
+				(unsigned long long)takion->recv_stats.ring_dropped);
 	}
 
 	// chiaki_congestion_control_stop(&congestion_control);
 
-	chiaki_takion_send_buffer_fini(&takion->send_buffer);
+	if(takion->postponed_packets)
+	{
+		for(size_t i=0; i<takion->postponed_packets_count; i++)
+			chiaki_packet_buf_unref(takion->postponed_packets[i].buf);
+		free(takion->postponed_packets);
+		takion->postponed_packets = NULL;
+		takion->postponed_packets_size = 0;
+		takion->postponed_packets_count = 0;
+	}
 
+	chiaki_takion_send_buffer_fini(&takion->send_buffer);
 error_reoder_queue:
 	chiaki_reorder_queue_fini(&takion->data_queue);
-
+error_recv_pool:
+	// buffers that are still referenced elsewhere keep the pool alive
+	chiaki_packet_buf_pool_free(takion->recv_pool);
+	takion->recv_pool = NULL;
+error_recv_copy_pool:
+	chiaki_packet_buf_pool_free(takion->recv_copy_pool);
+	takion->recv_copy_pool = NULL;
+error_recv_ring:
+	if(takion->recv_ring_size)
+		chiaki_spsc_ring_fini(&takion->recv_ring);
 beach:
 	if(takion->cb)
 	{
@@ -768,7 +1355,81 @@ beach:
 		event.type = CHIAKI_TAKION_EVENT_TYPE_DISCONNECT;
 		takion->cb(&event, takion->cb_user);
 	}
-	CHIAKI_SOCKET_CLOSE(takion->sock);
+	if(!takion->replay)
+		CHIAKI_SOCKET_CLOSE(takion->sock);
+	return NULL;
+}
+
+/**
+ * Hand a received datagram over to the Takion thread.
+ * av packets are dropped if the ring is (almost) full, everything else waits for space.
+ *
+ * @param buf ownership of this reference is taken.
+ * @return false if Takion was stopped while waiting
+ */
+static bool takion_recv_ring_push(ChiakiTakion *takion, ChiakiPacketBuf *buf, size_t buf_size, void *user)
+{
+	uint64_t *dropped = user;
+
+	// the ring holds on to datagrams for too long to keep coalesced buffers in it
+	buf = takion_recv_buf_detach(takion, buf, &buf_size);
+	if(!buf)
+		return true;
+	TakionRecvRingEntry entry = { buf, buf_size };
+
+	uint8_t base_type = buf->data[0] & TAKION_PACKET_BASE_TYPE_MASK;
+	if(base_type == TAKION_PACKET_TYPE_VIDEO || base_type == TAKION_PACKET_TYPE_AUDIO)
+	{
+		size_t capacity = chiaki_spsc_ring_capacity(&takion->recv_ring);
+		size_t av_limit = capacity - capacity / TAKION_RECV_RING_CONTROL_RESERVE_DIV;
+		if(chiaki_spsc_ring_count(&takion->recv_ring) >= av_limit
+			|| !chiaki_spsc_ring_push(&takion->recv_ring, &entry))
+		{
+			chiaki_packet_buf_unref(buf);
+			(*dropped)++;
+		}
+		return true;
+	}
+
+	while(!chiaki_spsc_ring_push(&takion->recv_ring, &entry))
+	{
+		if(chiaki_stop_pipe_sleep(&takion->stop_pipe, 1) == CHIAKI_ERR_CANCELED)
+		{
+			chiaki_packet_buf_unref(buf);
+			return false;
+		}
+	}
+	return true;
+}
+
+static void *takion_recv_thread_func(void *user)
+{
+	ChiakiTakion *takion = user;
+
+	TakionRecvBatch batch;
+	if(takion_recv_batch_init(&batch, takion->recv_batch_size, takion_recv_buf_size(takion), takion->recv_gro || takion->recv_timestamps) != CHIAKI_ERR_SUCCESS)
+		goto beach;
+	takion_recv_uring_start(takion);
+
+	while(true)
+	{
+		size_t received_count;
+		if(takion_recv_batch_fill(takion, &batch, &received_count) != CHIAKI_ERR_SUCCESS)
+			break;
+
+		uint64_t dropped = 0;
+		takion_recv_batch_dispatch(takion, &batch, received_count, takion_recv_ring_push, &dropped);
+
+		chiaki_mutex_lock(&takion->recv_stats_mutex);
+		takion->recv_stats.ring_dropped += dropped;
+		takion->recv_stats.ring_high_water = chiaki_spsc_ring_high_water(&takion->recv_ring);
+		chiaki_mutex_unlock(&takion->recv_stats_mutex);
+	}
+
+	takion_recv_uring_stop(takion);
+	takion_recv_batch_fini(&batch);
+beach:
+	chiaki_spsc_ring_close(&takion->recv_ring);
 	return NULL;
 }
 
@@ -796,7 +1457,148 @@ static ChiakiErrorCode takion_recv(ChiakiTakion *takion, uint8_t *buf, size_t *b
 	return CHIAKI_ERR_SUCCESS;
 }
 
-static ChiakiErrorCode takion_handle_packet_mac(ChiakiTakion *takion, uint8_t base_type, uint8_t *buf, size_t buf_size)
+/**
+ * Receive a single handshake datagram from the socket or the replay and capture it.
+ */
+static ChiakiErrorCode takion_recv_handshake(ChiakiTakion *takion, uint8_t *buf, size_t *buf_size)
+{
+	ChiakiErrorCode err;
+	if(takion->replay)
+		err = chiaki_takion_replay_next(takion->replay, &takion->stop_pipe, buf, buf_size, NULL, true);
+	else
+		err = takion_recv(takion, buf, buf_size, TAKION_EXPECT_TIMEOUT_MS);
+	if(err == CHIAKI_ERR_SUCCESS && takion->capture)
+		chiaki_takion_capture_write_datagram(takion->capture, chiaki_time_now_monotonic_us(), buf, *buf_size);
+	return err;
+}
+
+/**
+ * Wait until the socket becomes readable and receive up to batch->size datagrams into batch->bufs.
+ *
+ * @param count number of received datagrams, sizes are written to batch->buf_sizes and may be 0.
+ */
+static ChiakiErrorCode takion_recv_batch(ChiakiTakion *takion, TakionRecvBatch *batch, size_t *count)
+{
+#ifdef TAKION_RECVMMSG
+	ChiakiErrorCode err = chiaki_stop_pipe_select_single(&takion->stop_pipe, takion->sock, false, UINT64_MAX);
+	if(err == CHIAKI_ERR_TIMEOUT || err == CHIAKI_ERR_CANCELED)
+		return err;
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(takion->log, "Takion select failed: %s", strerror(errno));
+		return err;
+	}
+
+	for(size_t i=0; i<batch->size; i++)
+	{
+		batch->iovs[i].iov_base = batch->bufs[i]->data;
+		if(batch->controls)
+		{
+			// reset every time because the kernel overwrites msg_controllen
+			batch->msgs[i].msg_hdr.msg_control = batch->controls + i * TAKION_RECV_CONTROL_SIZE;
+			batch->msgs[i].msg_hdr.msg_controllen = TAKION_RECV_CONTROL_SIZE;
+		}
+	}
+
+	int r = recvmmsg(takion->sock, batch->msgs, (unsigned int)batch->size, MSG_DONTWAIT, NULL);
+	if(r < 0)
+	{
+		if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+		{
+			*count = 0;
+			return CHIAKI_ERR_SUCCESS;
+		}
+		CHIAKI_LOGE(takion->log, "Takion recvmmsg failed: %s", strerror(errno));
+		return CHIAKI_ERR_NETWORK;
+	}
+
+	// kernel timestamps are CLOCK_REALTIME, move them to the monotonic clock we use everywhere else
+	int64_t realtime_offset_us = 0;
+	if(batch->controls && takion->recv_timestamps)
+	{
+		struct timespec realtime;
+		clock_gettime(CLOCK_REALTIME, &realtime);
+		realtime_offset_us = (int64_t)realtime.tv_sec * 1000000 + realtime.tv_nsec / 1000 - (int64_t)chiaki_time_now_monotonic_us();
+	}
+
+	for(int i=0; i<r; i++)
+	{
+		batch->buf_sizes[i] = batch->msgs[i].msg_len;
+		batch->segment_sizes[i] = 0;
+		batch->recv_times[i] = 0;
+		if(!batch->controls)
+			continue;
+		struct msghdr *hdr = &batch->msgs[i].msg_hdr;
+		for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg))
+		{
+			if(cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+			{
+				int segment_size;
+				memcpy(&segment_size, CMSG_DATA(cmsg), sizeof(segment_size));
+				if(segment_size > 0)
+					batch->segment_sizes[i] = (size_t)segment_size;
+			}
+			else if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+			{
+				struct timespec ts;
+				memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+				int64_t recv_time = (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 - realtime_offset_us;
+				if(recv_time > 0)
+					batch->recv_times[i] = (uint64_t)recv_time;
+			}
+		}
+	}
+	*count = (size_t)r;
+	return CHIAKI_ERR_SUCCESS;
+#else
+	assert(batch->size == 1);
+	batch->buf_sizes[0] = batch->buf_size;
+	batch->segment_sizes[0] = 0;
+	batch->recv_times[0] = 0;
+	ChiakiErrorCode err = takion_recv(takion, batch->bufs[0]->data, &batch->buf_sizes[0], UINT64_MAX);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	*count = 1;
+	return CHIAKI_ERR_SUCCESS;
+#endif
+}
+
+/**
+ * Fill the batch from the replay like takion_recv_batch() does from the socket.
+ * In realtime mode, only datagrams that are due already are added after the first one.
+ *
+ * @return CHIAKI_ERR_DISCONNECTED at the end of the capture
+ */
+static ChiakiErrorCode takion_replay_batch(ChiakiTakion *takion, TakionRecvBatch *batch, size_t *count)
+{
+	// replaying as fast as possible never blocks, so stopping has to be checked explicitly
+	ChiakiErrorCode err = chiaki_stop_pipe_sleep(&takion->stop_pipe, 0);
+	if(err != CHIAKI_ERR_TIMEOUT)
+		return err == CHIAKI_ERR_SUCCESS ? CHIAKI_ERR_CANCELED : err;
+
+	size_t received = 0;
+	for(; received<batch->size; received++)
+	{
+		batch->buf_sizes[received] = batch->buf_size;
+		batch->segment_sizes[received] = 0;
+		// the captured arrival times, so the timing of the session is reproduced no matter how fast it is replayed
+		err = chiaki_takion_replay_next(takion->replay, &takion->stop_pipe,
+				batch->bufs[received]->data, &batch->buf_sizes[received], &batch->recv_times[received], received == 0);
+		if(err != CHIAKI_ERR_SUCCESS)
+			break;
+	}
+	if(!received)
+		return err;
+	*count = received;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+/**
+ * Check the MAC of a received packet and commit its key_pos.
+ *
+ * @param av if not NULL, the parsed av packet in buf, whose data is decrypted in the same pass
+ */
+static ChiakiErrorCode takion_handle_packet_mac(ChiakiTakion *takion, uint8_t base_type, uint8_t *buf, size_t buf_size, ChiakiTakionAVPacket *av)
 {
 	if(!takion->gkcrypt_remote)
 		return CHIAKI_ERR_SUCCESS;
@@ -810,8 +1612,21 @@ static ChiakiErrorCode takion_handle_packet_mac(ChiakiTakion *takion, uint8_t ba
 		CHIAKI_LOGE(takion->log, "Takion failed to pull key_pos out of received packet");
 		return err;
 	}
-	err = chiaki_takion_packet_mac(takion->gkcrypt_remote, buf, buf_size, key_pos, mac_expected, mac);
-	if(err != CHIAKI_ERR_SUCCESS)
+	if(av)
+	{
+		// same as chiaki_takion_packet_mac(), but the key_pos of av packets is part of the mac anyway
+		int mac_offset = takion_packet_type_mac_offset(base_type);
+		if(mac_offset < 0 || buf_size < mac_offset + CHIAKI_GKCRYPT_GMAC_SIZE)
+			return CHIAKI_ERR_BUF_TOO_SMALL;
+		memcpy(mac, buf + mac_offset, sizeof(mac));
+		memset(buf + mac_offset, 0, sizeof(mac));
+		err = chiaki_gkcrypt_verify_decrypt(takion->gkcrypt_remote, key_pos, buf, buf_size,
+				(size_t)(av->data - buf), av->key_pos + CHIAKI_GKCRYPT_BLOCK_SIZE, mac, mac_expected);
+		memcpy(buf + mac_offset, mac_expected, sizeof(mac_expected));
+	}
+	else
+		err = chiaki_takion_packet_mac(takion->gkcrypt_remote, buf, buf_size, key_pos, mac_expected, mac);
+	if(err != CHIAKI_ERR_SUCCESS && err != CHIAKI_ERR_INVALID_MAC)
 	{
 		CHIAKI_LOGE(takion->log, "Takion failed to calculate mac for received packet");
 		return err;
@@ -833,13 +1648,20 @@ static ChiakiErrorCode takion_handle_packet_mac(ChiakiTakion *takion, uint8_t ba
 	return CHIAKI_ERR_SUCCESS;
 }
 
-static void takion_postpone_packet(ChiakiTakion *takion, uint8_t *buf, size_t buf_size)
+static void takion_postpone_packet(ChiakiTakion *takion, ChiakiPacketBuf *buf, size_t buf_size)
 {
+	buf = takion_recv_buf_detach(takion, buf, &buf_size);
+	if(!buf)
+		return;
+
 	if(!takion->postponed_packets)
 	{
 		takion->postponed_packets = calloc(TAKION_POSTPONE_PACKETS_SIZE, sizeof(ChiakiTakionPostponedPacket));
 		if(!takion->postponed_packets)
+		{
+			chiaki_packet_buf_unref(buf);
 			return;
+		}
 		takion->postponed_packets_size = TAKION_POSTPONE_PACKETS_SIZE;
 		takion->postponed_packets_count = 0;
 	}
@@ -847,6 +1669,7 @@ static void takion_postpone_packet(ChiakiTakion *takion, uint8_t *buf, size_t bu
 	if(takion->postponed_packets_count >= takion->postponed_packets_size)
 	{
 		CHIAKI_LOGE(takion->log, "Should postpone a packet, but there is no space left");
+		chiaki_packet_buf_unref(buf);
 		return;
 	}
 
@@ -857,50 +1680,61 @@ static void takion_postpone_packet(ChiakiTakion *takion, uint8_t *buf, size_t bu
 }
 
 /**
- * @param buf ownership of this buf is taken.
+ * @param packet_buf ownership of this reference is taken.
  */
-static void takion_handle_packet(ChiakiTakion *takion, uint8_t *buf, size_t buf_size)
+static void takion_handle_packet(ChiakiTakion *takion, ChiakiPacketBuf *packet_buf, size_t buf_size)
 {
 	assert(buf_size > 0);
-	uint8_t base_type = (uint8_t)(buf[0] & TAKION_PACKET_BASE_TYPE_MASK);
+	uint8_t base_type = (uint8_t)(packet_buf->data[0] & TAKION_PACKET_BASE_TYPE_MASK);
 
-	if(takion_handle_packet_mac(takion, base_type, buf, buf_size) != CHIAKI_ERR_SUCCESS)
+	// the mac of av packets is checked while decrypting them in takion_handle_packet_av()
+	bool av = base_type == TAKION_PACKET_TYPE_VIDEO || base_type == TAKION_PACKET_TYPE_AUDIO;
+	if(!av)
+	{
+		// data messages may wait in data_queue
+		packet_buf = takion_recv_buf_detach(takion, packet_buf, &buf_size);
+		if(!packet_buf)
+			return;
+	}
+	uint8_t *buf = packet_buf->data;
+	if(!av && takion_handle_packet_mac(takion, base_type, buf, buf_size, NULL) != CHIAKI_ERR_SUCCESS)
 	{
-		free(buf);
+		chiaki_packet_buf_unref(packet_buf);
 		return;
 	}
 
 	switch(base_type)
 	{
 		case TAKION_PACKET_TYPE_CONTROL:
-			takion_handle_packet_message(takion, buf, buf_size);
+			takion_handle_packet_message(takion, packet_buf, buf_size);
 			break;
 		case TAKION_PACKET_TYPE_VIDEO:
 		case TAKION_PACKET_TYPE_AUDIO:
 			if(takion->enable_crypt && !takion->gkcrypt_remote)
-				takion_postpone_packet(takion, buf, buf_size);
+				takion_postpone_packet(takion, packet_buf, buf_size);
 			else
 			{
-				takion_handle_packet_av(takion, base_type, buf, buf_size);
-				free(buf);
+				takion_handle_packet_av(takion, base_type, packet_buf, buf_size);
+				chiaki_packet_buf_unref(packet_buf);
 			}
 			break;
 		default:
 			CHIAKI_LOGW(takion->log, "Takion packet with unknown type %#x received", base_type);
 			chiaki_log_hexdump(takion->log, CHIAKI_LOG_WARNING, buf, buf_size);
-			free(buf);
+			chiaki_packet_buf_unref(packet_buf);
 			break;
 	}
 }
 
 
-static void takion_handle_packet_message(ChiakiTakion *takion, uint8_t *buf, size_t buf_size)
+static void takion_handle_packet_message(ChiakiTakion *takion, ChiakiPacketBuf *packet_buf, size_t buf_size)
 {
+	uint8_t *buf = packet_buf->data;
 	TakionMessage msg;
 	ChiakiErrorCode err = takion_parse_message(takion, buf+1, buf_size-1, &msg);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
-		free(buf);
+		chiaki_packet_buf_unref(packet_buf);
 		return;
 	}
 
@@ -910,34 +1744,31 @@ static void takion_handle_packet_message(ChiakiTakion *takion, uint8_t *buf, siz
 	switch(msg.chunk_type)
 	{
 		case TAKION_CHUNK_TYPE_DATA:
-			takion_handle_packet_message_data(takion, buf, buf_size, msg.chunk_flags, msg.payload, msg.payload_size);
+			takion_handle_packet_message_data(takion, packet_buf, buf_size, msg.chunk_flags, msg.payload, msg.payload_size);
 			break;
 		case TAKION_CHUNK_TYPE_DATA_ACK:
 			takion_handle_packet_message_data_ack(takion, msg.chunk_flags, msg.payload, msg.payload_size);
-			free(buf);
+			chiaki_packet_buf_unref(packet_buf);
 			break;
 		default:
 			CHIAKI_LOGW(takion->log, "Takion received message with unknown chunk type = %#x", msg.chunk_type);
-			free(buf);
+			chiaki_packet_buf_unref(packet_buf);
 			break;
 	}
 }
 
 static void takion_flush_data_queue(ChiakiTakion *takion)
 {
-	uint64_t seq_num = 0;
-	bool ack = false;
 	while(true)
 	{
 		TakionDataPacketEntry *entry;
-		bool pulled = chiaki_reorder_queue_pull(&takion->data_queue, &seq_num, (void **)&entry);
+		bool pulled = chiaki_reorder_queue_pull(&takion->data_queue, NULL, (void **)&entry);
 		if(!pulled)
 			break;
-		ack = true;
 
 		if(entry->payload_size < 9)
 		{
-			free(entry->packet_buf);
+			chiaki_packet_buf_unref(entry->buf);
 			free(entry);
 			continue;
 		}
@@ -965,15 +1796,12 @@ static void takion_flush_data_queue(ChiakiTakion *takion)
 			takion->cb(&event, takion->cb_user);
 		}
 
-		free(entry->packet_buf);
+		chiaki_packet_buf_unref(entry->buf);
 		free(entry);
 	}
-
-	if(ack)
-		chiaki_takion_send_message_data_ack(takion, (uint32_t)seq_num);
 }
 
-static void takion_handle_packet_message_data(ChiakiTakion *takion, uint8_t *packet_buf, size_t packet_buf_size, uint8_t type_b, uint8_t *payload, size_t payload_size)
+static void takion_handle_packet_message_data(ChiakiTakion *takion, ChiakiPacketBuf *packet_buf, size_t packet_buf_size, uint8_t type_b, uint8_t *payload, size_t payload_size)
 {
 	if(type_b != 1)
 		CHIAKI_LOGW(takion->log, "Takion received data with type_b = %#x (was expecting %#x)", type_b, 1);
@@ -981,15 +1809,20 @@ static void takion_handle_packet_message_data(ChiakiTakion *takion, uint8_t *pac
 	if(payload_size < 9)
 	{
 		CHIAKI_LOGE(takion->log, "Takion received data with a size less than the header size");
+		chiaki_packet_buf_unref(packet_buf);
 		return;
 	}
 
 	TakionDataPacketEntry *entry = malloc(sizeof(TakionDataPacketEntry));
 	if(!entry)
+	{
+		chiaki_packet_buf_unref(packet_buf);
 		return;
+	}
 
 	entry->type_b = type_b;
-	entry->packet_buf = packet_buf;
+	entry->buf = packet_buf;
+	entry->packet_buf = packet_buf->data;
 	entry->packet_size = packet_buf_size;
 	entry->payload = payload;
 	entry->payload_size = payload_size;
@@ -998,13 +1831,17 @@ static void takion_handle_packet_message_data(ChiakiTakion *takion, uint8_t *pac
 
 	chiaki_reorder_queue_push(&takion->data_queue, seq_num, entry);
 	takion_flush_data_queue(takion);
+
+	// ack every data packet, even duplicates and ones behind a gap, so the remote
+	// only retransmits what is actually missing
+	chiaki_takion_send_message_data_ack(takion);
 }
 
 static void takion_handle_packet_message_data_ack(ChiakiTakion *takion, uint8_t flags, uint8_t *buf, size_t buf_size)
 {
-	if(buf_size != 0xc)
+	if(buf_size < 0xc)
 	{
-		CHIAKI_LOGE(takion->log, "Takion received data ack with size %#x != %#x", buf_size, 0xa);
+		CHIAKI_LOGE(takion->log, "Takion received data ack with size %#llx < %#x", (unsigned long long)buf_size, 0xc);
 		return;
 	}
 
@@ -1121,7 +1958,7 @@ static ChiakiErrorCode takion_recv_message_init_ack(ChiakiTakion *takion, Takion
 {
 	uint8_t message[1 + TAKION_MESSAGE_HEADER_SIZE + 0x10 + TAKION_COOKIE_SIZE];
 	size_t received_size = sizeof(message);
-	ChiakiErrorCode err = takion_recv(takion, message, &received_size, TAKION_EXPECT_TIMEOUT_MS);
+	ChiakiErrorCode err = takion_recv_handshake(takion, message, &received_size);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return err;
 
@@ -1168,7 +2005,7 @@ static ChiakiErrorCode takion_recv_message_cookie_ack(ChiakiTakion *takion)
 {
 	uint8_t message[1 + TAKION_MESSAGE_HEADER_SIZE];
 	size_t received_size = sizeof(message);
-	ChiakiErrorCode err = takion_recv(takion, message, &received_size, TAKION_EXPECT_TIMEOUT_MS);
+	ChiakiErrorCode err = takion_recv_handshake(takion, message, &received_size);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return err;
 
@@ -1203,14 +2040,16 @@ static ChiakiErrorCode takion_recv_message_cookie_ack(ChiakiTakion *takion)
 	return CHIAKI_ERR_SUCCESS;
 }
 
-static void takion_handle_packet_av(ChiakiTakion *takion, uint8_t base_type, uint8_t *buf, size_t buf_size)
+static void takion_handle_packet_av(ChiakiTakion *takion, uint8_t base_type, ChiakiPacketBuf *packet_buf, size_t buf_size)
 {
 	// HHIxIIx
 
 	assert(base_type == TAKION_PACKET_TYPE_VIDEO || base_type == TAKION_PACKET_TYPE_AUDIO);
 
+	// the key_pos must only be committed once the mac has been checked
+	ChiakiKeyState key_state = takion->key_state;
 	ChiakiTakionAVPacket packet;
-	ChiakiErrorCode err = takion->av_packet_parse(&packet, &takion->key_state, buf, buf_size);
+	ChiakiErrorCode err = takion->av_packet_parse(&packet, &key_state, packet_buf->data, buf_size);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		if(err == CHIAKI_ERR_BUF_TOO_SMALL)
@@ -1218,6 +2057,17 @@ static void takion_handle_packet_av(ChiakiTakion *takion, uint8_t base_type, uin
 		return;
 	}
 
+	if(takion->gkcrypt_remote)
+	{
+		if(takion_handle_packet_mac(takion, base_type, packet_buf->data, buf_size, &packet) != CHIAKI_ERR_SUCCESS)
+			return;
+	}
+	else
+		takion->key_state = key_state;
+	// consumers must not keep a whole coalesced buffer alive, so they have to copy
+	packet.buf = takion_recv_buf_is_gro(takion, packet_buf) ? NULL : packet_buf;
+	packet.recv_time_us = packet_buf->recv_time_us;
+
 	if(takion->cb)
 	{
 		ChiakiTakionEvent event = { 0 };
@@ -1329,6 +2179,78 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_v12_av_packet_parse(ChiakiTakionAVPa
 	return av_packet_parse(true, packet, key_state, buf, buf_size);
 }
 
+static ChiakiErrorCode av_packet_format_header(bool v12, uint8_t *buf, size_t buf_size, size_t *header_size_out, ChiakiTakionAVPacket *packet)
+{
+	// inverse of av_packet_parse()
+	size_t header_size = 1 + 0x11 + (packet->is_video ? 3 : 1);
+	if(packet->uses_nalu_info_structs)
+		header_size += 3;
+	if(v12 && !packet->is_video)
+		header_size += 1;
+	*header_size_out = header_size;
+
+	if(header_size > buf_size)
+		return CHIAKI_ERR_BUF_TOO_SMALL;
+
+	buf[0] = packet->is_video ? TAKION_PACKET_TYPE_VIDEO : TAKION_PACKET_TYPE_AUDIO;
+	if(packet->uses_nalu_info_structs)
+		buf[0] |= 0x10;
+
+	uint8_t *av = buf+1;
+	*(chiaki_unaligned_uint16_t *)(av + 0) = htons(packet->packet_index);
+	*(chiaki_unaligned_uint16_t *)(av + 2) = htons(packet->frame_index);
+
+	uint32_t dword_2;
+	if(packet->is_video)
+	{
+		dword_2 = (packet->units_in_frame_fec & 0x3ff)
+			| (((uint32_t)(packet->units_in_frame_total - 1) & 0x7ff) << 0xa)
+			| (((uint32_t)packet->unit_index & 0x7ff) << 0x15);
+	}
+	else
+	{
+		dword_2 = (packet->units_in_frame_fec & 0xffff)
+			| (((uint32_t)(packet->units_in_frame_total - 1) & 0xff) << 0x10)
+			| (((uint32_t)packet->unit_index & 0xff) << 0x18);
+	}
+	*(chiaki_unaligned_uint32_t *)(av + 4) = htonl(dword_2);
+
+	av[8] = packet->codec & 0xff;
+	*(chiaki_unaligned_uint32_t *)(av + 9) = 0; // gmac, see chiaki_takion_packet_mac()
+	*(chiaki_unaligned_uint32_t *)(av + 0xd) = htonl((uint32_t)packet->key_pos);
+
+	av += 0x11;
+	if(packet->is_video)
+	{
+		*(chiaki_unaligned_uint16_t *)av = htons(packet->word_at_0x18);
+		av[2] = packet->adaptive_stream_index << 5;
+		av += 3;
+	}
+	else
+		*av++ = 0; // unknown
+
+	if(packet->uses_nalu_info_structs)
+	{
+		memset(av, 0, 3); // unknown
+		av += 3;
+	}
+
+	if(v12 && !packet->is_video)
+		*av = packet->byte_before_audio_data;
+
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_v9_av_packet_format_header(uint8_t *buf, size_t buf_size, size_t *header_size_out, ChiakiTakionAVPacket *packet)
+{
+	return av_packet_format_header(false, buf, buf_size, header_size_out, packet);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_v12_av_packet_format_header(uint8_t *buf, size_t buf_size, size_t *header_size_out, ChiakiTakionAVPacket *packet)
+{
+	return av_packet_format_header(true, buf, buf_size, header_size_out, packet);
+}
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_v7_av_packet_format_header(uint8_t *buf, size_t buf_size, size_t *header_size_out, ChiakiTakionAVPacket *packet)
 {
 	size_t header_size = CHIAKI_TAKION_V7_AV_HEADER_SIZE_BASE;
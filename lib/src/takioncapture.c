@@ -0,0 +1,262 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/takioncapture.h>
+#include <chiaki/time.h>
+
+#include <string.h>
+
+#define CAPTURE_MAGIC "CHKTCAP"
+#define CAPTURE_MAGIC_SIZE 7
+#define CAPTURE_RECORD_HEADER_SIZE 13
+#define CAPTURE_TAKION_SIZE 5
+#define CAPTURE_KEYS_SIZE (4 + CHIAKI_TAKION_CAPTURE_HANDSHAKE_KEY_SIZE + CHIAKI_ECDH_SECRET_SIZE)
+
+static void write_le32(uint8_t *buf, uint32_t v)
+{
+	for(size_t i=0; i<4; i++)
+		buf[i] = (uint8_t)(v >> (8 * i));
+}
+
+static void write_le64(uint8_t *buf, uint64_t v)
+{
+	for(size_t i=0; i<8; i++)
+		buf[i] = (uint8_t)(v >> (8 * i));
+}
+
+static uint32_t read_le32(const uint8_t *buf)
+{
+	uint32_t v = 0;
+	for(size_t i=0; i<4; i++)
+		v |= (uint32_t)buf[i] << (8 * i);
+	return v;
+}
+
+static uint64_t read_le64(const uint8_t *buf)
+{
+	uint64_t v = 0;
+	for(size_t i=0; i<8; i++)
+		v |= (uint64_t)buf[i] << (8 * i);
+	return v;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_capture_init(ChiakiTakionCapture *capture, const char *filename)
+{
+	capture->failed = false;
+	capture->datagrams = 0;
+	capture->bytes = 0;
+	ChiakiErrorCode err = chiaki_mutex_init(&capture->mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+
+	capture->file = fopen(filename, "wb");
+	if(!capture->file)
+	{
+		err = CHIAKI_ERR_UNKNOWN;
+		goto error_mutex;
+	}
+
+	uint8_t header[CAPTURE_MAGIC_SIZE + 1];
+	memcpy(header, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE);
+	header[CAPTURE_MAGIC_SIZE] = CHIAKI_TAKION_CAPTURE_VERSION;
+	if(fwrite(header, sizeof(header), 1, capture->file) != 1)
+	{
+		err = CHIAKI_ERR_UNKNOWN;
+		goto error_file;
+	}
+
+	return CHIAKI_ERR_SUCCESS;
+error_file:
+	fclose(capture->file);
+error_mutex:
+	chiaki_mutex_fini(&capture->mutex);
+	return err;
+}
+
+CHIAKI_EXPORT void chiaki_takion_capture_fini(ChiakiTakionCapture *capture)
+{
+	fclose(capture->file);
+	chiaki_mutex_fini(&capture->mutex);
+}
+
+static void capture_write_record(ChiakiTakionCapture *capture, ChiakiTakionCaptureRecordType type, uint64_t time_us,
+		const uint8_t *payload, size_t payload_size)
+{
+	uint8_t header[CAPTURE_RECORD_HEADER_SIZE];
+	header[0] = (uint8_t)type;
+	write_le32(header + 1, (uint32_t)payload_size);
+	write_le64(header + 5, time_us);
+
+	chiaki_mutex_lock(&capture->mutex);
+	if(!capture->failed)
+	{
+		if(fwrite(header, sizeof(header), 1, capture->file) != 1
+			|| (payload_size && fwrite(payload, payload_size, 1, capture->file) != 1))
+			capture->failed = true;
+		else if(type == CHIAKI_TAKION_CAPTURE_RECORD_DATAGRAM)
+		{
+			capture->datagrams++;
+			capture->bytes += payload_size;
+		}
+	}
+	chiaki_mutex_unlock(&capture->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_takion_capture_write_takion(ChiakiTakionCapture *capture, uint8_t protocol_version, uint32_t tag_local)
+{
+	uint8_t payload[CAPTURE_TAKION_SIZE];
+	payload[0] = protocol_version;
+	write_le32(payload + 1, tag_local);
+	capture_write_record(capture, CHIAKI_TAKION_CAPTURE_RECORD_TAKION, chiaki_time_now_monotonic_us(), payload, sizeof(payload));
+}
+
+CHIAKI_EXPORT void chiaki_takion_capture_write_keys(ChiakiTakionCapture *capture, ChiakiTarget target,
+		const uint8_t *handshake_key, const uint8_t *ecdh_secret)
+{
+	uint8_t payload[CAPTURE_KEYS_SIZE];
+	write_le32(payload, (uint32_t)target);
+	memcpy(payload + 4, handshake_key, CHIAKI_TAKION_CAPTURE_HANDSHAKE_KEY_SIZE);
+	memcpy(payload + 4 + CHIAKI_TAKION_CAPTURE_HANDSHAKE_KEY_SIZE, ecdh_secret, CHIAKI_ECDH_SECRET_SIZE);
+	capture_write_record(capture, CHIAKI_TAKION_CAPTURE_RECORD_KEYS, chiaki_time_now_monotonic_us(), payload, sizeof(payload));
+}
+
+CHIAKI_EXPORT void chiaki_takion_capture_write_datagram(ChiakiTakionCapture *capture, uint64_t time_us, const uint8_t *buf, size_t buf_size)
+{
+	capture_write_record(capture, CHIAKI_TAKION_CAPTURE_RECORD_DATAGRAM, time_us, buf, buf_size);
+}
+
+static bool replay_read_record_header(ChiakiTakionReplay *replay, uint8_t *type, uint32_t *size, uint64_t *time_us)
+{
+	uint8_t header[CAPTURE_RECORD_HEADER_SIZE];
+	if(fread(header, sizeof(header), 1, replay->file) != 1)
+		return false;
+	*type = header[0];
+	*size = read_le32(header + 1);
+	*time_us = read_le64(header + 5);
+	return true;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_replay_init(ChiakiTakionReplay *replay, const char *filename, bool realtime)
+{
+	memset(replay, 0, sizeof(*replay));
+	replay->realtime = realtime;
+
+	replay->file = fopen(filename, "rb");
+	if(!replay->file)
+		return CHIAKI_ERR_UNKNOWN;
+
+	uint8_t header[CAPTURE_MAGIC_SIZE + 1];
+	if(fread(header, sizeof(header), 1, replay->file) != 1
+		|| memcmp(header, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE) != 0)
+		goto error_invalid;
+	if(header[CAPTURE_MAGIC_SIZE] != CHIAKI_TAKION_CAPTURE_VERSION)
+	{
+		fclose(replay->file);
+		return CHIAKI_ERR_VERSION_MISMATCH;
+	}
+
+	// the keys are only known after the bang was received, so they have to be looked up before replaying
+	bool takion_found = false;
+	bool keys_found = false;
+	uint8_t type;
+	uint32_t size;
+	uint64_t time_us;
+	while(!(takion_found && keys_found) && replay_read_record_header(replay, &type, &size, &time_us))
+	{
+		if(type == CHIAKI_TAKION_CAPTURE_RECORD_TAKION && size == CAPTURE_TAKION_SIZE && !takion_found)
+		{
+			uint8_t payload[CAPTURE_TAKION_SIZE];
+			if(fread(payload, sizeof(payload), 1, replay->file) != 1)
+				break;
+			replay->protocol_version = payload[0];
+			replay->tag_local = read_le32(payload + 1);
+			replay->data_offset = ftell(replay->file);
+			takion_found = true;
+		}
+		else if(type == CHIAKI_TAKION_CAPTURE_RECORD_KEYS && size == CAPTURE_KEYS_SIZE && !keys_found)
+		{
+			uint8_t payload[CAPTURE_KEYS_SIZE];
+			if(fread(payload, sizeof(payload), 1, replay->file) != 1)
+				break;
+			replay->target = (ChiakiTarget)read_le32(payload);
+			memcpy(replay->handshake_key, payload + 4, CHIAKI_TAKION_CAPTURE_HANDSHAKE_KEY_SIZE);
+			memcpy(replay->ecdh_secret, payload + 4 + CHIAKI_TAKION_CAPTURE_HANDSHAKE_KEY_SIZE, CHIAKI_ECDH_SECRET_SIZE);
+			keys_found = true;
+		}
+		else if(fseek(replay->file, size, SEEK_CUR) != 0)
+			break;
+	}
+
+	if(!takion_found || !keys_found || fseek(replay->file, replay->data_offset, SEEK_SET) != 0)
+		goto error_invalid;
+
+	return CHIAKI_ERR_SUCCESS;
+error_invalid:
+	fclose(replay->file);
+	return CHIAKI_ERR_INVALID_DATA;
+}
+
+CHIAKI_EXPORT void chiaki_takion_replay_fini(ChiakiTakionReplay *replay)
+{
+	fclose(replay->file);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_replay_next(ChiakiTakionReplay *replay, ChiakiStopPipe *stop_pipe,
+		uint8_t *buf, size_t *buf_size, uint64_t *time_us, bool wait)
+{
+	while(!replay->pending)
+	{
+		if(replay->eof)
+			return CHIAKI_ERR_DISCONNECTED;
+		uint8_t type;
+		if(!replay_read_record_header(replay, &type, &replay->pending_size, &replay->pending_time_us))
+		{
+			replay->eof = true;
+			return CHIAKI_ERR_DISCONNECTED;
+		}
+		if(type == CHIAKI_TAKION_CAPTURE_RECORD_DATAGRAM)
+			replay->pending = true;
+		else if(fseek(replay->file, replay->pending_size, SEEK_CUR) != 0)
+			replay->eof = true;
+	}
+
+	uint64_t now = chiaki_time_now_monotonic_us();
+	if(!replay->datagrams)
+	{
+		replay->first_time_us = replay->pending_time_us;
+		replay->start_us = now;
+	}
+
+	uint64_t offset = replay->pending_time_us > replay->first_time_us ? replay->pending_time_us - replay->first_time_us : 0;
+	uint64_t due = replay->start_us + offset;
+	if(replay->realtime)
+	{
+		if(now < due)
+		{
+			if(!wait)
+				return CHIAKI_ERR_TIMEOUT;
+			ChiakiErrorCode err = chiaki_stop_pipe_sleep(stop_pipe, (due - now + 999) / 1000);
+			if(err != CHIAKI_ERR_TIMEOUT)
+				return err == CHIAKI_ERR_SUCCESS ? CHIAKI_ERR_CANCELED : err;
+			now = chiaki_time_now_monotonic_us();
+		}
+		if(now > due && now - due > replay->late_us_max)
+			replay->late_us_max = now - due;
+	}
+
+	size_t size = replay->pending_size;
+	size_t copy_size = size < *buf_size ? size : *buf_size;
+	if(fread(buf, 1, copy_size, replay->file) != copy_size
+		|| (copy_size < size && fseek(replay->file, (long)(size - copy_size), SEEK_CUR) != 0))
+	{
+		replay->eof = true;
+		replay->pending = false;
+		return CHIAKI_ERR_DISCONNECTED;
+	}
+	replay->pending = false;
+	replay->datagrams++;
+	replay->bytes += size;
+	*buf_size = copy_size;
+	if(time_us)
+		*time_us = due;
+	return CHIAKI_ERR_SUCCESS;
+}
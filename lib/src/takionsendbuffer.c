@@ -9,8 +9,12 @@
 #include <string.h>
 #include <assert.h>
 
-#define TAKION_DATA_RESEND_TIMEOUT_MS 200
-#define TAKION_DATA_RESEND_WAKEUP_TIMEOUT_MS (TAKION_DATA_RESEND_TIMEOUT_MS/2)
+// retransmission timeout bounds and the timeout used until there is an rtt sample
+#define TAKION_DATA_RTO_MIN_US (5 * 1000)
+#define TAKION_DATA_RTO_MAX_US (1000 * 1000)
+#define TAKION_DATA_RTO_INITIAL_US (200 * 1000)
+// clock granularity G of RFC 6298
+#define TAKION_DATA_RTO_GRANULARITY_US 1000
 #define TAKION_DATA_RESEND_TRIES_MAX 10
 
 #endif
@@ -19,8 +23,9 @@ struct chiaki_takion_send_buffer_packet_t
 {
 	ChiakiSeqNum32 seq_num;
 	uint64_t tries;
-	uint64_t last_send_ms; // chiaki_time_now_monotonic_ms()
-	uint8_t *buf;
+	uint64_t first_send_us; // chiaki_time_now_monotonic_us()
+	uint64_t last_send_us;
+	uint8_t *buf; // NULL if the slot is free
 	size_t buf_size;
 }; // ChiakiTakionSendBufferPacket
 
@@ -28,17 +33,60 @@ struct chiaki_takion_send_buffer_packet_t
 
 static void *takion_send_buffer_thread_func(void *user);
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_init(ChiakiTakionSendBuffer *send_buffer, ChiakiTakion *takion, size_t size)
+static void takion_send_buffer_update_rto(ChiakiTakionSendBuffer *send_buffer)
+{
+	uint64_t var = 4 * send_buffer->rttvar_us;
+	if(var < TAKION_DATA_RTO_GRANULARITY_US)
+		var = TAKION_DATA_RTO_GRANULARITY_US;
+	uint64_t rto = send_buffer->srtt_us + var;
+	if(rto < TAKION_DATA_RTO_MIN_US)
+		rto = TAKION_DATA_RTO_MIN_US;
+	else if(rto > TAKION_DATA_RTO_MAX_US)
+		rto = TAKION_DATA_RTO_MAX_US;
+	send_buffer->rto_us = rto;
+}
+
+static void takion_send_buffer_rtt_sample(ChiakiTakionSendBuffer *send_buffer, uint64_t rtt_us)
+{
+	if(!send_buffer->srtt_us)
+	{
+		send_buffer->srtt_us = rtt_us ? rtt_us : 1;
+		send_buffer->rttvar_us = rtt_us / 2;
+	}
+	else
+	{
+		uint64_t delta = send_buffer->srtt_us > rtt_us ? send_buffer->srtt_us - rtt_us : rtt_us - send_buffer->srtt_us;
+		send_buffer->rttvar_us = (3 * send_buffer->rttvar_us + delta) / 4;
+		send_buffer->srtt_us = (7 * send_buffer->srtt_us + rtt_us) / 8;
+		if(!send_buffer->srtt_us)
+			send_buffer->srtt_us = 1;
+	}
+	takion_send_buffer_update_rto(send_buffer);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_init(ChiakiTakionSendBuffer *send_buffer, ChiakiTakion *takion, size_t size, uint64_t rtt_initial_us)
 {
 	send_buffer->takion = takion;
 	send_buffer->log = takion ? takion->log : NULL;
 
+	if(!size || (size & (size - 1)))
+		return CHIAKI_ERR_INVALID_DATA;
+
 	send_buffer->packets = calloc(size, sizeof(ChiakiTakionSendBufferPacket));
 	if(!send_buffer->packets)
 		return CHIAKI_ERR_MEMORY;
 	send_buffer->packets_size = size;
 	send_buffer->packets_count = 0;
+	send_buffer->begin = 0;
+	send_buffer->end = 0;
+
+	send_buffer->srtt_us = 0;
+	send_buffer->rttvar_us = 0;
+	send_buffer->rto_us = TAKION_DATA_RTO_INITIAL_US;
+	if(rtt_initial_us)
+		takion_send_buffer_rtt_sample(send_buffer, rtt_initial_us);
 
+	send_buffer->pushed = false;
 	send_buffer->should_stop = false;
 
 	ChiakiErrorCode err = chiaki_mutex_init(&send_buffer->mutex, false);
@@ -76,7 +124,7 @@ CHIAKI_EXPORT void chiaki_takion_send_buffer_fini(ChiakiTakionSendBuffer *send_b
 	err = chiaki_thread_join(&send_buffer->thread, NULL);
 	assert(err == CHIAKI_ERR_SUCCESS);
 
-	for(size_t i=0; i<send_buffer->packets_count; i++)
+	for(size_t i=0; i<send_buffer->packets_size; i++)
 		free(send_buffer->packets[i].buf);
 
 	chiaki_cond_fini(&send_buffer->cond);
@@ -84,44 +132,69 @@ CHIAKI_EXPORT void chiaki_takion_send_buffer_fini(ChiakiTakionSendBuffer *send_b
 	free(send_buffer->packets);
 }
 
+static inline ChiakiTakionSendBufferPacket *takion_send_buffer_slot(ChiakiTakionSendBuffer *send_buffer, ChiakiSeqNum32 seq_num)
+{
+	return &send_buffer->packets[seq_num & (send_buffer->packets_size - 1)];
+}
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_push(ChiakiTakionSendBuffer *send_buffer, ChiakiSeqNum32 seq_num, uint8_t *buf, size_t buf_size)
 {
 	ChiakiErrorCode err = chiaki_mutex_lock(&send_buffer->mutex);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return err;
 
-	if(send_buffer->packets_count >= send_buffer->packets_size)
+	ChiakiSeqNum32 begin = send_buffer->begin;
+	ChiakiSeqNum32 end = send_buffer->end;
+	if(!send_buffer->packets_count)
+	{
+		begin = seq_num;
+		end = seq_num + 1;
+	}
+	else if(chiaki_seq_num_32_lt(seq_num, begin))
+		begin = seq_num;
+	else if(!chiaki_seq_num_32_lt(seq_num, end))
+		end = seq_num + 1;
+
+	if((ChiakiSeqNum32)(end - begin) > send_buffer->packets_size)
 	{
 		CHIAKI_LOGE(send_buffer->log, "Takion Send Buffer overflow");
 		err = CHIAKI_ERR_OVERFLOW;
 		goto beach;
 	}
 
-	for(size_t i=0; i<send_buffer->packets_count; i++)
+	ChiakiTakionSendBufferPacket *packet = takion_send_buffer_slot(send_buffer, seq_num);
+	if(packet->buf)
 	{
-		if(send_buffer->packets[i].seq_num == seq_num)
-		{
-			CHIAKI_LOGE(send_buffer->log, "Tried to push duplicate seqnum into Takion Send Buffer");
-			err = CHIAKI_ERR_INVALID_DATA;
-			goto beach;
-		}
+		CHIAKI_LOGE(send_buffer->log, "Tried to push duplicate seqnum into Takion Send Buffer");
+		err = CHIAKI_ERR_INVALID_DATA;
+		goto beach;
 	}
 
-	ChiakiTakionSendBufferPacket *packet = &send_buffer->packets[send_buffer->packets_count++];
+	send_buffer->begin = begin;
+	send_buffer->end = end;
 	packet->seq_num = seq_num;
 	packet->tries = 0;
-	packet->last_send_ms = chiaki_time_now_monotonic_ms();
+	packet->first_send_us = packet->last_send_us = chiaki_time_now_monotonic_us();
 	packet->buf = buf;
 	packet->buf_size = buf_size;
+	send_buffer->packets_count++;
 
 	CHIAKI_LOGV(send_buffer->log, "Pushed seq num %#llx into Takion Send Buffer", (unsigned long long)seq_num);
 
-	if(send_buffer->packets_count == 1)
+	if(send_buffer->takion)
 	{
-		// buffer was empty before, so it will sleep without timeout => WAKE UP!!
-		chiaki_cond_signal(&send_buffer->cond);
+		err = chiaki_takion_send_raw(send_buffer->takion, buf, buf_size);
+		if(err != CHIAKI_ERR_SUCCESS)
+		{
+			CHIAKI_LOGE(send_buffer->log, "Takion Send Buffer failed to send seq num %#llx, leaving it to be re-sent", (unsigned long long)seq_num);
+			buf = NULL; // still owned by the buffer
+		}
 	}
 
+	// the thread might sleep without timeout or until a packet with a longer backoff is due => WAKE UP!!
+	send_buffer->pushed = true;
+	chiaki_cond_signal(&send_buffer->cond);
+
 beach:
 	if(err != CHIAKI_ERR_SUCCESS)
 		free(buf);
@@ -138,65 +211,46 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_ack(ChiakiTakionSendBuff
 	if(acked_seq_nums_count)
 		*acked_seq_nums_count = 0;
 
-	size_t i;
-	size_t shift = 0; // amount to shift back
-	size_t shift_start = SIZE_MAX;
-	for(i=0; i<send_buffer->packets_count; i++)
+	uint64_t now = chiaki_time_now_monotonic_us();
+	uint64_t rtt_sample_us = 0;
+	bool rtt_sampled = false;
+	while(send_buffer->packets_count
+			&& (send_buffer->begin == seq_num || chiaki_seq_num_32_lt(send_buffer->begin, seq_num)))
 	{
-		if(send_buffer->packets[i].seq_num == seq_num || chiaki_seq_num_32_lt(send_buffer->packets[i].seq_num, seq_num))
+		ChiakiTakionSendBufferPacket *packet = takion_send_buffer_slot(send_buffer, send_buffer->begin);
+		if(packet->buf && packet->seq_num == send_buffer->begin)
 		{
 			if(acked_seq_nums)
-				acked_seq_nums[(*acked_seq_nums_count)++] = send_buffer->packets[i].seq_num;
+				acked_seq_nums[(*acked_seq_nums_count)++] = packet->seq_num;
 
-			free(send_buffer->packets[i].buf);
-			if(shift_start == SIZE_MAX)
-			{
-				// first shift
-				shift_start = i;
-				shift = 1;
-			}
-			else if(shift_start + shift == i)
-			{
-				// still in the same gap
-				shift++;
-			}
-			else
-			{
-				// new gap, do shift
-				memmove(send_buffer->packets + shift_start,
-						send_buffer->packets + shift_start + shift,
-						(i - (shift_start + shift)) * sizeof(ChiakiTakionSendBufferPacket));
-				// start new shift
-				shift_start = i - shift;
-				shift++;
-			}
-		}
-	}
+			// Karn's rule: the ack of a retransmitted packet could belong to any of its transmissions
+			rtt_sampled = packet->tries == 0;
+			if(rtt_sampled)
+				rtt_sample_us = now - packet->first_send_us;
 
-	if(shift_start != SIZE_MAX)
-	{
-		// do final shift
-		if(shift_start + shift < send_buffer->packets_count)
-		{
-			memmove(send_buffer->packets + shift_start,
-					send_buffer->packets + shift_start + shift,
-					(send_buffer->packets_count - (shift_start + shift)) * sizeof(ChiakiTakionSendBufferPacket));
+			free(packet->buf);
+			packet->buf = NULL;
+			send_buffer->packets_count--;
 		}
-		send_buffer->packets_count -= shift;
+		send_buffer->begin++;
 	}
 
+	// sample only the newest acked packet, older ones may have waited for the cumulative ack of a retransmission
+	if(rtt_sampled)
+		takion_send_buffer_rtt_sample(send_buffer, rtt_sample_us);
+
 	CHIAKI_LOGV(send_buffer->log, "Acked seq num %#llx from Takion Send Buffer", (unsigned long long)seq_num);
 
 	chiaki_mutex_unlock(&send_buffer->mutex);
 	return err;
 }
 
-static void takion_send_buffer_resend(ChiakiTakionSendBuffer *send_buffer);
+static uint64_t takion_send_buffer_resend(ChiakiTakionSendBuffer *send_buffer);
 
 static bool takion_send_buffer_check_pred_packets(void *user)
 {
 	ChiakiTakionSendBuffer *send_buffer = user;
-	return send_buffer->should_stop;
+	return send_buffer->should_stop || send_buffer->pushed;
 }
 
 static bool takion_send_buffer_check_pred_no_packets(void *user)
@@ -213,10 +267,11 @@ static void *takion_send_buffer_thread_func(void *user)
 	if(err != CHIAKI_ERR_SUCCESS)
 		return NULL;
 
+	uint64_t timeout_ms = 0;
 	while(true)
 	{
-		if(send_buffer->packets_count) // if there are packets, wait with timeout
-			err = chiaki_cond_timedwait_pred(&send_buffer->cond, &send_buffer->mutex, TAKION_DATA_RESEND_WAKEUP_TIMEOUT_MS, takion_send_buffer_check_pred_packets, send_buffer);
+		if(send_buffer->packets_count) // if there are packets, wait until the next one is due
+			err = chiaki_cond_timedwait_pred(&send_buffer->cond, &send_buffer->mutex, timeout_ms, takion_send_buffer_check_pred_packets, send_buffer);
 		else // if not, wait without timeout, but also wakeup if packets become available
 			err = chiaki_cond_wait_pred(&send_buffer->cond, &send_buffer->mutex, takion_send_buffer_check_pred_no_packets, send_buffer);
 
@@ -226,7 +281,11 @@ static void *takion_send_buffer_thread_func(void *user)
 		if(send_buffer->should_stop)
 			break;
 
-		takion_send_buffer_resend(send_buffer);
+		send_buffer->pushed = false;
+		uint64_t timeout_us = takion_send_buffer_resend(send_buffer);
+		timeout_ms = (timeout_us + 999) / 1000;
+		if(!timeout_ms)
+			timeout_ms = 1;
 	}
 
 	chiaki_mutex_unlock(&send_buffer->mutex);
@@ -234,25 +293,44 @@ static void *takion_send_buffer_thread_func(void *user)
 	return NULL;
 }
 
-static void takion_send_buffer_resend(ChiakiTakionSendBuffer *send_buffer)
+/**
+ * @return time until the next packet is due for re-sending
+ */
+static uint64_t takion_send_buffer_resend(ChiakiTakionSendBuffer *send_buffer)
 {
-	if(!send_buffer->takion)
-		return;
+	uint64_t now = chiaki_time_now_monotonic_us();
+	uint64_t timeout_us = TAKION_DATA_RTO_MAX_US;
 
-	uint64_t now = chiaki_time_now_monotonic_ms();
-
-	for(size_t i=0; i<send_buffer->packets_count; i++)
+	for(ChiakiSeqNum32 seq_num = send_buffer->begin; seq_num != send_buffer->end; seq_num++)
 	{
-		ChiakiTakionSendBufferPacket *packet = &send_buffer->packets[i];
-		if(now - packet->last_send_ms > TAKION_DATA_RESEND_TIMEOUT_MS)
+		ChiakiTakionSendBufferPacket *packet = takion_send_buffer_slot(send_buffer, seq_num);
+		if(!packet->buf || packet->seq_num != seq_num)
+			continue;
+
+		// back off exponentially for every try
+		uint64_t rto = send_buffer->rto_us << (packet->tries < 8 ? packet->tries : 8);
+		if(rto > TAKION_DATA_RTO_MAX_US)
+			rto = TAKION_DATA_RTO_MAX_US;
+		uint64_t elapsed = now - packet->last_send_us;
+		if(elapsed >= rto)
 		{
-			CHIAKI_LOGI(send_buffer->log, "Takion Send Buffer re-sending packet with seqnum %#llx, tries: %llu", (unsigned long long)packet->seq_num, (unsigned long long)packet->tries);
-			packet->last_send_ms = now;
-			chiaki_takion_send_raw(send_buffer->takion, packet->buf, packet->buf_size);
+			if(send_buffer->takion)
+			{
+				CHIAKI_LOGI(send_buffer->log, "Takion Send Buffer re-sending packet with seqnum %#llx, tries: %llu, rto: %llu us",
+						(unsigned long long)packet->seq_num, (unsigned long long)packet->tries, (unsigned long long)rto);
+				chiaki_takion_send_raw(send_buffer->takion, packet->buf, packet->buf_size);
+			}
+			packet->last_send_us = now;
 			packet->tries++;
 			// TODO: check tries and disconnect if necessary
+			elapsed = 0;
+			rto = rto * 2 > TAKION_DATA_RTO_MAX_US ? TAKION_DATA_RTO_MAX_US : rto * 2;
 		}
+		if(rto - elapsed < timeout_us)
+			timeout_us = rto - elapsed;
 	}
+
+	return timeout_us;
 }
 
 #endif
@@ -0,0 +1,390 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include "takionuring.h"
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define TAKION_URING_SQ_ENTRIES 4
+#define TAKION_URING_BUF_GROUP 0
+
+#define TAKION_URING_TAG_RECV 1
+#define TAKION_URING_TAG_STOP 2
+#define TAKION_URING_TAG_CANCEL 3
+
+struct chiaki_takion_uring_t
+{
+	ChiakiLog *log;
+	int fd;
+	int sock;
+	int stop_fd;
+	ChiakiPacketBufPool *pool;
+
+	void *ring_ptr; // sq and cq ring in a single mapping
+	size_t ring_size;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned int to_submit;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+
+	struct io_uring_buf_ring *buf_ring;
+	size_t buf_ring_size;
+	uint16_t buf_ring_tail;
+	ChiakiPacketBuf **bufs; // currently provided buffers, indexed by buffer id
+	size_t bufs_count;
+
+	bool recv_armed; // whether the multishot recv is still posted
+	bool stop_armed; // whether the poll on stop_fd is still posted
+	bool stopped;
+	int recv_error; // last error that terminated the multishot recv
+};
+
+static void uring_push_sqe(ChiakiTakionUring *uring, const struct io_uring_sqe *sqe)
+{
+	// the caller guarantees there is space, we never have more than TAKION_URING_SQ_ENTRIES requests in flight at once
+	unsigned int tail = *uring->sq_tail;
+	unsigned int index = tail & uring->sq_mask;
+	uring->sqes[index] = *sqe;
+	uring->sq_array[index] = index;
+	__atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	uring->to_submit++;
+}
+
+static void uring_push_recv(ChiakiTakionUring *uring)
+{
+	struct io_uring_sqe sqe;
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = IORING_OP_RECV;
+	sqe.fd = uring->sock;
+	sqe.flags = IOSQE_BUFFER_SELECT;
+	sqe.ioprio = IORING_RECV_MULTISHOT;
+	sqe.buf_group = TAKION_URING_BUF_GROUP;
+	sqe.user_data = TAKION_URING_TAG_RECV;
+	uring_push_sqe(uring, &sqe);
+	uring->recv_armed = true;
+}
+
+static void uring_push_stop_poll(ChiakiTakionUring *uring)
+{
+	struct io_uring_sqe sqe;
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = IORING_OP_POLL_ADD;
+	sqe.fd = uring->stop_fd;
+	sqe.poll32_events = POLLIN;
+	sqe.user_data = TAKION_URING_TAG_STOP;
+	uring_push_sqe(uring, &sqe);
+	uring->stop_armed = true;
+}
+
+static void uring_push_cancel(ChiakiTakionUring *uring, uint64_t tag)
+{
+	struct io_uring_sqe sqe;
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = IORING_OP_ASYNC_CANCEL;
+	sqe.fd = -1;
+	sqe.addr = tag;
+	sqe.user_data = TAKION_URING_TAG_CANCEL;
+	uring_push_sqe(uring, &sqe);
+}
+
+/**
+ * Submit pending requests and, if min_complete > 0, wait for completions.
+ */
+static ChiakiErrorCode uring_enter(ChiakiTakionUring *uring, unsigned int min_complete)
+{
+	while(true)
+	{
+		int r = (int)syscall(__NR_io_uring_enter, uring->fd, uring->to_submit, min_complete,
+				min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		if(r >= 0)
+		{
+			uring->to_submit -= (unsigned int)r < uring->to_submit ? (unsigned int)r : uring->to_submit;
+			return CHIAKI_ERR_SUCCESS;
+		}
+		if(errno != EINTR)
+		{
+			CHIAKI_LOGE(uring->log, "Takion io_uring_enter failed: %s", strerror(errno));
+			return CHIAKI_ERR_UNKNOWN;
+		}
+	}
+}
+
+static void uring_provide_buf(ChiakiTakionUring *uring, uint16_t bid)
+{
+	struct io_uring_buf *buf = &uring->buf_ring->bufs[uring->buf_ring_tail & (uring->bufs_count - 1)];
+	buf->addr = (uint64_t)(uintptr_t)uring->bufs[bid]->data;
+	buf->len = (uint32_t)uring->bufs[bid]->size;
+	buf->bid = bid;
+	uring->buf_ring_tail++;
+}
+
+static void uring_provide_commit(ChiakiTakionUring *uring)
+{
+	__atomic_store_n(&uring->buf_ring->tail, uring->buf_ring_tail, __ATOMIC_RELEASE);
+}
+
+/**
+ * Consume available completions.
+ *
+ * @param bufs if NULL, received datagrams are dropped, otherwise up to bufs_size of them are passed out
+ */
+static void uring_reap(ChiakiTakionUring *uring, ChiakiPacketBuf **bufs, size_t *buf_sizes, size_t bufs_size,
+		size_t *count, uint64_t *pool_exhausted)
+{
+	unsigned int head = *uring->cq_head;
+	unsigned int tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+	bool provided = false;
+	for(; head != tail; head++)
+	{
+		if(bufs && *count >= bufs_size)
+			break;
+		struct io_uring_cqe *cqe = &uring->cqes[head & uring->cq_mask];
+		switch(cqe->user_data)
+		{
+			case TAKION_URING_TAG_RECV:
+				if(cqe->flags & IORING_CQE_F_BUFFER)
+				{
+					uint16_t bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+					if(bufs && cqe->res > 0)
+					{
+						// hand out the filled buffer and provide a fresh one in its place
+						bufs[*count] = uring->bufs[bid];
+						buf_sizes[*count] = (size_t)cqe->res;
+						(*count)++;
+						bool exhausted = false;
+						uring->bufs[bid] = chiaki_packet_buf_pool_acquire(uring->pool, &exhausted);
+						if(exhausted && pool_exhausted)
+							(*pool_exhausted)++;
+					}
+					if(uring->bufs[bid])
+					{
+						uring_provide_buf(uring, bid);
+						provided = true;
+					}
+					else
+						CHIAKI_LOGE(uring->log, "Takion io_uring failed to allocate receive buffer");
+				}
+				if(!(cqe->flags & IORING_CQE_F_MORE))
+				{
+					uring->recv_armed = false;
+					// ENOBUFS only means we were too slow to give buffers back, the recv is simply posted again
+					if(cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED)
+						uring->recv_error = -cqe->res;
+				}
+				break;
+			case TAKION_URING_TAG_STOP:
+				uring->stop_armed = false;
+				if(cqe->res != -ECANCELED)
+					uring->stopped = true;
+				break;
+			default:
+				break;
+		}
+	}
+	__atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+	if(provided)
+		uring_provide_commit(uring);
+}
+
+ChiakiTakionUring *chiaki_takion_uring_new(ChiakiLog *log, int sock, int stop_fd, ChiakiPacketBufPool *pool, size_t bufs_count)
+{
+	if(!bufs_count || bufs_count > (1 << 15) || (bufs_count & (bufs_count - 1)))
+		return NULL;
+
+	ChiakiTakionUring *uring = calloc(1, sizeof(ChiakiTakionUring));
+	if(!uring)
+		return NULL;
+	uring->log = log;
+	uring->sock = sock;
+	uring->stop_fd = stop_fd;
+	uring->pool = pool;
+	uring->bufs_count = bufs_count;
+	uring->ring_ptr = MAP_FAILED;
+	uring->sqes = MAP_FAILED;
+
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = (unsigned int)bufs_count * 2; // every provided buffer may be waiting in a cqe
+	uring->fd = (int)syscall(__NR_io_uring_setup, TAKION_URING_SQ_ENTRIES, &params);
+	if(uring->fd < 0)
+	{
+		CHIAKI_LOGW(log, "Takion io_uring_setup failed: %s", strerror(errno));
+		free(uring);
+		return NULL;
+	}
+	if(!(params.features & IORING_FEAT_SINGLE_MMAP))
+	{
+		CHIAKI_LOGW(log, "Takion io_uring is too old");
+		goto error;
+	}
+
+	size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	uring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+	uring->ring_ptr = mmap(NULL, uring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING);
+	if(uring->ring_ptr == MAP_FAILED)
+		goto error;
+	uint8_t *ring = uring->ring_ptr;
+	uring->sq_head = (unsigned int *)(ring + params.sq_off.head);
+	uring->sq_tail = (unsigned int *)(ring + params.sq_off.tail);
+	uring->sq_mask = *(unsigned int *)(ring + params.sq_off.ring_mask);
+	uring->sq_entries = params.sq_entries;
+	uring->sq_array = (unsigned int *)(ring + params.sq_off.array);
+	uring->cq_head = (unsigned int *)(ring + params.cq_off.head);
+	uring->cq_tail = (unsigned int *)(ring + params.cq_off.tail);
+	uring->cq_mask = *(unsigned int *)(ring + params.cq_off.ring_mask);
+	uring->cqes = (struct io_uring_cqe *)(ring + params.cq_off.cqes);
+
+	uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+	if(uring->sqes == MAP_FAILED)
+		goto error;
+
+	uring->bufs = calloc(bufs_count, sizeof(ChiakiPacketBuf *));
+	if(!uring->bufs)
+		goto error;
+	uring->buf_ring_size = bufs_count * sizeof(struct io_uring_buf);
+	long page_size = sysconf(_SC_PAGESIZE);
+	if(posix_memalign((void **)&uring->buf_ring, page_size > 0 ? (size_t)page_size : 4096, uring->buf_ring_size) != 0)
+	{
+		uring->buf_ring = NULL;
+		goto error;
+	}
+	memset(uring->buf_ring, 0, uring->buf_ring_size);
+
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)uring->buf_ring;
+	reg.ring_entries = (uint32_t)bufs_count;
+	reg.bgid = TAKION_URING_BUF_GROUP;
+	if(syscall(__NR_io_uring_register, uring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+	{
+		CHIAKI_LOGW(log, "Takion io_uring does not support provided buffer rings: %s", strerror(errno));
+		free(uring->buf_ring);
+		uring->buf_ring = NULL;
+		goto error;
+	}
+
+	for(size_t i=0; i<bufs_count; i++)
+	{
+		uring->bufs[i] = chiaki_packet_buf_pool_acquire(pool, NULL);
+		if(!uring->bufs[i])
+			goto error;
+		uring_provide_buf(uring, (uint16_t)i);
+	}
+	uring_provide_commit(uring);
+
+	uring_push_stop_poll(uring);
+	uring_push_recv(uring);
+	if(uring_enter(uring, 0) != CHIAKI_ERR_SUCCESS)
+		goto error;
+
+	// Kernels without multishot recv reject it right away, peek at the completions without consuming any data.
+	unsigned int cq_tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+	for(unsigned int head = *uring->cq_head; head != cq_tail; head++)
+	{
+		struct io_uring_cqe *cqe = &uring->cqes[head & uring->cq_mask];
+		if(cqe->user_data == TAKION_URING_TAG_RECV && cqe->res == -EINVAL)
+		{
+			CHIAKI_LOGW(log, "Takion io_uring does not support multishot recv");
+			goto error;
+		}
+	}
+
+	return uring;
+error:
+	chiaki_takion_uring_free(uring);
+	return NULL;
+}
+
+void chiaki_takion_uring_free(ChiakiTakionUring *uring)
+{
+	if(!uring)
+		return;
+
+	if(uring->sqes != MAP_FAILED)
+	{
+		// the kernel may still write into the provided buffers until the recv is really gone
+		if(uring->recv_armed)
+			uring_push_cancel(uring, TAKION_URING_TAG_RECV);
+		if(uring->stop_armed)
+			uring_push_cancel(uring, TAKION_URING_TAG_STOP);
+		while(uring->recv_armed || uring->stop_armed)
+		{
+			if(uring_enter(uring, 1) != CHIAKI_ERR_SUCCESS)
+				break;
+			uring_reap(uring, NULL, NULL, 0, NULL, NULL);
+		}
+	}
+
+	if(uring->buf_ring)
+	{
+		struct io_uring_buf_reg reg;
+		memset(&reg, 0, sizeof(reg));
+		reg.bgid = TAKION_URING_BUF_GROUP;
+		syscall(__NR_io_uring_register, uring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+		free(uring->buf_ring);
+	}
+
+	if(uring->bufs)
+	{
+		for(size_t i=0; i<uring->bufs_count; i++)
+		{
+			if(uring->bufs[i])
+				chiaki_packet_buf_unref(uring->bufs[i]);
+		}
+		free(uring->bufs);
+	}
+
+	if(uring->sqes != MAP_FAILED)
+		munmap(uring->sqes, uring->sqes_size);
+	if(uring->ring_ptr != MAP_FAILED)
+		munmap(uring->ring_ptr, uring->ring_size);
+	close(uring->fd);
+	free(uring);
+}
+
+ChiakiErrorCode chiaki_takion_uring_recv(ChiakiTakionUring *uring, ChiakiPacketBuf **bufs, size_t *buf_sizes, size_t bufs_size,
+		size_t *count, uint64_t *pool_exhausted)
+{
+	*count = 0;
+	while(true)
+	{
+		uring_reap(uring, bufs, buf_sizes, bufs_size, count, pool_exhausted);
+		if(uring->stopped)
+			return CHIAKI_ERR_CANCELED;
+		if(uring->recv_error)
+		{
+			CHIAKI_LOGE(uring->log, "Takion io_uring recv failed: %s", strerror(uring->recv_error));
+			return CHIAKI_ERR_NETWORK;
+		}
+		if(!uring->recv_armed)
+			uring_push_recv(uring);
+		if(*count)
+		{
+			if(uring->to_submit)
+				return uring_enter(uring, 0);
+			return CHIAKI_ERR_SUCCESS;
+		}
+		ChiakiErrorCode err = uring_enter(uring, 1);
+		if(err != CHIAKI_ERR_SUCCESS)
+			return err;
+	}
+}
@@ -0,0 +1,48 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_TAKIONURING_H
+#define CHIAKI_TAKIONURING_H
+
+#include <chiaki/common.h>
+#include <chiaki/log.h>
+#include <chiaki/packetbuf.h>
+
+#include <stddef.h>
+
+/*
+ * io_uring receive backend for the Takion socket (Linux only, CHIAKI_LIB_ENABLE_IO_URING).
+ *
+ * A single multishot recv is kept posted against a provided buffer ring made of buffers from a ChiakiPacketBufPool,
+ * so datagrams land directly in buffers that can be passed on without copying and without a syscall per datagram.
+ * Instead of selecting on the stop pipe, its eventfd is polled through the ring as well.
+ */
+
+typedef struct chiaki_takion_uring_t ChiakiTakionUring;
+
+/**
+ * @param sock connected UDP socket to receive from
+ * @param stop_fd fd that becomes readable when receiving should be canceled
+ * @param pool pool to take the provided buffers from, it must have room for bufs_count buffers besides everything else
+ * @param bufs_count number of buffers kept provided to the kernel, must be a power of 2
+ * @return NULL if io_uring or one of the required features is not available at runtime
+ */
+ChiakiTakionUring *chiaki_takion_uring_new(ChiakiLog *log, int sock, int stop_fd, ChiakiPacketBufPool *pool, size_t bufs_count);
+
+/**
+ * Cancel the pending requests and release all provided buffers.
+ */
+void chiaki_takion_uring_free(ChiakiTakionUring *uring);
+
+/**
+ * Wait until at least one datagram has been received.
+ *
+ * @param bufs receives references to the buffers of up to bufs_size datagrams, ownership is passed to the caller
+ * @param buf_sizes receives the sizes of the datagrams
+ * @param count number of datagrams received
+ * @param pool_exhausted incremented for every buffer that could not be taken from the pool without allocating
+ * @return CHIAKI_ERR_CANCELED once stop_fd has become readable
+ */
+ChiakiErrorCode chiaki_takion_uring_recv(ChiakiTakionUring *uring, ChiakiPacketBuf **bufs, size_t *buf_sizes, size_t bufs_size,
+		size_t *count, uint64_t *pool_exhausted);
+
+#endif // CHIAKI_TAKIONURING_H
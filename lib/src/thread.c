@@ -9,6 +9,10 @@
 #include <stdlib.h>
 #include <errno.h>
 
+#if !_WIN32
+#include <sched.h>
+#endif
+
 #ifdef __SWITCH__
 #include <switch.h>
 #endif
@@ -97,6 +101,17 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_thread_set_name(ChiakiThread *thread, const
 	return CHIAKI_ERR_SUCCESS;
 }
 
+CHIAKI_EXPORT void chiaki_thread_yield(void)
+{
+#if _WIN32
+	SwitchToThread();
+#elif defined(__SWITCH__)
+	svcSleepThread(0);
+#else
+	sched_yield();
+#endif
+}
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_mutex_init(ChiakiMutex *mutex, bool rec)
 {
 #if _WIN32
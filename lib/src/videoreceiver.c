@@ -2,12 +2,13 @@
 
 #include <chiaki/videoreceiver.h>
 #include <chiaki/session.h>
+#include <chiaki/time.h>
 
 #include <string.h>
 
-static ChiakiErrorCode chiaki_video_receiver_flush_frame(ChiakiVideoReceiver *video_receiver);
+static ChiakiErrorCode chiaki_video_receiver_flush_frame(ChiakiVideoReceiver *video_receiver, ChiakiVideoFrameSlot *slot);
 
-CHIAKI_EXPORT void chiaki_video_receiver_init(ChiakiVideoReceiver *video_receiver, struct chiaki_session_t *session, ChiakiPacketStats *packet_stats)
+CHIAKI_EXPORT void chiaki_video_receiver_init(ChiakiVideoReceiver *video_receiver, struct chiaki_session_t *session, ChiakiPacketStats *packet_stats, ChiakiStreamStats *stream_stats)
 {
 	video_receiver->session = session;
 	video_receiver->log = session->log;
@@ -15,19 +16,51 @@ CHIAKI_EXPORT void chiaki_video_receiver_init(ChiakiVideoReceiver *video_receive
 	video_receiver->profiles_count = 0;
 	video_receiver->profile_cur = -1;
 
-	video_receiver->frame_index_cur = -1;
-	video_receiver->frame_index_prev = -1;
+	unsigned int reorder_frames = session->connect_info.video_reorder_frames;
+	if(!reorder_frames)
+		reorder_frames = CHIAKI_VIDEO_RECEIVER_REORDER_FRAMES_DEFAULT;
+	if(reorder_frames > CHIAKI_VIDEO_RECEIVER_FRAME_SLOTS_MAX)
+	{
+		CHIAKI_LOGW(video_receiver->log, "Video Receiver can only reorder %u frames, requested %u",
+				(unsigned int)CHIAKI_VIDEO_RECEIVER_FRAME_SLOTS_MAX, reorder_frames);
+		reorder_frames = CHIAKI_VIDEO_RECEIVER_FRAME_SLOTS_MAX;
+	}
+	video_receiver->reorder_frames = reorder_frames;
+	video_receiver->reorder_window_us = session->connect_info.video_reorder_window_us
+		? session->connect_info.video_reorder_window_us
+		: CHIAKI_VIDEO_RECEIVER_REORDER_WINDOW_US_DEFAULT;
+
+	video_receiver->frame_index_next = -1;
 	video_receiver->frame_index_prev_complete = 0;
 
-	chiaki_frame_processor_init(&video_receiver->frame_processor, video_receiver->log);
+	for(size_t i=0; i<CHIAKI_VIDEO_RECEIVER_FRAME_SLOTS_MAX; i++)
+	{
+		video_receiver->frame_slots[i].frame_index = -1;
+		video_receiver->frame_slots[i].slices_failed = false;
+		chiaki_frame_processor_init(&video_receiver->frame_slots[i].frame_processor, video_receiver->log);
+	}
 	video_receiver->packet_stats = packet_stats;
+	video_receiver->stream_stats = stream_stats;
+	memset(&video_receiver->frame_timing_stats, 0, sizeof(video_receiver->frame_timing_stats));
 }
 
 CHIAKI_EXPORT void chiaki_video_receiver_fini(ChiakiVideoReceiver *video_receiver)
 {
+	ChiakiVideoFrameTimingStats *timing_stats = &video_receiver->frame_timing_stats;
+	if(timing_stats->frames)
+	{
+		CHIAKI_LOGI(video_receiver->log, "Video Receiver frame arrival spread avg %llu us, max %llu us, processing delay avg %llu us, max %llu us over %llu frames",
+				(unsigned long long)(timing_stats->arrival_spread_sum_us / timing_stats->frames),
+				(unsigned long long)timing_stats->arrival_spread_max_us,
+				(unsigned long long)(timing_stats->processing_delay_sum_us / timing_stats->frames),
+				(unsigned long long)timing_stats->processing_delay_max_us,
+				(unsigned long long)timing_stats->frames);
+	}
+
 	for(size_t i=0; i<video_receiver->profiles_count; i++)
 		free(video_receiver->profiles[i].header);
-	chiaki_frame_processor_fini(&video_receiver->frame_processor);
+	for(size_t i=0; i<CHIAKI_VIDEO_RECEIVER_FRAME_SLOTS_MAX; i++)
+		chiaki_frame_processor_fini(&video_receiver->frame_slots[i].frame_processor);
 }
 
 CHIAKI_EXPORT void chiaki_video_receiver_stream_info(ChiakiVideoReceiver *video_receiver, ChiakiVideoProfile *profiles, size_t profiles_count)
@@ -50,14 +83,133 @@ CHIAKI_EXPORT void chiaki_video_receiver_stream_info(ChiakiVideoReceiver *video_
 	}
 }
 
+static bool video_receiver_frame_slot_pending(ChiakiVideoFrameSlot *slot)
+{
+	return slot->frame_index >= 0 && !slot->frame_processor.flushed;
+}
+
+static ChiakiVideoFrameSlot *video_receiver_frame_slot(ChiakiVideoReceiver *video_receiver, ChiakiSeqNum16 frame_index)
+{
+	for(size_t i=0; i<video_receiver->reorder_frames; i++)
+	{
+		ChiakiVideoFrameSlot *slot = &video_receiver->frame_slots[i];
+		if(slot->frame_index >= 0 && (ChiakiSeqNum16)slot->frame_index == frame_index)
+			return slot;
+	}
+	return NULL;
+}
+
+/**
+ * Get a slot that no pending frame is using, preferring the one with the oldest frame
+ * so late units of recently flushed frames are still counted for stats.
+ */
+static ChiakiVideoFrameSlot *video_receiver_frame_slot_free(ChiakiVideoReceiver *video_receiver)
+{
+	ChiakiVideoFrameSlot *r = NULL;
+	for(size_t i=0; i<video_receiver->reorder_frames; i++)
+	{
+		ChiakiVideoFrameSlot *slot = &video_receiver->frame_slots[i];
+		if(slot->frame_index < 0)
+			return slot;
+		if(slot->frame_processor.flushed
+			&& (!r || chiaki_seq_num_16_lt((ChiakiSeqNum16)slot->frame_index, (ChiakiSeqNum16)r->frame_index)))
+			r = slot;
+	}
+	return r;
+}
+
+/**
+ * Flush the next frame with whatever has been received of it, if anything, and continue with the one after it.
+ */
+static void video_receiver_give_up_next(ChiakiVideoReceiver *video_receiver)
+{
+	ChiakiSeqNum16 next = (ChiakiSeqNum16)video_receiver->frame_index_next;
+	ChiakiVideoFrameSlot *slot = video_receiver_frame_slot(video_receiver, next);
+	if(slot && !slot->frame_processor.flushed)
+		chiaki_video_receiver_flush_frame(video_receiver, slot);
+	video_receiver->frame_index_next = (ChiakiSeqNum16)(next + 1);
+}
+
+/**
+ * Give up on all frames before frame_index.
+ */
+static void video_receiver_give_up_until(ChiakiVideoReceiver *video_receiver, ChiakiSeqNum16 frame_index)
+{
+	// pending frames are never further apart than the slots, the rest of a large gap can be skipped at once
+	ChiakiSeqNum16 count = frame_index - (ChiakiSeqNum16)video_receiver->frame_index_next;
+	if(count > video_receiver->reorder_frames)
+		count = video_receiver->reorder_frames;
+	for(ChiakiSeqNum16 i=0; i<count; i++)
+		video_receiver_give_up_next(video_receiver);
+	video_receiver->frame_index_next = frame_index;
+}
+
+/**
+ * Flush frames in order as long as enough of them has been received.
+ */
+static void video_receiver_flush_ready(ChiakiVideoReceiver *video_receiver)
+{
+	while(true)
+	{
+		ChiakiVideoFrameSlot *slot = video_receiver_frame_slot(video_receiver, (ChiakiSeqNum16)video_receiver->frame_index_next);
+		if(!slot || slot->frame_processor.flushed || !chiaki_frame_processor_flush_possible(&slot->frame_processor))
+			return;
+		chiaki_video_receiver_flush_frame(video_receiver, slot);
+		video_receiver->frame_index_next = (ChiakiSeqNum16)(video_receiver->frame_index_next + 1);
+	}
+}
+
+/**
+ * Pass on the complete nal units at the start of the next frame that have not been passed on yet.
+ * Later frames have to wait until the next one is flushed, so the decoder always gets them in order.
+ */
+static void video_receiver_flush_slices(ChiakiVideoReceiver *video_receiver)
+{
+	ChiakiVideoFrameSlot *slot = video_receiver_frame_slot(video_receiver, (ChiakiSeqNum16)video_receiver->frame_index_next);
+	if(!slot || slot->frame_processor.flushed)
+		return;
+	ChiakiVideoSampleSegment *segments;
+	size_t segments_count;
+	size_t size;
+	if(!chiaki_frame_processor_flush_slices(&slot->frame_processor, &segments, &segments_count, &size))
+		return;
+	ChiakiSession *session = video_receiver->session;
+	if(!session->video_slice_cb(segments, segments_count, size, false, session->video_slice_cb_user))
+		slot->slices_failed = true;
+}
+
+/**
+ * @return whether a frame after the next one has been waiting for longer than the reorder window,
+ * in which case the missing units of the next frame are more likely lost than late.
+ */
+static bool video_receiver_next_timed_out(ChiakiVideoReceiver *video_receiver, uint64_t now_us)
+{
+	ChiakiSeqNum16 next = (ChiakiSeqNum16)video_receiver->frame_index_next;
+	for(size_t i=0; i<video_receiver->reorder_frames; i++)
+	{
+		ChiakiVideoFrameSlot *slot = &video_receiver->frame_slots[i];
+		if(!video_receiver_frame_slot_pending(slot) || !chiaki_seq_num_16_gt((ChiakiSeqNum16)slot->frame_index, next))
+			continue;
+		uint64_t first_us = slot->frame_processor.recv_time_first_us;
+		if(first_us && now_us >= first_us + video_receiver->reorder_window_us)
+			return true;
+	}
+	return false;
+}
+
 CHIAKI_EXPORT void chiaki_video_receiver_av_packet(ChiakiVideoReceiver *video_receiver, ChiakiTakionAVPacket *packet)
 {
 	// old frame?
 	ChiakiSeqNum16 frame_index = packet->frame_index;
-	if(video_receiver->frame_index_cur >= 0
-		&& chiaki_seq_num_16_lt(frame_index, (ChiakiSeqNum16)video_receiver->frame_index_cur))
+	if(video_receiver->frame_index_next >= 0
+		&& chiaki_seq_num_16_lt(frame_index, (ChiakiSeqNum16)video_receiver->frame_index_next))
 	{
-		CHIAKI_LOGW(video_receiver->log, "Video Receiver received old frame packet");
+		// units of frames that have already been flushed are still interesting for stats
+		ChiakiVideoFrameSlot *slot = video_receiver_frame_slot(video_receiver, frame_index);
+		if(slot)
+			chiaki_frame_processor_put_unit(&slot->frame_processor, packet);
+		else
+			CHIAKI_LOGW(video_receiver->log, "Video Receiver received old frame packet");
 		return;
 	}
 
@@ -75,51 +227,111 @@ CHIAKI_EXPORT void chiaki_video_receiver_av_packet(ChiakiVideoReceiver *video_re
 
 		ChiakiVideoProfile *profile = video_receiver->profiles + video_receiver->profile_cur;
 		CHIAKI_LOGI(video_receiver->log, "Switched to profile %d, resolution: %ux%u", video_receiver->profile_cur, profile->width, profile->height);
-		if(video_receiver->session->video_sample_cb)
-			video_receiver->session->video_sample_cb(profile->header, profile->header_sz, video_receiver->session->video_sample_cb_user);
+		ChiakiSession *session = video_receiver->session;
+		if(session->video_slice_cb)
+		{
+			ChiakiVideoSampleSegment segment = { profile->header, profile->header_sz, NULL };
+			session->video_slice_cb(&segment, 1, profile->header_sz, false, session->video_slice_cb_user);
+		}
+		else if(session->video_sample_gather_cb)
+		{
+			ChiakiVideoSampleSegment segment = { profile->header, profile->header_sz, NULL };
+			session->video_sample_gather_cb(&segment, 1, profile->header_sz, session->video_sample_gather_cb_user);
+		}
+		else if(session->video_sample_cb)
+			session->video_sample_cb(profile->header, profile->header_sz, session->video_sample_cb_user);
 	}
 
-	// next frame?
-	if(video_receiver->frame_index_cur < 0 ||
-		chiaki_seq_num_16_gt(frame_index, (ChiakiSeqNum16)video_receiver->frame_index_cur))
+	// new frame?
+	ChiakiVideoFrameSlot *slot = video_receiver_frame_slot(video_receiver, frame_index);
+	if(!slot)
 	{
-		if(video_receiver->packet_stats)
-			chiaki_frame_processor_report_packet_stats(&video_receiver->frame_processor, video_receiver->packet_stats);
+		if(video_receiver->frame_index_next < 0)
+			video_receiver->frame_index_next = frame_index;
 
-		// last frame not flushed yet?
-		if(video_receiver->frame_index_cur >= 0 && video_receiver->frame_index_prev != video_receiver->frame_index_cur)
-			chiaki_video_receiver_flush_frame(video_receiver);
+		// make room by giving up on frames that are too old to wait for
+		ChiakiSeqNum16 first_pending = frame_index - (ChiakiSeqNum16)(video_receiver->reorder_frames - 1);
+		if(chiaki_seq_num_16_gt(first_pending, (ChiakiSeqNum16)video_receiver->frame_index_next))
+			video_receiver_give_up_until(video_receiver, first_pending);
 
-		ChiakiSeqNum16 next_frame_expected = (ChiakiSeqNum16)(video_receiver->frame_index_prev_complete + 1);
-		if(chiaki_seq_num_16_gt(frame_index, next_frame_expected)
-			&& !(frame_index == 1 && video_receiver->frame_index_cur < 0)) // ok for frame 1
+		slot = video_receiver_frame_slot_free(video_receiver);
+		if(slot->frame_index >= 0)
 		{
-			CHIAKI_LOGW(video_receiver->log, "Detected missing or corrupt frame(s) from %d to %d", next_frame_expected, (int)frame_index);
-			stream_connection_send_corrupt_frame(&video_receiver->session->stream_connection, next_frame_expected, frame_index - 1);
+			if(video_receiver->packet_stats)
+				chiaki_frame_processor_report_packet_stats(&slot->frame_processor, video_receiver->packet_stats);
+			if(video_receiver->stream_stats)
+				chiaki_frame_processor_report_stream_stats(&slot->frame_processor, video_receiver->stream_stats, chiaki_time_now_monotonic_us());
 		}
 
-		video_receiver->frame_index_cur = frame_index;
-		chiaki_frame_processor_alloc_frame(&video_receiver->frame_processor, packet);
+		slot->frame_index = frame_index;
+		slot->slices_failed = false;
+		chiaki_frame_processor_alloc_frame(&slot->frame_processor, packet);
 	}
 
-	chiaki_frame_processor_put_unit(&video_receiver->frame_processor, packet);
+	chiaki_frame_processor_put_unit(&slot->frame_processor, packet);
 
-	// if we are currently building up a frame
-	if(video_receiver->frame_index_cur != video_receiver->frame_index_prev)
+	// if we already have enough for the next frames, flush them already
+	video_receiver_flush_ready(video_receiver);
+
+	if(packet->recv_time_us)
 	{
-		// if we already have enough for the whole frame, flush it already
-		if(chiaki_frame_processor_flush_possible(&video_receiver->frame_processor))
-			chiaki_video_receiver_flush_frame(video_receiver);
+		while(video_receiver_next_timed_out(video_receiver, packet->recv_time_us))
+		{
+			video_receiver_give_up_next(video_receiver);
+			video_receiver_flush_ready(video_receiver);
+		}
 	}
+
+	if(video_receiver->session->video_slice_cb)
+		video_receiver_flush_slices(video_receiver);
 }
 
 #define FLUSH_CORRUPT_FRAMES
 
-static ChiakiErrorCode chiaki_video_receiver_flush_frame(ChiakiVideoReceiver *video_receiver)
+static ChiakiErrorCode chiaki_video_receiver_flush_frame(ChiakiVideoReceiver *video_receiver, ChiakiVideoFrameSlot *slot)
 {
+	ChiakiSession *session = video_receiver->session;
+	ChiakiSeqNum16 frame_index = (ChiakiSeqNum16)slot->frame_index;
+
+	ChiakiSeqNum16 next_frame_expected = (ChiakiSeqNum16)(video_receiver->frame_index_prev_complete + 1);
+	if(chiaki_seq_num_16_gt(frame_index, next_frame_expected))
+	{
+		CHIAKI_LOGW(video_receiver->log, "Detected missing or corrupt frame(s) from %d to %d", next_frame_expected, (int)frame_index);
+		stream_connection_send_corrupt_frame(&session->stream_connection, next_frame_expected, frame_index - 1);
+	}
+
+	ChiakiFrameProcessor *frame_processor = &slot->frame_processor;
 	uint8_t *frame;
-	size_t frame_size;
-	ChiakiFrameProcessorFlushResult flush_result = chiaki_frame_processor_flush(&video_receiver->frame_processor, &frame, &frame_size);
+	ChiakiVideoSampleSegment *segments;
+	size_t segments_count;
+	size_t frame_size = 0;
+	ChiakiFrameProcessorFlushResult flush_result = session->video_slice_cb || session->video_sample_gather_cb
+		? chiaki_frame_processor_flush_segments(frame_processor, &segments, &segments_count, &frame_size)
+		: chiaki_frame_processor_flush(frame_processor, &frame, &frame_size);
+	// whatever has already been passed on as slices is part of the frame as well
+	size_t frame_size_total = frame_size + frame_processor->slices_size;
+
+	bool timing_known = frame_processor->recv_time_first_us != 0;
+	if(timing_known)
+	{
+		// frames that could not be completed still tell how late they arrived
+		stream_connection_push_frame_arrival(&session->stream_connection, frame_index,
+				frame_processor->recv_time_first_us, frame_processor->recv_time_last_us,
+				flush_result == CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FAILED ? 0 : frame_size_total);
+	}
+
+	if(video_receiver->stream_stats)
+	{
+		bool failed = flush_result == CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FAILED || flush_result == CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_FAILED;
+		bool passed_on = flush_result != CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FAILED
+#ifndef FLUSH_CORRUPT_FRAMES
+			&& flush_result != CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_FAILED
+#endif
+			;
+		chiaki_stream_stats_push_frame(video_receiver->stream_stats, chiaki_time_now_monotonic_us(),
+				frame_index, frame_processor->recv_time_first_us,
+				passed_on ? frame_size_total : 0, flush_result != CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_SUCCESS, failed);
+	}
 
 	if(flush_result == CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FAILED
 #ifndef FLUSH_CORRUPT_FRAMES
@@ -127,17 +339,46 @@ static ChiakiErrorCode chiaki_video_receiver_flush_frame(ChiakiVideoReceiver *vi
 #endif
 		)
 	{
-		CHIAKI_LOGW(video_receiver->log, "Failed to complete frame %d", (int)video_receiver->frame_index_cur);
+		CHIAKI_LOGW(video_receiver->log, "Failed to complete frame %d", (int)frame_index);
+		// the decoder must not wait for the rest of a frame it has already started on
+		if(session->video_slice_cb && frame_processor->slices_size)
+			session->video_slice_cb(NULL, 0, 0, true, session->video_slice_cb_user);
+		chiaki_frame_processor_release_units(frame_processor);
 		return CHIAKI_ERR_UNKNOWN;
 	}
 
 	// TODO: Error Concealment on CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_FAILED
 
-	bool succ = flush_result != CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_FAILED;
+	bool succ = flush_result != CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_FAILED && !slot->slices_failed;
+
+	ChiakiVideoFrameTiming timing;
+	if(timing_known)
+	{
+		uint64_t now = chiaki_time_now_monotonic_us();
+		timing.frame_index = frame_index;
+		timing.units_received = frame_processor->units_source_received + frame_processor->units_fec_received;
+		timing.arrival_spread_us = frame_processor->recv_time_last_us - frame_processor->recv_time_first_us;
+		timing.processing_delay_us = now > frame_processor->recv_time_last_us ? now - frame_processor->recv_time_last_us : 0;
+
+		ChiakiVideoFrameTimingStats *timing_stats = &video_receiver->frame_timing_stats;
+		timing_stats->frames++;
+		timing_stats->arrival_spread_sum_us += timing.arrival_spread_us;
+		if(timing.arrival_spread_us > timing_stats->arrival_spread_max_us)
+			timing_stats->arrival_spread_max_us = timing.arrival_spread_us;
+		timing_stats->processing_delay_sum_us += timing.processing_delay_us;
+		if(timing.processing_delay_us > timing_stats->processing_delay_max_us)
+			timing_stats->processing_delay_max_us = timing.processing_delay_us;
+	}
 
-	if(video_receiver->session->video_sample_cb)
+	if(session->video_slice_cb || session->video_sample_gather_cb || session->video_sample_cb)
 	{
-		bool cb_succ = video_receiver->session->video_sample_cb(frame, frame_size, video_receiver->session->video_sample_cb_user);
+		bool cb_succ;
+		if(session->video_slice_cb)
+			cb_succ = session->video_slice_cb(segments, segments_count, frame_size, true, session->video_slice_cb_user);
+		else if(session->video_sample_gather_cb)
+			cb_succ = session->video_sample_gather_cb(segments, segments_count, frame_size, session->video_sample_gather_cb_user);
+		else
+			cb_succ = session->video_sample_cb(frame, frame_size, session->video_sample_cb_user);
 		if(!cb_succ)
 		{
 			succ = false;
@@ -145,10 +386,14 @@ static ChiakiErrorCode chiaki_video_receiver_flush_frame(ChiakiVideoReceiver *vi
 		}
 	}
 
-	video_receiver->frame_index_prev = video_receiver->frame_index_cur;
+	// the slot may not be reused for a while, its units would keep buffers of the receive pool until then
+	chiaki_frame_processor_release_units(frame_processor);
+
+	if(timing_known && session->video_frame_timing_cb)
+		session->video_frame_timing_cb(&timing, session->video_frame_timing_cb_user);
 
 	if(succ)
-		video_receiver->frame_index_prev_complete = video_receiver->frame_index_cur;
+		video_receiver->frame_index_prev_complete = frame_index;
 
 	return CHIAKI_ERR_SUCCESS;
 }
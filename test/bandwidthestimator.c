@@ -0,0 +1,137 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/bandwidthestimator.h>
+
+#define FPS 60
+#define FRAME_INTERVAL_US (1000000 / FPS)
+#define FRAME_SIZE 10000 // 4.8 Mbit/s at 60 fps
+#define RECEIVED_KBPS (FRAME_SIZE * 8 * FPS / 1000)
+
+/**
+ * Push frames that are sent every FRAME_INTERVAL_US but each arrive delay_increase_us later than the one before.
+ */
+static void push_frames(ChiakiBandwidthEstimator *estimator, ChiakiSeqNum16 *frame_index, uint64_t *arrival_us,
+		size_t count, uint64_t delay_increase_us)
+{
+	for(size_t i=0; i<count; i++)
+	{
+		chiaki_bandwidth_estimator_push_frame(estimator, *frame_index, *arrival_us, *arrival_us + 2000, FRAME_SIZE);
+		(*frame_index)++;
+		*arrival_us += FRAME_INTERVAL_US + delay_increase_us;
+	}
+}
+
+static MunitResult test_bandwidth_estimator_steady(const MunitParameter params[], void *user)
+{
+	ChiakiBandwidthEstimator estimator;
+	chiaki_bandwidth_estimator_init(&estimator, FPS, 15000);
+	munit_assert_uint64(estimator.estimate.bitrate_kbps, ==, 0);
+
+	ChiakiSeqNum16 frame_index = 0xfff0; // also wrap around
+	uint64_t arrival_us = 1000000;
+	push_frames(&estimator, &frame_index, &arrival_us, FPS * 3, 0);
+
+	ChiakiBandwidthEstimate *estimate = &estimator.estimate;
+	munit_assert_int(estimate->usage, ==, CHIAKI_BANDWIDTH_USAGE_NORMAL);
+	munit_assert_uint64(estimate->received_kbps, >=, RECEIVED_KBPS * 95 / 100);
+	munit_assert_uint64(estimate->received_kbps, <=, RECEIVED_KBPS * 105 / 100);
+	munit_assert_uint64(estimate->bitrate_kbps, >=, estimate->received_kbps);
+	munit_assert_uint64(estimate->bitrate_kbps, <=, 15000);
+
+	// old or duplicate frames are ignored
+	uint64_t bitrate = estimate->bitrate_kbps;
+	chiaki_bandwidth_estimator_push_frame(&estimator, frame_index - 10, arrival_us, arrival_us, FRAME_SIZE * 100);
+	chiaki_bandwidth_estimator_push_frame(&estimator, frame_index - 1, arrival_us, arrival_us, FRAME_SIZE * 100);
+	munit_assert_uint64(estimator.rate_window_bytes % FRAME_SIZE, ==, 0);
+	munit_assert_uint64(estimate->bitrate_kbps, ==, bitrate);
+
+	return MUNIT_OK;
+}
+
+static MunitResult test_bandwidth_estimator_overuse(const MunitParameter params[], void *user)
+{
+	ChiakiBandwidthEstimator estimator;
+	chiaki_bandwidth_estimator_init(&estimator, FPS, 0);
+
+	ChiakiSeqNum16 frame_index = 0;
+	uint64_t arrival_us = 1000000;
+	push_frames(&estimator, &frame_index, &arrival_us, FPS * 2, 0);
+	ChiakiBandwidthEstimate *estimate = &estimator.estimate;
+	munit_assert_int(estimate->usage, ==, CHIAKI_BANDWIDTH_USAGE_NORMAL);
+	uint64_t bitrate = estimate->bitrate_kbps;
+	munit_assert_uint64(bitrate, >, 0);
+
+	// a queue building up by 2 ms per frame must be detected within half a second, long before it would overflow
+	size_t frames = 0;
+	while(estimate->usage != CHIAKI_BANDWIDTH_USAGE_OVERUSE)
+	{
+		munit_assert_size(frames, <, FPS / 2);
+		push_frames(&estimator, &frame_index, &arrival_us, 1, 2000);
+		frames++;
+	}
+	munit_assert_double(estimate->delay_trend, >, estimate->delay_threshold);
+	munit_assert_uint64(estimate->bitrate_kbps, <, bitrate);
+	munit_assert_uint64(estimate->bitrate_kbps, <, estimate->received_kbps);
+
+	// once the queue drains and stays empty, usage goes back to normal
+	push_frames(&estimator, &frame_index, &arrival_us, FPS / 4, 0);
+	munit_assert_int(estimate->usage, !=, CHIAKI_BANDWIDTH_USAGE_OVERUSE);
+	push_frames(&estimator, &frame_index, &arrival_us, FPS * 2, 0);
+	munit_assert_int(estimate->usage, ==, CHIAKI_BANDWIDTH_USAGE_NORMAL);
+
+	return MUNIT_OK;
+}
+
+static MunitResult test_bandwidth_estimator_loss(const MunitParameter params[], void *user)
+{
+	ChiakiBandwidthEstimator estimator;
+	chiaki_bandwidth_estimator_init(&estimator, FPS, 0);
+
+	ChiakiSeqNum16 frame_index = 0;
+	uint64_t arrival_us = 1000000;
+	push_frames(&estimator, &frame_index, &arrival_us, FPS * 2, 0);
+	ChiakiBandwidthEstimate *estimate = &estimator.estimate;
+	uint64_t bitrate = estimate->bitrate_kbps;
+
+	// a little loss is left to fec
+	chiaki_bandwidth_estimator_push_loss(&estimator, 990, 10, arrival_us);
+	munit_assert_double(estimate->loss_ratio, ==, 0.01);
+	munit_assert_uint64(estimate->bitrate_kbps, ==, bitrate);
+
+	chiaki_bandwidth_estimator_push_loss(&estimator, 800, 200, arrival_us);
+	munit_assert_double(estimate->loss_ratio, ==, 0.2);
+	munit_assert_uint64(estimate->bitrate_kbps, >=, bitrate * 9 / 10 - 1);
+	munit_assert_uint64(estimate->bitrate_kbps, <=, bitrate * 9 / 10);
+
+	return MUNIT_OK;
+}
+
+MunitTest tests_bandwidth_estimator[] = {
+	{
+		"/steady",
+		test_bandwidth_estimator_steady,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/overuse",
+		test_bandwidth_estimator_overuse,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/loss",
+		test_bandwidth_estimator_loss,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
@@ -67,6 +67,135 @@ static MunitResult test_fec(const MunitParameter params[], void *test_user)
 	return test_fec_case(&fec_test_cases[test_case_id]);
 }
 
+static MunitResult test_fec_bitmatrix(const MunitParameter params[], void *test_user)
+{
+	chiaki_fec_set_engine(CHIAKI_FEC_ENGINE_BITMATRIX);
+	MunitResult result = MUNIT_OK;
+	for(size_t i=0; fec_test_case_ids[i] && result == MUNIT_OK; i++)
+		result = test_fec_case(&fec_test_cases[i]);
+	chiaki_fec_set_engine(CHIAKI_FEC_ENGINE_MATRIX);
+	return result;
+}
+
+static MunitResult test_fec_encode(const MunitParameter params[], void *test_user)
+{
+	const unsigned int k = 7;
+	const unsigned int m = 3;
+	const size_t unit_size = 0x51;
+	const size_t stride = ((unit_size + 0xf) / 0x10) * 0x10;
+
+	uint8_t *frame_buffer = calloc(k + m, stride);
+	munit_assert_not_null(frame_buffer);
+	uint8_t *frame_buffer_ref = calloc(k, stride);
+	munit_assert_not_null(frame_buffer_ref);
+
+	for(size_t i=0; i<k; i++)
+		munit_rand_memory(unit_size, frame_buffer + i * stride);
+	memcpy(frame_buffer_ref, frame_buffer, k * stride);
+
+	ChiakiErrorCode err = chiaki_fec_encode(frame_buffer, unit_size, stride, k, m);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	// lose as many units as there are fec units
+	const unsigned int erasures[] = { 0, 4, 8 };
+	for(size_t i=0; i<sizeof(erasures) / sizeof(erasures[0]); i++)
+		memset(frame_buffer + stride * erasures[i], 0x42, unit_size);
+
+	err = chiaki_fec_decode(frame_buffer, unit_size, stride, k, m, erasures, sizeof(erasures) / sizeof(erasures[0]));
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	for(size_t i=0; i<k; i++)
+		munit_assert_memory_equal(unit_size, frame_buffer + i * stride, frame_buffer_ref + i * stride);
+
+	free(frame_buffer_ref);
+	free(frame_buffer);
+	return MUNIT_OK;
+}
+
+static void fec_cache_decode(uint8_t *frame_buffer, const uint8_t *frame_buffer_ref, size_t unit_size, size_t stride,
+		unsigned int k, unsigned int m, const unsigned int *erasures, size_t erasures_count)
+{
+	// erased fec units are not restored
+	memcpy(frame_buffer, frame_buffer_ref, (k + m) * stride);
+	for(size_t i=0; i<erasures_count; i++)
+		memset(frame_buffer + stride * erasures[i], 0x42, unit_size);
+	ChiakiErrorCode err = chiaki_fec_decode(frame_buffer, unit_size, stride, k, m, erasures, erasures_count);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	for(size_t i=0; i<k; i++)
+		munit_assert_memory_equal(unit_size, frame_buffer + i * stride, frame_buffer_ref + i * stride);
+}
+
+static MunitResult test_fec_cache(const MunitParameter params[], void *test_user)
+{
+	const unsigned int k = 12;
+	const unsigned int m = 4;
+	const size_t unit_size = 0x40;
+	const size_t stride = unit_size;
+
+	ChiakiErrorCode err = chiaki_fec_cache_init();
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	uint8_t *frame_buffer = calloc(k + m, stride);
+	munit_assert_not_null(frame_buffer);
+	uint8_t *frame_buffer_ref = calloc(k + m, stride);
+	munit_assert_not_null(frame_buffer_ref);
+	for(size_t i=0; i<k; i++)
+		munit_rand_memory(unit_size, frame_buffer_ref + i * stride);
+
+	ChiakiFecCacheStats stats_before;
+	chiaki_fec_cache_stats(&stats_before);
+	err = chiaki_fec_encode(frame_buffer_ref, unit_size, stride, k, m);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	// same erasures twice, order and duplicates don't matter
+	const unsigned int erasures_a[] = { 1, 5, 13 };
+	const unsigned int erasures_b[] = { 13, 5, 1, 5 };
+	const unsigned int erasures_c[] = { 0, 1, 2, 3 };
+	fec_cache_decode(frame_buffer, frame_buffer_ref, unit_size, stride, k, m, erasures_a, 3);
+	fec_cache_decode(frame_buffer, frame_buffer_ref, unit_size, stride, k, m, erasures_b, 4);
+	fec_cache_decode(frame_buffer, frame_buffer_ref, unit_size, stride, k, m, erasures_c, 4);
+
+	ChiakiFecCacheStats stats;
+	chiaki_fec_cache_stats(&stats);
+	munit_assert_uint64(stats.decoding_misses - stats_before.decoding_misses, ==, 2);
+	munit_assert_uint64(stats.decoding_hits - stats_before.decoding_hits, ==, 1);
+	// the encode and the decoding matrix of erasures_c can reuse the coding matrix of erasures_a
+	munit_assert_uint64(stats.coding_hits + stats.coding_misses - stats_before.coding_hits - stats_before.coding_misses, ==, 3);
+	munit_assert_uint64(stats.coding_hits - stats_before.coding_hits, >=, 2);
+
+	// lost fec units only need nothing restored
+	const unsigned int erasures_fec[] = { 12, 15 };
+	err = chiaki_fec_decode(frame_buffer, unit_size, stride, k, m, erasures_fec, 2);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	chiaki_fec_cache_stats(&stats_before);
+	munit_assert_uint64(stats_before.decoding_hits + stats_before.decoding_misses, ==, stats.decoding_hits + stats.decoding_misses);
+
+	const unsigned int erasures_many[] = { 0, 1, 2, 3, 4 };
+	err = chiaki_fec_decode(frame_buffer, unit_size, stride, k, m, erasures_many, 5);
+	munit_assert_int(err, ==, CHIAKI_ERR_FEC_FAILED);
+
+	// more erasure patterns than fit into the cache
+	for(unsigned int i=0; i<CHIAKI_FEC_CACHE_DECODING_ENTRIES * 2; i++)
+	{
+		const unsigned int erasures[] = { i % k, (i / k + i + 1) % k };
+		fec_cache_decode(frame_buffer, frame_buffer_ref, unit_size, stride, k, m, erasures, 2);
+	}
+
+	// schedules are cached separately
+	chiaki_fec_set_engine(CHIAKI_FEC_ENGINE_BITMATRIX);
+	chiaki_fec_cache_stats(&stats_before);
+	fec_cache_decode(frame_buffer, frame_buffer_ref, unit_size, stride, k, m, erasures_a, 3);
+	fec_cache_decode(frame_buffer, frame_buffer_ref, unit_size, stride, k, m, erasures_b, 4);
+	chiaki_fec_set_engine(CHIAKI_FEC_ENGINE_MATRIX);
+	chiaki_fec_cache_stats(&stats);
+	munit_assert_uint64(stats.schedule_misses - stats_before.schedule_misses, ==, 1);
+	munit_assert_uint64(stats.schedule_hits - stats_before.schedule_hits, ==, 1);
+
+	free(frame_buffer_ref);
+	free(frame_buffer);
+	return MUNIT_OK;
+}
+
 MunitTest tests_fec[] = {
 	{
 		"/fec",
@@ -76,5 +205,29 @@ MunitTest tests_fec[] = {
 		MUNIT_TEST_OPTION_NONE,
 		fec_params
 	},
+	{
+		"/fec_bitmatrix",
+		test_fec_bitmatrix,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/fec_encode",
+		test_fec_encode,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/fec_cache",
+		test_fec_cache,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
 	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
 };
@@ -0,0 +1,407 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/frameprocessor.h>
+#include <chiaki/fec.h>
+
+#include <string.h>
+
+#ifndef _WIN32
+#include <arpa/inet.h>
+#endif
+
+#include "test_log.h"
+
+#define CHUNK_SIZE 200
+#define UNIT_SIZE (CHUNK_SIZE + 2)
+#define UNIT_STRIDE (((UNIT_SIZE + 0xf) / 0x10) * 0x10)
+#define UNITS_MAX 32
+
+typedef struct test_frame_t
+{
+	uint8_t buf[UNITS_MAX * UNIT_STRIDE];
+	unsigned int k;
+	unsigned int m;
+	size_t unit_last_size;
+} TestFrame;
+
+/**
+ * Split au into units the way the console does, with the size of the padding in front of each unit, and add m fec units.
+ */
+static void test_frame_build(TestFrame *frame, const uint8_t *au, size_t au_size, unsigned int m)
+{
+	memset(frame->buf, 0, sizeof(frame->buf));
+	frame->k = (unsigned int)((au_size + CHUNK_SIZE - 1) / CHUNK_SIZE);
+	frame->m = m;
+	munit_assert_uint(frame->k + frame->m, <=, UNITS_MAX);
+	for(unsigned int i=0; i<frame->k; i++)
+	{
+		uint8_t *unit = frame->buf + i * UNIT_STRIDE;
+		size_t part_size = au_size - i * CHUNK_SIZE;
+		if(part_size > CHUNK_SIZE)
+			part_size = CHUNK_SIZE;
+		*((chiaki_unaligned_uint16_t *)unit) = htons((uint16_t)(CHUNK_SIZE - part_size));
+		memcpy(unit + 2, au + i * CHUNK_SIZE, part_size);
+		frame->unit_last_size = part_size + 2;
+	}
+	ChiakiErrorCode err = chiaki_fec_encode(frame->buf, UNIT_SIZE, UNIT_STRIDE, frame->k, frame->m);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+}
+
+static void test_frame_packet(TestFrame *frame, ChiakiSeqNum16 frame_index, unsigned int unit_index, ChiakiTakionAVPacket *packet)
+{
+	memset(packet, 0, sizeof(*packet));
+	packet->is_video = true;
+	packet->frame_index = frame_index;
+	packet->unit_index = unit_index;
+	packet->units_in_frame_total = frame->k + frame->m;
+	packet->units_in_frame_fec = frame->m;
+	packet->data = frame->buf + unit_index * UNIT_STRIDE;
+	packet->data_size = unit_index == frame->k - 1 ? frame->unit_last_size : UNIT_SIZE;
+}
+
+/**
+ * Pass all units of frame except the lost ones to frame_processor.
+ */
+static void test_frame_put(ChiakiFrameProcessor *frame_processor, TestFrame *frame, ChiakiSeqNum16 frame_index, const bool *lost)
+{
+	bool allocated = false;
+	for(unsigned int i=0; i<frame->k + frame->m; i++)
+	{
+		if(lost && lost[i])
+			continue;
+		ChiakiTakionAVPacket packet;
+		test_frame_packet(frame, frame_index, i, &packet);
+		ChiakiErrorCode err;
+		if(!allocated)
+		{
+			err = chiaki_frame_processor_alloc_frame(frame_processor, &packet);
+			munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+			allocated = true;
+		}
+		err = chiaki_frame_processor_put_unit(frame_processor, &packet);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	}
+}
+
+/**
+ * Pass all units of frame except the lost ones to frame_processor and flush it.
+ */
+static ChiakiFrameProcessorFlushResult test_frame_process(ChiakiFrameProcessor *frame_processor, TestFrame *frame,
+		ChiakiSeqNum16 frame_index, const bool *lost, uint8_t **out, size_t *out_size)
+{
+	test_frame_put(frame_processor, frame, frame_index, lost);
+	return chiaki_frame_processor_flush(frame_processor, out, out_size);
+}
+
+/**
+ * Like test_frame_process(), but flush into segments and gather them into out.
+ */
+static ChiakiFrameProcessorFlushResult test_frame_process_segments(ChiakiFrameProcessor *frame_processor, TestFrame *frame,
+		ChiakiSeqNum16 frame_index, const bool *lost, uint8_t *out, size_t *out_size, size_t *segments_count)
+{
+	test_frame_put(frame_processor, frame, frame_index, lost);
+	ChiakiVideoSampleSegment *segments;
+	size_t frame_size;
+	ChiakiFrameProcessorFlushResult result = chiaki_frame_processor_flush_segments(frame_processor, &segments, segments_count, &frame_size);
+	if(result == CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FAILED)
+		return result;
+	size_t cur = 0;
+	for(size_t i=0; i<*segments_count; i++)
+	{
+		munit_assert_size(cur + segments[i].size, <=, frame_size);
+		memcpy(out + cur, segments[i].data, segments[i].size);
+		cur += segments[i].size;
+	}
+	munit_assert_size(cur, ==, frame_size);
+	*out_size = frame_size;
+	return result;
+}
+
+static MunitResult test_frame_processor_fec_reuse(const MunitParameter params[], void *user)
+{
+	ChiakiFrameProcessor frame_processor;
+	chiaki_frame_processor_init(&frame_processor, get_test_log());
+
+	// fill the frame buffer with a big frame first, so nothing in it is zero anymore
+	uint8_t au_big[CHUNK_SIZE * 20];
+	memset(au_big, 0xff, sizeof(au_big));
+	TestFrame frame;
+	test_frame_build(&frame, au_big, sizeof(au_big), 4);
+	uint8_t *out;
+	size_t out_size;
+	ChiakiFrameProcessorFlushResult result = test_frame_process(&frame_processor, &frame, 1, NULL, &out, &out_size);
+	munit_assert_int(result, ==, CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_SUCCESS);
+	munit_assert_size(out_size, ==, sizeof(au_big));
+	munit_assert_memory_equal(sizeof(au_big), out, au_big);
+	for(size_t i=0; i<CHIAKI_VIDEO_BUFFER_PADDING_SIZE; i++)
+		munit_assert_uint8(out[out_size + i], ==, 0);
+
+	// the last unit of a smaller frame is short, so fec only works if the rest of its slot is zeroed again
+	uint8_t au[CHUNK_SIZE * 5 + 17];
+	for(size_t i=0; i<sizeof(au); i++)
+		au[i] = (uint8_t)(i * 7 + 3);
+	test_frame_build(&frame, au, sizeof(au), 3);
+	bool lost[UNITS_MAX] = { 0 };
+	lost[0] = true;
+	lost[frame.k - 2] = true;
+	lost[frame.k] = true;
+	result = test_frame_process(&frame_processor, &frame, 2, lost, &out, &out_size);
+	munit_assert_int(result, ==, CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_SUCCESS);
+	munit_assert_size(out_size, ==, sizeof(au));
+	munit_assert_memory_equal(sizeof(au), out, au);
+
+	// too many lost units
+	lost[1] = true;
+	result = test_frame_process(&frame_processor, &frame, 3, lost, &out, &out_size);
+	munit_assert_int(result, ==, CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_FAILED);
+
+	chiaki_frame_processor_fini(&frame_processor);
+	return MUNIT_OK;
+}
+
+static MunitResult test_frame_processor_units(const MunitParameter params[], void *user)
+{
+	ChiakiFrameProcessor frame_processor;
+	chiaki_frame_processor_init(&frame_processor, get_test_log());
+
+	uint8_t au[CHUNK_SIZE * 10];
+	memset(au, 0x42, sizeof(au));
+	TestFrame frame;
+	test_frame_build(&frame, au, sizeof(au), 2);
+
+	ChiakiTakionAVPacket packet;
+	test_frame_packet(&frame, 1, 3, &packet);
+	ChiakiErrorCode err = chiaki_frame_processor_alloc_frame(&frame_processor, &packet);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	size_t capacity = frame_processor.unit_slots_capacity;
+	munit_assert_size(capacity, ==, frame.k + frame.m);
+	err = chiaki_frame_processor_put_unit(&frame_processor, &packet);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	err = chiaki_frame_processor_put_unit(&frame_processor, &packet);
+	munit_assert_int(err, ==, CHIAKI_ERR_INVALID_DATA);
+	munit_assert_uint(frame_processor.units_source_received, ==, 1);
+
+	// lost units show up as bursts
+	for(unsigned int i=5; i<frame.k + frame.m; i++)
+	{
+		test_frame_packet(&frame, 1, i, &packet);
+		err = chiaki_frame_processor_put_unit(&frame_processor, &packet);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	}
+	ChiakiStreamStats stats;
+	chiaki_stream_stats_init(&stats);
+	chiaki_stream_stats_reset(&stats, 60);
+	chiaki_frame_processor_report_stream_stats(&frame_processor, &stats, 1000000);
+	ChiakiStreamStatsSnapshot snapshot;
+	chiaki_stream_stats_snapshot(&stats, 1000000, &snapshot);
+	munit_assert_uint64(snapshot.window_short.units_lost, ==, 4);
+	munit_assert_uint64(snapshot.window_short.bursts[chiaki_stream_stats_burst_bucket(3)], ==, 1);
+	munit_assert_uint64(snapshot.window_short.bursts[chiaki_stream_stats_burst_bucket(1)], ==, 1);
+
+	// a smaller frame keeps the allocation and starts without any units
+	uint8_t au_small[CHUNK_SIZE * 2];
+	memset(au_small, 0x23, sizeof(au_small));
+	test_frame_build(&frame, au_small, sizeof(au_small), 1);
+	uint8_t *out;
+	size_t out_size;
+	ChiakiFrameProcessorFlushResult result = test_frame_process(&frame_processor, &frame, 2, NULL, &out, &out_size);
+	munit_assert_int(result, ==, CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_SUCCESS);
+	munit_assert_size(frame_processor.unit_slots_capacity, ==, capacity);
+	munit_assert_uint(frame_processor.units_source_received, ==, frame.k);
+	munit_assert_size(out_size, ==, sizeof(au_small));
+	munit_assert_memory_equal(sizeof(au_small), out, au_small);
+
+	chiaki_frame_processor_fini(&frame_processor);
+	return MUNIT_OK;
+}
+
+static MunitResult test_frame_processor_flush_segments(const MunitParameter params[], void *user)
+{
+	ChiakiFrameProcessor frame_processor;
+	chiaki_frame_processor_init(&frame_processor, get_test_log());
+
+	uint8_t au[CHUNK_SIZE * 7 + 55];
+	for(size_t i=0; i<sizeof(au); i++)
+		au[i] = (uint8_t)(i * 13 + 1);
+	TestFrame frame;
+	test_frame_build(&frame, au, sizeof(au), 3);
+
+	// one segment per unit, nothing compacted
+	uint8_t out[sizeof(au)];
+	size_t out_size;
+	size_t segments_count;
+	ChiakiFrameProcessorFlushResult result = test_frame_process_segments(&frame_processor, &frame, 1, NULL,
+			out, &out_size, &segments_count);
+	munit_assert_int(result, ==, CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_SUCCESS);
+	munit_assert_size(segments_count, ==, frame.k);
+	munit_assert_size(out_size, ==, sizeof(au));
+	munit_assert_memory_equal(sizeof(au), out, au);
+
+	// units restored by fec are segments too
+	bool lost[UNITS_MAX] = { 0 };
+	lost[1] = true;
+	lost[frame.k - 1] = true;
+	result = test_frame_process_segments(&frame_processor, &frame, 2, lost, out, &out_size, &segments_count);
+	munit_assert_int(result, ==, CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_SUCCESS);
+	munit_assert_size(segments_count, ==, frame.k);
+	munit_assert_size(out_size, ==, sizeof(au));
+	munit_assert_memory_equal(sizeof(au), out, au);
+
+	// a frame that can't be restored leaves out the lost units
+	lost[2] = true;
+	lost[3] = true;
+	result = test_frame_process_segments(&frame_processor, &frame, 3, lost, out, &out_size, &segments_count);
+	munit_assert_int(result, ==, CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_FAILED);
+	munit_assert_size(segments_count, ==, frame.k - 4);
+
+	chiaki_frame_processor_fini(&frame_processor);
+	return MUNIT_OK;
+}
+
+/**
+ * Append the segments of a flush to out.
+ */
+static size_t test_gather(uint8_t *out, size_t out_size, ChiakiVideoSampleSegment *segments, size_t segments_count)
+{
+	for(size_t i=0; i<segments_count; i++)
+	{
+		memcpy(out + out_size, segments[i].data, segments[i].size);
+		out_size += segments[i].size;
+	}
+	return out_size;
+}
+
+static bool test_nal_start(const size_t *nal_starts, size_t nal_count, size_t offset)
+{
+	for(size_t i=0; i<nal_count; i++)
+	{
+		if(nal_starts[i] == offset)
+			return true;
+	}
+	return false;
+}
+
+static MunitResult test_frame_processor_flush_slices(const MunitParameter params[], void *user)
+{
+	ChiakiFrameProcessor frame_processor;
+	chiaki_frame_processor_init(&frame_processor, get_test_log());
+
+	// an access unit of nal units with 4 and 3 byte start codes
+	static const size_t nal_sizes[] = { 150, 420, 90, 700, 333, 60 };
+	const size_t nal_count = sizeof(nal_sizes) / sizeof(nal_sizes[0]);
+	uint8_t au[CHUNK_SIZE * UNITS_MAX];
+	size_t nal_starts[sizeof(nal_sizes) / sizeof(nal_sizes[0])];
+	size_t au_size = 0;
+	for(size_t i=0; i<nal_count; i++)
+	{
+		nal_starts[i] = au_size;
+		if(i % 2 == 0)
+			au[au_size++] = 0;
+		au[au_size++] = 0;
+		au[au_size++] = 0;
+		au[au_size++] = 1;
+		for(size_t j=0; j<nal_sizes[i]; j++)
+			au[au_size++] = (uint8_t)(0x80 | (i * 31 + j * 7));
+	}
+	TestFrame frame;
+	test_frame_build(&frame, au, au_size, 2);
+
+	ChiakiTakionAVPacket packet;
+	test_frame_packet(&frame, 1, 0, &packet);
+	ChiakiErrorCode err = chiaki_frame_processor_alloc_frame(&frame_processor, &packet);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	// slices are complete nal units, as far as units have been received without gaps
+	const unsigned int lost = 4;
+	uint8_t out[sizeof(au)];
+	size_t out_size = 0;
+	for(unsigned int i=0; i<frame.k + frame.m; i++)
+	{
+		if(i == lost)
+			continue;
+		test_frame_packet(&frame, 1, i, &packet);
+		err = chiaki_frame_processor_put_unit(&frame_processor, &packet);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+		ChiakiVideoSampleSegment *segments;
+		size_t segments_count;
+		size_t size;
+		if(!chiaki_frame_processor_flush_slices(&frame_processor, &segments, &segments_count, &size))
+			continue;
+		munit_assert_size(size, >, 0);
+		size_t out_size_prev = out_size;
+		out_size = test_gather(out, out_size, segments, segments_count);
+		munit_assert_size(out_size - out_size_prev, ==, size);
+		munit_assert_size(out_size, <=, lost * CHUNK_SIZE);
+		munit_assert_true(test_nal_start(nal_starts, nal_count, out_size));
+	}
+	munit_assert_size(out_size, >, 0);
+	munit_assert_size(frame_processor.slices_size, ==, out_size);
+	munit_assert_memory_equal(out_size, out, au);
+
+	// the rest of the frame after fec
+	ChiakiVideoSampleSegment *segments;
+	size_t segments_count;
+	size_t frame_size;
+	ChiakiFrameProcessorFlushResult result = chiaki_frame_processor_flush_segments(&frame_processor, &segments, &segments_count, &frame_size);
+	munit_assert_int(result, ==, CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_SUCCESS);
+	out_size = test_gather(out, out_size, segments, segments_count);
+	munit_assert_size(out_size, ==, au_size);
+	munit_assert_memory_equal(au_size, out, au);
+
+	// compacting after slices returns only the rest as well
+	out_size = 0;
+	test_frame_put(&frame_processor, &frame, 2, NULL);
+	munit_assert_true(chiaki_frame_processor_flush_slices(&frame_processor, &segments, &segments_count, &frame_size));
+	munit_assert_size(frame_size, ==, nal_starts[nal_count - 1]);
+	out_size = test_gather(out, out_size, segments, segments_count);
+	munit_assert_false(chiaki_frame_processor_flush_slices(&frame_processor, &segments, &segments_count, &frame_size));
+	uint8_t *rest;
+	result = chiaki_frame_processor_flush(&frame_processor, &rest, &frame_size);
+	munit_assert_int(result, ==, CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_SUCCESS);
+	memcpy(out + out_size, rest, frame_size);
+	out_size += frame_size;
+	munit_assert_size(out_size, ==, au_size);
+	munit_assert_memory_equal(au_size, out, au);
+
+	chiaki_frame_processor_fini(&frame_processor);
+	return MUNIT_OK;
+}
+
+MunitTest tests_frame_processor[] = {
+	{
+		"/fec_reuse",
+		test_frame_processor_fec_reuse,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/units",
+		test_frame_processor_units,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/flush_segments",
+		test_frame_processor_flush_segments,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/flush_slices",
+		test_frame_processor_flush_slices,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
@@ -0,0 +1,104 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/gf256.h>
+
+#include <galois.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#define SRCS_MAX 300 // more than the tables of one pass
+#define SIZE_MAX_TEST 1400
+
+static MunitResult test_gf256_mul(const MunitParameter params[], void *user)
+{
+	// must be identical to Jerasure, or fec units of the console can't be used
+	galois_init_default_field(8);
+	for(unsigned int a=0; a<0x100; a++)
+	{
+		for(unsigned int b=0; b<0x100; b++)
+			munit_assert_uint8(chiaki_gf256_mul((uint8_t)a, (uint8_t)b), ==, (uint8_t)galois_single_multiply(a, b, 8));
+	}
+	return MUNIT_OK;
+}
+
+static void dotprod_ref(uint8_t *dst, const uint8_t *const *srcs, const uint8_t *coefs, size_t count, size_t size)
+{
+	for(size_t i=0; i<size; i++)
+	{
+		uint8_t acc = 0;
+		for(size_t j=0; j<count; j++)
+			acc ^= chiaki_gf256_mul(coefs[j], srcs[j][i]);
+		dst[i] = acc;
+	}
+}
+
+static MunitResult test_gf256_dotprod(const MunitParameter params[], void *user)
+{
+	uint8_t *buf = malloc(SRCS_MAX * SIZE_MAX_TEST);
+	munit_assert_not_null(buf);
+	munit_rand_memory(SRCS_MAX * SIZE_MAX_TEST, buf);
+	const uint8_t *srcs[SRCS_MAX];
+	uint8_t coefs[SRCS_MAX];
+	for(size_t j=0; j<SRCS_MAX; j++)
+	{
+		// unaligned sources
+		srcs[j] = buf + j * SIZE_MAX_TEST + (j % 3);
+		coefs[j] = (uint8_t)munit_rand_uint32();
+	}
+	coefs[0] = 0;
+	coefs[1] = 1;
+
+	uint8_t ref[SIZE_MAX_TEST];
+	uint8_t dst[SIZE_MAX_TEST + 1];
+	// sizes that leave over tails for each vector width
+	static const size_t sizes[] = { 0, 1, 15, 16, 17, 31, 48, 63, 64, 65, 127, 200, SIZE_MAX_TEST - 2 };
+	static const size_t counts[] = { 0, 1, 2, 7, 40, SRCS_MAX };
+	size_t tested = 0;
+	for(int impl=0; impl<CHIAKI_GF256_IMPL_COUNT; impl++)
+	{
+		if(!chiaki_gf256_impl_supported((ChiakiGf256Impl)impl))
+			continue;
+		for(size_t c=0; c<sizeof(counts) / sizeof(counts[0]); c++)
+		{
+			for(size_t s=0; s<sizeof(sizes) / sizeof(sizes[0]); s++)
+			{
+				dotprod_ref(ref, srcs, coefs, counts[c], sizes[s]);
+				memset(dst, 0x42, sizeof(dst));
+				chiaki_gf256_dotprod((ChiakiGf256Impl)impl, dst + 1, srcs, coefs, counts[c], sizes[s]);
+				munit_assert_memory_equal(sizes[s], dst + 1, ref);
+				munit_assert_uint8(dst[0], ==, 0x42);
+				if(sizes[s] < SIZE_MAX_TEST)
+					munit_assert_uint8(dst[1 + sizes[s]], ==, 0x42);
+			}
+		}
+		tested++;
+	}
+	munit_assert_size(tested, >=, 1);
+	munit_assert_true(chiaki_gf256_impl_supported(chiaki_gf256_impl_best()));
+
+	free(buf);
+	return MUNIT_OK;
+}
+
+MunitTest tests_gf256[] = {
+	{
+		"/mul",
+		test_gf256_mul,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/dotprod",
+		test_gf256_dotprod,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
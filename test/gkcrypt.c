@@ -4,6 +4,13 @@
 
 #include <chiaki/ecdh.h>
 #include <chiaki/gkcrypt.h>
+#include <chiaki/session.h>
+#include <chiaki/thread.h>
+#include <chiaki/time.h>
+
+#include "../lib/src/atomic.h"
+
+#define KEY_BUF_WAIT_TIMEOUT_US (5 * 1000 * 1000)
 
 static MunitResult test_ecdh(const MunitParameter params[], void *user)
 {
@@ -215,6 +222,7 @@ static MunitResult test_gmac(const MunitParameter params[], void *user)
 		return MUNIT_ERROR;
 
 	munit_assert_memory_equal(sizeof(gmac), gmac, gmac_expected);
+	chiaki_gkcrypt_fini(&gkcrypt);
 
 	// High
 	memset(&gkcrypt, 0, sizeof(gkcrypt));
@@ -230,6 +238,7 @@ static MunitResult test_gmac(const MunitParameter params[], void *user)
 		return MUNIT_ERROR;
 
 	munit_assert_memory_equal(sizeof(gmac), gmac, gmac_expected_high);
+	chiaki_gkcrypt_fini(&gkcrypt);
 
 	return MUNIT_OK;
 }
@@ -316,6 +325,7 @@ static MunitResult test_gmac_split(const MunitParameter params[], void *user)
 		return MUNIT_ERROR;
 
 	munit_assert_memory_equal(sizeof(gmac), gmac, gmac_expected);
+	chiaki_gkcrypt_fini(&gkcrypt);
 
 	// High
 	memset(&gkcrypt, 0, sizeof(gkcrypt));
@@ -331,6 +341,7 @@ static MunitResult test_gmac_split(const MunitParameter params[], void *user)
 		return MUNIT_ERROR;
 
 	munit_assert_memory_equal(sizeof(gmac), gmac, gmac_expected_high);
+	chiaki_gkcrypt_fini(&gkcrypt);
 
 	return MUNIT_OK;
 }
@@ -379,6 +390,399 @@ static MunitResult test_gmac_multiple_of_key_refresh(const MunitParameter params
 	return MUNIT_OK;
 }
 
+static MunitResult test_gmac_ctxs(const MunitParameter params[], void *user)
+{
+	uint8_t handshake_key[CHIAKI_HANDSHAKE_KEY_SIZE];
+	uint8_t ecdh_secret[CHIAKI_ECDH_SECRET_SIZE];
+	uint8_t data[0x200];
+	munit_rand_memory(sizeof(handshake_key), handshake_key);
+	munit_rand_memory(sizeof(ecdh_secret), ecdh_secret);
+	munit_rand_memory(sizeof(data), data);
+
+	// older key indices around refreshes, and ones that have been evicted from the contexts long ago
+	static const uint64_t key_indices[] = { 0, 1, 0, 1, 2, 1, 3, 4, 5, 2, 6, 0, 6, 5 };
+
+	ChiakiLog log;
+	ChiakiGKCrypt gkcrypt;
+	ChiakiErrorCode err = chiaki_gkcrypt_init(&gkcrypt, &log, 0, 2, handshake_key, ecdh_secret);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	for(size_t i=0; i<sizeof(key_indices) / sizeof(key_indices[0]); i++)
+	{
+		uint64_t key_pos = key_indices[i] * CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_KEY_POS + 0x10 * (i + 1);
+		uint8_t gmac[CHIAKI_GKCRYPT_GMAC_SIZE];
+		err = chiaki_gkcrypt_gmac(&gkcrypt, key_pos, data, sizeof(data), gmac);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+		// must be the same as with a fresh instance that keys everything just for this one
+		ChiakiGKCrypt gkcrypt_fresh;
+		err = chiaki_gkcrypt_init(&gkcrypt_fresh, &log, 0, 2, handshake_key, ecdh_secret);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		uint8_t gmac_fresh[CHIAKI_GKCRYPT_GMAC_SIZE];
+		err = chiaki_gkcrypt_gmac(&gkcrypt_fresh, key_pos, data, sizeof(data), gmac_fresh);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		chiaki_gkcrypt_fini(&gkcrypt_fresh);
+
+		munit_assert_memory_equal(sizeof(gmac), gmac, gmac_fresh);
+	}
+	munit_assert_uint64(gkcrypt.key_gmac_index_current, ==, 6);
+	chiaki_gkcrypt_fini(&gkcrypt);
+
+	return MUNIT_OK;
+}
+
+static MunitResult test_impls(const MunitParameter params[], void *user)
+{
+	uint8_t handshake_key[CHIAKI_HANDSHAKE_KEY_SIZE];
+	uint8_t ecdh_secret[CHIAKI_ECDH_SECRET_SIZE];
+	uint8_t data[0x600];
+	munit_rand_memory(sizeof(handshake_key), handshake_key);
+	munit_rand_memory(sizeof(ecdh_secret), ecdh_secret);
+	munit_rand_memory(sizeof(data), data);
+
+	// sizes with every kind of tail for 4 blocks at a time, and a full packet
+	static const size_t sizes[] = { 0, 1, 15, 16, 17, 48, 63, 64, 65, 79, 80, 111, 128, 200, 1400 };
+	#define SIZES_COUNT (sizeof(sizes) / sizeof(sizes[0]))
+	uint64_t key_pos[SIZES_COUNT];
+	const uint8_t *bufs[SIZES_COUNT];
+	for(size_t i=0; i<SIZES_COUNT; i++)
+	{
+		// around key refreshes and back
+		key_pos[i] = (i % 3) * CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_KEY_POS + i * 0x111;
+		bufs[i] = data + i;
+	}
+
+	ChiakiLog log;
+	ChiakiGKCrypt ref;
+	chiaki_gkcrypt_set_impl(CHIAKI_GKCRYPT_IMPL_BACKEND);
+	ChiakiErrorCode err = chiaki_gkcrypt_init(&ref, &log, 0, 3, handshake_key, ecdh_secret);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	for(int impl=CHIAKI_GKCRYPT_IMPL_BACKEND+1; impl<CHIAKI_GKCRYPT_IMPL_COUNT; impl++)
+	{
+		if(!chiaki_gkcrypt_impl_supported((ChiakiGKCryptImpl)impl))
+			continue;
+		chiaki_gkcrypt_set_impl((ChiakiGKCryptImpl)impl);
+		ChiakiGKCrypt gkcrypt;
+		err = chiaki_gkcrypt_init(&gkcrypt, &log, 0, 3, handshake_key, ecdh_secret);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+		uint8_t buf[sizeof(data)];
+		uint8_t buf_ref[sizeof(data)];
+		err = chiaki_gkcrypt_gen_key_stream(&gkcrypt, 0x12340, buf, sizeof(buf));
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		err = chiaki_gkcrypt_gen_key_stream(&ref, 0x12340, buf_ref, sizeof(buf_ref));
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		munit_assert_memory_equal(sizeof(buf), buf, buf_ref);
+
+		uint8_t gmacs[SIZES_COUNT][CHIAKI_GKCRYPT_GMAC_SIZE];
+		uint8_t *gmacs_out[SIZES_COUNT];
+		for(size_t i=0; i<SIZES_COUNT; i++)
+		{
+			memcpy(buf, data, sizes[i]);
+			memcpy(buf_ref, data, sizes[i]);
+			err = chiaki_gkcrypt_decrypt(&gkcrypt, key_pos[i], buf, sizes[i]);
+			munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+			err = chiaki_gkcrypt_decrypt(&ref, key_pos[i], buf_ref, sizes[i]);
+			munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+			munit_assert_memory_equal(sizes[i], buf, buf_ref);
+
+			uint8_t gmac[CHIAKI_GKCRYPT_GMAC_SIZE];
+			uint8_t gmac_ref[CHIAKI_GKCRYPT_GMAC_SIZE];
+			err = chiaki_gkcrypt_gmac(&gkcrypt, key_pos[i], bufs[i], sizes[i], gmac);
+			munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+			err = chiaki_gkcrypt_gmac(&ref, key_pos[i], bufs[i], sizes[i], gmac_ref);
+			munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+			munit_assert_memory_equal(sizeof(gmac), gmac, gmac_ref);
+			gmacs_out[i] = gmacs[i];
+		}
+
+		// all of them at once must give the same as one by one
+		uint8_t gmacs_single[SIZES_COUNT][CHIAKI_GKCRYPT_GMAC_SIZE];
+		for(size_t i=0; i<SIZES_COUNT; i++)
+		{
+			err = chiaki_gkcrypt_gmac(&ref, key_pos[i], bufs[i], sizes[i], gmacs_single[i]);
+			munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		}
+		err = chiaki_gkcrypt_gmac_multi(&gkcrypt, SIZES_COUNT, key_pos, bufs, sizes, gmacs_out);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		munit_assert_memory_equal(sizeof(gmacs), gmacs, gmacs_single);
+
+		chiaki_gkcrypt_fini(&gkcrypt);
+	}
+	#undef SIZES_COUNT
+
+	chiaki_gkcrypt_fini(&ref);
+	chiaki_gkcrypt_set_impl(chiaki_gkcrypt_impl_best());
+
+	return MUNIT_OK;
+}
+
+static MunitResult test_verify_decrypt(const MunitParameter params[], void *user)
+{
+	uint8_t handshake_key[CHIAKI_HANDSHAKE_KEY_SIZE];
+	uint8_t ecdh_secret[CHIAKI_ECDH_SECRET_SIZE];
+	uint8_t data[0x600];
+	munit_rand_memory(sizeof(handshake_key), handshake_key);
+	munit_rand_memory(sizeof(ecdh_secret), ecdh_secret);
+	munit_rand_memory(sizeof(data), data);
+
+	// less than one piece up to several, with the key stream at any offset to the gmac blocks
+	static const size_t sizes[] = { 0x20, 0x100, 0x123, 0x301, 0x578, 0x600 };
+	static const size_t decrypt_offsets[] = { 0, 0x13, 0x20 };
+	static const uint64_t key_pos[] = { 0, 0x11, CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_KEY_POS + 0x345 };
+
+	ChiakiLog log;
+	chiaki_log_init(&log, CHIAKI_LOG_ERROR, NULL, NULL);
+	ChiakiGKCrypt ref;
+	chiaki_gkcrypt_set_impl(CHIAKI_GKCRYPT_IMPL_BACKEND);
+	ChiakiErrorCode err = chiaki_gkcrypt_init(&ref, &log, 0, 3, handshake_key, ecdh_secret);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	for(int impl=0; impl<CHIAKI_GKCRYPT_IMPL_COUNT; impl++)
+	{
+		if(!chiaki_gkcrypt_impl_supported((ChiakiGKCryptImpl)impl))
+			continue;
+		chiaki_gkcrypt_set_impl((ChiakiGKCryptImpl)impl);
+		for(size_t key_buf_chunks=0; key_buf_chunks<=2; key_buf_chunks+=2)
+		{
+			ChiakiGKCrypt gkcrypt;
+			err = chiaki_gkcrypt_init(&gkcrypt, &log, key_buf_chunks, 3, handshake_key, ecdh_secret);
+			munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+			for(size_t s=0; s<sizeof(sizes) / sizeof(sizes[0]); s++)
+			{
+				for(size_t o=0; o<sizeof(decrypt_offsets) / sizeof(decrypt_offsets[0]); o++)
+				{
+					for(size_t k=0; k<sizeof(key_pos) / sizeof(key_pos[0]); k++)
+					{
+						size_t size = sizes[s];
+						size_t decrypt_offset = decrypt_offsets[o];
+						uint64_t decrypt_key_pos = key_pos[k] + CHIAKI_GKCRYPT_BLOCK_SIZE + o;
+
+						uint8_t buf_ref[sizeof(data)];
+						uint8_t gmac_ref[CHIAKI_GKCRYPT_GMAC_SIZE];
+						memcpy(buf_ref, data, size);
+						err = chiaki_gkcrypt_gmac(&ref, key_pos[k], buf_ref, size, gmac_ref);
+						munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+						err = chiaki_gkcrypt_decrypt(&ref, decrypt_key_pos, buf_ref + decrypt_offset, size - decrypt_offset);
+						munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+						uint8_t buf[sizeof(data)];
+						uint8_t gmac[CHIAKI_GKCRYPT_GMAC_SIZE];
+						memcpy(buf, data, size);
+						err = chiaki_gkcrypt_verify_decrypt(&gkcrypt, key_pos[k], buf, size, decrypt_offset, decrypt_key_pos, gmac_ref, gmac);
+						munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+						munit_assert_memory_equal(sizeof(gmac), gmac, gmac_ref);
+						munit_assert_memory_equal(size, buf, buf_ref);
+
+						gmac_ref[0] ^= 1;
+						memcpy(buf, data, size);
+						err = chiaki_gkcrypt_verify_decrypt(&gkcrypt, key_pos[k], buf, size, decrypt_offset, decrypt_key_pos, gmac_ref, NULL);
+						munit_assert_int(err, ==, CHIAKI_ERR_INVALID_MAC);
+					}
+				}
+			}
+
+			chiaki_gkcrypt_fini(&gkcrypt);
+		}
+	}
+
+	chiaki_gkcrypt_fini(&ref);
+	chiaki_gkcrypt_set_impl(chiaki_gkcrypt_impl_best());
+
+	return MUNIT_OK;
+}
+
+/**
+ * Wait until the key buffer thread has generated the key stream up to key_pos_end.
+ */
+static void wait_key_buf_covers(ChiakiGKCrypt *gkcrypt, uint64_t key_pos_end)
+{
+	uint64_t start = chiaki_time_now_monotonic_us();
+	while(chiaki_atomic_load_acquire(&gkcrypt->key_buf_key_pos_max) < key_pos_end)
+	{
+		munit_assert_uint64(chiaki_time_now_monotonic_us() - start, <, KEY_BUF_WAIT_TIMEOUT_US);
+		chiaki_thread_yield();
+	}
+}
+
+/**
+ * Wait until the key buffer thread goes to sleep.
+ *
+ * @return the lead it went to sleep with, see gkcrypt_thread_func()
+ */
+static uint64_t wait_key_buf_lead(ChiakiGKCrypt *gkcrypt)
+{
+	uint64_t start = chiaki_time_now_monotonic_us();
+	while(true)
+	{
+		// the thread only releases the mutex while it is awake and generating or sleeping on the cond
+		chiaki_mutex_lock(&gkcrypt->key_buf_mutex);
+		uint64_t wake_key_pos = chiaki_atomic_load_relaxed(&gkcrypt->key_buf_wake_key_pos);
+		uint64_t max = chiaki_atomic_load_relaxed(&gkcrypt->key_buf_key_pos_max);
+		chiaki_mutex_unlock(&gkcrypt->key_buf_mutex);
+		if(wake_key_pos != UINT64_MAX)
+			return (max - wake_key_pos) * 2;
+		munit_assert_uint64(chiaki_time_now_monotonic_us() - start, <, KEY_BUF_WAIT_TIMEOUT_US);
+		chiaki_thread_yield();
+	}
+}
+
+static MunitResult test_key_buf(const MunitParameter params[], void *user)
+{
+	uint8_t handshake_key[CHIAKI_HANDSHAKE_KEY_SIZE];
+	uint8_t ecdh_secret[CHIAKI_ECDH_SECRET_SIZE];
+	munit_rand_memory(sizeof(handshake_key), handshake_key);
+	munit_rand_memory(sizeof(ecdh_secret), ecdh_secret);
+
+	ChiakiLog log;
+	chiaki_log_init(&log, CHIAKI_LOG_ERROR, NULL, NULL);
+	ChiakiGKCrypt ref;
+	ChiakiErrorCode err = chiaki_gkcrypt_init(&ref, &log, 0, 3, handshake_key, ecdh_secret);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	ChiakiGKCrypt gkcrypt;
+	// the lead leaves at least 2 of the 8 chunks for older key stream, so reclaiming a chunk at a time
+	// never reaches the packets swapped back by 0x800
+	err = chiaki_gkcrypt_init(&gkcrypt, &log, 8, 3, handshake_key, ecdh_secret);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	// packets in order through the ring many times, some of them swapped, then a jump far ahead
+	uint64_t requests = 0;
+	ChiakiGKCryptKeyBufStats stats_in_order;
+	uint64_t key_pos = 0x21;
+	for(size_t i=0; i<2000; i++)
+	{
+		size_t size = 1 + (size_t)munit_rand_int_range(0, 1400);
+		uint64_t pos = key_pos;
+		if(i == 1500)
+		{
+			chiaki_gkcrypt_key_buf_stats(&gkcrypt, &stats_in_order);
+			pos = key_pos = 0x100000000ull + 0x42;
+		}
+		else if(i % 7 == 0 && i)
+			pos -= 0x800;
+
+		if(!(i % 2))
+		{
+			// get_key_stream() falls back to chiaki_gkcrypt_gen_key_stream(), which takes whole blocks only
+			pos -= pos % CHIAKI_GKCRYPT_BLOCK_SIZE;
+			size = ((size + CHIAKI_GKCRYPT_BLOCK_SIZE - 1) / CHIAKI_GKCRYPT_BLOCK_SIZE) * CHIAKI_GKCRYPT_BLOCK_SIZE;
+		}
+
+		// the thread only has to keep up with the requests before the jump
+		if(i < 1500)
+			wait_key_buf_covers(&gkcrypt, pos + size);
+
+		uint8_t buf[1408];
+		uint8_t buf_ref[sizeof(buf)];
+		munit_rand_memory(size, buf);
+		memcpy(buf_ref, buf, size);
+		if(i % 2)
+			err = chiaki_gkcrypt_decrypt(&gkcrypt, pos, buf, size);
+		else
+			err = chiaki_gkcrypt_get_key_stream(&gkcrypt, pos, buf, size);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		requests++;
+		// without a key buf, the reference generates every key stream itself
+		if(i % 2)
+			err = chiaki_gkcrypt_decrypt(&ref, pos, buf_ref, size);
+		else
+			err = chiaki_gkcrypt_get_key_stream(&ref, pos, buf_ref, size);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		munit_assert_memory_equal(size, buf, buf_ref);
+		key_pos += size;
+	}
+
+	ChiakiGKCryptKeyBufStats stats;
+	chiaki_gkcrypt_key_buf_stats(&gkcrypt, &stats);
+	munit_assert_uint64(stats.hits + stats.misses, ==, requests);
+	// everything before the jump was already generated and not reclaimed yet
+	munit_assert_uint64(stats_in_order.hits, ==, 1500);
+	munit_assert_uint64(stats_in_order.misses, ==, 0);
+
+	chiaki_gkcrypt_fini(&gkcrypt);
+	chiaki_gkcrypt_fini(&ref);
+
+	return MUNIT_OK;
+}
+
+static MunitResult test_key_buf_prefill(const MunitParameter params[], void *user)
+{
+	uint8_t handshake_key[CHIAKI_HANDSHAKE_KEY_SIZE];
+	uint8_t ecdh_secret[CHIAKI_ECDH_SECRET_SIZE];
+	munit_rand_memory(sizeof(handshake_key), handshake_key);
+	munit_rand_memory(sizeof(ecdh_secret), ecdh_secret);
+
+	ChiakiLog log;
+	chiaki_log_init(&log, CHIAKI_LOG_ERROR, NULL, NULL);
+	ChiakiGKCrypt gkcrypt;
+	ChiakiErrorCode err = chiaki_gkcrypt_init(&gkcrypt, &log, CHIAKI_GKCRYPT_KEY_BUF_BLOCKS_DEFAULT, 3, handshake_key, ecdh_secret);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	// no waiting for the thread, the first quarter of the buffer is generated by init
+	size_t lead_min = gkcrypt.key_buf_size / 4;
+	uint64_t requests = 0;
+	uint8_t buf[1408];
+	uint8_t buf_ref[sizeof(buf)];
+	for(uint64_t key_pos = 0; key_pos + sizeof(buf) <= lead_min; key_pos += sizeof(buf))
+	{
+		err = chiaki_gkcrypt_get_key_stream(&gkcrypt, key_pos, buf, sizeof(buf));
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		requests++;
+		err = chiaki_gkcrypt_gen_key_stream(&gkcrypt, key_pos, buf_ref, sizeof(buf_ref));
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		munit_assert_memory_equal(sizeof(buf), buf, buf_ref);
+	}
+
+	ChiakiGKCryptKeyBufStats stats;
+	chiaki_gkcrypt_key_buf_stats(&gkcrypt, &stats);
+	munit_assert_uint64(requests, >, 0);
+	munit_assert_uint64(stats.hits, ==, requests);
+	munit_assert_uint64(stats.misses, ==, 0);
+
+	chiaki_gkcrypt_fini(&gkcrypt);
+
+	return MUNIT_OK;
+}
+
+static MunitResult test_key_buf_lead(const MunitParameter params[], void *user)
+{
+	uint8_t handshake_key[CHIAKI_HANDSHAKE_KEY_SIZE];
+	uint8_t ecdh_secret[CHIAKI_ECDH_SECRET_SIZE];
+	munit_rand_memory(sizeof(handshake_key), handshake_key);
+	munit_rand_memory(sizeof(ecdh_secret), ecdh_secret);
+
+	ChiakiLog log;
+	chiaki_log_init(&log, CHIAKI_LOG_ERROR, NULL, NULL);
+	ChiakiGKCrypt gkcrypt;
+	ChiakiErrorCode err = chiaki_gkcrypt_init(&gkcrypt, &log, 16, 3, handshake_key, ecdh_secret);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	uint64_t lead_min = gkcrypt.key_buf_size / 4;
+	uint64_t lead_max = gkcrypt.key_buf_size - lead_min;
+
+	// nothing requested yet, so the estimated rate is 0 and the lead is clamped to its minimum
+	uint64_t lead = wait_key_buf_lead(&gkcrypt);
+	munit_assert_uint64(chiaki_atomic_load_relaxed(&gkcrypt.key_buf_key_pos_max), ==, gkcrypt.key_buf_size);
+	munit_assert_uint64(lead, ==, lead_min);
+
+	// let the next sample cover some time, then request a lot at once
+	uint64_t start = chiaki_time_now_monotonic_us();
+	while(chiaki_time_now_monotonic_us() - start < 20000)
+		chiaki_thread_yield();
+	uint64_t key_pos = gkcrypt.key_buf_size * 64;
+	uint8_t buf[CHIAKI_GKCRYPT_BLOCK_SIZE];
+	err = chiaki_gkcrypt_get_key_stream(&gkcrypt, key_pos, buf, sizeof(buf));
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	// the rate is far beyond what fits into the buffer, so the lead grows up to leaving only the minimum behind it
+	lead = wait_key_buf_lead(&gkcrypt);
+	munit_assert_uint64(chiaki_atomic_load_relaxed(&gkcrypt.key_buf_key_pos_max), ==, key_pos + gkcrypt.key_buf_size);
+	munit_assert_uint64(lead, ==, lead_max);
+
+	chiaki_gkcrypt_fini(&gkcrypt);
+
+	return MUNIT_OK;
+}
 
 MunitTest tests_gkcrypt[] = {
 	{
@@ -437,5 +841,53 @@ MunitTest tests_gkcrypt[] = {
 		MUNIT_TEST_OPTION_NONE,
 		NULL
 	},
+	{
+		"/gmac_ctxs",
+		test_gmac_ctxs,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/impls",
+		test_impls,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/verify_decrypt",
+		test_verify_decrypt,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/key_buf",
+		test_key_buf,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/key_buf_prefill",
+		test_key_buf_prefill,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/key_buf_lead",
+		test_key_buf_lead,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
 	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
 };
\ No newline at end of file
@@ -5,11 +5,18 @@
 extern MunitTest tests_seq_num[];
 extern MunitTest tests_key_state[];
 extern MunitTest tests_reorder_queue[];
+extern MunitTest tests_spsc_ring[];
+extern MunitTest tests_packet_buf[];
 extern MunitTest tests_http[];
 extern MunitTest tests_rpcrypt[];
 extern MunitTest tests_gkcrypt[];
 extern MunitTest tests_takion[];
 extern MunitTest tests_fec[];
+extern MunitTest tests_gf256[];
+extern MunitTest tests_frame_processor[];
+extern MunitTest tests_video_receiver[];
+extern MunitTest tests_bandwidth_estimator[];
+extern MunitTest tests_stream_stats[];
 extern MunitTest tests_regist[];
 
 static MunitSuite suites[] = {
@@ -34,6 +41,20 @@ static MunitSuite suites[] = {
 		1,
 		MUNIT_SUITE_OPTION_NONE
 	},
+	{
+		"/spsc_ring",
+		tests_spsc_ring,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/packet_buf",
+		tests_packet_buf,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
 	{
 		"/http",
 		tests_http,
@@ -69,6 +90,41 @@ static MunitSuite suites[] = {
 		1,
 		MUNIT_SUITE_OPTION_NONE
 	},
+	{
+		"/gf256",
+		tests_gf256,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/frame_processor",
+		tests_frame_processor,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/video_receiver",
+		tests_video_receiver,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/bandwidth_estimator",
+		tests_bandwidth_estimator,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/stream_stats",
+		tests_stream_stats,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
 	{
 		"/regist",
 		tests_regist,
@@ -0,0 +1,138 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/packetbuf.h>
+
+#include <string.h>
+
+#define BUF_SIZE 64
+
+static MunitResult test_pool_free_outstanding(const MunitParameter params[], void *user)
+{
+	ChiakiPacketBufPool *pool = chiaki_packet_buf_pool_new(2, BUF_SIZE);
+	munit_assert_not_null(pool);
+
+	ChiakiPacketBuf *buf = chiaki_packet_buf_pool_acquire(pool, NULL);
+	munit_assert_not_null(buf);
+	ChiakiPacketBuf *extra = chiaki_packet_buf_pool_acquire(pool, NULL);
+	munit_assert_not_null(extra);
+	memset(buf->data, 0x42, buf->size);
+
+	// the buffers stay valid after the pool is gone, the last unref frees everything
+	chiaki_packet_buf_pool_free(pool);
+	chiaki_packet_buf_unref(extra);
+	munit_assert_uint8(buf->data[0], ==, 0x42);
+	munit_assert_uint8(buf->data[buf->size - 1], ==, 0x42);
+	chiaki_packet_buf_unref(buf);
+
+	return MUNIT_OK;
+}
+
+static MunitResult test_pool_exhausted(const MunitParameter params[], void *user)
+{
+	ChiakiPacketBufPool *pool = chiaki_packet_buf_pool_new(1, BUF_SIZE);
+	munit_assert_not_null(pool);
+
+	bool exhausted = true;
+	ChiakiPacketBuf *pooled = chiaki_packet_buf_pool_acquire(pool, &exhausted);
+	munit_assert_not_null(pooled);
+	munit_assert_false(exhausted);
+	munit_assert_true(pooled->pooled);
+
+	// no more preallocated buffers, so one is allocated separately
+	ChiakiPacketBuf *buf = chiaki_packet_buf_pool_acquire(pool, &exhausted);
+	munit_assert_not_null(buf);
+	munit_assert_true(exhausted);
+	munit_assert_false(buf->pooled);
+	munit_assert_ptr_equal(buf->pool, pool);
+	munit_assert_size(buf->size, ==, BUF_SIZE);
+	munit_assert_uint(buf->refcount, ==, 1);
+	memset(buf->data, 0x42, buf->size);
+
+	// it is freed instead of being added to the pool, so the pool is still exhausted afterwards
+	chiaki_packet_buf_unref(buf);
+	exhausted = false;
+	buf = chiaki_packet_buf_pool_acquire(pool, &exhausted);
+	munit_assert_not_null(buf);
+	munit_assert_true(exhausted);
+	munit_assert_false(buf->pooled);
+	chiaki_packet_buf_unref(buf);
+
+	// while the preallocated one goes back
+	chiaki_packet_buf_unref(pooled);
+	buf = chiaki_packet_buf_pool_acquire(pool, &exhausted);
+	munit_assert_false(exhausted);
+	munit_assert_ptr_equal(buf, pooled);
+	chiaki_packet_buf_unref(buf);
+
+	chiaki_packet_buf_pool_free(pool);
+	return MUNIT_OK;
+}
+
+static MunitResult test_refcount(const MunitParameter params[], void *user)
+{
+	ChiakiPacketBufPool *pool = chiaki_packet_buf_pool_new(1, BUF_SIZE);
+	munit_assert_not_null(pool);
+
+	ChiakiPacketBuf *buf = chiaki_packet_buf_pool_acquire(pool, NULL);
+	munit_assert_not_null(buf);
+	munit_assert_uint(buf->refcount, ==, 1);
+
+	for(unsigned int i=0; i<3; i++)
+	{
+		chiaki_packet_buf_ref(buf);
+		munit_assert_uint(buf->refcount, ==, 2 + i);
+	}
+	for(unsigned int i=0; i<3; i++)
+	{
+		chiaki_packet_buf_unref(buf);
+		munit_assert_uint(buf->refcount, ==, 3 - i);
+	}
+
+	// still referenced, so the pool is empty
+	bool exhausted = false;
+	ChiakiPacketBuf *other = chiaki_packet_buf_pool_acquire(pool, &exhausted);
+	munit_assert_true(exhausted);
+	chiaki_packet_buf_unref(other);
+
+	// the last unref gives it back
+	chiaki_packet_buf_unref(buf);
+	munit_assert_uint(buf->refcount, ==, 0);
+	other = chiaki_packet_buf_pool_acquire(pool, &exhausted);
+	munit_assert_false(exhausted);
+	munit_assert_ptr_equal(other, buf);
+	munit_assert_uint(other->refcount, ==, 1);
+	chiaki_packet_buf_unref(other);
+
+	chiaki_packet_buf_pool_free(pool);
+	return MUNIT_OK;
+}
+
+MunitTest tests_packet_buf[] = {
+	{
+		"/pool_free_outstanding",
+		test_pool_free_outstanding,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/pool_exhausted",
+		test_pool_exhausted,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/refcount",
+		test_refcount,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
@@ -171,6 +171,74 @@ static MunitResult test_reorder_queue_16(const MunitParameter params[], void *te
 	return MUNIT_OK;
 }
 
+static MunitResult test_reorder_queue_received_ranges(const MunitParameter params[], void *test_user)
+{
+	ChiakiReorderQueue queue;
+	ChiakiErrorCode err = chiaki_reorder_queue_init_32(&queue, 4, 0xfffffffe);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	DropRecord drop_record = { 0 };
+	chiaki_reorder_queue_set_drop_cb(&queue, drop, &drop_record);
+
+	ChiakiReorderQueueRange ranges[8];
+	munit_assert_size(chiaki_reorder_queue_received_ranges(&queue, ranges, 8), ==, 0);
+
+	// 0xfffffffe missing, then 0xffffffff..0 received, 1 missing, 2 received, 3..4 missing, 5..6 received
+	chiaki_reorder_queue_push(&queue, 0xffffffff, (void *)1);
+	chiaki_reorder_queue_push(&queue, 0, (void *)2);
+	chiaki_reorder_queue_push(&queue, 2, (void *)3);
+	chiaki_reorder_queue_push(&queue, 6, (void *)4);
+	chiaki_reorder_queue_push(&queue, 5, (void *)5);
+	munit_assert_uint64(chiaki_reorder_queue_count(&queue), ==, 9);
+
+	size_t ranges_count = chiaki_reorder_queue_received_ranges(&queue, ranges, 8);
+	munit_assert_size(ranges_count, ==, 3);
+	munit_assert_uint64(ranges[0].start, ==, 1);
+	munit_assert_uint64(ranges[0].end, ==, 2);
+	munit_assert_uint64(ranges[1].start, ==, 4);
+	munit_assert_uint64(ranges[1].end, ==, 4);
+	munit_assert_uint64(ranges[2].start, ==, 7);
+	munit_assert_uint64(ranges[2].end, ==, 8);
+
+	// truncated to ranges_max
+	munit_assert_size(chiaki_reorder_queue_received_ranges(&queue, ranges, 2), ==, 2);
+	munit_assert_uint64(ranges[1].start, ==, 4);
+
+	// dropping the last element must remove it from the ranges and shrink the queue
+	chiaki_reorder_queue_drop(&queue, 8);
+	munit_assert_uint64(drop_record.count[4], ==, 1);
+	munit_assert_uint64(chiaki_reorder_queue_count(&queue), ==, 8);
+	ranges_count = chiaki_reorder_queue_received_ranges(&queue, ranges, 8);
+	munit_assert_size(ranges_count, ==, 3);
+	munit_assert_uint64(ranges[2].start, ==, 7);
+	munit_assert_uint64(ranges[2].end, ==, 7);
+
+	// dropping one in the middle splits its range
+	chiaki_reorder_queue_drop(&queue, 1);
+	munit_assert_uint64(drop_record.count[1], ==, 1);
+	ranges_count = chiaki_reorder_queue_received_ranges(&queue, ranges, 8);
+	munit_assert_size(ranges_count, ==, 3);
+	munit_assert_uint64(ranges[0].start, ==, 2);
+	munit_assert_uint64(ranges[0].end, ==, 2);
+
+	// filling the first gap pulls everything up to the next one
+	chiaki_reorder_queue_push(&queue, 0xfffffffe, (void *)6);
+	uint64_t seq_num;
+	void *user;
+	munit_assert(chiaki_reorder_queue_pull(&queue, &seq_num, &user));
+	munit_assert_uint64(seq_num, ==, 0xfffffffe);
+	munit_assert(!chiaki_reorder_queue_pull(&queue, &seq_num, &user));
+	ranges_count = chiaki_reorder_queue_received_ranges(&queue, ranges, 8);
+	munit_assert_size(ranges_count, ==, 3);
+	munit_assert_uint64(ranges[0].start, ==, 1);
+	munit_assert_uint64(ranges[0].end, ==, 1);
+
+	munit_assert(!drop_record.failed);
+	chiaki_reorder_queue_fini(&queue);
+
+	return MUNIT_OK;
+}
+
 
 MunitTest tests_reorder_queue[] = {
 	{
@@ -181,5 +249,13 @@ MunitTest tests_reorder_queue[] = {
 		MUNIT_TEST_OPTION_NONE,
 		NULL
 	},
+	{
+		"/reorder_queue_received_ranges",
+		test_reorder_queue_received_ranges,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
 	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
 };
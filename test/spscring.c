@@ -0,0 +1,114 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/spscring.h>
+
+static MunitResult test_spsc_ring_basic(const MunitParameter params[], void *test_user)
+{
+	ChiakiSpscRing ring;
+	ChiakiErrorCode err = chiaki_spsc_ring_init(&ring, 3, sizeof(uint32_t));
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_size(chiaki_spsc_ring_capacity(&ring), ==, 4);
+	munit_assert_size(chiaki_spsc_ring_count(&ring), ==, 0);
+
+	uint32_t v = 0;
+	munit_assert(!chiaki_spsc_ring_pop(&ring, &v));
+
+	// wrap around a few times
+	uint32_t next_push = 0;
+	uint32_t next_pop = 0;
+	for(size_t round=0; round<5; round++)
+	{
+		for(size_t i=0; i<4; i++)
+		{
+			munit_assert(chiaki_spsc_ring_push(&ring, &next_push));
+			next_push++;
+		}
+		munit_assert(!chiaki_spsc_ring_push(&ring, &next_push));
+		munit_assert_size(chiaki_spsc_ring_count(&ring), ==, 4);
+
+		for(size_t i=0; i<3; i++)
+		{
+			munit_assert(chiaki_spsc_ring_pop(&ring, &v));
+			munit_assert_uint32(v, ==, next_pop);
+			next_pop++;
+		}
+		munit_assert_size(chiaki_spsc_ring_count(&ring), ==, 1);
+		munit_assert(chiaki_spsc_ring_pop(&ring, &v));
+		munit_assert_uint32(v, ==, next_pop);
+		next_pop++;
+		munit_assert(!chiaki_spsc_ring_pop(&ring, &v));
+	}
+
+	munit_assert_size(chiaki_spsc_ring_high_water(&ring), ==, 4);
+
+	// pushed elements are still delivered after close
+	munit_assert(chiaki_spsc_ring_push(&ring, &next_push));
+	chiaki_spsc_ring_close(&ring);
+	err = chiaki_spsc_ring_pop_wait(&ring, &v);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_uint32(v, ==, next_push);
+	err = chiaki_spsc_ring_pop_wait(&ring, &v);
+	munit_assert_int(err, ==, CHIAKI_ERR_CANCELED);
+
+	chiaki_spsc_ring_fini(&ring);
+	return MUNIT_OK;
+}
+
+#define THREADED_COUNT 100000
+
+static void *producer_thread_func(void *user)
+{
+	ChiakiSpscRing *ring = user;
+	for(uint64_t i=0; i<THREADED_COUNT; i++)
+	{
+		while(!chiaki_spsc_ring_push(ring, &i));
+	}
+	chiaki_spsc_ring_close(ring);
+	return NULL;
+}
+
+static MunitResult test_spsc_ring_threaded(const MunitParameter params[], void *test_user)
+{
+	ChiakiSpscRing ring;
+	ChiakiErrorCode err = chiaki_spsc_ring_init(&ring, 64, sizeof(uint64_t));
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	ChiakiThread thread;
+	err = chiaki_thread_create(&thread, producer_thread_func, &ring);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	uint64_t expected = 0;
+	uint64_t v;
+	while(chiaki_spsc_ring_pop_wait(&ring, &v) == CHIAKI_ERR_SUCCESS)
+	{
+		munit_assert_uint64(v, ==, expected);
+		expected++;
+	}
+	munit_assert_uint64(expected, ==, THREADED_COUNT);
+
+	chiaki_thread_join(&thread, NULL);
+	chiaki_spsc_ring_fini(&ring);
+	return MUNIT_OK;
+}
+
+MunitTest tests_spsc_ring[] = {
+	{
+		"/basic",
+		test_spsc_ring_basic,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/threaded",
+		test_spsc_ring_threaded,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
@@ -0,0 +1,245 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/streamstats.h>
+#include <chiaki/thread.h>
+
+#define FPS 60
+#define FRAME_INTERVAL_US (1000000 / FPS)
+#define FRAME_SIZE 1000
+#define UNITS_PER_FRAME 10
+
+static const uint64_t no_bursts[CHIAKI_STREAM_STATS_BURST_BUCKETS] = { 0 };
+
+static void push_frames(ChiakiStreamStats *stats, ChiakiSeqNum16 *frame_index, uint64_t *now_us, uint64_t duration_us)
+{
+	uint64_t end_us = *now_us + duration_us;
+	while(*now_us < end_us)
+	{
+		chiaki_stream_stats_push_units(stats, *now_us, UNITS_PER_FRAME, 0, no_bursts);
+		chiaki_stream_stats_push_frame(stats, *now_us, *frame_index, *now_us, FRAME_SIZE, false, false);
+		(*frame_index)++;
+		*now_us += FRAME_INTERVAL_US;
+	}
+}
+
+static MunitResult test_stream_stats_burst_bucket(const MunitParameter params[], void *user)
+{
+	munit_assert_uint(chiaki_stream_stats_burst_bucket(1), ==, 0);
+	munit_assert_uint(chiaki_stream_stats_burst_bucket(2), ==, 1);
+	munit_assert_uint(chiaki_stream_stats_burst_bucket(3), ==, 2);
+	munit_assert_uint(chiaki_stream_stats_burst_bucket(4), ==, 2);
+	munit_assert_uint(chiaki_stream_stats_burst_bucket(5), ==, 3);
+	munit_assert_uint(chiaki_stream_stats_burst_bucket(8), ==, 3);
+	munit_assert_uint(chiaki_stream_stats_burst_bucket(9), ==, 4);
+	munit_assert_uint(chiaki_stream_stats_burst_bucket(64), ==, 6);
+	munit_assert_uint(chiaki_stream_stats_burst_bucket(65), ==, 7);
+	munit_assert_uint(chiaki_stream_stats_burst_bucket(1000), ==, CHIAKI_STREAM_STATS_BURST_BUCKETS - 1);
+	return MUNIT_OK;
+}
+
+static MunitResult test_stream_stats_windows(const MunitParameter params[], void *user)
+{
+	ChiakiStreamStats stats;
+	chiaki_stream_stats_init(&stats);
+	chiaki_stream_stats_reset(&stats, FPS);
+
+	ChiakiStreamStatsSnapshot snapshot;
+	chiaki_stream_stats_snapshot(&stats, 1000000, &snapshot);
+	munit_assert_uint64(snapshot.window_short.duration_us, ==, 0);
+	munit_assert_uint64(snapshot.frames_total, ==, 0);
+
+	// lossy first seconds that must have left both windows later
+	ChiakiSeqNum16 frame_index = 0;
+	uint64_t now_us = 1000000;
+	uint64_t bursts[CHIAKI_STREAM_STATS_BURST_BUCKETS] = { 0 };
+	bursts[chiaki_stream_stats_burst_bucket(3)] = 1;
+	for(size_t i=0; i<FPS; i++)
+	{
+		chiaki_stream_stats_push_units(&stats, now_us, UNITS_PER_FRAME - 3, 3, bursts);
+		chiaki_stream_stats_push_frame(&stats, now_us, frame_index++, now_us, FRAME_SIZE * 10, true, i % 2 == 0);
+		now_us += FRAME_INTERVAL_US;
+	}
+
+	push_frames(&stats, &frame_index, &now_us, 11000000);
+	chiaki_stream_stats_snapshot(&stats, now_us, &snapshot);
+	munit_assert_uint64(snapshot.frames_total, ==, frame_index);
+	munit_assert_uint64(snapshot.jitter_us, <=, 1);
+
+	ChiakiStreamStatsWindow *window = &snapshot.window_short;
+	munit_assert_uint64(window->duration_us, >, CHIAKI_STREAM_STATS_WINDOW_SHORT_US - CHIAKI_STREAM_STATS_SLOT_US);
+	munit_assert_uint64(window->duration_us, <=, CHIAKI_STREAM_STATS_WINDOW_SHORT_US);
+	munit_assert_double(window->fps, >, FPS - 2);
+	munit_assert_double(window->fps, <, FPS + 2);
+	munit_assert_uint64(window->bitrate, >, FRAME_SIZE * 8 * (FPS - 2));
+	munit_assert_uint64(window->bitrate, <, FRAME_SIZE * 8 * (FPS + 2));
+	munit_assert_uint64(window->units_lost, ==, 0);
+	munit_assert_double(window->fec_recovery_ratio, ==, 1.0);
+
+	window = &snapshot.window_long;
+	munit_assert_uint64(window->duration_us, >, CHIAKI_STREAM_STATS_WINDOW_LONG_US - CHIAKI_STREAM_STATS_SLOT_US);
+	munit_assert_double(window->fps, >, FPS - 2);
+	munit_assert_double(window->fps, <, FPS + 2);
+	munit_assert_uint64(window->units_lost, ==, 0);
+	munit_assert_uint64(window->bursts[2], ==, 0);
+
+	// new loss shows up in both windows, but only stays in the long one
+	bursts[chiaki_stream_stats_burst_bucket(3)] = 0;
+	bursts[chiaki_stream_stats_burst_bucket(1)] = 2;
+	chiaki_stream_stats_push_units(&stats, now_us, UNITS_PER_FRAME - 2, 2, bursts);
+	chiaki_stream_stats_push_frame(&stats, now_us, frame_index++, now_us, FRAME_SIZE, true, false);
+	chiaki_stream_stats_push_frame(&stats, now_us, frame_index++, now_us, 0, true, true);
+	now_us += FRAME_INTERVAL_US;
+	chiaki_stream_stats_snapshot(&stats, now_us, &snapshot);
+	window = &snapshot.window_short;
+	munit_assert_uint64(window->units_lost, ==, 2);
+	munit_assert_uint64(window->bursts[0], ==, 2);
+	munit_assert_uint64(window->frames_fec, ==, 2);
+	munit_assert_uint64(window->frames_fec_failed, ==, 1);
+	munit_assert_double(window->fec_recovery_ratio, ==, 0.5);
+	munit_assert_double(window->loss_ratio, >, 0.0);
+
+	push_frames(&stats, &frame_index, &now_us, 2000000);
+	chiaki_stream_stats_snapshot(&stats, now_us, &snapshot);
+	munit_assert_uint64(snapshot.window_short.units_lost, ==, 0);
+	munit_assert_uint64(snapshot.window_long.units_lost, ==, 2);
+	munit_assert_uint64(snapshot.window_long.bursts[0], ==, 2);
+
+	// nothing received for a while
+	now_us += 3000000;
+	chiaki_stream_stats_snapshot(&stats, now_us, &snapshot);
+	munit_assert_double(snapshot.window_short.fps, ==, 0.0);
+	munit_assert_uint64(snapshot.window_short.bitrate, ==, 0);
+	munit_assert_double(snapshot.window_long.fps, >, 0.0);
+
+	chiaki_stream_stats_reset(&stats, FPS);
+	chiaki_stream_stats_snapshot(&stats, now_us, &snapshot);
+	munit_assert_uint64(snapshot.frames_total, ==, 0);
+	munit_assert_double(snapshot.window_long.fps, ==, 0.0);
+
+	return MUNIT_OK;
+}
+
+static MunitResult test_stream_stats_jitter(const MunitParameter params[], void *user)
+{
+	ChiakiStreamStats stats;
+	chiaki_stream_stats_init(&stats);
+	chiaki_stream_stats_reset(&stats, FPS);
+
+	// every other frame arrives 4 ms late
+	uint64_t now_us = 1000000;
+	for(ChiakiSeqNum16 frame_index=0; frame_index<FPS * 5; frame_index++)
+	{
+		uint64_t arrival_us = now_us + (frame_index % 2 ? 4000 : 0);
+		chiaki_stream_stats_push_frame(&stats, arrival_us, frame_index, arrival_us, FRAME_SIZE, false, false);
+		now_us += FRAME_INTERVAL_US;
+	}
+
+	ChiakiStreamStatsSnapshot snapshot;
+	chiaki_stream_stats_snapshot(&stats, now_us, &snapshot);
+	munit_assert_uint64(snapshot.jitter_us, >, 3500);
+	munit_assert_uint64(snapshot.jitter_us, <, 4500);
+	return MUNIT_OK;
+}
+
+#define THREADED_COUNT 100000
+
+typedef struct threaded_t
+{
+	ChiakiStreamStats stats;
+	ChiakiBoolPredCond done;
+} Threaded;
+
+static void *writer_thread_func(void *user)
+{
+	Threaded *threaded = user;
+	uint64_t bursts[CHIAKI_STREAM_STATS_BURST_BUCKETS] = { 0 };
+	for(uint64_t i=0; i<THREADED_COUNT; i++)
+	{
+		// pretend to be a lot faster than real time, so slots are cleared all the time
+		uint64_t now_us = 1000000 + i * 100;
+		bursts[i % CHIAKI_STREAM_STATS_BURST_BUCKETS] = 1;
+		chiaki_stream_stats_push_units(&threaded->stats, now_us, i % 7, i % 7, bursts);
+		bursts[i % CHIAKI_STREAM_STATS_BURST_BUCKETS] = 0;
+		chiaki_stream_stats_push_frame(&threaded->stats, now_us, (ChiakiSeqNum16)i, now_us, FRAME_SIZE, true, true);
+	}
+	chiaki_bool_pred_cond_signal(&threaded->done);
+	return NULL;
+}
+
+static MunitResult test_stream_stats_threaded(const MunitParameter params[], void *user)
+{
+	Threaded threaded;
+	chiaki_stream_stats_init(&threaded.stats);
+	chiaki_stream_stats_reset(&threaded.stats, FPS);
+	ChiakiErrorCode err = chiaki_bool_pred_cond_init(&threaded.done);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	ChiakiThread thread;
+	err = chiaki_thread_create(&thread, writer_thread_func, &threaded);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	// every snapshot must see each write completely or not at all
+	size_t snapshots = 0;
+	while(true)
+	{
+		chiaki_bool_pred_cond_lock(&threaded.done);
+		bool done = threaded.done.pred;
+		chiaki_bool_pred_cond_unlock(&threaded.done);
+		ChiakiStreamStatsSnapshot snapshot;
+		chiaki_stream_stats_snapshot(&threaded.stats, 1000000 + THREADED_COUNT * 100, &snapshot);
+		munit_assert_uint64(snapshot.bytes_total, ==, snapshot.frames_total * FRAME_SIZE);
+		ChiakiStreamStatsWindow *window = &snapshot.window_long;
+		munit_assert_uint64(window->units_received, ==, window->units_lost);
+		munit_assert_uint64(window->frames_fec, ==, window->frames_fec_failed);
+		snapshots++;
+		if(done)
+			break;
+	}
+
+	chiaki_thread_join(&thread, NULL);
+	ChiakiStreamStatsSnapshot snapshot;
+	chiaki_stream_stats_snapshot(&threaded.stats, 1000000 + THREADED_COUNT * 100, &snapshot);
+	munit_assert_uint64(snapshot.frames_total, ==, THREADED_COUNT);
+	munit_assert_size(snapshots, >, 0);
+
+	chiaki_bool_pred_cond_fini(&threaded.done);
+	return MUNIT_OK;
+}
+
+MunitTest tests_stream_stats[] = {
+	{
+		"/burst_bucket",
+		test_stream_stats_burst_bucket,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/windows",
+		test_stream_stats_windows,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/jitter",
+		test_stream_stats_jitter,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/threaded",
+		test_stream_stats_threaded,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
@@ -3,8 +3,33 @@
 #include <munit.h>
 
 #include <chiaki/takion.h>
+#include <chiaki/takioncapture.h>
+#include <chiaki/frameprocessor.h>
 #include <chiaki/seqnum.h>
 #include <chiaki/base64.h>
+#include <chiaki/thread.h>
+#include <chiaki/time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <netinet/udp.h>
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103 // older libc headers
+#endif
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#endif
 
 #define CHIAKI_UNIT_TEST
 #include "../lib/src/takionsendbuffer.c"
@@ -55,26 +80,63 @@ static MunitResult test_av_packet_parse(const MunitParameter params[], void *use
 }
 
 
-static MunitResult test_av_packet_parse_real_video(const MunitParameter params[], void *user)
+static MunitResult test_av_packet_format_header(const MunitParameter params[], void *user)
 {
-#include "takion_av_packet_parse_real_video.inl"
-	return MUNIT_OK;
-}
+	ChiakiKeyState key_state;
+	uint8_t packet[0x40];
+	memset(packet, 0, sizeof(packet));
 
-static void random_seqnums(ChiakiSeqNum32 *nums, size_t count)
-{
-	for(size_t i=0; i<count; i++)
+	for(int v12=0; v12<2; v12++)
 	{
-		ChiakiSeqNum32 seqnum;
-		retry:
-		seqnum = munit_rand_uint32();
-		for(size_t j=0; j<i; j++)
+		for(int is_video=0; is_video<2; is_video++)
 		{
-			if(nums[j] == seqnum)
-				goto retry;
+			ChiakiTakionAVPacket av_packet = { 0 };
+			av_packet.is_video = is_video;
+			av_packet.packet_index = 1337;
+			av_packet.frame_index = 42;
+			av_packet.unit_index = is_video ? 6 : 0;
+			av_packet.units_in_frame_total = is_video ? 8 : 3;
+			av_packet.units_in_frame_fec = is_video ? 1 : ((0x20 << 8) | (1 << 4) | 2);
+			av_packet.codec = is_video ? 3 : 5;
+			av_packet.key_pos = 0x1234;
+			av_packet.adaptive_stream_index = is_video ? 1 : 0;
+			av_packet.byte_before_audio_data = v12 && !is_video ? 0x42 : 0;
+
+			size_t header_size;
+			ChiakiErrorCode err = v12
+				? chiaki_takion_v12_av_packet_format_header(packet, sizeof(packet), &header_size, &av_packet)
+				: chiaki_takion_v9_av_packet_format_header(packet, sizeof(packet), &header_size, &av_packet);
+			munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+			ChiakiTakionAVPacket parsed;
+			chiaki_key_state_init(&key_state);
+			err = v12
+				? chiaki_takion_v12_av_packet_parse(&parsed, &key_state, packet, sizeof(packet))
+				: chiaki_takion_v9_av_packet_parse(&parsed, &key_state, packet, sizeof(packet));
+			munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+			munit_assert(parsed.is_video == av_packet.is_video);
+			munit_assert_uint16(parsed.packet_index, ==, av_packet.packet_index);
+			munit_assert_uint16(parsed.frame_index, ==, av_packet.frame_index);
+			munit_assert_uint16(parsed.unit_index, ==, av_packet.unit_index);
+			munit_assert_uint16(parsed.units_in_frame_total, ==, av_packet.units_in_frame_total);
+			munit_assert_uint16(parsed.units_in_frame_fec, ==, av_packet.units_in_frame_fec);
+			munit_assert_uint32(parsed.codec, ==, av_packet.codec);
+			munit_assert_uint64(parsed.key_pos, ==, av_packet.key_pos);
+			munit_assert_uint8(parsed.adaptive_stream_index, ==, av_packet.adaptive_stream_index);
+			munit_assert_uint8(parsed.byte_before_audio_data, ==, av_packet.byte_before_audio_data);
+			munit_assert_ptr_equal(parsed.data, packet + header_size);
+			munit_assert_size(parsed.data_size, ==, sizeof(packet) - header_size);
 		}
-		nums[i] = seqnum;
 	}
+
+	return MUNIT_OK;
+}
+
+static MunitResult test_av_packet_parse_real_video(const MunitParameter params[], void *user)
+{
+#include "takion_av_packet_parse_real_video.inl"
+	return MUNIT_OK;
 }
 
 static bool check_send_buffer_contents(ChiakiTakionSendBuffer *send_buffer, const ChiakiSeqNum32 *nums_expected, size_t nums_expected_count)
@@ -90,9 +152,9 @@ static bool check_send_buffer_contents(ChiakiTakionSendBuffer *send_buffer, cons
 	for(size_t i=0; i<nums_expected_count; i++)
 	{
 		bool found = false;
-		for(size_t j=0; j<send_buffer->packets_count; j++)
+		for(size_t j=0; j<send_buffer->packets_size; j++)
 		{
-			if(send_buffer->packets[j].seq_num == nums_expected[i])
+			if(send_buffer->packets[j].buf && send_buffer->packets[j].seq_num == nums_expected[i])
 			{
 				found = true;
 				break;
@@ -126,14 +188,24 @@ static void seqnums_ack(ChiakiSeqNum32 *nums, size_t *nums_count, ChiakiSeqNum32
 
 static MunitResult test_takion_send_buffer(const MunitParameter params[], void *user)
 {
-#define nums_count 0x30
+#define nums_count 0x20
 	ChiakiTakionSendBuffer send_buffer;
-	ChiakiErrorCode err = chiaki_takion_send_buffer_init(&send_buffer, NULL, nums_count);
+	ChiakiErrorCode err = chiaki_takion_send_buffer_init(&send_buffer, NULL, nums_count, 0);
 	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
 	send_buffer.log = get_test_log();
 
-	ChiakiSeqNum32 nums_expected[nums_count + 1];
-	random_seqnums(nums_expected, nums_count + 1);
+	// a window of consecutive seq nums, pushed in random order
+	ChiakiSeqNum32 base = munit_rand_uint32();
+	ChiakiSeqNum32 nums_expected[nums_count];
+	for(size_t i=0; i<nums_count; i++)
+		nums_expected[i] = base + (ChiakiSeqNum32)i;
+	for(size_t i=nums_count-1; i>0; i--)
+	{
+		size_t j = (size_t)munit_rand_int_range(0, (int)i);
+		ChiakiSeqNum32 tmp = nums_expected[i];
+		nums_expected[i] = nums_expected[j];
+		nums_expected[j] = tmp;
+	}
 
 	for(size_t i=0; i<nums_count; i++)
 	{
@@ -141,16 +213,26 @@ static MunitResult test_takion_send_buffer(const MunitParameter params[], void *
 		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
 	}
 
-	err = chiaki_takion_send_buffer_push(&send_buffer, nums_expected[nums_count], malloc(8), 8);
+	err = chiaki_takion_send_buffer_push(&send_buffer, base + nums_count, malloc(8), 8);
+	munit_assert_int(err, ==, CHIAKI_ERR_OVERFLOW);
+	err = chiaki_takion_send_buffer_push(&send_buffer, base - 1, malloc(8), 8);
 	munit_assert_int(err, ==, CHIAKI_ERR_OVERFLOW);
+	err = chiaki_takion_send_buffer_push(&send_buffer, base + 3, malloc(8), 8);
+	munit_assert_int(err, ==, CHIAKI_ERR_INVALID_DATA);
 
 	size_t nums_count_cur = nums_count;
 	while(nums_count_cur > 0)
 	{
 		ChiakiSeqNum32 ack_num = nums_expected[nums_count_cur - 1]
 				+ munit_rand_int_range(-1, 1) * munit_rand_int_range(1, 32);
-		chiaki_takion_send_buffer_ack(&send_buffer, ack_num, NULL, NULL); // TODO: test acked seqnums params
+		ChiakiSeqNum32 acked_seq_nums[nums_count];
+		size_t acked_seq_nums_count;
+		chiaki_takion_send_buffer_ack(&send_buffer, ack_num, acked_seq_nums, &acked_seq_nums_count);
+		size_t nums_count_prev = nums_count_cur;
 		seqnums_ack(nums_expected, &nums_count_cur, ack_num);
+		munit_assert_size(acked_seq_nums_count, ==, nums_count_prev - nums_count_cur);
+		for(size_t i=0; i<acked_seq_nums_count; i++)
+			munit_assert(acked_seq_nums[i] == ack_num || chiaki_seq_num_32_lt(acked_seq_nums[i], ack_num));
 		bool correct = check_send_buffer_contents(&send_buffer, nums_expected, nums_count_cur);
 		munit_assert(correct);
 	}
@@ -160,6 +242,35 @@ static MunitResult test_takion_send_buffer(const MunitParameter params[], void *
 #undef nums_count
 }
 
+static MunitResult test_takion_send_buffer_rto(const MunitParameter params[], void *user)
+{
+	ChiakiTakionSendBuffer send_buffer;
+	ChiakiErrorCode err = chiaki_takion_send_buffer_init(&send_buffer, NULL, 3, 0);
+	munit_assert_int(err, ==, CHIAKI_ERR_INVALID_DATA);
+
+	// seeded with 20 ms => srtt + 4 * rttvar = 60 ms
+	err = chiaki_takion_send_buffer_init(&send_buffer, NULL, 4, 20000);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	send_buffer.log = get_test_log();
+	munit_assert_uint64(send_buffer.srtt_us, ==, 20000);
+	munit_assert_uint64(send_buffer.rto_us, ==, 60000);
+
+	// an immediate ack pulls the estimate down
+	for(ChiakiSeqNum32 seq_num=0; seq_num<0x20; seq_num++)
+	{
+		err = chiaki_takion_send_buffer_push(&send_buffer, seq_num, malloc(8), 8);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		err = chiaki_takion_send_buffer_ack(&send_buffer, seq_num, NULL, NULL);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	}
+	munit_assert_uint64(send_buffer.srtt_us, <, 20000);
+	munit_assert_uint64(send_buffer.rto_us, <, 60000);
+	munit_assert_uint64(send_buffer.rto_us, >=, 5000);
+
+	chiaki_takion_send_buffer_fini(&send_buffer);
+	return MUNIT_OK;
+}
+
 static MunitResult test_takion_format_congestion(const MunitParameter params[], void *user)
 {
 	static const uint8_t handshake_key[] = { 0x54, 0x65, 0x4c, 0x34, 0x5c, 0xac, 0x56, 0xb8, 0xea, 0xe6, 0x15, 0x2a, 0xde, 0x1c, 0xe2, 0xe8 };
@@ -195,6 +306,701 @@ static MunitResult test_takion_format_congestion(const MunitParameter params[],
 	return MUNIT_OK;
 }
 
+#ifndef _WIN32
+
+#define TEST_TAKION_VERSION 12
+#define TEST_CONSOLE_TAG 0x1337
+#define TEST_COOKIE_SIZE 0x20
+#define TEST_AV_PACKETS_MAX 256
+#define TEST_TIMEOUT_MS 5000
+
+/**
+ * Console side of a Takion connection on the loopback interface,
+ * just enough for the handshake and sending av packets without encryption.
+ */
+typedef struct test_console_t
+{
+	int sock;
+	struct sockaddr_in addr;
+	struct sockaddr_in client_addr;
+	uint32_t tag_client;
+} TestConsole;
+
+typedef struct test_av_packet_t
+{
+	ChiakiSeqNum16 packet_index;
+	size_t data_size;
+	uint8_t data_first;
+	uint8_t data_last;
+	ChiakiPacketBuf *buf; // only if TestTakion.hold_bufs, referenced until the test is done
+	uint64_t recv_time_us;
+	uint64_t cb_time_us;
+} TestAVPacket;
+
+typedef struct test_takion_t
+{
+	ChiakiTakion takion;
+	ChiakiMutex mutex;
+	ChiakiCond cond;
+	bool connected;
+	bool disconnected;
+	bool released; // the connected callback blocks until this is set, so everything sent before is waiting in the socket already
+	bool hold_bufs; // keep references to received buffers like a frame processor does
+	TestAVPacket av[TEST_AV_PACKETS_MAX];
+	size_t av_count;
+} TestTakion;
+
+static void test_console_init(TestConsole *console)
+{
+	memset(console, 0, sizeof(*console));
+	console->sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	munit_assert_int(console->sock, >=, 0);
+
+	console->addr.sin_family = AF_INET;
+	console->addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	console->addr.sin_port = 0;
+	int r = bind(console->sock, (struct sockaddr *)&console->addr, sizeof(console->addr));
+	munit_assert_int(r, ==, 0);
+	socklen_t addr_len = sizeof(console->addr);
+	r = getsockname(console->sock, (struct sockaddr *)&console->addr, &addr_len);
+	munit_assert_int(r, ==, 0);
+
+	struct timeval timeout = { TEST_TIMEOUT_MS / 1000, 0 };
+	setsockopt(console->sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+static void test_console_fini(TestConsole *console)
+{
+	close(console->sock);
+}
+
+#define TEST_MESSAGE_SIZE_MAX (1 + 0x10 + 0x10 + TEST_COOKIE_SIZE)
+
+/**
+ * Write a control packet containing a message for the Takion with the local tag.
+ *
+ * @param buf at least TEST_MESSAGE_SIZE_MAX bytes
+ * @return size of the whole packet
+ */
+static size_t test_format_message(uint8_t *buf, uint32_t tag, uint8_t chunk_type, const uint8_t *payload, size_t payload_size)
+{
+	munit_assert_size(payload_size, <=, TEST_MESSAGE_SIZE_MAX - 0x11);
+	buf[0] = 0; // control
+	*((chiaki_unaligned_uint32_t *)(buf + 1)) = htonl(tag);
+	memset(buf + 5, 0, 8); // gmac and key_pos
+	buf[0xd] = chunk_type;
+	buf[0xe] = 0;
+	*((chiaki_unaligned_uint16_t *)(buf + 0xf)) = htons((uint16_t)(payload_size + 4));
+	if(payload_size)
+		memcpy(buf + 0x11, payload, payload_size);
+	return 0x11 + payload_size;
+}
+
+/**
+ * Write the payload of an init ack message for test_format_message().
+ */
+static void test_format_init_ack(uint8_t *payload)
+{
+	*((chiaki_unaligned_uint32_t *)(payload + 0)) = htonl(TEST_CONSOLE_TAG);
+	*((chiaki_unaligned_uint32_t *)(payload + 4)) = htonl(0x19000);
+	*((chiaki_unaligned_uint16_t *)(payload + 8)) = htons(0x64);
+	*((chiaki_unaligned_uint16_t *)(payload + 0xa)) = htons(0x64);
+	*((chiaki_unaligned_uint32_t *)(payload + 0xc)) = htonl(TEST_CONSOLE_TAG);
+	memset(payload + 0x10, 0x42, TEST_COOKIE_SIZE);
+}
+
+static void test_console_send_message(TestConsole *console, uint8_t chunk_type, const uint8_t *payload, size_t payload_size)
+{
+	uint8_t buf[TEST_MESSAGE_SIZE_MAX];
+	size_t size = test_format_message(buf, console->tag_client, chunk_type, payload, payload_size);
+	ssize_t r = sendto(console->sock, buf, size, 0, (struct sockaddr *)&console->client_addr, sizeof(console->client_addr));
+	munit_assert_int64(r, ==, size);
+}
+
+/**
+ * @return size of the payload written to payload
+ */
+static size_t test_console_recv_message(TestConsole *console, uint8_t chunk_type, uint8_t *payload, size_t payload_size_max)
+{
+	uint8_t buf[0x100];
+	socklen_t addr_len = sizeof(console->client_addr);
+	ssize_t r = recvfrom(console->sock, buf, sizeof(buf), 0, (struct sockaddr *)&console->client_addr, &addr_len);
+	munit_assert_int64(r, >=, 0x11);
+	munit_assert_uint8(buf[0], ==, 0);
+	munit_assert_uint8(buf[0xd], ==, chunk_type);
+	size_t payload_size = (size_t)r - 0x11;
+	munit_assert_size(payload_size, <=, payload_size_max);
+	memcpy(payload, buf + 0x11, payload_size);
+	return payload_size;
+}
+
+static void test_console_handshake(TestConsole *console)
+{
+	uint8_t payload[0x10 + TEST_COOKIE_SIZE];
+	size_t payload_size = test_console_recv_message(console, 1 /* init */, payload, sizeof(payload));
+	munit_assert_size(payload_size, ==, 0x10);
+	console->tag_client = ntohl(*((chiaki_unaligned_uint32_t *)payload));
+
+	test_format_init_ack(payload);
+	test_console_send_message(console, 2 /* init ack */, payload, sizeof(payload));
+
+	payload_size = test_console_recv_message(console, 0xa /* cookie */, payload, sizeof(payload));
+	munit_assert_size(payload_size, ==, TEST_COOKIE_SIZE);
+	test_console_send_message(console, 0xb /* cookie ack */, NULL, 0);
+}
+
+/**
+ * Write an av packet whose data consists of the lower byte of its packet_index only.
+ *
+ * @return size of the whole packet
+ */
+static size_t test_format_av(uint8_t *buf, size_t buf_size, ChiakiTakionAVPacket *packet, size_t data_size)
+{
+	size_t header_size;
+	ChiakiErrorCode err = chiaki_takion_v12_av_packet_format_header(buf, buf_size, &header_size, packet);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_size(header_size + data_size, <=, buf_size);
+	memset(buf + header_size, (uint8_t)packet->packet_index, data_size);
+	return header_size + data_size;
+}
+
+/**
+ * Write a video packet that is a whole frame by itself.
+ */
+static size_t test_console_format_av(uint8_t *buf, size_t buf_size, ChiakiSeqNum16 packet_index, size_t data_size)
+{
+	ChiakiTakionAVPacket packet = { 0 };
+	packet.is_video = true;
+	packet.packet_index = packet_index;
+	packet.frame_index = packet_index;
+	packet.units_in_frame_total = 1;
+	return test_format_av(buf, buf_size, &packet, data_size);
+}
+
+static void test_console_send_av(TestConsole *console, ChiakiSeqNum16 packet_index, size_t data_size)
+{
+	uint8_t buf[CHIAKI_TAKION_PACKET_BUF_SIZE];
+	size_t size = test_console_format_av(buf, sizeof(buf), packet_index, data_size);
+	ssize_t r = sendto(console->sock, buf, size, 0, (struct sockaddr *)&console->client_addr, sizeof(console->client_addr));
+	munit_assert_int64(r, ==, size);
+}
+
+static void test_takion_cb(ChiakiTakionEvent *event, void *user)
+{
+	TestTakion *t = user;
+	chiaki_mutex_lock(&t->mutex);
+	switch(event->type)
+	{
+		case CHIAKI_TAKION_EVENT_TYPE_CONNECTED:
+			t->connected = true;
+			chiaki_cond_broadcast(&t->cond);
+			while(!t->released)
+				chiaki_cond_wait(&t->cond, &t->mutex);
+			break;
+		case CHIAKI_TAKION_EVENT_TYPE_DISCONNECT:
+			t->disconnected = true;
+			chiaki_cond_broadcast(&t->cond);
+			break;
+		case CHIAKI_TAKION_EVENT_TYPE_AV:
+		{
+			if(t->av_count >= TEST_AV_PACKETS_MAX)
+				break;
+			ChiakiTakionAVPacket *packet = event->av;
+			TestAVPacket *av = &t->av[t->av_count++];
+			av->packet_index = packet->packet_index;
+			av->data_size = packet->data_size;
+			av->data_first = packet->data_size ? packet->data[0] : 0;
+			av->data_last = packet->data_size ? packet->data[packet->data_size - 1] : 0;
+			av->buf = NULL;
+			if(t->hold_bufs && packet->buf)
+			{
+				chiaki_packet_buf_ref(packet->buf);
+				av->buf = packet->buf;
+			}
+			av->recv_time_us = packet->recv_time_us;
+			av->cb_time_us = chiaki_time_now_monotonic_us();
+			chiaki_cond_broadcast(&t->cond);
+			break;
+		}
+		default:
+			break;
+	}
+	chiaki_mutex_unlock(&t->mutex);
+}
+
+static bool test_takion_connected_pred(void *user)
+{
+	TestTakion *t = user;
+	return t->connected;
+}
+
+static void test_takion_init(TestTakion *t)
+{
+	memset(t, 0, sizeof(*t));
+	ChiakiErrorCode err = chiaki_mutex_init(&t->mutex, false);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	err = chiaki_cond_init(&t->cond);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+}
+
+/**
+ * Connect to console, the rest of info is expected to be set up already.
+ * Takion stays blocked in the connected callback until test_takion_release().
+ */
+static void test_takion_connect(TestTakion *t, TestConsole *console, ChiakiTakionConnectInfo *info)
+{
+	test_takion_init(t);
+
+	info->log = get_test_log();
+	info->sa = (struct sockaddr *)&console->addr;
+	info->sa_len = sizeof(console->addr);
+	info->cb = test_takion_cb;
+	info->cb_user = t;
+	info->enable_crypt = false;
+	info->protocol_version = TEST_TAKION_VERSION;
+	ChiakiErrorCode err = chiaki_takion_connect(&t->takion, info);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	test_console_handshake(console);
+
+	chiaki_mutex_lock(&t->mutex);
+	err = chiaki_cond_timedwait_pred(&t->cond, &t->mutex, TEST_TIMEOUT_MS, test_takion_connected_pred, t);
+	chiaki_mutex_unlock(&t->mutex);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+}
+
+static void test_takion_release(TestTakion *t)
+{
+	chiaki_mutex_lock(&t->mutex);
+	t->released = true;
+	chiaki_cond_broadcast(&t->cond);
+	chiaki_mutex_unlock(&t->mutex);
+}
+
+typedef struct test_takion_av_pred_t
+{
+	TestTakion *t;
+	size_t count;
+} TestTakionAVPred;
+
+static bool test_takion_av_pred(void *user)
+{
+	TestTakionAVPred *pred = user;
+	return pred->t->av_count >= pred->count;
+}
+
+static void test_takion_wait_av(TestTakion *t, size_t count)
+{
+	TestTakionAVPred pred = { t, count };
+	chiaki_mutex_lock(&t->mutex);
+	ChiakiErrorCode err = chiaki_cond_timedwait_pred(&t->cond, &t->mutex, TEST_TIMEOUT_MS, test_takion_av_pred, &pred);
+	chiaki_mutex_unlock(&t->mutex);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+}
+
+/**
+ * Stop Takion and release everything held by t, the counters in t->takion.recv_stats are final afterwards.
+ */
+static void test_takion_close(TestTakion *t)
+{
+	test_takion_release(t);
+	chiaki_takion_close(&t->takion);
+	munit_assert_true(t->disconnected);
+	for(size_t i=0; i<t->av_count; i++)
+	{
+		if(t->av[i].buf)
+			chiaki_packet_buf_unref(t->av[i].buf);
+	}
+	chiaki_cond_fini(&t->cond);
+	chiaki_mutex_fini(&t->mutex);
+}
+
+#define TEST_RECV_BATCH_SIZE 4
+#define TEST_RECV_BATCH_PACKETS 22
+#define TEST_RECV_TIME_ERROR_MAX_US 1000
+
+static MunitResult test_takion_recv_batch(const MunitParameter params[], void *user)
+{
+	for(int pipelined=0; pipelined<2; pipelined++)
+	{
+		TestConsole console;
+		test_console_init(&console);
+
+		TestTakion t;
+		ChiakiTakionConnectInfo info = { 0 };
+		info.recv_batch_size = TEST_RECV_BATCH_SIZE;
+		info.recv_ring_size = pipelined ? 64 : 0;
+		test_takion_connect(&t, &console, &info);
+
+		// everything is queued in the socket before Takion starts receiving, so it takes more than one batch
+		uint64_t sent_us = chiaki_time_now_monotonic_us();
+		for(size_t i=0; i<TEST_RECV_BATCH_PACKETS; i++)
+			test_console_send_av(&console, (ChiakiSeqNum16)(1000 + i), 100 + i * 57);
+		test_takion_release(&t);
+		test_takion_wait_av(&t, TEST_RECV_BATCH_PACKETS);
+
+		munit_assert_size(t.av_count, ==, TEST_RECV_BATCH_PACKETS);
+		for(size_t i=0; i<TEST_RECV_BATCH_PACKETS; i++)
+		{
+			TestAVPacket *av = &t.av[i];
+			munit_assert_uint16(av->packet_index, ==, 1000 + i);
+			munit_assert_size(av->data_size, ==, 100 + i * 57);
+			munit_assert_uint8(av->data_first, ==, (uint8_t)(1000 + i));
+			munit_assert_uint8(av->data_last, ==, (uint8_t)(1000 + i));
+			// kernel timestamps are moved from another clock, so allow for some error
+			munit_assert_uint64(av->recv_time_us + TEST_RECV_TIME_ERROR_MAX_US, >=, sent_us);
+			munit_assert_uint64(av->recv_time_us, <=, av->cb_time_us + TEST_RECV_TIME_ERROR_MAX_US);
+		}
+
+		test_takion_close(&t);
+		test_console_fini(&console);
+
+		// recvmmsg() is not available everywhere, then every batch is a single datagram
+		size_t batch_size = t.takion.recv_batch_size;
+		ChiakiTakionRecvStats *stats = &t.takion.recv_stats;
+		munit_assert_uint64(stats->packets, ==, TEST_RECV_BATCH_PACKETS);
+		munit_assert_uint64(stats->batch_size_max, ==, batch_size);
+		munit_assert_uint64(stats->batches_full, >=, 1);
+		munit_assert_uint64(stats->wakeups, >=, (TEST_RECV_BATCH_PACKETS + batch_size - 1) / batch_size);
+		munit_assert_uint64(stats->ring_dropped, ==, 0);
+	}
+	return MUNIT_OK;
+}
+
+#define TEST_CLOSE_TIMEOUT_MS 500
+
+typedef struct test_takion_closer_t
+{
+	TestTakion *t;
+	ChiakiBoolPredCond closed;
+} TestTakionCloser;
+
+static void *test_takion_close_thread_func(void *user)
+{
+	TestTakionCloser *closer = user;
+	test_takion_close(closer->t);
+	chiaki_bool_pred_cond_signal(&closer->closed);
+	return NULL;
+}
+
+static MunitResult test_takion_close_while_waiting(const MunitParameter params[], void *user)
+{
+	for(int pipelined=0; pipelined<2; pipelined++)
+	{
+		TestConsole console;
+		test_console_init(&console);
+
+		TestTakion t;
+		ChiakiTakionConnectInfo info = { 0 };
+		info.recv_ring_size = pipelined ? 64 : 0;
+		test_takion_connect(&t, &console, &info);
+		test_takion_release(&t);
+
+		// after handling this, the receiving thread goes back to waiting for the socket without any timeout
+		test_console_send_av(&console, 0, 100);
+		test_takion_wait_av(&t, 1);
+		usleep(50000);
+
+		// closing on another thread, so a Takion that does not wake up fails instead of blocking the test forever
+		TestTakionCloser closer = { &t };
+		ChiakiErrorCode err = chiaki_bool_pred_cond_init(&closer.closed);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		ChiakiThread thread;
+		err = chiaki_thread_create(&thread, test_takion_close_thread_func, &closer);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+		chiaki_bool_pred_cond_lock(&closer.closed);
+		err = chiaki_bool_pred_cond_timedwait(&closer.closed, TEST_CLOSE_TIMEOUT_MS);
+		chiaki_bool_pred_cond_unlock(&closer.closed);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+		chiaki_thread_join(&thread, NULL);
+		chiaki_bool_pred_cond_fini(&closer.closed);
+		test_console_fini(&console);
+	}
+	return MUNIT_OK;
+}
+
+#define TEST_REPLAY_TAG 0x4823
+#define TEST_REPLAY_FRAMES 3
+#define TEST_REPLAY_UNITS 4
+#define TEST_REPLAY_CAPTURE_START_US 1000000
+
+// when the units of every frame were captured, relative to the first datagram of the capture
+static const uint64_t test_replay_unit_times_us[TEST_REPLAY_FRAMES][TEST_REPLAY_UNITS] = {
+	{ 20000, 20150, 20900, 23400 },
+	{ 36700, 36710, 36720, 36730 },
+	{ 53300, 55100, 55200, 61000 }
+};
+
+typedef struct test_replay_t
+{
+	TestTakion t;
+	ChiakiFrameProcessor frame_processor;
+	bool frame_allocated;
+	ChiakiSeqNum16 frame_index;
+	uint64_t frame_recv_time_first_us[TEST_REPLAY_FRAMES];
+	uint64_t frame_recv_time_last_us[TEST_REPLAY_FRAMES];
+	size_t frames_count;
+} TestReplay;
+
+static void test_replay_frame_done(TestReplay *replay)
+{
+	if(!replay->frame_allocated || replay->frames_count >= TEST_REPLAY_FRAMES)
+		return;
+	replay->frame_recv_time_first_us[replay->frames_count] = replay->frame_processor.recv_time_first_us;
+	replay->frame_recv_time_last_us[replay->frames_count] = replay->frame_processor.recv_time_last_us;
+	replay->frames_count++;
+}
+
+/**
+ * Put all av packets into a frame processor like the video receiver does, which reports the per-frame timing from it.
+ */
+static void test_replay_cb(ChiakiTakionEvent *event, void *user)
+{
+	TestReplay *replay = user;
+	if(event->type == CHIAKI_TAKION_EVENT_TYPE_AV)
+	{
+		ChiakiTakionAVPacket *packet = event->av;
+		ChiakiErrorCode err;
+		if(!replay->frame_allocated || packet->frame_index != replay->frame_index)
+		{
+			test_replay_frame_done(replay);
+			err = chiaki_frame_processor_alloc_frame(&replay->frame_processor, packet);
+			munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+			replay->frame_allocated = true;
+			replay->frame_index = packet->frame_index;
+		}
+		err = chiaki_frame_processor_put_unit(&replay->frame_processor, packet);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	}
+	test_takion_cb(event, &replay->t);
+}
+
+static void test_replay_write_capture(const char *filename)
+{
+	ChiakiTakionCapture capture;
+	ChiakiErrorCode err = chiaki_takion_capture_init(&capture, filename);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	chiaki_takion_capture_write_takion(&capture, TEST_TAKION_VERSION, TEST_REPLAY_TAG);
+	uint8_t handshake_key[CHIAKI_TAKION_CAPTURE_HANDSHAKE_KEY_SIZE] = { 0 };
+	uint8_t ecdh_secret[CHIAKI_ECDH_SECRET_SIZE] = { 0 };
+	chiaki_takion_capture_write_keys(&capture, CHIAKI_TARGET_PS5_1, handshake_key, ecdh_secret);
+
+	uint8_t buf[CHIAKI_TAKION_PACKET_BUF_SIZE];
+	uint8_t payload[0x10 + TEST_COOKIE_SIZE];
+	test_format_init_ack(payload);
+	size_t size = test_format_message(buf, TEST_REPLAY_TAG, 2 /* init ack */, payload, sizeof(payload));
+	chiaki_takion_capture_write_datagram(&capture, TEST_REPLAY_CAPTURE_START_US, buf, size);
+	size = test_format_message(buf, TEST_REPLAY_TAG, 0xb /* cookie ack */, NULL, 0);
+	chiaki_takion_capture_write_datagram(&capture, TEST_REPLAY_CAPTURE_START_US + 100, buf, size);
+
+	ChiakiSeqNum16 packet_index = 0;
+	for(size_t frame=0; frame<TEST_REPLAY_FRAMES; frame++)
+	{
+		for(size_t unit=0; unit<TEST_REPLAY_UNITS; unit++)
+		{
+			ChiakiTakionAVPacket packet = { 0 };
+			packet.is_video = true;
+			packet.packet_index = packet_index++;
+			packet.frame_index = (ChiakiSeqNum16)frame;
+			packet.unit_index = (ChiakiSeqNum16)unit;
+			packet.units_in_frame_total = TEST_REPLAY_UNITS;
+			size = test_format_av(buf, sizeof(buf), &packet, 200);
+			chiaki_takion_capture_write_datagram(&capture, TEST_REPLAY_CAPTURE_START_US + test_replay_unit_times_us[frame][unit], buf, size);
+		}
+	}
+
+	munit_assert_false(capture.failed);
+	chiaki_takion_capture_fini(&capture);
+}
+
+static MunitResult test_takion_replay_recv_time(const MunitParameter params[], void *user)
+{
+	char filename[] = "/tmp/chiaki-test-capture-XXXXXX";
+	int fd = mkstemp(filename);
+	munit_assert_int(fd, >=, 0);
+	close(fd);
+	test_replay_write_capture(filename);
+
+	// as fast as possible, the captured times must come out anyway
+	ChiakiTakionReplay replay_file;
+	ChiakiErrorCode err = chiaki_takion_replay_init(&replay_file, filename, false);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	TestReplay replay;
+	memset(&replay, 0, sizeof(replay));
+	test_takion_init(&replay.t);
+	replay.t.released = true;
+	chiaki_frame_processor_init(&replay.frame_processor, get_test_log());
+
+	ChiakiTakionConnectInfo info = { 0 };
+	info.log = get_test_log();
+	info.cb = test_replay_cb;
+	info.cb_user = &replay;
+	info.protocol_version = TEST_TAKION_VERSION;
+	info.replay = &replay_file;
+	err = chiaki_takion_connect(&replay.t.takion, &info);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	test_takion_wait_av(&replay.t, TEST_REPLAY_FRAMES * TEST_REPLAY_UNITS);
+	test_takion_close(&replay.t);
+	test_replay_frame_done(&replay);
+
+	// the first datagram of the capture was replayed at start_us
+	uint64_t start_us = replay_file.start_us;
+	munit_assert_uint64(start_us, !=, 0);
+	munit_assert_size(replay.t.av_count, ==, TEST_REPLAY_FRAMES * TEST_REPLAY_UNITS);
+	for(size_t frame=0; frame<TEST_REPLAY_FRAMES; frame++)
+	{
+		for(size_t unit=0; unit<TEST_REPLAY_UNITS; unit++)
+		{
+			TestAVPacket *av = &replay.t.av[frame * TEST_REPLAY_UNITS + unit];
+			munit_assert_uint16(av->packet_index, ==, frame * TEST_REPLAY_UNITS + unit);
+			munit_assert_uint64(av->recv_time_us, ==, start_us + test_replay_unit_times_us[frame][unit]);
+		}
+	}
+
+	munit_assert_size(replay.frames_count, ==, TEST_REPLAY_FRAMES);
+	for(size_t frame=0; frame<TEST_REPLAY_FRAMES; frame++)
+	{
+		munit_assert_uint64(replay.frame_recv_time_first_us[frame], ==, start_us + test_replay_unit_times_us[frame][0]);
+		munit_assert_uint64(replay.frame_recv_time_last_us[frame], ==, start_us + test_replay_unit_times_us[frame][TEST_REPLAY_UNITS - 1]);
+	}
+
+	chiaki_frame_processor_fini(&replay.frame_processor);
+	chiaki_takion_replay_fini(&replay_file);
+	remove(filename);
+	return MUNIT_OK;
+}
+
+#ifdef __linux__
+
+#define TEST_GRO_BURSTS 24
+#define TEST_GRO_SEGMENTS 8
+#define TEST_GRO_DATA_SIZE 1000
+#define TEST_GRO_DATA_SIZE_LAST 333
+
+/**
+ * Send count av packets of the same size, except for a shorter last one, in a single UDP_SEGMENT send,
+ * which arrives as one coalesced buffer if the receiver has UDP_GRO enabled.
+ *
+ * @return false if UDP_SEGMENT is not supported
+ */
+static bool test_console_send_av_segmented(TestConsole *console, ChiakiSeqNum16 packet_index, size_t count, size_t data_size, size_t data_size_last)
+{
+	uint8_t buf[TEST_GRO_SEGMENTS * CHIAKI_TAKION_PACKET_BUF_SIZE];
+	munit_assert_size(count, <=, TEST_GRO_SEGMENTS);
+	size_t segment_size = 0;
+	size_t size = 0;
+	for(size_t i=0; i<count; i++)
+	{
+		size_t packet_size = test_console_format_av(buf + size, sizeof(buf) - size, (ChiakiSeqNum16)(packet_index + i),
+				i + 1 < count ? data_size : data_size_last);
+		if(!i)
+			segment_size = packet_size;
+		size += packet_size;
+	}
+
+	struct iovec iov = { buf, size };
+	union
+	{
+		char buf[CMSG_SPACE(sizeof(uint16_t))];
+		struct cmsghdr align;
+	} control;
+	memset(&control, 0, sizeof(control));
+	struct msghdr msg = { 0 };
+	msg.msg_name = &console->client_addr;
+	msg.msg_namelen = sizeof(console->client_addr);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_UDP;
+	cmsg->cmsg_type = UDP_SEGMENT;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+	uint16_t gso_size = (uint16_t)segment_size;
+	memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+
+	ssize_t r = sendmsg(console->sock, &msg, 0);
+	if(r < 0)
+		return false;
+	munit_assert_int64(r, ==, size);
+	return true;
+}
+
+static MunitResult test_takion_recv_gro(const MunitParameter params[], void *user)
+{
+	TestConsole console;
+	test_console_init(&console);
+
+	TestTakion t;
+	ChiakiTakionConnectInfo info = { 0 };
+	info.recv_batch_size = 4;
+	info.enable_udp_gro = true;
+	test_takion_connect(&t, &console, &info);
+	// like a frame processor, which keeps all units of a frame
+	t.hold_bufs = true;
+	test_takion_release(&t);
+
+	MunitResult result = MUNIT_SKIP;
+	if(!t.takion.recv_gro)
+		goto beach;
+
+	// many more bursts than there are coalesced receive buffers
+	size_t count = 0;
+	for(size_t i=0; i<TEST_GRO_BURSTS; i++)
+	{
+		if(!test_console_send_av_segmented(&console, (ChiakiSeqNum16)count, TEST_GRO_SEGMENTS, TEST_GRO_DATA_SIZE, TEST_GRO_DATA_SIZE_LAST))
+			goto beach;
+		count += TEST_GRO_SEGMENTS;
+		// one at a time to not overflow the socket's receive buffer
+		test_takion_wait_av(&t, count);
+	}
+
+	// not coalesced, but it must not keep a whole coalesced buffer alive either
+	test_console_send_av(&console, (ChiakiSeqNum16)count, TEST_GRO_DATA_SIZE);
+	count++;
+	test_takion_wait_av(&t, count);
+
+	munit_assert_size(t.av_count, ==, count);
+	for(size_t i=0; i<count - 1; i++)
+	{
+		TestAVPacket *av = &t.av[i];
+		munit_assert_uint16(av->packet_index, ==, i);
+		bool last = i % TEST_GRO_SEGMENTS == TEST_GRO_SEGMENTS - 1;
+		munit_assert_size(av->data_size, ==, last ? TEST_GRO_DATA_SIZE_LAST : TEST_GRO_DATA_SIZE);
+		munit_assert_uint8(av->data_first, ==, (uint8_t)i);
+		munit_assert_uint8(av->data_last, ==, (uint8_t)i);
+		// slices are not handed out to be kept
+		munit_assert_null(av->buf);
+	}
+	TestAVPacket *av = &t.av[count - 1];
+	munit_assert_uint16(av->packet_index, ==, count - 1);
+	munit_assert_size(av->data_size, ==, TEST_GRO_DATA_SIZE);
+	munit_assert_not_null(av->buf);
+	munit_assert_ptr_equal(av->buf->pool, t.takion.recv_copy_pool);
+	result = MUNIT_OK;
+
+beach:
+	test_takion_close(&t);
+	test_console_fini(&console);
+	if(result != MUNIT_OK)
+		return result;
+
+	ChiakiTakionRecvStats *stats = &t.takion.recv_stats;
+	munit_assert_uint64(stats->packets, ==, count);
+	munit_assert_uint64(stats->gro_coalesced, ==, TEST_GRO_BURSTS);
+	// every coalesced buffer went back to the pool in time for the next batch
+	munit_assert_uint64(stats->pool_exhausted, ==, 0);
+	return MUNIT_OK;
+}
+
+#endif
+
+#endif
+
 MunitTest tests_takion[] = {
 	{
 		"/av_packet_parse",
@@ -204,6 +1010,14 @@ MunitTest tests_takion[] = {
 		MUNIT_TEST_OPTION_NONE,
 		NULL
 	},
+	{
+		"/av_packet_format_header",
+		test_av_packet_format_header,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
 	{
 		"/av_packet_parse_real_video",
 		test_av_packet_parse_real_video,
@@ -220,6 +1034,14 @@ MunitTest tests_takion[] = {
 		MUNIT_TEST_OPTION_NONE,
 		NULL
 	},
+	{
+		"/send_buffer_rto",
+		test_takion_send_buffer_rto,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
 	{
 		"/format_congestion",
 		test_takion_format_congestion,
@@ -228,5 +1050,41 @@ MunitTest tests_takion[] = {
 		MUNIT_TEST_OPTION_NONE,
 		NULL
 	},
+#ifndef _WIN32
+	{
+		"/recv_batch",
+		test_takion_recv_batch,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/close_while_waiting",
+		test_takion_close_while_waiting,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/replay_recv_time",
+		test_takion_replay_recv_time,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+#endif
+#ifdef __linux__
+	{
+		"/recv_gro",
+		test_takion_recv_gro,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+#endif
 	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
 };
@@ -0,0 +1,403 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/videoreceiver.h>
+#include <chiaki/session.h>
+#include <chiaki/packetbuf.h>
+
+#include <string.h>
+
+#include "test_log.h"
+
+#define CHUNK_SIZE 100
+#define UNIT_SIZE (CHUNK_SIZE + 2)
+#define UNITS_SOURCE 3
+#define UNITS_FEC 1
+#define HEADER_SIZE 7
+#define FRAMES_MAX 32
+#define REORDER_WINDOW_US 3000
+
+typedef struct test_receiver_t
+{
+	ChiakiSession *session;
+	ChiakiVideoReceiver video_receiver;
+	ChiakiSeqNum16 frames[FRAMES_MAX]; // frames handed out, in order
+	size_t frame_sizes[FRAMES_MAX];
+	size_t frames_count;
+	uint64_t now_us;
+	ChiakiPacketBufPool *pool; // if set, units are passed in packet buffers from it
+} TestReceiver;
+
+static bool test_gather_cb(ChiakiVideoSampleSegment *segments, size_t segments_count, size_t frame_size, void *user)
+{
+	TestReceiver *receiver = user;
+	// the header of the profile is passed on before the first frame
+	if(frame_size == HEADER_SIZE)
+		return true;
+	munit_assert_size(receiver->frames_count, <, FRAMES_MAX);
+	munit_assert_size(segments_count, >, 0);
+	// every byte of a frame is the low byte of its index, the high byte is in the first one
+	ChiakiSeqNum16 frame_index = (ChiakiSeqNum16)((segments[0].data[0] << 8) | segments[0].data[1]);
+	receiver->frames[receiver->frames_count] = frame_index;
+	receiver->frame_sizes[receiver->frames_count] = frame_size;
+	receiver->frames_count++;
+	return true;
+}
+
+/**
+ * Set up a video receiver with only as much of a session as flushing frames needs.
+ * Corrupt frame reports end up unsent in the send buffer of the Takion.
+ */
+static void test_receiver_init(TestReceiver *receiver, unsigned int reorder_frames)
+{
+	memset(receiver, 0, sizeof(*receiver));
+	receiver->now_us = 1000000;
+	ChiakiSession *session = calloc(1, sizeof(ChiakiSession));
+	munit_assert_not_null(session);
+	receiver->session = session;
+	session->log = get_test_log();
+	session->connect_info.video_reorder_frames = reorder_frames;
+	session->connect_info.video_reorder_window_us = REORDER_WINDOW_US;
+	chiaki_session_set_video_sample_gather_cb(session, test_gather_cb, receiver);
+
+	ChiakiStreamConnection *stream_connection = &session->stream_connection;
+	stream_connection->log = session->log;
+	stream_connection->congestion_control_active = false;
+	ChiakiErrorCode err = chiaki_mutex_init(&stream_connection->congestion_control_mutex, false);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	ChiakiTakion *takion = &stream_connection->takion;
+	takion->log = session->log;
+	err = chiaki_mutex_init(&takion->gkcrypt_local_mutex, false);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	err = chiaki_mutex_init(&takion->seq_num_local_mutex, false);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	err = chiaki_takion_send_buffer_init(&takion->send_buffer, NULL, 16, 0);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	takion->send_buffer.log = session->log;
+
+	chiaki_video_receiver_init(&receiver->video_receiver, session, NULL, NULL);
+	ChiakiVideoProfile profile = { 0 };
+	profile.width = 1280;
+	profile.height = 720;
+	profile.header_sz = HEADER_SIZE;
+	profile.header = calloc(1, HEADER_SIZE);
+	munit_assert_not_null(profile.header);
+	chiaki_video_receiver_stream_info(&receiver->video_receiver, &profile, 1);
+}
+
+static void test_receiver_fini(TestReceiver *receiver)
+{
+	ChiakiSession *session = receiver->session;
+	chiaki_video_receiver_fini(&receiver->video_receiver);
+	ChiakiTakion *takion = &session->stream_connection.takion;
+	chiaki_takion_send_buffer_fini(&takion->send_buffer);
+	chiaki_mutex_fini(&takion->seq_num_local_mutex);
+	chiaki_mutex_fini(&takion->gkcrypt_local_mutex);
+	chiaki_mutex_fini(&session->stream_connection.congestion_control_mutex);
+	free(session);
+}
+
+static size_t test_receiver_corrupt_reports(TestReceiver *receiver)
+{
+	return receiver->session->stream_connection.takion.send_buffer.packets_count;
+}
+
+/**
+ * Pass unit_index of frame_index to the receiver, receiver->now_us is its arrival time.
+ */
+static void test_receiver_unit(TestReceiver *receiver, ChiakiSeqNum16 frame_index, unsigned int unit_index)
+{
+	uint8_t unit[UNIT_SIZE];
+	// no padding, then the payload
+	unit[0] = 0;
+	unit[1] = 0;
+	memset(unit + 2, (uint8_t)frame_index, CHUNK_SIZE);
+	unit[2] = (uint8_t)(frame_index >> 8);
+
+	ChiakiTakionAVPacket packet;
+	memset(&packet, 0, sizeof(packet));
+	packet.is_video = true;
+	packet.frame_index = frame_index;
+	packet.unit_index = unit_index;
+	packet.units_in_frame_total = UNITS_SOURCE + UNITS_FEC;
+	packet.units_in_frame_fec = UNITS_FEC;
+	packet.data = unit;
+	packet.data_size = sizeof(unit);
+	packet.recv_time_us = receiver->now_us;
+	if(receiver->pool)
+	{
+		// like Takion, which drops its own reference once the packet has been processed
+		packet.buf = chiaki_packet_buf_pool_acquire(receiver->pool, NULL);
+		munit_assert_not_null(packet.buf);
+		memcpy(packet.buf->data, unit, sizeof(unit));
+		packet.data = packet.buf->data;
+	}
+	chiaki_video_receiver_av_packet(&receiver->video_receiver, &packet);
+	if(packet.buf)
+		chiaki_packet_buf_unref(packet.buf);
+}
+
+/**
+ * Pass the source units unit_first to unit_end - 1 of frame_index.
+ */
+static void test_receiver_frame(TestReceiver *receiver, ChiakiSeqNum16 frame_index, unsigned int unit_first, unsigned int unit_end)
+{
+	for(unsigned int i=unit_first; i<unit_end; i++)
+		test_receiver_unit(receiver, frame_index, i);
+}
+
+/**
+ * @return how many buffers can be acquired from pool before it is exhausted
+ */
+static size_t test_pool_available(ChiakiPacketBufPool *pool, size_t bufs_count)
+{
+	ChiakiPacketBuf *bufs[FRAMES_MAX];
+	munit_assert_size(bufs_count, <, FRAMES_MAX);
+	size_t count = 0;
+	for(; count<=bufs_count; count++)
+	{
+		bool exhausted = false;
+		bufs[count] = chiaki_packet_buf_pool_acquire(pool, &exhausted);
+		munit_assert_not_null(bufs[count]);
+		if(exhausted)
+		{
+			chiaki_packet_buf_unref(bufs[count]);
+			break;
+		}
+	}
+	for(size_t i=0; i<count; i++)
+		chiaki_packet_buf_unref(bufs[i]);
+	return count;
+}
+
+static void test_receiver_assert_frames(TestReceiver *receiver, const ChiakiSeqNum16 *frames, size_t frames_count)
+{
+	munit_assert_size(receiver->frames_count, ==, frames_count);
+	for(size_t i=0; i<frames_count; i++)
+		munit_assert_uint16(receiver->frames[i], ==, frames[i]);
+}
+
+static MunitResult test_video_receiver_out_of_order(const MunitParameter params[], void *user)
+{
+	TestReceiver receiver;
+	test_receiver_init(&receiver, 4);
+
+	// frame 1 is missing its last unit while the next ones are already complete
+	test_receiver_frame(&receiver, 1, 0, UNITS_SOURCE - 1);
+	test_receiver_frame(&receiver, 2, 0, UNITS_SOURCE);
+	test_receiver_frame(&receiver, 3, 0, UNITS_SOURCE);
+	munit_assert_size(receiver.frames_count, ==, 0);
+
+	// once it arrives, all of them are handed out in order and completely
+	test_receiver_unit(&receiver, 1, UNITS_SOURCE - 1);
+	static const ChiakiSeqNum16 frames[] = { 1, 2, 3 };
+	test_receiver_assert_frames(&receiver, frames, 3);
+	for(size_t i=0; i<3; i++)
+		munit_assert_size(receiver.frame_sizes[i], ==, UNITS_SOURCE * CHUNK_SIZE);
+	munit_assert_size(test_receiver_corrupt_reports(&receiver), ==, 0);
+
+	// a late duplicate of a flushed frame is not handed out again
+	test_receiver_unit(&receiver, 2, 0);
+	munit_assert_size(receiver.frames_count, ==, 3);
+
+	test_receiver_fini(&receiver);
+	return MUNIT_OK;
+}
+
+static MunitResult test_video_receiver_gap_timeout(const MunitParameter params[], void *user)
+{
+	TestReceiver receiver;
+	test_receiver_init(&receiver, 4);
+	uint64_t start_us = receiver.now_us;
+
+	test_receiver_frame(&receiver, 10, 0, UNITS_SOURCE);
+	// frames before 10 have never been seen, which is reported once already
+	size_t reports = test_receiver_corrupt_reports(&receiver);
+	// frame 11 never arrives, frame 12 is incomplete and frame 13 complete
+	test_receiver_frame(&receiver, 12, 0, UNITS_SOURCE - 1);
+	receiver.now_us = start_us + 1000;
+	test_receiver_frame(&receiver, 13, 0, UNITS_SOURCE);
+	static const ChiakiSeqNum16 frames_waiting[] = { 10 };
+	test_receiver_assert_frames(&receiver, frames_waiting, 1);
+
+	// within the reorder window of 12, the missing frame is still waited for
+	receiver.now_us = start_us + REORDER_WINDOW_US - 1;
+	test_receiver_unit(&receiver, 14, 0);
+	munit_assert_size(test_receiver_corrupt_reports(&receiver), ==, reports);
+
+	// after that, 11 is skipped, but 12 is the next frame now and may still complete within the window of 13
+	receiver.now_us = start_us + REORDER_WINDOW_US;
+	test_receiver_unit(&receiver, 14, 1);
+	test_receiver_assert_frames(&receiver, frames_waiting, 1);
+
+	receiver.now_us = start_us + REORDER_WINDOW_US + 500;
+	test_receiver_unit(&receiver, 12, UNITS_SOURCE - 1);
+	static const ChiakiSeqNum16 frames_late[] = { 10, 12, 13 };
+	test_receiver_assert_frames(&receiver, frames_late, 3);
+	munit_assert_size(receiver.frame_sizes[1], ==, UNITS_SOURCE * CHUNK_SIZE);
+	// the skipped 11 is reported when 12 is handed out
+	munit_assert_size(test_receiver_corrupt_reports(&receiver), ==, reports + 1);
+
+	// 14 stays incomplete, so once 15 has waited for the window it is handed out with what it has
+	receiver.now_us = start_us + 4000;
+	test_receiver_frame(&receiver, 15, 0, UNITS_SOURCE);
+	test_receiver_assert_frames(&receiver, frames_late, 3);
+	receiver.now_us = start_us + 4000 + REORDER_WINDOW_US;
+	test_receiver_unit(&receiver, 16, 0);
+	static const ChiakiSeqNum16 frames_given_up[] = { 10, 12, 13, 14, 15 };
+	test_receiver_assert_frames(&receiver, frames_given_up, 5);
+	munit_assert_size(receiver.frame_sizes[3], ==, (UNITS_SOURCE - 1) * CHUNK_SIZE);
+	munit_assert_size(receiver.frame_sizes[4], ==, UNITS_SOURCE * CHUNK_SIZE);
+	// the incomplete 14 has been reported when 15 was handed out
+	munit_assert_size(test_receiver_corrupt_reports(&receiver), ==, reports + 2);
+
+	// a jump far ahead gives up on everything before it at once, without waiting for the frames in between
+	test_receiver_frame(&receiver, 1000, 0, UNITS_SOURCE);
+	static const ChiakiSeqNum16 frames_jump[] = { 10, 12, 13, 14, 15, 16, 1000, 1001, 1002, 1003 };
+	test_receiver_assert_frames(&receiver, frames_jump, 6);
+	test_receiver_frame(&receiver, 1001, 0, UNITS_SOURCE);
+	test_receiver_frame(&receiver, 1002, 0, UNITS_SOURCE);
+	test_receiver_assert_frames(&receiver, frames_jump, 6);
+	// pending frames never span more than the slots, so 1003 pushes out the missing 997 to 999
+	test_receiver_frame(&receiver, 1003, 0, UNITS_SOURCE);
+	test_receiver_assert_frames(&receiver, frames_jump, 10);
+	munit_assert_size(test_receiver_corrupt_reports(&receiver), ==, reports + 3);
+
+	test_receiver_fini(&receiver);
+	return MUNIT_OK;
+}
+
+static MunitResult test_video_receiver_slot_reuse(const MunitParameter params[], void *user)
+{
+	TestReceiver receiver;
+	test_receiver_init(&receiver, 2);
+
+	// both slots are taken by incomplete frames
+	test_receiver_frame(&receiver, 1, 0, UNITS_SOURCE - 1);
+	test_receiver_frame(&receiver, 2, 0, UNITS_SOURCE - 1);
+	munit_assert_size(receiver.frames_count, ==, 0);
+
+	// a third frame needs a slot, so the oldest one is given up on and handed out with what it has
+	test_receiver_unit(&receiver, 3, 0);
+	static const ChiakiSeqNum16 frames_given_up[] = { 1 };
+	test_receiver_assert_frames(&receiver, frames_given_up, 1);
+	munit_assert_size(receiver.frame_sizes[0], ==, (UNITS_SOURCE - 1) * CHUNK_SIZE);
+
+	// the rest of frame 1 is too late now, its slot holds frame 3
+	test_receiver_unit(&receiver, 1, UNITS_SOURCE - 1);
+	test_receiver_assert_frames(&receiver, frames_given_up, 1);
+
+	test_receiver_unit(&receiver, 2, UNITS_SOURCE - 1);
+	test_receiver_frame(&receiver, 3, 1, UNITS_SOURCE);
+	static const ChiakiSeqNum16 frames[] = { 1, 2, 3 };
+	test_receiver_assert_frames(&receiver, frames, 3);
+	munit_assert_size(receiver.frame_sizes[1], ==, UNITS_SOURCE * CHUNK_SIZE);
+	munit_assert_size(receiver.frame_sizes[2], ==, UNITS_SOURCE * CHUNK_SIZE);
+
+	test_receiver_fini(&receiver);
+	return MUNIT_OK;
+}
+
+static MunitResult test_video_receiver_wraparound(const MunitParameter params[], void *user)
+{
+	TestReceiver receiver;
+	test_receiver_init(&receiver, 4);
+
+	test_receiver_frame(&receiver, 0xfffe, 0, UNITS_SOURCE);
+	test_receiver_frame(&receiver, 0xffff, 0, UNITS_SOURCE - 1);
+	test_receiver_frame(&receiver, 0, 0, UNITS_SOURCE);
+	test_receiver_frame(&receiver, 1, 0, UNITS_SOURCE);
+	static const ChiakiSeqNum16 frames_before[] = { 0xfffe };
+	test_receiver_assert_frames(&receiver, frames_before, 1);
+
+	// 0 and 1 come after 0xffff, not before it
+	test_receiver_unit(&receiver, 0xffff, UNITS_SOURCE - 1);
+	static const ChiakiSeqNum16 frames[] = { 0xfffe, 0xffff, 0, 1 };
+	test_receiver_assert_frames(&receiver, frames, 4);
+	munit_assert_size(test_receiver_corrupt_reports(&receiver), ==, 0);
+
+	// and 0xffff is old again afterwards
+	test_receiver_unit(&receiver, 0xffff, 0);
+	test_receiver_frame(&receiver, 2, 0, UNITS_SOURCE);
+	static const ChiakiSeqNum16 frames_after[] = { 0xfffe, 0xffff, 0, 1, 2 };
+	test_receiver_assert_frames(&receiver, frames_after, 5);
+
+	test_receiver_fini(&receiver);
+	return MUNIT_OK;
+}
+
+static MunitResult test_video_receiver_release_buffers(const MunitParameter params[], void *user)
+{
+	TestReceiver receiver;
+	test_receiver_init(&receiver, 4);
+	size_t bufs_count = UNITS_SOURCE * 2;
+	receiver.pool = chiaki_packet_buf_pool_new(bufs_count, UNIT_SIZE);
+	munit_assert_not_null(receiver.pool);
+
+	// pending frames keep their units
+	test_receiver_frame(&receiver, 1, 0, UNITS_SOURCE - 1);
+	test_receiver_frame(&receiver, 2, 0, UNITS_SOURCE);
+	munit_assert_size(receiver.frames_count, ==, 0);
+	munit_assert_size(test_pool_available(receiver.pool, bufs_count), ==, 1);
+
+	// frames that have been handed out give them back right away, not only once their slots are reused
+	test_receiver_unit(&receiver, 1, UNITS_SOURCE - 1);
+	munit_assert_size(receiver.frames_count, ==, 2);
+	munit_assert_size(test_pool_available(receiver.pool, bufs_count), ==, bufs_count);
+
+	// and so do frames that have been given up on
+	test_receiver_frame(&receiver, 3, 0, UNITS_SOURCE - 1);
+	test_receiver_unit(&receiver, 7, 0);
+	static const ChiakiSeqNum16 frames[] = { 1, 2, 3 };
+	test_receiver_assert_frames(&receiver, frames, 3);
+	munit_assert_size(test_pool_available(receiver.pool, bufs_count), ==, bufs_count - 1);
+
+	test_receiver_fini(&receiver);
+	chiaki_packet_buf_pool_free(receiver.pool);
+	return MUNIT_OK;
+}
+
+MunitTest tests_video_receiver[] = {
+	{
+		"/out_of_order",
+		test_video_receiver_out_of_order,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/gap_timeout",
+		test_video_receiver_gap_timeout,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/slot_reuse",
+		test_video_receiver_slot_reuse,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/wraparound",
+		test_video_receiver_wraparound,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/release_buffers",
+		test_video_receiver_release_buffers,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};